@@ -0,0 +1,43 @@
+#ifndef ACCUM_H
+#define ACCUM_H
+
+#include <stdbool.h>
+
+#include "render.h"
+
+// Linear radiance sums and sample counts per pixel, the mergeable form of a render: jobs over
+// disjoint sample ranges (or seed offsets) of the same frame add up to one image, however
+// many nodes rendered them. Files hold a small header and then one AccumPixel per pixel,
+// rows bottom up like RenderImage, in host byte order.
+#define ACCUM_MAGIC 0x43434152u // "RACC"
+#define ACCUM_VERSION 1
+
+typedef struct
+{
+    float sum[3];
+    unsigned int count;
+} AccumPixel;
+
+typedef struct
+{
+    int width, height;
+    AccumPixel* pixels;
+} RenderAccum;
+
+bool render_accum_init(RenderAccum* accum, int width, int height);
+void render_accum_free(RenderAccum* accum);
+
+// Add num_samples samples per pixel, sums as render_region writes them for the whole image
+void render_accum_add_sums(RenderAccum* accum, const float* sums, unsigned int num_samples);
+
+// history is the mean of each pixel, gamma encoded (black where no sample landed), frame_count
+// the smallest sample count
+void render_accum_resolve(const RenderAccum* accum, RenderImage* image);
+
+bool render_accum_write(const RenderAccum* accum, const char* filename);
+
+// Stream a file into accum a chunk at a time, an empty accum (width 0) takes the file's size.
+// Fails on a size mismatch or a short file.
+bool render_accum_add_file(RenderAccum* accum, const char* filename);
+
+#endif
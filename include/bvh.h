@@ -0,0 +1,162 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rt_math.h"
+#include "scene.h"
+#include "intersect.h"
+
+#define BVH_MAX_LEAF_PRIMS 4
+#define BVH_SAH_BINS 16
+#define BVH_MAX_DEPTH 64
+
+// Treelet restructuring after the build, see bvh_optimize
+#define BVH_TREELET_LEAVES 7
+#define BVH_TREELET_ITERATIONS 2
+
+// A primitive is "large" if its box is this many times bigger than everything smaller
+// than it combined (the ground sphere). Large prims get their own leaf under the root.
+#define BVH_LARGE_PRIM_FACTOR 4.0f
+#define BVH_MAX_LARGE_PRIMS 8
+
+// Leaf primitive reference: top bit set for triangles, index into spheres / triangles otherwise
+#define PRIM_TRIANGLE_BIT 0x80000000u
+#define PRIM_INDEX_MASK 0x7fffffffu
+
+static inline unsigned int prim_ref_sphere(unsigned int index) {return index;}
+static inline unsigned int prim_ref_triangle(unsigned int index) {return index | PRIM_TRIANGLE_BIT;}
+static inline bool prim_ref_is_triangle(unsigned int ref) {return (ref & PRIM_TRIANGLE_BIT) != 0;}
+static inline unsigned int prim_ref_index(unsigned int ref) {return ref & PRIM_INDEX_MASK;}
+
+// std430 compatible, matches struct BVHNode in raytrace.frag
+// Interior: count <= 0, children at left_first and left_first + 1. -count is the split axis,
+// the children are ordered low to high along it (see bvh_order_children).
+// Leaf: count > 0 prims starting at prims[left_first]
+typedef struct
+{
+    float minx, miny, minz;
+    int left_first;
+    float maxx, maxy, maxz;
+    int count;
+} BVHNode;
+
+static inline int bvh_node_axis(const BVHNode* node) {return -node->count;}
+
+typedef struct
+{
+    BVHNode* nodes;
+    size_t num_nodes;
+    unsigned int* prims;
+    size_t num_prims;
+} BVH;
+
+typedef struct
+{
+    unsigned long long nodes_visited;
+    unsigned long long prims_tested;
+    unsigned long long bytes_fetched; // Node data only
+} TraversalStats;
+
+// Build over every sphere and triangle of the scene, then run bvh_optimize with
+// treelet_iterations rounds (0 keeps the plain binned SAH tree)
+bool bvh_build(BVH* bvh, const Scene* scene, int treelet_iterations);
+void bvh_free(BVH* bvh);
+
+// Top levels only: nodes of more than BVH_MAX_LEAF_PRIMS but at most pending_prims prims are
+// left as (big) leaves for bvh_lazy.c to refine. num_large is the size of the large prim leaf
+// at node 1, 0 if there is none. No treelet optimization.
+bool bvh_build_top(BVH* bvh, const Scene* scene, int pending_prims, int* num_large);
+
+// Full tree over refs (leaf ranges index the reordered bvh->prims), at most max_depth levels deep
+bool bvh_build_refs(BVH* bvh, const Scene* scene, const unsigned int* refs, int count, int max_depth);
+
+// Swap every sibling pair under root so the child with the lower center along the axis that
+// separates them best comes first, and store that axis in the parent. Needs children behind
+// their parents. bvh_build (after bvh_optimize, so treelet output is ordered too) and the lazy
+// builders call it last. Only the dynamic BVH's inserts and rotations leave axis 0 behind,
+// which is still a valid order.
+void bvh_order_children(BVH* bvh, int root);
+
+// TRBVH style optimizer: every interior node under root, bottom up, gets its treelet of up to
+// BVH_TREELET_LEAVES leaves rebuilt with the lowest SAH topology. Independent subtrees run in
+// parallel. Each round restarts from the improved tree and stops early once SAH stops falling.
+// Leaves and prims are unchanged, the tree stays within BVH_MAX_DEPTH and children behind parents.
+// On failure the BVH is left as it was.
+bool bvh_optimize(BVH* bvh, int root, int iterations);
+
+static inline AABB bvh_node_bounds(const BVHNode* node)
+{
+    return (AABB){{node->minx, node->miny, node->minz}, {node->maxx, node->maxy, node->maxz}};
+}
+
+// Bounds of the primitive behind a leaf reference
+AABB prim_ref_bounds(const Scene* scene, unsigned int ref);
+
+// Intersect a single primitive reference, returns t or -1.0
+float prim_ref_intersect(const Scene* scene, unsigned int ref, Vec3 ro, Vec3 rd);
+
+// Closest hit of either type, same result as the linear loops in findClosestHit
+// stats may be NULL
+bool bvh_intersect(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+// Which child of a hit pair is entered first, the other is pushed and skipped on the way back
+// if the closest hit is nearer than its box. bvh_intersect (and raytrace.frag) use octant order.
+typedef enum
+{
+    BVH_ORDER_LEFT = 0, // Always the left child
+    BVH_ORDER_OCTANT,   // Near side of the split axis for the ray's direction signs
+    BVH_ORDER_DISTANCE  // Smaller box entry distance
+} BVHChildOrder;
+
+bool bvh_intersect_ordered(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHChildOrder order, Hit* hit, TraversalStats* stats);
+
+// bvh_intersect that also calls leaf(ctx, node_index) for every leaf it reaches, before testing
+// its prims. For bookkeeping on top of the one traversal, like the pending leaf hits of bvh_lazy.h.
+typedef void (*BVHLeafFn)(void* ctx, int node_index);
+bool bvh_intersect_visit(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHLeafFn leaf, void* ctx, Hit* hit, TraversalStats* stats);
+
+// Any hit in (HIT_EPSILON, t_max), mirrors occluded() in raytrace.frag. Stops at the first
+// blocker found, so it never has to order children by distance or re-test popped nodes.
+bool bvh_occluded(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+// Prim types a scene holds, so the leaf loops can skip the type test per prim. The traversals
+// are compiled once per value; a scene with both types needs BVH_PRIMS_MIXED.
+typedef enum
+{
+    BVH_PRIMS_MIXED = 0,
+    BVH_PRIMS_SPHERES,
+    BVH_PRIMS_TRIANGLES
+} BVHPrims;
+
+// bvh_intersect and bvh_occluded for a scene holding only prims, same hits
+bool bvh_intersect_prims(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHPrims prims, Hit* hit, TraversalStats* stats);
+bool bvh_occluded_prims(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, BVHPrims prims, TraversalStats* stats);
+
+static inline bool prim_ref_occludes(const Scene* scene, unsigned int ref, Vec3 ro, Vec3 rd, float t_max)
+{
+    float t = prim_ref_intersect(scene, ref, ro, rd);
+    return t > HIT_EPSILON && t < t_max;
+}
+
+// Slab test, returns entry distance or 1e30 on miss
+static inline float ray_aabb(AABB box, Vec3 ro, Vec3 inv_rd, float t_max)
+{
+    float tx1 = (box.min.x - ro.x) * inv_rd.x, tx2 = (box.max.x - ro.x) * inv_rd.x;
+    float tmin = fminf(tx1, tx2), tmax = fmaxf(tx1, tx2);
+    float ty1 = (box.min.y - ro.y) * inv_rd.y, ty2 = (box.max.y - ro.y) * inv_rd.y;
+    tmin = fmaxf(tmin, fminf(ty1, ty2)); tmax = fminf(tmax, fmaxf(ty1, ty2));
+    float tz1 = (box.min.z - ro.z) * inv_rd.z, tz2 = (box.max.z - ro.z) * inv_rd.z;
+    tmin = fmaxf(tmin, fminf(tz1, tz2)); tmax = fminf(tmax, fmaxf(tz1, tz2));
+
+    if (tmax >= tmin && tmin < t_max && tmax > 0.0f) {return tmin;}
+    return 1e30f;
+}
+
+static inline Vec3 ray_inv_dir(Vec3 rd)
+{
+    return v3(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scene.h"
+
+// On disk cache of built acceleration structures, one file per key holding the buffers exactly
+// as they are uploaded. Opening maps the file read only, so a hit goes from the page cache
+// straight into glBufferData without parsing or copying.
+//
+// The key hashes the spheres, vertices and indices, the builder constants of bvh.h and the
+// caller's settings, so editing the mesh or changing a build option picks another file. Bump
+// BVH_CACHE_VERSION when the builder itself changes what it outputs.
+#define BVH_CACHE_VERSION 2
+
+// One buffer of the file, id is the caller's (main.c uses SSBO bindings)
+typedef struct
+{
+    unsigned int id;
+    const void* data;
+    size_t size;
+} BVHCacheBlob;
+
+typedef struct
+{
+    BVHCacheBlob* blobs; // Point into the mapping, valid until bvh_cache_close
+    int num_blobs;
+    void* base;
+    size_t size;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#endif
+} BVHCache;
+
+// 64 bit content hash for cache files, fast rather than cryptographic
+unsigned long long bvh_cache_key(const Scene* scene, const int* settings, int num_settings);
+
+// dir/<key>.bvh, false if it does not fit in size
+bool bvh_cache_path(char* path, size_t size, const char* dir, unsigned long long key);
+
+// Map the file at path. False if it is missing, truncated or was written for another key.
+bool bvh_cache_open(BVHCache* cache, const char* path, unsigned long long key);
+void bvh_cache_close(BVHCache* cache);
+
+// Blob data is aligned to BVH_CACHE_ALIGN bytes in the file (and so in the mapping)
+#define BVH_CACHE_ALIGN 256
+
+// Write every blob under key, creating the directory of path if needed. Goes through a
+// temporary file, a reader never maps a half written cache.
+bool bvh_cache_write(const char* path, unsigned long long key, const BVHCacheBlob* blobs, int num_blobs);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef BVH_COMPRESSED_H
+#define BVH_COMPRESSED_H
+
+#include "bvh_wide.h"
+
+#define CBVH_WIDTH 8
+
+// Lane meta byte: 0 empty, CBVH_META_INTERIOR for an interior child, otherwise the leaf prim count.
+// Interior children live at child_base + (number of interior lanes before this one), leaf prims at
+// prim_base + (sum of leaf counts before this one), so lanes need no per-child indices.
+#define CBVH_META_EMPTY 0
+#define CBVH_META_INTERIOR 0x80
+
+// 80 bytes, read as 5 uvec4 by raytrace.frag. Child box of lane i on axis a:
+// [origin + qlo[a][i] * 2^(e[a] - 127), origin + qhi[a][i] * 2^(e[a] - 127)]
+typedef struct
+{
+    float ox, oy, oz;
+    unsigned char ex, ey, ez, pad;
+    unsigned int child_base;
+    unsigned int prim_base;
+    unsigned char meta[CBVH_WIDTH];
+    unsigned char qlo[3][CBVH_WIDTH];
+    unsigned char qhi[3][CBVH_WIDTH];
+} CompressedNode;
+
+typedef struct
+{
+    CompressedNode* nodes;
+    size_t num_nodes;
+    unsigned int* prims; // Reordered so the leaves of a node are contiguous
+    size_t num_prims;
+} CompressedBVH;
+
+// Quantize a 4 or 8 wide BVH, lanes beyond its width stay empty
+bool bvh_compressed_build(CompressedBVH* cbvh, const WideBVH* wide);
+void bvh_compressed_free(CompressedBVH* cbvh);
+
+// Most entries a depth first traversal's stack holds at once, see bvh_wide_stack_entries
+int bvh_compressed_stack_entries(const CompressedBVH* cbvh);
+
+// Decoded boxes always contain the original child boxes
+AABB bvh_compressed_child_bounds(const CompressedNode* node, int lane);
+
+bool bvh_compressed_intersect(const CompressedBVH* cbvh, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+// Any hit in (HIT_EPSILON, t_max), see bvh_occluded
+bool bvh_compressed_occluded(const CompressedBVH* cbvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef BVH_DYNAMIC_H
+#define BVH_DYNAMIC_H
+
+#include "bvh.h"
+
+// Dynamic BVH for interactive sphere edits, in the spirit of broadphase AABB trees: leaves are
+// inserted by a greedy SAH descent, removed by collapsing their parent, and every node on the
+// path back to the root is refit and offered a tree rotation (Kopta et al. 2012) that lowers
+// its surface area.
+//
+// The tree stays in the binary BVHNode layout the shader reads: node 0 is the root and sibling
+// pairs sit at (odd, odd + 1) slots, handed out from a free list. Unlike bvh_build, children are
+// not always behind their parents, so only the stack traversals (bvh_intersect, the default
+// branch of raytrace.frag) can walk it.
+//
+// Every edit records the node, prim and sphere slots it wrote; dynamic_bvh_flush hands those
+// out as coalesced ranges so only they are uploaded.
+
+typedef enum
+{
+    DYNAMIC_BUFFER_NODES = 0,
+    DYNAMIC_BUFFER_PRIMS,
+    DYNAMIC_BUFFER_SPHERES,
+    DYNAMIC_NUM_BUFFERS
+} DynamicBuffer;
+
+typedef struct
+{
+    int* items;
+    size_t count;
+    size_t capacity;
+    unsigned char* flags; // One per slot of the buffer, dedups items
+    size_t num_flags;
+} DirtyList;
+
+typedef struct
+{
+    // num_nodes / num_prims are high water marks: slots of freed pairs and prims stay unreferenced
+    BVH bvh;
+    size_t node_capacity;
+    size_t prim_capacity;
+    size_t sphere_capacity; // Of scene->spheres, the tail past num_spheres is zeroed
+
+    int* parent; // Per node slot, -1 for the root
+    int* height; // Per node slot, 0 for leaves
+    int* prim_leaf; // Leaf owning each prim slot, -1 when free
+    int* sphere_slot; // Prim slot of each sphere
+
+    int* free_pairs; // First slot of every free sibling pair
+    size_t num_free_pairs;
+    int* free_prims;
+    size_t num_free_prims;
+
+    DirtyList dirty[DYNAMIC_NUM_BUFFERS];
+    size_t uploaded_capacity[DYNAMIC_NUM_BUFFERS]; // Bytes, a grown buffer is uploaded whole
+} DynamicBVH;
+
+// Receives bytes [offset, offset + size) of a buffer, data points at its start. capacity is
+// the full buffer size; when it changes the whole buffer is passed once.
+typedef void (*DynamicUploadFn)(void* ctx, DynamicBuffer buffer, const void* data, size_t offset, size_t size, size_t capacity);
+
+// Takes over the nodes and prims of bvh (from bvh_build, leaves may hold several prims) and
+// leaves it empty. The scene's sphere array becomes owned by the edit functions below.
+bool dynamic_bvh_init(DynamicBVH* dyn, BVH* bvh, Scene* scene);
+void dynamic_bvh_free(DynamicBVH* dyn);
+
+// Edits keep scene and tree in sync and return false when allocation fails or the tree grew
+// deeper than BVH_MAX_DEPTH (it stays valid, but the caller should rebuild it).
+// Removal moves the last sphere into the freed index.
+int dynamic_bvh_add_sphere(DynamicBVH* dyn, Scene* scene, Sphere sphere); // New index or -1
+bool dynamic_bvh_move_sphere(DynamicBVH* dyn, Scene* scene, int index, Vec3 position);
+bool dynamic_bvh_remove_sphere(DynamicBVH* dyn, Scene* scene, int index);
+
+// Pass every dirty range (or grown buffer) to upload and clear the dirty lists.
+// Returns the bytes handed out.
+size_t dynamic_bvh_flush(DynamicBVH* dyn, const Scene* scene, DynamicUploadFn upload, void* ctx);
+
+// Surface area heuristic cost of the current tree, for checking rotations keep it in shape
+float dynamic_bvh_sah(const DynamicBVH* dyn);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef BVH_LAZY_H
+#define BVH_LAZY_H
+
+#include "bvh.h"
+#include "bvh_dynamic.h"
+
+// Lazy BVH for a fast first frame: only the top levels are built up front, every subtree of at
+// most pending_prims prims is left as one big "pending" leaf over its prim range. Pending leaves
+// are ordinary leaves, so any binary traversal (bvh_intersect, the shader) renders the scene
+// right away, just slower where rays reach them.
+//
+// Worker threads refine pending leaves into full subtrees, most hit first. Hits come from
+// lazy_bvh_intersect on the CPU or from sampled GPU counts (lazy_bvh_add_feedback).
+// lazy_bvh_splice puts finished subtrees in place: their nodes are appended and the pending
+// leaf becomes their root, the prim range is rewritten in the subtree's order. Nodes are
+// allocated for the finished tree up front, so nothing moves and rendering never waits on a build.
+#define BVH_LAZY_PENDING_PRIMS 4096
+
+typedef struct LazyWorkers LazyWorkers;
+
+typedef struct
+{
+    BVH bvh; // Node array sized for the finished tree, num_nodes grows with each splice
+    size_t node_capacity;
+
+    int num_pending; // Pending leaves at the start, refined ones keep their entry
+    int* pending_node;
+    int* pending_depth;
+    unsigned int* pending_hits;
+    unsigned char* pending_state;
+    int* node_pending; // Pending entry of every node slot, -1 if none
+    int num_refined;
+
+    LazyWorkers* workers;
+} LazyBVH;
+
+// Builds the top levels and starts threads workers (at least one), which read scene until
+// lazy_bvh_finish or lazy_bvh_free
+bool lazy_bvh_build(LazyBVH* lazy, const Scene* scene, int pending_prims, int threads);
+void lazy_bvh_free(LazyBVH* lazy);
+
+// Closest hit like bvh_intersect, counting every pending leaf it reaches as feedback.
+// Safe to call from several threads, but not during lazy_bvh_splice.
+bool lazy_bvh_intersect(LazyBVH* lazy, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+// Adds per node hit counts (indexed by node slot, num_nodes entries) to the pending leaves
+void lazy_bvh_add_feedback(LazyBVH* lazy, const unsigned int* node_hits, size_t num_nodes);
+
+// Splice every finished subtree, between frames. Changed node and prim ranges go to upload
+// (DYNAMIC_BUFFER_NODES / DYNAMIC_BUFFER_PRIMS), the first call uploads both buffers whole.
+// Returns the number of subtrees spliced.
+int lazy_bvh_splice(LazyBVH* lazy, DynamicUploadFn upload, void* ctx);
+
+// Block until every pending leaf is built and spliced
+void lazy_bvh_finish(LazyBVH* lazy, DynamicUploadFn upload, void* ctx);
+
+static inline bool lazy_bvh_done(const LazyBVH* lazy) {return lazy->num_refined == lazy->num_pending;}
+
+#endif
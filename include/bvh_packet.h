@@ -0,0 +1,35 @@
+#ifndef BVH_PACKET_H
+#define BVH_PACKET_H
+
+#include <stdbool.h>
+
+#include "bvh.h"
+
+// Coherent rays (camera rays of a 4x2 pixel block) traced through the binary BVH together:
+// one node fetch and one box test per packet with all lanes tested at once, and a leaf tests
+// each prim against every lane. Lanes get exactly what bvh_intersect returns, bar ties between
+// prims at the same t. AVX2 kernels are picked at runtime through cpu_isa. The scalar
+// fallback loops over the lanes, but while they agree on their direction signs it first rules
+// out nodes with one test of the packet's frustum (interval bounds of the origins and inverse
+// directions).
+#define BVH_PACKET_SIZE 8
+
+typedef struct
+{
+    float ox[BVH_PACKET_SIZE], oy[BVH_PACKET_SIZE], oz[BVH_PACKET_SIZE];
+    float dx[BVH_PACKET_SIZE], dy[BVH_PACKET_SIZE], dz[BVH_PACKET_SIZE];
+    unsigned int active; // Bit per lane, the others are skipped and come back as misses
+} RayPacket;
+
+static inline void ray_packet_set(RayPacket* packet, int lane, Vec3 ro, Vec3 rd)
+{
+    packet->ox[lane] = ro.x; packet->oy[lane] = ro.y; packet->oz[lane] = ro.z;
+    packet->dx[lane] = rd.x; packet->dy[lane] = rd.y; packet->dz[lane] = rd.z;
+    packet->active |= 1u << lane;
+}
+
+// Closest hit of every active lane, true if any lane hit. stats (may be NULL) counts node
+// visits per packet and prim tests per active lane.
+bool bvh_intersect_packet(const BVH* bvh, const Scene* scene, const RayPacket* packet, Hit hits[BVH_PACKET_SIZE], TraversalStats* stats);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef BVH_STACKLESS_H
+#define BVH_STACKLESS_H
+
+#include "bvh.h"
+
+// Threaded BVH: the binary BVH with nodes in depth first pre-order, so the node after a
+// hit is always index + 1. Interior nodes reuse left_first as the skip (miss) link, the
+// index right after their subtree. Leaves continue at index + 1 either way.
+// Traversal is a single loop over node indices, no stack, ending at num_nodes.
+bool bvh_stackless_build(BVH* threaded, const BVH* bvh);
+
+bool bvh_stackless_intersect(const BVH* threaded, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+// Any hit in (HIT_EPSILON, t_max), see bvh_occluded. The pre-order is fixed, so the only
+// difference to the closest hit loop is the early exit.
+bool bvh_stackless_occluded(const BVH* threaded, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef BVH_WIDE_H
+#define BVH_WIDE_H
+
+#include "bvh.h"
+#include "prim_block.h"
+
+#define BVH_WIDE_MAX 8
+
+// Rows of a wide node, each row holds one value for every child lane (structure of arrays)
+enum
+{
+    WIDE_ROW_MINX = 0,
+    WIDE_ROW_MINY,
+    WIDE_ROW_MINZ,
+    WIDE_ROW_MAXX,
+    WIDE_ROW_MAXY,
+    WIDE_ROW_MAXZ,
+    WIDE_ROW_CHILD, // Interior: node index, leaf: first prim
+    WIDE_ROW_COUNT, // 0 for interior and empty lanes, prim count for leaves
+    WIDE_NUM_ROWS
+};
+
+typedef union
+{
+    float f;
+    int i;
+} WideLane;
+
+// Leaf prims of a node in SoA blocks: the prims of its leaf children in lane order, triangles
+// and spheres in blocks of their own. Indices count blocks.
+typedef struct
+{
+    int first_tri, num_tri;
+    int first_sphere, num_sphere;
+} WideNodeBlocks;
+
+// Per lane of a block, the prim index and the bit of the child lane it hangs under (0 for padding)
+typedef struct
+{
+    int index[PRIM_BLOCK_SIZE];
+    unsigned char child_bit[PRIM_BLOCK_SIZE];
+} WideBlockLanes;
+
+// Node n is WIDE_NUM_ROWS * width lanes starting at lanes[n * WIDE_NUM_ROWS * width].
+// Matches the vec4 packing of WideBVHData in raytrace.frag, empty lanes have all bounds at 1e30.
+typedef struct
+{
+    int width;
+    WideLane* lanes;
+    size_t num_nodes;
+    unsigned int* prims;
+    size_t num_prims;
+
+    // Optional, see bvh_wide_build_blocks
+    WideNodeBlocks* node_blocks;
+    TriBlock* tri_blocks;
+    WideBlockLanes* tri_lanes;
+    size_t num_tri_blocks;
+    SphereBlock* sphere_blocks;
+    WideBlockLanes* sphere_lanes;
+    size_t num_sphere_blocks;
+} WideBVH;
+
+// Collapse a binary BVH into 4 or 8 wide nodes, prims are copied from the binary BVH
+bool bvh_wide_build(WideBVH* wide, const BVH* bvh, int width);
+void bvh_wide_free(WideBVH* wide);
+
+// Most entries a depth first traversal's stack holds at once: the root, then the interior
+// siblings left waiting on every node down the worst path. Sizes the stacks of raytrace.frag.
+int bvh_wide_stack_entries(const WideBVH* wide);
+
+// Copy the leaf prims into per node blocks for the SIMD traversal, which otherwise tests them
+// one at a time. A copy: rebuild after moving spheres or triangles.
+bool bvh_wide_build_blocks(WideBVH* wide, const Scene* scene);
+
+// Bytes of the leaf blocks, 0 if not built
+size_t bvh_wide_block_bytes(const WideBVH* wide);
+
+static inline size_t bvh_wide_node_bytes(const WideBVH* wide) {return WIDE_NUM_ROWS * wide->width * sizeof(WideLane);}
+
+static inline WideLane* bvh_wide_row(const WideBVH* wide, size_t node, int row)
+{
+    return wide->lanes + (node * WIDE_NUM_ROWS + row) * wide->width;
+}
+
+// One ray at a time, for incoherent rays. With AVX2 (cpu_isa) a node's child boxes are tested
+// in one go, the hit children are compacted and sorted in registers and, if built, the leaf
+// blocks of the node are tested a block at a time. Same hits as the scalar loops either way.
+bool bvh_wide_intersect(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+// Any hit in (HIT_EPSILON, t_max), see bvh_occluded
+bool bvh_wide_occluded(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "struct.h"
+#include "rt_math.h"
+
+#define CAMERA_FOV 45.0f
+
+// Primary ray through pixel coordinate (px, py), same construction as main() in raytrace.frag
+// px/py are in gl_FragCoord convention (origin bottom left, +0.5 at pixel centers)
+void camera_ray(const Camera* camera, float px, float py, int width, int height, Vec3* ro, Vec3* rd);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+// Runtime instruction set dispatch for the SIMD kernels. The kernels are compiled with per
+// function target attributes, so the tools still build with plain -O2 and run on any x86-64;
+// callers ask cpu_isa which one to use. Other compilers and CPUs get the scalar code only.
+typedef enum
+{
+    CPU_ISA_SCALAR = 0,
+    CPU_ISA_SSE41,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512
+} CpuIsa;
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CPU_X86 1
+// No fma: the kernels round exactly like the scalar code, so every ISA gives the same image.
+// CPU_ISA_AVX2 includes BMI2 (pext / pdep), every AVX2 CPU has it.
+#define CPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+// AVX-512F brings FMA along, contraction has to be switched off explicitly
+#define CPU_TARGET_AVX512 __attribute__((target("avx2,bmi2,avx512f,avx512vl"), optimize("fp-contract=off")))
+#endif
+
+// Best ISA the CPU and OS support, capped by cpu_set_isa_limit
+CpuIsa cpu_isa(void);
+
+// Cap for benchmarks and debugging, CPU_ISA_SCALAR forces the plain C kernels
+void cpu_set_isa_limit(CpuIsa isa);
+
+const char* cpu_isa_name(CpuIsa isa);
+
+// Inverse of cpu_isa_name, false for an unknown name
+bool cpu_isa_parse(const char* name, CpuIsa* isa);
+
+#endif
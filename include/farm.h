@@ -0,0 +1,79 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include <stdbool.h>
+
+#include "struct.h"
+#include "scene.h"
+#include "render.h"
+
+// Render farm: a coordinator splits the image into tiles and deals them to worker processes
+// over a socket, workers send back the linear sums of their tiles (render_region) and the
+// coordinator assembles the image. Addresses are "unix:/path" for workers on the same host or
+// "tcp:host:port" ("tcp:port" listens on every interface, connects to localhost).
+//
+// Workers connect, get the scene and settings once, build their own BVHs and then take one
+// tile at a time. A worker that drops its connection or holds a tile past tile_timeout is
+// written off and its tile goes to the next idle worker. Once no tile is left to hand out,
+// idle workers get backup copies of the tiles still running, the first result wins. Messages
+// are in host byte order, so the machines of a farm have to share it.
+#define FARM_TILE_SIZE 64
+#define FARM_VERSION 1
+
+// The render every worker runs, sent with the scene
+typedef struct
+{
+    Camera camera;
+    int width, height;
+    int spp;
+    bool light_sampling;
+    int packet_bounces;
+    int wide_width;   // 0, 4 or 8, see RenderSettings.wide
+    int treelet;      // BVH treelet rounds
+    bool tri_records;
+    bool wavefront;
+    unsigned int seed_offset;
+} FarmRender;
+
+typedef struct
+{
+    int tile_size;
+    double tile_timeout; // Seconds, 0 waits forever
+    double wait_timeout; // Give up after this long without any worker connected
+    bool backups;        // Copies of straggling tiles for idle workers
+} FarmOptions;
+
+typedef struct
+{
+    int workers;        // That said hello
+    int failed_workers; // Dropped with a tile or timed out
+    int tiles;
+    int reissued;       // Tiles handed out again after their worker failed
+    int backups;        // Backup copies handed out
+    int wasted;         // Results for tiles that were already done
+    double seconds;
+} FarmStats;
+
+typedef struct
+{
+    int threads;    // 0 for every core
+    // Fault injection for testing on one host: drop the connection on receiving tile
+    // fail_after + 1 (0 never), sleep delay_ms before sending each result
+    int fail_after;
+    int delay_ms;
+} FarmWorkerOptions;
+
+static inline FarmOptions farm_default_options(void) {return (FarmOptions){FARM_TILE_SIZE, 0.0, 30.0, true};}
+
+// Listening socket for farm_coordinate, -1 on failure. Start it before any local worker.
+int farm_listen(const char* address);
+void farm_close(int fd);
+
+// Render on whatever workers connect to listen_fd until every tile is in, into image (already
+// initialized to render->width x render->height). Closes listen_fd. stats may be NULL.
+bool farm_coordinate(int listen_fd, const Scene* scene, const FarmRender* render, const FarmOptions* options, RenderImage* image, FarmStats* stats);
+
+// Connect to a coordinator (retrying for a few seconds) and work until it says done
+bool farm_work(const char* address, const FarmWorkerOptions* options);
+
+#endif
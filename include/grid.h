@@ -0,0 +1,47 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "bvh.h"
+
+// Two level grid (Kalojanov et al. 2011): a coarse top grid over the scene, every non-empty
+// top cell holds its own sub grid sized to the prims inside it. Resolutions follow the
+// cells-per-prim densities below.
+#define GRID_TOP_DENSITY 0.0625f
+#define GRID_CELL_DENSITY 2.0f
+#define GRID_MAX_TOP_DIM 256
+#define GRID_MAX_SUB_DIM 255
+
+// Layout of data[], uploaded as is and read by the ACCEL_GRID traversal in raytrace.frag:
+// header of GRID_HEADER_SIZE words, then 2 words per top cell (first leaf cell, sub grid dims
+// packed x | y << 8 | z << 16, 0 when empty), then 2 words per leaf cell (first ref, count).
+// Float header fields are stored as their bits.
+enum
+{
+    GRID_HEADER_MIN = 0,  // xyz
+    GRID_HEADER_MAX = 3,  // xyz
+    GRID_HEADER_CELL = 6, // xyz, top cell size
+    GRID_HEADER_DIMS = 9, // xyz, top grid resolution
+    GRID_HEADER_NUM_LARGE = 12,
+    GRID_HEADER_TOP = 13,   // Offset of the top cells
+    GRID_HEADER_CELLS = 14, // Offset of the leaf cells
+    GRID_HEADER_SIZE = 16
+};
+
+typedef struct
+{
+    unsigned int* data;
+    size_t data_size; // Words
+    // Prim references of every leaf cell, same encoding as the BVH. The first num_large are
+    // prims too big to bin (the ground sphere), tested by every ray.
+    unsigned int* refs;
+    size_t num_refs;
+} Grid;
+
+bool grid_build(Grid* grid, const Scene* scene);
+void grid_free(Grid* grid);
+
+// Same contracts as bvh_intersect / bvh_occluded, nodes_visited counts cells
+bool grid_intersect(const Grid* grid, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+bool grid_occluded(const Grid* grid, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <string.h>
+
+// 64 bit content hash for cache keys and output checks, fast rather than cryptographic
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// FNV-1a over 8 byte words with an extra shift to mix the high bits back down. The size goes
+// in first so adjacent arrays cannot trade bytes.
+static inline unsigned long long hash_bytes(unsigned long long h, const void* data, size_t size)
+{
+    const unsigned long long prime = 0x100000001b3ull;
+    h = (h ^ size) * prime;
+
+    const unsigned char* p = (const unsigned char*)data;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    for (; size > 0; p++, size--) {h = (h ^ *p) * prime;}
+    return h;
+}
+
+#endif
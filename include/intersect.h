@@ -0,0 +1,48 @@
+#ifndef INTERSECT_H
+#define INTERSECT_H
+
+#include "rt_math.h"
+#include "scene.h"
+
+// Hit type: 0 miss, 1 sphere, 2 triangle (same values as raytrace.frag)
+#define HIT_NONE 0
+#define HIT_SPHERE 1
+#define HIT_TRIANGLE 2
+
+#define HIT_EPSILON 0.001f
+#define HIT_MAX_T 10000.0f
+
+typedef struct
+{
+    float t;
+    int index;
+    int type;
+} Hit;
+
+static inline Hit hit_none(void) {return (Hit){HIT_MAX_T, -1, HIT_NONE};}
+
+// Returns distance t to intersection (or -1.0 if miss), mirrors hitSphere in raytrace.frag
+float hit_sphere(const Sphere* s, Vec3 ro, Vec3 rd);
+
+// Moller-Trumbore against a triangle given as v0 and its two edges
+float hit_triangle(Vec3 v0, Vec3 edge1, Vec3 edge2, Vec3 ro, Vec3 rd);
+
+// Moller-Trumbore against triangle triIndex of the mesh, mirrors hitTriangleIndexed
+float hit_triangle_indexed(const MeshData* mesh, int tri_index, Vec3 ro, Vec3 rd);
+
+float hit_tri_record(const TriRecord* rec, Vec3 ro, Vec3 rd);
+
+// One record per triangle of the mesh, NULL on failure
+TriRecord* tri_records_build(const MeshData* mesh);
+
+// Bounds of a single primitive
+AABB sphere_bounds(const Sphere* s);
+AABB triangle_bounds(const MeshData* mesh, int tri_index);
+
+static inline Vec3 mesh_vertex(const MeshData* mesh, unsigned int i)
+{
+    const float* v = mesh->vertices + 3 * i;
+    return (Vec3){v[0], v[1], v[2]};
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "scene.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "parallel.h"
+
+// NUMA placement for the CPU renderer: render threads pinned node by node, and the read-only
+// scene data they trace (spheres, materials, mesh, tri records, BVH and wide BVH with leaf
+// blocks) either left where it was built, copied into the memory of every node, or spread
+// page by page over the nodes. Topology comes from /sys/devices/system/node, limited to the
+// CPUs the process may run on; anywhere else it is one node with every CPU.
+#define NUMA_MAX_NODES 64
+
+typedef struct
+{
+    int num_nodes;                  // With CPUs
+    int node_id[NUMA_MAX_NODES];    // Kernel numbering, may have gaps
+    int first_cpu[NUMA_MAX_NODES];  // Into cpus
+    int num_cpus[NUMA_MAX_NODES];
+    int cpus[PARALLEL_MAX_THREADS]; // Usable CPUs node by node
+    int total_cpus;
+} NumaTopology;
+
+void numa_detect(NumaTopology* topo);
+
+// CPUs of the first num_nodes nodes
+int numa_node_cpus(const NumaTopology* topo, int num_nodes);
+
+// Pin parallel thread t of threads to the first num_nodes nodes, a contiguous share of the
+// threads per node, and write the node index of each thread to thread_node. threads 0 takes
+// every CPU of those nodes. Returns the thread count. parallel_set_affinity(NULL, 0) undoes it.
+int numa_pin_threads(const NumaTopology* topo, int num_nodes, int threads, int* thread_node);
+
+typedef enum
+{
+    NUMA_SHARED = 0, // Where it was built, first touch
+    NUMA_REPLICATE,  // A copy per node, each thread traces its node's
+    NUMA_INTERLEAVE  // One copy, pages round robin over the nodes
+} NumaPlacement;
+
+typedef struct
+{
+    Scene scene;
+    BVH bvh;
+    WideBVH wide;
+    bool has_wide;
+    void* arena; // Everything above points into it
+    size_t arena_size;
+} NumaReplica;
+
+// What RenderSettings.numa points at
+typedef struct
+{
+    NumaPlacement placement;
+    int num_replicas; // 0 when shared
+    NumaReplica replicas[NUMA_MAX_NODES];
+    unsigned char thread_replica[PARALLEL_MAX_THREADS];
+    bool bound; // The kernel took the memory policy, otherwise the copies went by first touch
+} NumaScene;
+
+// Lay out scene, bvh and wide (may be NULL) for the threads of numa_pin_threads
+bool numa_scene_build(NumaScene* numa, const NumaTopology* topo, int num_nodes, const int* thread_node, int threads,
+    NumaPlacement placement, const Scene* scene, const BVH* bvh, const WideBVH* wide);
+void numa_scene_free(NumaScene* numa);
+
+const char* numa_placement_name(NumaPlacement placement);
+
+// Inverse of numa_placement_name, false for an unknown name
+bool numa_placement_parse(const char* name, NumaPlacement* placement);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#define PARALLEL_MAX_THREADS 256
+
+// Number of hardware threads, at least 1
+int parallel_thread_count(void);
+
+// Pin worker thread t of every later parallel_for / parallel_tiles call to CPU cpus[t % count],
+// the calling thread (thread 0) only for the length of the call. count 0 lets the OS place them
+// again. Linux only, a no-op elsewhere.
+void parallel_set_affinity(const int* cpus, int count);
+
+// Call fn(ctx, index, thread) for every index in [0, count) across up to max_threads
+// threads (0 for all cores, more than the cores is allowed). Indices are handed out in order,
+// one at a time, so put the biggest work items first. The calling thread works too (as thread
+// 0) and the call returns once every index is done.
+typedef void (*ParallelFn)(void* ctx, int index, int thread);
+void parallel_for(int count, int max_threads, ParallelFn fn, void* ctx);
+
+// Work stealing over the tiles of a width x height image. The tiles are laid out in Hilbert
+// order and dealt to the threads as contiguous runs, so each thread works through one compact
+// region. A thread that runs dry steals from the far end of another thread's run, splitting
+// the stolen tile into quarters (down to PARALLEL_MIN_TILE) and keeping the rest in its own
+// deque for others to steal, so a frame doesn't end on one thread chewing through a slow tile.
+#define PARALLEL_MIN_TILE 4
+
+typedef struct
+{
+    int x0, y0, x1, y1; // Pixels [x0, x1) x [y0, y1)
+} ParallelTile;
+
+typedef struct
+{
+    double busy_seconds; // Inside fn
+    int tiles;
+    int steals;         // Tiles taken from other threads
+    int failed_steals;  // Sweeps over every other thread that found nothing
+} ParallelThreadStats;
+
+typedef struct
+{
+    int threads;
+    double seconds; // Wall time of the call
+    ParallelThreadStats thread[PARALLEL_MAX_THREADS];
+} ParallelTileStats;
+
+typedef void (*ParallelTileFn)(void* ctx, ParallelTile tile, int thread);
+
+// stats may be NULL
+void parallel_tiles(int width, int height, int tile_size, int max_threads, ParallelTileFn fn, void* ctx, ParallelTileStats* stats);
+
+// Fraction of the wall time the threads spent inside fn
+double parallel_tile_utilization(const ParallelTileStats* stats);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef PRIM_BLOCK_H
+#define PRIM_BLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "intersect.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+// Leaf prims in structure of arrays blocks, so one kernel call tests a ray against a whole
+// block: scalar, SSE4.1 (half a block per register), AVX2 (a block) and AVX-512 (two blocks).
+// Every kernel rounds like hit_triangle / hit_sphere, so they all find the same hit. Unused
+// lanes hold a triangle with zero edges or a sphere of radius^2 -inf, neither can be hit.
+#define PRIM_BLOCK_SIZE 8
+
+typedef struct
+{
+    float v0x[PRIM_BLOCK_SIZE], v0y[PRIM_BLOCK_SIZE], v0z[PRIM_BLOCK_SIZE];
+    float e1x[PRIM_BLOCK_SIZE], e1y[PRIM_BLOCK_SIZE], e1z[PRIM_BLOCK_SIZE];
+    float e2x[PRIM_BLOCK_SIZE], e2y[PRIM_BLOCK_SIZE], e2z[PRIM_BLOCK_SIZE];
+} TriBlock;
+
+typedef struct
+{
+    float cx[PRIM_BLOCK_SIZE], cy[PRIM_BLOCK_SIZE], cz[PRIM_BLOCK_SIZE];
+    float r2[PRIM_BLOCK_SIZE]; // radius * radius
+} SphereBlock;
+
+// index is block * PRIM_BLOCK_SIZE + lane, -1 on a miss
+typedef struct
+{
+    float t;
+    int index;
+} PrimBlockHit;
+
+// Every lane unused
+void tri_block_clear(TriBlock* block);
+void sphere_block_clear(SphereBlock* block);
+
+void tri_block_set(TriBlock* block, int lane, Vec3 v0, Vec3 edge1, Vec3 edge2);
+void sphere_block_set(SphereBlock* block, int lane, const Sphere* s);
+
+// Blocks for triangles first..first+count-1 of the mesh (tri_records if not NULL), the last
+// block padded. NULL on failure, *num_blocks gets the block count.
+TriBlock* tri_blocks_build(const MeshData* mesh, const TriRecord* tri_records, size_t first, size_t count, size_t* num_blocks);
+SphereBlock* sphere_blocks_build(const Sphere* spheres, size_t count, size_t* num_blocks);
+
+// Closest hit in (HIT_EPSILON, t_max) over the blocks, of equally close ones the lowest index.
+// Uses the best kernel cpu_isa allows (AVX2 for a single block on AVX-512 CPUs).
+bool tri_blocks_closest(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit);
+bool sphere_blocks_closest(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit);
+
+// Same with the kernel of isa, which the CPU has to support (for benchmarks and tests)
+bool tri_blocks_closest_isa(CpuIsa isa, const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit);
+bool sphere_blocks_closest_isa(CpuIsa isa, const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit);
+
+#ifdef CPU_X86
+// The AVX2 block kernels for traversal loops that inline them: t of every lane, -1 where
+// hit_triangle / hit_sphere miss (the HIT_EPSILON and t_max window is the caller's)
+typedef struct
+{
+    __m256 ox, oy, oz;
+    __m256 dx, dy, dz;
+} BlockRay8;
+
+CPU_TARGET_AVX2 static inline BlockRay8 block_ray8(Vec3 ro, Vec3 rd)
+{
+    return (BlockRay8){
+        _mm256_set1_ps(ro.x), _mm256_set1_ps(ro.y), _mm256_set1_ps(ro.z),
+        _mm256_set1_ps(rd.x), _mm256_set1_ps(rd.y), _mm256_set1_ps(rd.z)
+    };
+}
+
+CPU_TARGET_AVX2 static inline __m256 tri_block_avx2(const TriBlock* b, const BlockRay8* ray)
+{
+    __m256 e1x = _mm256_loadu_ps(b->e1x), e1y = _mm256_loadu_ps(b->e1y), e1z = _mm256_loadu_ps(b->e1z);
+    __m256 e2x = _mm256_loadu_ps(b->e2x), e2y = _mm256_loadu_ps(b->e2y), e2z = _mm256_loadu_ps(b->e2z);
+
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(ray->dy, e2z), _mm256_mul_ps(ray->dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(ray->dz, e2x), _mm256_mul_ps(ray->dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(ray->dx, e2y), _mm256_mul_ps(ray->dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+    __m256 ok = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_set1_ps(-0.001f), _CMP_LE_OQ), _mm256_cmp_ps(a, _mm256_set1_ps(0.001f), _CMP_GE_OQ));
+
+    __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+    __m256 sx = _mm256_sub_ps(ray->ox, _mm256_loadu_ps(b->v0x));
+    __m256 sy = _mm256_sub_ps(ray->oy, _mm256_loadu_ps(b->v0y));
+    __m256 sz = _mm256_sub_ps(ray->oz, _mm256_loadu_ps(b->v0z));
+    __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ray->dx, qx), _mm256_mul_ps(ray->dy, qy)), _mm256_mul_ps(ray->dz, qz)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+    __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), t, ok);
+}
+
+CPU_TARGET_AVX2 static inline __m256 sphere_block_avx2(const SphereBlock* b, const BlockRay8* ray)
+{
+    __m256 ocx = _mm256_sub_ps(ray->ox, _mm256_loadu_ps(b->cx));
+    __m256 ocy = _mm256_sub_ps(ray->oy, _mm256_loadu_ps(b->cy));
+    __m256 ocz = _mm256_sub_ps(ray->oz, _mm256_loadu_ps(b->cz));
+
+    __m256 bb = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ray->dx), _mm256_mul_ps(ocy, ray->dy)), _mm256_mul_ps(ocz, ray->dz));
+    __m256 c = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+    c = _mm256_sub_ps(c, _mm256_loadu_ps(b->r2));
+    __m256 h = _mm256_sub_ps(_mm256_mul_ps(bb, bb), c);
+
+    __m256 t = _mm256_sub_ps(_mm256_xor_ps(bb, _mm256_set1_ps(-0.0f)), _mm256_sqrt_ps(h));
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), t, _mm256_cmp_ps(h, _mm256_setzero_ps(), _CMP_GE_OQ));
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <stdbool.h>
+
+#include "scene.h"
+#include "bvh.h"
+#include "render.h"
+
+// Interactive CPU rendering under a frame time budget, into the same accumulation as the
+// viewer: the running mean of render.h restarts whenever the camera moves, like g_frameCount
+// = 0. While the camera moves an update is one sample per pixel at the finest internal
+// resolution whose measured cost fits the budget, upscaled for display. Once it stops, full
+// resolution frames are rendered a run of tiles at a time (whole tile rows once they fit),
+// sized from what each tile cost in the last pass, as many as the budget allows, so a frame
+// slower than the budget never holds up the display, and the image refines from there. Until the first full frame is done the last preview stays on
+// screen.
+#define PROGRESSIVE_MAX_SCALE 8
+
+typedef struct
+{
+    double budget;  // Seconds of rendering per update, under 1/30 for 30 fps
+    int max_scale;  // Coarsest internal resolution while moving, width / max_scale
+    int max_frames; // Stop refining at this many samples per pixel, 0 never stops
+} ProgressiveOptions;
+
+ProgressiveOptions progressive_default_options(void);
+
+typedef struct
+{
+    ProgressiveOptions options;
+    RenderImage full;      // Full resolution accumulation
+    RenderImage preview;   // Full size buffer, width and height set to the scaled ones
+    int scale;             // Of preview, 1 is full resolution
+    int next_tile;         // Row major tile the next run of frame full.frame_count starts at, 0 between frames
+    double sample_seconds; // Measured cost of one sample, 0 before the first update
+    double* tile_seconds;  // Cost of every tile in its last full resolution pass, 0 not rendered yet
+    int cost_tile;         // Tile size of tile_seconds, 0 after a camera move clears them
+    Camera camera;         // Of the last update
+    bool has_camera;
+} ProgressiveView;
+
+// What one update did
+typedef struct
+{
+    bool moving;     // The camera changed, the update rendered a preview
+    int scale;       // Resolution divisor of the image on display
+    int frames;      // Complete samples per pixel of the image on display
+    int samples;     // Rendered, a preview's or parts of full resolution frames
+    double seconds;  // Spent rendering
+} ProgressiveFrame;
+
+bool progressive_init(ProgressiveView* view, int width, int height, const ProgressiveOptions* options);
+void progressive_free(ProgressiveView* view);
+
+// Restart accumulation for a scene edit, a camera move is noticed by progressive_update
+void progressive_reset(ProgressiveView* view);
+
+// One display frame of work for settings->camera, whose threads, packets, wide BVH and so on
+// are used as they are
+ProgressiveFrame progressive_update(ProgressiveView* view, const Scene* scene, const BVH* bvh, const RenderSettings* settings);
+
+// The image on display as 8 bit RGB, full size and top row first like a PPM, the preview
+// upscaled by pixel replication
+void progressive_display(const ProgressiveView* view, unsigned char* rgb);
+
+#endif
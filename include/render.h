@@ -0,0 +1,131 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+
+#include "struct.h"
+#include "scene.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "parallel.h"
+#include "numa.h"
+
+// CPU reference path tracer: main() of raytrace.frag step for step (pcg_hash seeding, pixel
+// jitter, cosHemisphere, the Fresnel weighted specular choice, LIGHT_SAMPLING, Russian
+// roulette and the gamma space running mean), traced through the binary BVH or a wide one.
+// Tiles are spread over threads with the work stealing parallel_tiles.
+//
+// Output is deterministic: a pixel's random stream is seeded from its position and frame
+// (sample index plus seed_offset) only, and draws in the same order whatever traces it, and
+// each pixel is accumulated by one thread in frame order. Thread count, tile stealing, packets,
+// the wide BVH and its ISA, wavefront order and NUMA placement all give the same image bit for
+// bit. Farm tiles give the same sums however the image is split; sample ranges merged from
+// accumulation files match one run up to the rounding of the float sums, added in the order
+// the files are given.
+#define RENDER_MAX_BOUNCES 15
+#define RENDER_TILE_SIZE 16
+
+// Packets cover RENDER_PACKET_WIDTH x 2 pixels (BVH_PACKET_SIZE rays, see bvh_packet.h)
+#define RENDER_PACKET_WIDTH 4
+
+// Wavefront mode traces the paths of a stream tile together, a bounce at a time
+#define RENDER_STREAM_TILE 64
+
+// Material of every triangle, like matIndex in raytrace.frag
+#define RENDER_TRIANGLE_MATERIAL 5
+
+// Scene features the path kernel is compiled for, as a mask. Each combination with prims is its
+// own variant of the whole tile loop, with the tests on hit type, emission and lights per hit
+// folded away and the binary BVH leaves tested through bvh_intersect_prims.
+// RENDER_KERNEL_GENERIC keeps every test and renders any scene. The bounce limit is
+// RENDER_MAX_BOUNCES in all of them.
+#define RENDER_KERNEL_GENERIC 0u
+#define RENDER_KERNEL_SPHERES 1u   // The scene has spheres
+#define RENDER_KERNEL_TRIANGLES 2u // Has triangles
+#define RENDER_KERNEL_EMISSIVE 4u  // A sphere's material or the triangles' emits
+#define RENDER_KERNEL_COUNT 8
+
+typedef struct
+{
+    Camera camera;
+    bool light_sampling; // LIGHT_SAMPLING in raytrace.frag
+    int threads;         // 0 for every core
+    // Bounces traced as ray packets: 0 off, 1 camera rays, 2 camera rays and the first bounce.
+    // Same image either way, packets are just faster while the rays stay coherent.
+    int packet_bounces;
+    // Rays past the packets and shadow rays once they no longer share a path through the tree,
+    // traced one at a time through this wide BVH with its SIMD kernel. NULL for the binary BVH.
+    const WideBVH* wide;
+    // Wavefront instead of depth first: the paths of a stream tile advance a bounce at a time,
+    // their rays traced in order of ray octant and origin (packets of neighbours in that order
+    // for the first packet_bounces) and their hits shaded from one queue per material. Same
+    // image, the rays are still traced one after the other rather than breadth first.
+    bool wavefront;
+    // Added to the frame number in every pixel seed (u_frameCount in raytrace.frag), so jobs
+    // rendering the same frames with different offsets draw independent samples
+    unsigned int seed_offset;
+    // Per node copies of the scene, BVH and wide BVH for threads pinned by numa_pin_threads.
+    // NULL, or placement NUMA_SHARED, traces the scene and BVHs passed in.
+    const NumaScene* numa;
+    // Variant from render_kernel_select for this scene, a kernel assuming features the scene
+    // lacks is wrong. RENDER_KERNEL_GENERIC (0) fits any scene.
+    unsigned int kernel;
+} RenderSettings;
+
+// Accumulated image, rows bottom up like gl_FragCoord. history holds what the shader keeps in
+// its RGBA32F accumulation texture: the running mean, gamma encoded.
+typedef struct
+{
+    int width, height;
+    float* history; // 3 floats per pixel
+    int frame_count;
+} RenderImage;
+
+bool render_image_init(RenderImage* image, int width, int height);
+void render_image_free(RenderImage* image);
+
+// Restart accumulation, as a camera move or scene edit does in the viewer
+static inline void render_image_reset(RenderImage* image) {image->frame_count = 0;}
+
+// One more sample per pixel, frame_count goes up by one first (u_frameCount). stats, if not
+// NULL, gets the scheduler's per thread numbers for the frame.
+void render_frame(RenderImage* image, const Scene* scene, const BVH* bvh, const RenderSettings* settings, ParallelTileStats* stats);
+
+// Frame image->frame_count over region only, the caller counts the frame (frame_count++) before
+// its first region. A frame can be spread over several calls this way, as long as each pixel
+// gets its sample once; render_frame is the whole image in one.
+void render_frame_region(RenderImage* image, const Scene* scene, const BVH* bvh, const RenderSettings* settings, ParallelTile region,
+    ParallelTileStats* stats);
+
+// Linear radiance of frames first_frame .. first_frame + num_frames - 1 (the frame_count values
+// render_frame would use, the first frame is 1) of a width x height image, summed over the
+// pixels of region into sums: 3 floats per region pixel, row by row, added to what is there.
+// Regions and frame ranges rendered apart, on any machine, add up to the same samples as the
+// frame loop, so sums are what distributed renders pass around.
+void render_region(const Scene* scene, const BVH* bvh, const RenderSettings* settings, int width, int height, ParallelTile region,
+    int first_frame, int num_frames, float* sums);
+
+// history from the sums of num_frames samples over the whole image
+void render_image_set_sums(RenderImage* image, const float* sums, int num_frames);
+
+// Kernel variant for what the scene holds, picked once it is loaded; the image is the generic
+// kernel's. Still right for the copies of a NumaScene, not after edits that add a prim type or
+// a light.
+unsigned int render_kernel_select(const Scene* scene);
+const char* render_kernel_name(unsigned int kernel);
+
+// Radiance along one camera ray, the bounce loop of main()
+Vec3 render_trace_path(const Scene* scene, const BVH* bvh, Vec3 ro, Vec3 rd, unsigned int* seed, bool light_sampling);
+
+// Binary PPM, top row first, clamped to 8 bits like the display pass
+bool render_image_write_ppm(const RenderImage* image, const char* filename);
+
+// Hash of the image as render_image_write_ppm writes it, for regression checks (see the
+// determinism note above)
+unsigned long long render_image_hash(const RenderImage* image);
+
+// Print "hash <16 hex digits>" to stdout, followed by ok or MISMATCH when expected is not NULL.
+// false on a mismatch.
+bool render_image_verify(const RenderImage* image, const char* expected);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef RT_MATH_H
+#define RT_MATH_H
+
+#include <math.h>
+
+// Small vector helpers shared by the CPU side of the renderer (BVH builder, traversal)
+typedef struct
+{
+    float x, y, z;
+} Vec3;
+
+static inline Vec3 v3(float x, float y, float z) {return (Vec3){x, y, z};}
+static inline Vec3 v3_add(Vec3 a, Vec3 b) {return (Vec3){a.x + b.x, a.y + b.y, a.z + b.z};}
+static inline Vec3 v3_sub(Vec3 a, Vec3 b) {return (Vec3){a.x - b.x, a.y - b.y, a.z - b.z};}
+static inline Vec3 v3_mul(Vec3 a, Vec3 b) {return (Vec3){a.x * b.x, a.y * b.y, a.z * b.z};}
+static inline Vec3 v3_scale(Vec3 a, float s) {return (Vec3){a.x * s, a.y * s, a.z * s};}
+static inline float v3_dot(Vec3 a, Vec3 b) {return a.x * b.x + a.y * b.y + a.z * b.z;}
+static inline Vec3 v3_min(Vec3 a, Vec3 b) {return (Vec3){fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)};}
+static inline Vec3 v3_max(Vec3 a, Vec3 b) {return (Vec3){fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z)};}
+static inline float v3_length(Vec3 a) {return sqrtf(v3_dot(a, a));}
+
+static inline Vec3 v3_cross(Vec3 a, Vec3 b)
+{
+    return (Vec3){a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+static inline Vec3 v3_normalize(Vec3 a)
+{
+    float len = v3_length(a);
+    return len > 0.0f ? v3_scale(a, 1.0f / len) : a;
+}
+
+static inline float v3_axis(Vec3 a, int axis) {return axis == 0 ? a.x : (axis == 1 ? a.y : a.z);}
+
+typedef struct
+{
+    Vec3 min, max;
+} AABB;
+
+static inline AABB aabb_empty(void)
+{
+    return (AABB){{1e30f, 1e30f, 1e30f}, {-1e30f, -1e30f, -1e30f}};
+}
+
+static inline AABB aabb_union(AABB a, AABB b) {return (AABB){v3_min(a.min, b.min), v3_max(a.max, b.max)};}
+static inline AABB aabb_grow(AABB a, Vec3 p) {return (AABB){v3_min(a.min, p), v3_max(a.max, p)};}
+static inline Vec3 aabb_center(AABB a) {return v3_scale(v3_add(a.min, a.max), 0.5f);}
+static inline Vec3 aabb_extent(AABB a) {return v3_sub(a.max, a.min);}
+
+static inline float aabb_area(AABB a)
+{
+    Vec3 e = aabb_extent(a);
+    if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f) {return 0.0f;}
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+#endif
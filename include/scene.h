@@ -0,0 +1,43 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stddef.h>
+
+#include "struct.h"
+#include "obj_loader.h"
+#include "rt_math.h"
+
+// Acceleration structure a scene is traced with, ACCEL_GRID in raytrace.frag for the grid
+typedef enum
+{
+    SCENE_ACCEL_BVH = 0,
+    SCENE_ACCEL_GRID
+} SceneAccel;
+
+// Host side copy of everything the shader reads from the SSBOs
+typedef struct
+{
+    Sphere* spheres;
+    size_t num_spheres;
+    Material* materials;
+    size_t num_materials;
+    MeshData mesh;
+    TriRecord* tri_records; // Optional, one per triangle, see scene_build_tri_records
+    SceneAccel accel;
+} Scene;
+
+// Default demo scene: tetrahedron.obj, five spheres and the ground sphere
+bool scene_load_default(Scene* scene, const char* obj_filename);
+
+// Append a random triangle soup inside the given box, used by the benchmarks to scale
+// scenes without needing large assets on disk
+bool scene_add_random_triangles(Scene* scene, size_t count, float size, Vec3 box_min, Vec3 box_max, unsigned int seed);
+
+// Precompute v0/edges/normal of every triangle so intersection reads one record
+bool scene_build_tri_records(Scene* scene);
+
+static inline size_t scene_num_triangles(const Scene* scene) {return scene->mesh.num_indices / 3;}
+
+void scene_free(Scene* scene);
+
+#endif
@@ -24,6 +24,14 @@ typedef struct
     unsigned int x, y, z, pad;
 } Index4;
 
+// Precomputed triangle for intersection, v0 and both edges with the geometric normal in w
+typedef struct
+{
+    float v0x, v0y, v0z, nx;
+    float e1x, e1y, e1z, ny;
+    float e2x, e2y, e2z, nz;
+} TriRecord;
+
 typedef struct 
 {
     float px, py, pz;
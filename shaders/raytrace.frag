@@ -24,6 +24,59 @@ layout(std430, binding = 1) buffer MaterialData {Material materials[];};
 layout(std430, binding = 2) buffer VertexData {vec3 vertices[];};
 layout(std430, binding = 3) buffer IndexData {uint indices[];};
 
+// TRI_RECORDS: per triangle (v0, n.x), (edge1, n.y), (edge2, n.z), 48 contiguous bytes
+#ifdef TRI_RECORDS
+layout(std430, binding = 8) buffer TriRecordData {vec4 triRecords[];};
+#endif
+
+// Interior: count <= 0, children at leftFirst and leftFirst + 1, ordered low to high along
+// split axis -count
+// Leaf: count prims starting at primRefs[leftFirst]
+struct BVHNode
+{
+    vec3 bmin;
+    int leftFirst;
+    vec3 bmax;
+    int count;
+};
+
+layout(std430, binding = 4) buffer BVHData {BVHNode nodes[];};
+
+// Top bit set for triangles, sphere index otherwise
+layout(std430, binding = 5) buffer PrimData {uint primRefs[];};
+
+// BVH_WIDTH (4 or 8) is injected at compile time to select the collapsed wide BVH.
+// Each node is 8 rows (minx, miny, minz, maxx, maxy, maxz, child, count) of BVH_WIDTH
+// lanes, so one vec4 fetch yields a coordinate of four child boxes.
+#ifdef BVH_WIDTH
+layout(std430, binding = 6) buffer WideBVHData {vec4 wideNodes[];};
+#endif
+
+// BVH_STACKLESS selects the threaded BVH in the nodes buffer: nodes in pre-order, interior
+// nodes keep their skip link (index after the subtree) in leftFirst. No traversal stack.
+
+// BVH_COMPRESSED selects the quantized BVH8, 5 uvec4 per node:
+// origin + exponents, child/prim base + 8 meta bytes, then 8 bit qlo xyz and qhi xyz per lane
+#ifdef BVH_COMPRESSED
+layout(std430, binding = 7) buffer CompressedBVHData {uvec4 compressedNodes[];};
+#endif
+
+// ACCEL_GRID replaces the BVH with the two level grid of grid.h: a 16 word header (bounds,
+// top cell size and resolution as float bits, large prim count, offsets), 2 words per top
+// cell (first leaf cell, packed sub grid dims) and 2 words per leaf cell (first ref, count)
+// into primRefs. The first numLarge refs are tested by every ray.
+#ifdef ACCEL_GRID
+layout(std430, binding = 9) buffer GridData {uint gridData[];};
+#endif
+
+// LAZY_FEEDBACK: hit counts per node slot for the lazy BVH of bvh_lazy.h, bumped when a sampled
+// pixel reaches a leaf too big to be finished (a pending subtree). Read back and cleared by the host.
+// Leaves over BVH_MAX_LEAF_PRIMS stay once everything is refined (the large prim leaf, depth
+// limited ones), so the buffer keeps a slot per node for as long as the shader is in use.
+#ifdef LAZY_FEEDBACK
+layout(std430, binding = 10) buffer LeafFeedback {uint leafHits[];};
+#endif
+
 uniform vec2 u_resolution;
 uniform int u_frameCount;
 uniform sampler2D u_historyTexture;
@@ -63,18 +116,8 @@ vec3 cosHemisphere(vec3 n, inout uint seed)
     return tangent * localRay.x + bitangent * localRay.y + n * localRay.z;
 }
 
-float hitTriangleIndexed(int triIndex, vec3 ro, vec3 rd)
+float hitTriangle(vec3 v0, vec3 edge1, vec3 edge2, vec3 ro, vec3 rd)
 {
-    uint i0 = indices[3 * triIndex + 0];
-    uint i1 = indices[3 * triIndex + 1];
-    uint i2 = indices[3 * triIndex + 2];
-
-    vec3 v0 = vertices[i0];
-    vec3 v1 = vertices[i1];
-    vec3 v2 = vertices[i2];
-
-    vec3 edge1 = v1 - v0;
-    vec3 edge2 = v2 - v0;
     vec3 h = cross(rd, edge2);
     float a = dot(edge1, h);
 
@@ -98,6 +141,47 @@ float hitTriangleIndexed(int triIndex, vec3 ro, vec3 rd)
     return -1.0;
 }
 
+#ifdef TRI_RECORDS
+float hitTriangleIndexed(int triIndex, vec3 ro, vec3 rd)
+{
+    return hitTriangle(triRecords[3 * triIndex].xyz, triRecords[3 * triIndex + 1].xyz, triRecords[3 * triIndex + 2].xyz, ro, rd);
+}
+
+vec3 triangleNormal(int triIndex)
+{
+    return vec3(triRecords[3 * triIndex].w, triRecords[3 * triIndex + 1].w, triRecords[3 * triIndex + 2].w);
+}
+#else
+float hitTriangleIndexed(int triIndex, vec3 ro, vec3 rd)
+{
+    uint i0 = indices[3 * triIndex + 0];
+    uint i1 = indices[3 * triIndex + 1];
+    uint i2 = indices[3 * triIndex + 2];
+
+    vec3 v0 = vertices[i0];
+    vec3 v1 = vertices[i1];
+    vec3 v2 = vertices[i2];
+
+    return hitTriangle(v0, v1 - v0, v2 - v0, ro, rd);
+}
+
+vec3 triangleNormal(int triIndex)
+{
+    uint i0 = indices[3 * triIndex + 0];
+    uint i1 = indices[3 * triIndex + 1];
+    uint i2 = indices[3 * triIndex + 2];
+
+    vec3 v0 = vertices[i0];
+    vec3 v1 = vertices[i1];
+    vec3 v2 = vertices[i2];
+
+    vec3 edge1 = v1 - v0;
+    vec3 edge2 = v2 - v0;
+
+    return normalize(cross(edge1, edge2));
+}
+#endif
+
 // Returns distance t to intersection (or -1.0 if miss)
 float hitSphere(Sphere s, vec3 ro, vec3 rd) {
     vec3 oc = ro - s.pos;
@@ -111,38 +195,612 @@ float hitSphere(Sphere s, vec3 ro, vec3 rd) {
     return -b - sqrt(h); 
 }
 
+const uint PRIM_TRIANGLE_BIT = 0x80000000u;
+const int BVH_STACK_SIZE = 64;
+// Stack of the wide and compressed traversals, measured on the uploaded tree by the host
+// (bvh_wide_stack_entries) so pushes never overflow: tens of entries where the worst case of any
+// 8 wide tree within BVH_MAX_DEPTH would be hundreds
+#ifndef BVH_STACK_ENTRIES
+#define BVH_STACK_ENTRIES 1 // No scene was uploaded
+#endif
+
+// Slab test, returns entry distance or 1e30 on miss
+float hitAABB(vec3 bmin, vec3 bmax, vec3 ro, vec3 invRd, float tMax)
+{
+    vec3 t1 = (bmin - ro) * invRd;
+    vec3 t2 = (bmax - ro) * invRd;
+    vec3 tSmall = min(t1, t2);
+    vec3 tBig = max(t1, t2);
+    float tNear = max(max(tSmall.x, tSmall.y), tSmall.z);
+    float tFar = min(min(tBig.x, tBig.y), tBig.z);
+
+    if (tFar >= tNear && tNear < tMax && tFar > 0.0) {return tNear;}
+    return 1e30;
+}
+
+// Test count prims starting at primRefs[first], spheres and triangles share the list
+void intersectLeaf(int first, int count, vec3 ro, vec3 rd, inout float minT, inout int hitIndex, inout int hitType)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        uint ref = primRefs[i];
+        bool isTriangle = (ref & PRIM_TRIANGLE_BIT) != 0u;
+        int primIndex = int(ref & ~PRIM_TRIANGLE_BIT);
+
+        float t = isTriangle ? hitTriangleIndexed(primIndex, ro, rd) : hitSphere(spheres[primIndex], ro, rd);
+        if (t > 0.001 && t < minT)
+        {
+            minT = t;
+            hitIndex = primIndex;
+            hitType = isTriangle ? 2 : 1;
+        }
+    }
+}
+
+// True if any prim of the leaf is hit in (0.001, tMax)
+bool occludedLeaf(int first, int count, vec3 ro, vec3 rd, float tMax)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        uint ref = primRefs[i];
+        int primIndex = int(ref & ~PRIM_TRIANGLE_BIT);
+
+        float t = (ref & PRIM_TRIANGLE_BIT) != 0u ? hitTriangleIndexed(primIndex, ro, rd) : hitSphere(spheres[primIndex], ro, rd);
+        if (t > 0.001 && t < tMax) {return true;}
+    }
+    return false;
+}
+
+// occluded(ro, rd, tMax) below is the any hit query for shadow rays: it returns at the first
+// blocker, so no variant orders children by distance or re-tests boxes against a shrinking t.
+
+#if defined(ACCEL_GRID)
+vec3 gridVec(int offset)
+{
+    return uintBitsToFloat(uvec3(gridData[offset], gridData[offset + 1], gridData[offset + 2]));
+}
+
+// Axis whose cell boundary the ray crosses first
+int minAxis(vec3 t)
+{
+    return t.x < t.y ? (t.x < t.z ? 0 : 2) : (t.y < t.z ? 1 : 2);
+}
+
+// DDA start for a grid of cells of the given size at origin: first cell and the distance to
+// its far boundary on every axis, 1e30 on axes the ray doesn't move along
+ivec3 ddaStart(vec3 origin, vec3 size, ivec3 dims, vec3 ro, vec3 rd, vec3 invRd, float t, ivec3 stepDir, out vec3 tNext)
+{
+    ivec3 cell = clamp(ivec3(floor((ro + rd * t - origin) / size)), ivec3(0), dims - 1);
+    tNext = (origin + vec3(cell + ivec3(greaterThan(stepDir, ivec3(0)))) * size - ro) * invRd;
+    tNext = mix(tNext, vec3(1e30), equal(stepDir, ivec3(0)));
+    return cell;
+}
+
+// Both levels of DDA, cells front to back so a hit inside the current cell ends the walk.
+// With anyHit it returns true at the first prim closer than minT instead.
+bool gridWalk(vec3 ro, vec3 rd, bool anyHit, inout float minT, inout int hitIndex, inout int hitType)
+{
+    if (gridData.length() == 0) {return false;}
+
+    int numLarge = int(gridData[12]);
+    if (anyHit)
+    {
+        if (occludedLeaf(0, numLarge, ro, rd, minT)) {return true;}
+    }
+    else {intersectLeaf(0, numLarge, ro, rd, minT, hitIndex, hitType);}
+
+    vec3 gridMin = gridVec(0);
+    vec3 cellSize = gridVec(6);
+    ivec3 dims = ivec3(gridData[9], gridData[10], gridData[11]);
+    int top = int(gridData[13]);
+    int cells = int(gridData[14]);
+
+    vec3 invRd = 1.0 / rd;
+    vec3 t1 = (gridMin - ro) * invRd;
+    vec3 t2 = (gridVec(3) - ro) * invRd;
+    vec3 tSmall = min(t1, t2);
+    vec3 tBig = max(t1, t2);
+    float tEnter = max(max(max(tSmall.x, tSmall.y), tSmall.z), 0.0);
+    float tExit = min(min(tBig.x, tBig.y), tBig.z);
+    if (tEnter > tExit || tEnter >= minT) {return false;}
+
+    ivec3 stepDir = ivec3(sign(rd));
+    vec3 tNext;
+    ivec3 cell = ddaStart(gridMin, cellSize, dims, ro, rd, invRd, tEnter, stepDir, tNext);
+    vec3 tDelta = abs(cellSize * invRd);
+
+    while (true)
+    {
+        int c = cell.x + dims.x * (cell.y + dims.y * cell.z);
+        float cellExit = min(min(tNext.x, tNext.y), tNext.z);
+        uint packed = gridData[top + 2 * c + 1];
+
+        if (packed != 0u)
+        {
+            ivec3 subDims = ivec3(packed & 0xffu, (packed >> 8) & 0xffu, (packed >> 16) & 0xffu);
+            vec3 subSize = cellSize / vec3(subDims);
+            int firstLeaf = int(gridData[top + 2 * c]);
+            float subEnd = min(cellExit, minT);
+
+            vec3 subNext;
+            ivec3 sub = ddaStart(gridMin + vec3(cell) * cellSize, subSize, subDims, ro, rd, invRd, tEnter, stepDir, subNext);
+            vec3 subDelta = abs(subSize * invRd);
+
+            while (true)
+            {
+                int leaf = cells + 2 * (firstLeaf + sub.x + subDims.x * (sub.y + subDims.y * sub.z));
+                int first = int(gridData[leaf]);
+                int count = int(gridData[leaf + 1]);
+                if (anyHit)
+                {
+                    if (occludedLeaf(first, count, ro, rd, minT)) {return true;}
+                }
+                else {intersectLeaf(first, count, ro, rd, minT, hitIndex, hitType);}
+
+                float leafExit = min(min(subNext.x, subNext.y), subNext.z);
+                if (minT <= leafExit || leafExit >= subEnd) {break;}
+
+                int axis = minAxis(subNext);
+                sub[axis] += stepDir[axis];
+                subNext[axis] += subDelta[axis];
+                if (sub[axis] < 0 || sub[axis] >= subDims[axis]) {break;}
+            }
+        }
+
+        if (minT <= cellExit || cellExit >= tExit) {break;}
+        tEnter = cellExit;
+
+        int axis = minAxis(tNext);
+        cell[axis] += stepDir[axis];
+        tNext[axis] += tDelta[axis];
+        if (cell[axis] < 0 || cell[axis] >= dims[axis]) {break;}
+    }
+    return hitType != 0;
+}
+
 // Hit type: 0 miss, 1 sphere, 2 triangle
 void findClosestHit(vec3 ro, vec3 rd, out float minT, out int hitIndex, out int hitType)
 {
     minT = 10000.0;
     hitIndex = -1;
     hitType = 0;
+    gridWalk(ro, rd, false, minT, hitIndex, hitType);
+}
+bool occluded(vec3 ro, vec3 rd, float tMax)
+{
+    int hitIndex = -1;
+    int hitType = 0;
+    return gridWalk(ro, rd, true, tMax, hitIndex, hitType);
+}
+#elif defined(BVH_COMPRESSED)
+const int CBVH_STACK_SIZE = BVH_STACK_ENTRIES;
 
-    // Check for sphere
-    for(int i = 0; i < spheres.length(); i++)
+// Byte lane (0..7) of two packed words
+uint laneByte(uvec2 words, int lane)
+{
+    return (words[lane >> 2] >> (8 * (lane & 3))) & 0xffu;
+}
+
+// Hit type: 0 miss, 1 sphere, 2 triangle
+void findClosestHit(vec3 ro, vec3 rd, out float minT, out int hitIndex, out int hitType)
+{
+    minT = 10000.0;
+    hitIndex = -1;
+    hitType = 0;
+
+    if (compressedNodes.length() == 0) {return;}
+
+    vec3 invRd = 1.0 / rd;
+    int stack[CBVH_STACK_SIZE];
+    float stackT[CBVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp] = 0;
+    stackT[sp++] = 0.0;
+
+    while (sp > 0)
     {
-        float t = hitSphere(spheres[i], ro, rd);
-        if (t > 0.001 && t < minT)
+        sp--;
+        if (stackT[sp] >= minT) {continue;}
+        int base = stack[sp] * 5;
+
+        uvec4 header = compressedNodes[base];
+        uvec4 links = compressedNodes[base + 1];
+        uvec4 q0 = compressedNodes[base + 2];
+        uvec4 q1 = compressedNodes[base + 3];
+        uvec4 q2 = compressedNodes[base + 4];
+
+        vec3 origin = uintBitsToFloat(header.xyz);
+        vec3 scale = uintBitsToFloat(uvec3(header.w & 0xffu, (header.w >> 8) & 0xffu, (header.w >> 16) & 0xffu) << 23);
+
+        int order[8];
+        float orderT[8];
+        int numOrder = 0;
+        uint childSlot = 0u;
+        uint primOffset = 0u;
+
+        for (int lane = 0; lane < 8; lane++)
         {
-            minT = t;
-            hitIndex = i;
-            hitType = 1;
+            // 0 empty, 0x80 interior, otherwise leaf prim count
+            uint meta = laneByte(links.zw, lane);
+            if (meta == 0u) {continue;}
+
+            bool interior = meta == 0x80u;
+            int child = int(interior ? links.x + childSlot : links.y + primOffset);
+            if (interior) {childSlot++;}
+            else {primOffset += meta;}
+
+            // Same decode the builder verified as conservative, precise keeps it from being fused
+            precise vec3 lo = origin + vec3(laneByte(q0.xy, lane), laneByte(q0.zw, lane), laneByte(q1.xy, lane)) * scale;
+            precise vec3 hi = origin + vec3(laneByte(q1.zw, lane), laneByte(q2.xy, lane), laneByte(q2.zw, lane)) * scale;
+            float tNear = hitAABB(lo, hi, ro, invRd, minT);
+            if (tNear == 1e30) {continue;}
+
+            if (!interior)
+            {
+                intersectLeaf(child, int(meta), ro, rd, minT, hitIndex, hitType);
+                continue;
+            }
+
+            int j = numOrder++;
+            while (j > 0 && orderT[j - 1] > tNear)
+            {
+                order[j] = order[j - 1];
+                orderT[j] = orderT[j - 1];
+                j--;
+            }
+            order[j] = child;
+            orderT[j] = tNear;
+        }
+
+        for (int i = numOrder - 1; i >= 0; i--)
+        {
+            stack[sp] = order[i];
+            stackT[sp++] = orderT[i];
         }
     }
+}
+// Leaves are tested as soon as their box is hit, interior children pushed unsorted
+bool occluded(vec3 ro, vec3 rd, float tMax)
+{
+    if (compressedNodes.length() == 0) {return false;}
 
-    // Check for triangle
-    int triCount = indices.length() / 3;
-    for(int i = 0; i < triCount; i++)
+    vec3 invRd = 1.0 / rd;
+    int stack[CBVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
     {
-        float t = hitTriangleIndexed(i, ro, rd);
-        if (t > 0.001 && t < minT)
+        int base = stack[--sp] * 5;
+
+        uvec4 header = compressedNodes[base];
+        uvec4 links = compressedNodes[base + 1];
+        uvec4 q0 = compressedNodes[base + 2];
+        uvec4 q1 = compressedNodes[base + 3];
+        uvec4 q2 = compressedNodes[base + 4];
+
+        vec3 origin = uintBitsToFloat(header.xyz);
+        vec3 scale = uintBitsToFloat(uvec3(header.w & 0xffu, (header.w >> 8) & 0xffu, (header.w >> 16) & 0xffu) << 23);
+
+        uint childSlot = 0u;
+        uint primOffset = 0u;
+
+        for (int lane = 0; lane < 8; lane++)
         {
-            minT = t;
-            hitIndex = i;
-            hitType = 2;
+            uint meta = laneByte(links.zw, lane);
+            if (meta == 0u) {continue;}
+
+            bool interior = meta == 0x80u;
+            int child = int(interior ? links.x + childSlot : links.y + primOffset);
+            if (interior) {childSlot++;}
+            else {primOffset += meta;}
+
+            precise vec3 lo = origin + vec3(laneByte(q0.xy, lane), laneByte(q0.zw, lane), laneByte(q1.xy, lane)) * scale;
+            precise vec3 hi = origin + vec3(laneByte(q1.zw, lane), laneByte(q2.xy, lane), laneByte(q2.zw, lane)) * scale;
+            if (hitAABB(lo, hi, ro, invRd, tMax) == 1e30) {continue;}
+
+            if (!interior)
+            {
+                if (occludedLeaf(child, int(meta), ro, rd, tMax)) {return true;}
+                continue;
+            }
+            stack[sp++] = child;
+        }
+    }
+    return false;
+}
+#elif defined(BVH_STACKLESS)
+// Hit type: 0 miss, 1 sphere, 2 triangle
+void findClosestHit(vec3 ro, vec3 rd, out float minT, out int hitIndex, out int hitType)
+{
+    minT = 10000.0;
+    hitIndex = -1;
+    hitType = 0;
+
+    vec3 invRd = 1.0 / rd;
+    int nodeCount = nodes.length();
+    int nodeIndex = 0;
+
+    while (nodeIndex < nodeCount)
+    {
+        BVHNode node = nodes[nodeIndex];
+
+        if (hitAABB(node.bmin, node.bmax, ro, invRd, minT) == 1e30)
+        {
+            // Miss, skip the whole subtree
+            nodeIndex = node.count > 0 ? nodeIndex + 1 : node.leftFirst;
+            continue;
+        }
+
+        if (node.count > 0) {intersectLeaf(node.leftFirst, node.count, ro, rd, minT, hitIndex, hitType);}
+        nodeIndex++;
+    }
+}
+bool occluded(vec3 ro, vec3 rd, float tMax)
+{
+    vec3 invRd = 1.0 / rd;
+    int nodeCount = nodes.length();
+    int nodeIndex = 0;
+
+    while (nodeIndex < nodeCount)
+    {
+        BVHNode node = nodes[nodeIndex];
+
+        if (hitAABB(node.bmin, node.bmax, ro, invRd, tMax) == 1e30)
+        {
+            nodeIndex = node.count > 0 ? nodeIndex + 1 : node.leftFirst;
+            continue;
+        }
+
+        if (node.count > 0 && occludedLeaf(node.leftFirst, node.count, ro, rd, tMax)) {return true;}
+        nodeIndex++;
+    }
+    return false;
+}
+#elif defined(BVH_WIDTH)
+const int WIDE_GROUPS = BVH_WIDTH / 4;
+const int WIDE_STACK_SIZE = BVH_STACK_ENTRIES;
+
+vec4 wideRow(int node, int row, int group)
+{
+    return wideNodes[(node * 8 + row) * WIDE_GROUPS + group];
+}
+
+// Hit type: 0 miss, 1 sphere, 2 triangle
+void findClosestHit(vec3 ro, vec3 rd, out float minT, out int hitIndex, out int hitType)
+{
+    minT = 10000.0;
+    hitIndex = -1;
+    hitType = 0;
+
+    if (wideNodes.length() == 0) {return;}
+
+    vec3 invRd = 1.0 / rd;
+    int stack[WIDE_STACK_SIZE];
+    float stackT[WIDE_STACK_SIZE];
+    int sp = 0;
+    stack[sp] = 0;
+    stackT[sp++] = 0.0;
+
+    while (sp > 0)
+    {
+        sp--;
+        if (stackT[sp] >= minT) {continue;}
+        int nodeIndex = stack[sp];
+
+        int order[BVH_WIDTH];
+        float orderT[BVH_WIDTH];
+        int numOrder = 0;
+
+        for (int g = 0; g < WIDE_GROUPS; g++)
+        {
+            // Four child boxes per fetch
+            vec4 t1x = (wideRow(nodeIndex, 0, g) - ro.x) * invRd.x;
+            vec4 t1y = (wideRow(nodeIndex, 1, g) - ro.y) * invRd.y;
+            vec4 t1z = (wideRow(nodeIndex, 2, g) - ro.z) * invRd.z;
+            vec4 t2x = (wideRow(nodeIndex, 3, g) - ro.x) * invRd.x;
+            vec4 t2y = (wideRow(nodeIndex, 4, g) - ro.y) * invRd.y;
+            vec4 t2z = (wideRow(nodeIndex, 5, g) - ro.z) * invRd.z;
+            ivec4 child = floatBitsToInt(wideRow(nodeIndex, 6, g));
+            ivec4 count = floatBitsToInt(wideRow(nodeIndex, 7, g));
+
+            vec4 tNear = max(max(min(t1x, t2x), min(t1y, t2y)), min(t1z, t2z));
+            vec4 tFar = min(min(max(t1x, t2x), max(t1y, t2y)), max(t1z, t2z));
+
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (tFar[lane] < tNear[lane] || tNear[lane] >= minT || tFar[lane] <= 0.0) {continue;}
+
+                // Leaves right away, interior children sorted near to far
+                if (count[lane] > 0)
+                {
+                    intersectLeaf(child[lane], count[lane], ro, rd, minT, hitIndex, hitType);
+                    continue;
+                }
+
+                int j = numOrder++;
+                while (j > 0 && orderT[j - 1] > tNear[lane])
+                {
+                    order[j] = order[j - 1];
+                    orderT[j] = orderT[j - 1];
+                    j--;
+                }
+                order[j] = child[lane];
+                orderT[j] = tNear[lane];
+            }
+        }
+
+        // Push far to near so the nearest child is popped next
+        for (int i = numOrder - 1; i >= 0; i--)
+        {
+            stack[sp] = order[i];
+            stackT[sp++] = orderT[i];
+        }
+    }
+}
+// Leaves are tested as soon as their box is hit, interior children pushed unsorted
+bool occluded(vec3 ro, vec3 rd, float tMax)
+{
+    if (wideNodes.length() == 0) {return false;}
+
+    vec3 invRd = 1.0 / rd;
+    int stack[WIDE_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        int nodeIndex = stack[--sp];
+
+        for (int g = 0; g < WIDE_GROUPS; g++)
+        {
+            vec4 t1x = (wideRow(nodeIndex, 0, g) - ro.x) * invRd.x;
+            vec4 t1y = (wideRow(nodeIndex, 1, g) - ro.y) * invRd.y;
+            vec4 t1z = (wideRow(nodeIndex, 2, g) - ro.z) * invRd.z;
+            vec4 t2x = (wideRow(nodeIndex, 3, g) - ro.x) * invRd.x;
+            vec4 t2y = (wideRow(nodeIndex, 4, g) - ro.y) * invRd.y;
+            vec4 t2z = (wideRow(nodeIndex, 5, g) - ro.z) * invRd.z;
+            ivec4 child = floatBitsToInt(wideRow(nodeIndex, 6, g));
+            ivec4 count = floatBitsToInt(wideRow(nodeIndex, 7, g));
+
+            vec4 tNear = max(max(min(t1x, t2x), min(t1y, t2y)), min(t1z, t2z));
+            vec4 tFar = min(min(max(t1x, t2x), max(t1y, t2y)), max(t1z, t2z));
+
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (tFar[lane] < tNear[lane] || tNear[lane] >= tMax || tFar[lane] <= 0.0) {continue;}
+
+                if (count[lane] > 0)
+                {
+                    if (occludedLeaf(child[lane], count[lane], ro, rd, tMax)) {return true;}
+                    continue;
+                }
+                stack[sp++] = child[lane];
+            }
+        }
+    }
+    return false;
+}
+#else
+// Hit type: 0 miss, 1 sphere, 2 triangle
+void findClosestHit(vec3 ro, vec3 rd, out float minT, out int hitIndex, out int hitType)
+{
+    minT = 10000.0;
+    hitIndex = -1;
+    hitType = 0;
+
+    if (nodes.length() == 0) {return;}
+
+    vec3 invRd = 1.0 / rd;
+    ivec3 dirNeg = ivec3(lessThan(rd, vec3(0.0)));
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int nodeIndex = 0;
+
+    if (hitAABB(nodes[0].bmin, nodes[0].bmax, ro, invRd, minT) == 1e30) {return;}
+
+    while (true)
+    {
+        BVHNode node = nodes[nodeIndex];
+
+        if (node.count > 0)
+        {
+#ifdef LAZY_FEEDBACK
+            // One pixel in 16 is plenty to rank the pending leaves, and keeps the atomics cheap
+            if (node.count > BVH_MAX_LEAF_PRIMS && ((uint(gl_FragCoord.x) + uint(gl_FragCoord.y) * 3u) & 15u) == 0u) {atomicAdd(leafHits[nodeIndex], 1u);}
+#endif
+            intersectLeaf(node.leftFirst, node.count, ro, rd, minT, hitIndex, hitType);
+        }
+        else
+        {
+            // Visit the near child for the ray's octant first: children are ordered along the
+            // split axis, so a ray going down it reaches the right one first
+            int nearChild = node.leftFirst + dirNeg[-node.count];
+            int farChild = nearChild == node.leftFirst ? nearChild + 1 : node.leftFirst;
+            float tNear = hitAABB(nodes[nearChild].bmin, nodes[nearChild].bmax, ro, invRd, minT);
+            float tFar = hitAABB(nodes[farChild].bmin, nodes[farChild].bmax, ro, invRd, minT);
+
+            if (tNear != 1e30)
+            {
+                if (tFar != 1e30) {stack[sp++] = farChild;}
+                nodeIndex = nearChild;
+                continue;
+            }
+            if (tFar != 1e30)
+            {
+                nodeIndex = farChild;
+                continue;
+            }
         }
+
+        // Pop until a node that can still hold a closer hit
+        bool found = false;
+        while (sp > 0)
+        {
+            nodeIndex = stack[--sp];
+            if (hitAABB(nodes[nodeIndex].bmin, nodes[nodeIndex].bmax, ro, invRd, minT) != 1e30)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {break;}
     }
 }
+float boxArea(vec3 bmin, vec3 bmax)
+{
+    vec3 e = bmax - bmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// The larger child is entered first, it is the one more likely to hold a blocker
+bool occluded(vec3 ro, vec3 rd, float tMax)
+{
+    if (nodes.length() == 0) {return false;}
+
+    vec3 invRd = 1.0 / rd;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int nodeIndex = 0;
+
+    if (hitAABB(nodes[0].bmin, nodes[0].bmax, ro, invRd, tMax) == 1e30) {return false;}
+
+    while (true)
+    {
+        BVHNode node = nodes[nodeIndex];
+
+        if (node.count > 0)
+        {
+            if (occludedLeaf(node.leftFirst, node.count, ro, rd, tMax)) {return true;}
+        }
+        else
+        {
+            BVHNode first = nodes[node.leftFirst];
+            BVHNode second = nodes[node.leftFirst + 1];
+            bool hitFirst = hitAABB(first.bmin, first.bmax, ro, invRd, tMax) != 1e30;
+            bool hitSecond = hitAABB(second.bmin, second.bmax, ro, invRd, tMax) != 1e30;
+
+            if (hitFirst && hitSecond)
+            {
+                bool secondLarger = boxArea(second.bmin, second.bmax) > boxArea(first.bmin, first.bmax);
+                stack[sp++] = secondLarger ? node.leftFirst : node.leftFirst + 1;
+                nodeIndex = secondLarger ? node.leftFirst + 1 : node.leftFirst;
+                continue;
+            }
+            if (hitFirst || hitSecond)
+            {
+                nodeIndex = hitFirst ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+        }
+
+        // tMax is fixed, popped nodes need no second box test
+        if (sp == 0) {break;}
+        nodeIndex = stack[--sp];
+    }
+    return false;
+}
+#endif
 
 float hash(vec2 p)
 {
@@ -153,6 +811,61 @@ float hash(vec2 p)
 
 const float SHININESS = 1000.0;
 
+#ifdef LIGHT_SAMPLING
+// Next event estimation: one emissive sphere picked uniformly, a direction sampled over the cone
+// it subtends and an occluded() test towards it. Returns radiance * cos / pdf, the caller
+// multiplies by the diffuse BRDF.
+vec3 sampleLight(vec3 pos, vec3 normal, inout uint seed)
+{
+    int numLights = 0;
+    for (int i = 0; i < spheres.length(); i++)
+    {
+        if (materials[spheres[i].material_index].emission > 0.0) {numLights++;}
+    }
+    if (numLights == 0) {return vec3(0.0);}
+
+    int pick = min(int(random(seed) * float(numLights)), numLights - 1);
+    int lightIndex = 0;
+    for (int i = 0; i < spheres.length(); i++)
+    {
+        if (materials[spheres[i].material_index].emission <= 0.0) {continue;}
+        if (pick-- == 0)
+        {
+            lightIndex = i;
+            break;
+        }
+    }
+
+    Sphere light = spheres[lightIndex];
+    vec3 toCenter = light.pos - pos;
+    float dist2 = dot(toCenter, toCenter);
+    float radius2 = light.radius * light.radius;
+    if (dist2 <= radius2) {return vec3(0.0);}
+
+    float cosMax = sqrt(1.0 - radius2 / dist2);
+    float cosTheta = 1.0 - random(seed) * (1.0 - cosMax);
+    float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));
+    float phi = 2.0 * M_PI * random(seed);
+
+    vec3 w = toCenter * inversesqrt(dist2);
+    vec3 up = abs(w.z) < 0.999 ? vec3(0, 0, 1) : vec3(1, 0, 0);
+    vec3 tangent = normalize(cross(up, w));
+    vec3 bitangent = cross(w, tangent);
+    vec3 dir = normalize(tangent * cos(phi) * sinTheta + bitangent * sin(phi) * sinTheta + w * cosTheta);
+
+    float cosSurface = dot(normal, dir);
+    if (cosSurface <= 0.0) {return vec3(0.0);}
+
+    // The light itself sits at t, anything closer blocks it
+    float t = hitSphere(light, pos, dir);
+    if (t <= 0.0 || occluded(pos, dir, t * 0.999)) {return vec3(0.0);}
+
+    Material mat = materials[light.material_index];
+    float pdf = 1.0 / (2.0 * M_PI * (1.0 - cosMax));
+    return mat.color.rgb * mat.emission * cosSurface / pdf * float(numLights);
+}
+#endif
+
 vec3 shade(vec3 hitPost, vec3 normal, vec3 rd, int matIndex)
 {
     Material mat = materials[matIndex];
@@ -215,7 +928,7 @@ void main()
     float tanFov = tan(radians(fov) * 0.5);
     vec3 rd = normalize(forward + uv.x * tanFov * right + uv.y * tanFov * up);
 
-    // Recursive Raytracing
+    // Recursive Raytracing, mirrored by render_trace_path in src/render.c for the CPU renderer
     vec3 accumulatedLight = vec3(0.0, 0.0, 0.0);
     vec3 throughput = vec3(1.0, 1.0, 1.0);
     vec3 current_ro = u_cameraPos;
@@ -223,6 +936,9 @@ void main()
 
     const int MAX_BOUNCES = 15;
 
+    // Set after a diffuse bounce that sampled the lights directly, so hitting one next isn't counted twice
+    bool lightSampled = false;
+
     for (int bounce = 0; bounce < MAX_BOUNCES; bounce++)
     {
         float minT;
@@ -244,18 +960,7 @@ void main()
             }
             else if (hitType == 2)
             {
-                uint i0 = indices[3 * hitIndex + 0];
-                uint i1 = indices[3 * hitIndex + 1];
-                uint i2 = indices[3 * hitIndex + 2];
-                
-                vec3 v0 = vertices[i0];
-                vec3 v1 = vertices[i1];
-                vec3 v2 = vertices[i2];
-
-                vec3 edge1 = v1 - v0;
-                vec3 edge2 = v2 - v0;
-
-                normal = normalize(cross(edge1, edge2));
+                normal = triangleNormal(hitIndex);
                 matIndex = 5;
 
                 // Flip normal if hit back face
@@ -264,7 +969,8 @@ void main()
             Material mat = materials[matIndex];
 
             // Emissive
-            accumulatedLight += mat.color.rgb * mat.emission * throughput;
+            if (!lightSampled) {accumulatedLight += mat.color.rgb * mat.emission * throughput;}
+            lightSampled = false;
 
             // Simple Schlik Fresnel approx.
             float fresnel = 0.04 + (1.0 - 0.04) * pow(1.0 - max(dot(normal, -current_rd), 0.0), 5.0);
@@ -279,6 +985,10 @@ void main()
             }
             else
             {
+#ifdef LIGHT_SAMPLING
+                accumulatedLight += throughput * mat.color.rgb / M_PI * sampleLight(hitPos + normal * 0.001, normal, seed);
+                lightSampled = true;
+#endif
                 current_rd = cosHemisphere(normal, seed);
                 throughput *= mat.color.rgb;
             }
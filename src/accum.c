@@ -0,0 +1,126 @@
+#include "accum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define ACCUM_CHUNK_PIXELS 65536
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    int width, height;
+} AccumHeader;
+
+bool render_accum_init(RenderAccum* accum, int width, int height)
+{
+    memset(accum, 0, sizeof(*accum));
+    if (width <= 0 || height <= 0) {return false;}
+
+    accum->pixels = (AccumPixel*)calloc((size_t)width * height, sizeof(AccumPixel));
+    if (accum->pixels == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for %dx%d accumulation\n", width, height);
+        return false;
+    }
+    accum->width = width;
+    accum->height = height;
+    return true;
+}
+
+void render_accum_free(RenderAccum* accum)
+{
+    free(accum->pixels);
+    memset(accum, 0, sizeof(*accum));
+}
+
+void render_accum_add_sums(RenderAccum* accum, const float* sums, unsigned int num_samples)
+{
+    size_t count = (size_t)accum->width * accum->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        AccumPixel* p = &accum->pixels[i];
+        for (int c = 0; c < 3; c++) {p->sum[c] += sums[3 * i + c];}
+        p->count += num_samples;
+    }
+}
+
+void render_accum_resolve(const RenderAccum* accum, RenderImage* image)
+{
+    size_t count = (size_t)accum->width * accum->height;
+    unsigned int min_count = count > 0 ? accum->pixels[0].count : 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const AccumPixel* p = &accum->pixels[i];
+        for (int c = 0; c < 3; c++) {image->history[3 * i + c] = p->count > 0 ? powf(p->sum[c] / (float)p->count, 1.0f / 2.2f) : 0.0f;}
+        if (p->count < min_count) {min_count = p->count;}
+    }
+    image->frame_count = (int)min_count;
+}
+
+bool render_accum_write(const RenderAccum* accum, const char* filename)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not write %s\n", filename);
+        return false;
+    }
+
+    AccumHeader header = {ACCUM_MAGIC, ACCUM_VERSION, accum->width, accum->height};
+    size_t count = (size_t)accum->width * accum->height;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(accum->pixels, sizeof(AccumPixel), count, fp) == count;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {fprintf(stderr, "Failed writing %s\n", filename);}
+    return ok;
+}
+
+bool render_accum_add_file(RenderAccum* accum, const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    AccumHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == ACCUM_MAGIC && header.version == ACCUM_VERSION;
+    if (!ok) {fprintf(stderr, "%s is not an accumulation file\n", filename);}
+    else if (accum->pixels == NULL) {ok = render_accum_init(accum, header.width, header.height);}
+    else if (header.width != accum->width || header.height != accum->height)
+    {
+        fprintf(stderr, "%s is %dx%d, expected %dx%d\n", filename, header.width, header.height, accum->width, accum->height);
+        ok = false;
+    }
+
+    AccumPixel* chunk = ok ? (AccumPixel*)malloc(ACCUM_CHUNK_PIXELS * sizeof(AccumPixel)) : NULL;
+    if (ok && chunk == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed reading %s\n", filename);
+        ok = false;
+    }
+    size_t count = (size_t)accum->width * accum->height;
+    for (size_t first = 0; ok && first < count; first += ACCUM_CHUNK_PIXELS)
+    {
+        size_t n = count - first < ACCUM_CHUNK_PIXELS ? count - first : ACCUM_CHUNK_PIXELS;
+        ok = fread(chunk, sizeof(AccumPixel), n, fp) == n;
+        if (!ok)
+        {
+            fprintf(stderr, "%s is truncated\n", filename);
+            break;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            AccumPixel* p = &accum->pixels[first + i];
+            for (int c = 0; c < 3; c++) {p->sum[c] += chunk[i].sum[c];}
+            p->count += chunk[i].count;
+        }
+    }
+
+    free(chunk);
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,609 @@
+#include "bvh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    AABB box;
+    Vec3 centroid;
+    unsigned int ref;
+} PrimInfo;
+
+typedef struct
+{
+    PrimInfo* prims;
+    BVHNode* nodes;
+    size_t num_nodes;
+    int max_depth;
+    int pending_prims; // Nodes this small stay leaves, see bvh_build_top
+} Builder;
+
+typedef struct
+{
+    AABB box;
+    int count;
+} Bin;
+
+typedef struct
+{
+    int node;
+    int depth;
+} BuildTask;
+
+AABB prim_ref_bounds(const Scene* scene, unsigned int ref)
+{
+    unsigned int i = prim_ref_index(ref);
+    if (prim_ref_is_triangle(ref)) {return triangle_bounds(&scene->mesh, (int)i);}
+    return sphere_bounds(&scene->spheres[i]);
+}
+
+float prim_ref_intersect(const Scene* scene, unsigned int ref, Vec3 ro, Vec3 rd)
+{
+    unsigned int i = prim_ref_index(ref);
+    if (prim_ref_is_triangle(ref))
+    {
+        if (scene->tri_records != NULL) {return hit_tri_record(&scene->tri_records[i], ro, rd);}
+        return hit_triangle_indexed(&scene->mesh, (int)i, ro, rd);
+    }
+    return hit_sphere(&scene->spheres[i], ro, rd);
+}
+
+static void set_node_bounds(BVHNode* node, AABB box)
+{
+    node->minx = box.min.x; node->miny = box.min.y; node->minz = box.min.z;
+    node->maxx = box.max.x; node->maxy = box.max.y; node->maxz = box.max.z;
+}
+
+static void make_leaf(Builder* b, int node_index, int first, int count)
+{
+    BVHNode* node = &b->nodes[node_index];
+    AABB box = aabb_empty();
+    for (int i = first; i < first + count; i++) {box = aabb_union(box, b->prims[i].box);}
+
+    set_node_bounds(node, box);
+    node->left_first = first;
+    node->count = count;
+}
+
+// Binned SAH, returns false if keeping the node as a leaf is cheaper
+static bool find_split(const Builder* b, int first, int count, int* out_axis, float* out_pos)
+{
+    AABB centroid_box = aabb_empty();
+    AABB node_box = aabb_empty();
+    for (int i = first; i < first + count; i++)
+    {
+        centroid_box = aabb_grow(centroid_box, b->prims[i].centroid);
+        node_box = aabb_union(node_box, b->prims[i].box);
+    }
+
+    float best_cost = 1e30f;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo = v3_axis(centroid_box.min, axis);
+        float hi = v3_axis(centroid_box.max, axis);
+        if (hi - lo < 1e-6f) {continue;}
+
+        Bin bins[BVH_SAH_BINS];
+        for (int i = 0; i < BVH_SAH_BINS; i++) {bins[i].box = aabb_empty(); bins[i].count = 0;}
+
+        float scale = BVH_SAH_BINS / (hi - lo);
+        for (int i = first; i < first + count; i++)
+        {
+            int bin = (int)((v3_axis(b->prims[i].centroid, axis) - lo) * scale);
+            if (bin > BVH_SAH_BINS - 1) {bin = BVH_SAH_BINS - 1;}
+            bins[bin].count++;
+            bins[bin].box = aabb_union(bins[bin].box, b->prims[i].box);
+        }
+
+        // Sweep from both sides
+        float left_area[BVH_SAH_BINS - 1], right_area[BVH_SAH_BINS - 1];
+        int left_count[BVH_SAH_BINS - 1], right_count[BVH_SAH_BINS - 1];
+        AABB left_box = aabb_empty(), right_box = aabb_empty();
+        int left_sum = 0, right_sum = 0;
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++)
+        {
+            left_sum += bins[i].count;
+            left_count[i] = left_sum;
+            left_box = aabb_union(left_box, bins[i].box);
+            left_area[i] = aabb_area(left_box);
+
+            right_sum += bins[BVH_SAH_BINS - 1 - i].count;
+            right_count[BVH_SAH_BINS - 2 - i] = right_sum;
+            right_box = aabb_union(right_box, bins[BVH_SAH_BINS - 1 - i].box);
+            right_area[BVH_SAH_BINS - 2 - i] = aabb_area(right_box);
+        }
+
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++)
+        {
+            if (left_count[i] == 0 || right_count[i] == 0) {continue;}
+            float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *out_axis = axis;
+                *out_pos = lo + (i + 1) / scale;
+            }
+        }
+    }
+
+    if (best_cost == 1e30f) {return false;}
+
+    float leaf_cost = count * aabb_area(node_box);
+    return best_cost < leaf_cost || count > BVH_MAX_LEAF_PRIMS;
+}
+
+static void build_recursive(Builder* b, int root)
+{
+    BuildTask stack[BVH_MAX_DEPTH + 1];
+    int sp = 0;
+    stack[sp++] = (BuildTask){root, 0};
+
+    while (sp > 0)
+    {
+        BuildTask task = stack[--sp];
+        BVHNode* node = &b->nodes[task.node];
+        int first = node->left_first;
+        int count = node->count;
+
+        if (count <= 1 || task.depth >= b->max_depth - 1) {continue;}
+        if (count > BVH_MAX_LEAF_PRIMS && count <= b->pending_prims) {continue;}
+
+        int axis = 0;
+        float pos = 0.0f;
+        if (!find_split(b, first, count, &axis, &pos)) {continue;}
+
+        // Partition prims around the split plane
+        int i = first;
+        int j = first + count - 1;
+        while (i <= j)
+        {
+            if (v3_axis(b->prims[i].centroid, axis) < pos) {i++;}
+            else
+            {
+                PrimInfo tmp = b->prims[i];
+                b->prims[i] = b->prims[j];
+                b->prims[j--] = tmp;
+            }
+        }
+
+        int left_count = i - first;
+        if (left_count == 0 || left_count == count) {continue;}
+
+        int left = (int)b->num_nodes;
+        b->num_nodes += 2;
+        make_leaf(b, left, first, left_count);
+        make_leaf(b, left + 1, i, count - left_count);
+
+        node = &b->nodes[task.node];
+        node->left_first = left;
+        node->count = 0;
+
+        stack[sp++] = (BuildTask){left + 1, task.depth + 1};
+        stack[sp++] = (BuildTask){left, task.depth + 1};
+    }
+}
+
+static float box_diagonal(AABB box)
+{
+    return box.min.x > box.max.x ? 0.0f : v3_length(aabb_extent(box));
+}
+
+static int compare_by_diagonal(const void* a, const void* b)
+{
+    float da = box_diagonal(((const PrimInfo*)a)->box);
+    float db = box_diagonal(((const PrimInfo*)b)->box);
+    return (da > db) - (da < db);
+}
+
+// Sort by size and peel off prims that dwarf the rest of the scene, returns how many
+// ended up at the end of the array
+static int separate_large_prims(PrimInfo* prims, int count)
+{
+    if (count < 2) {return 0;}
+
+    qsort(prims, count, sizeof(PrimInfo), compare_by_diagonal);
+
+    AABB* prefix = (AABB*)malloc(count * sizeof(AABB));
+    if (prefix == NULL) {return 0;}
+
+    AABB box = aabb_empty();
+    for (int i = 0; i < count; i++)
+    {
+        box = aabb_union(box, prims[i].box);
+        prefix[i] = box;
+    }
+
+    int large = 0;
+    for (int i = count - 1; i > 0 && large < BVH_MAX_LARGE_PRIMS; i--)
+    {
+        if (box_diagonal(prims[i].box) <= BVH_LARGE_PRIM_FACTOR * box_diagonal(prefix[i - 1])) {break;}
+        large++;
+    }
+
+    free(prefix);
+    return large;
+}
+
+static PrimInfo prim_info(const Scene* scene, unsigned int ref)
+{
+    AABB box = prim_ref_bounds(scene, ref);
+    return (PrimInfo){box, aabb_center(box), ref};
+}
+
+// Build over b->prims, takes ownership of them. With split_large the large prims get their
+// own leaf under the root, returns how many did (or -1 on failure).
+static int build_tree(BVH* bvh, Builder* b, int count, bool split_large)
+{
+    b->nodes = (BVHNode*)malloc((2 * count + 1) * sizeof(BVHNode));
+    if (b->nodes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for BVH\n");
+        free(b->prims);
+        return -1;
+    }
+
+    int large = split_large ? separate_large_prims(b->prims, count) : 0;
+    int regular = count - large;
+
+    if (large > 0)
+    {
+        // Root keeps the large prims in a leaf next to the real tree, so SAH
+        // binning and the inner bounds never see the ground sphere
+        make_leaf(b, 1, regular, large);
+        make_leaf(b, 2, 0, regular);
+
+        AABB root_box = aabb_union(bvh_node_bounds(&b->nodes[1]), bvh_node_bounds(&b->nodes[2]));
+        set_node_bounds(&b->nodes[0], root_box);
+        b->nodes[0].left_first = 1;
+        b->nodes[0].count = 0;
+        b->num_nodes = 3;
+
+        build_recursive(b, 2);
+    }
+    else
+    {
+        make_leaf(b, 0, 0, count);
+        b->num_nodes = 1;
+
+        build_recursive(b, 0);
+    }
+
+    bvh->num_nodes = b->num_nodes;
+    bvh->nodes = (BVHNode*)realloc(b->nodes, b->num_nodes * sizeof(BVHNode));
+    if (bvh->nodes == NULL) {bvh->nodes = b->nodes;}
+
+    bvh->num_prims = count;
+    bvh->prims = (unsigned int*)malloc(count * sizeof(unsigned int));
+    if (bvh->prims == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for BVH\n");
+        free(b->prims);
+        bvh_free(bvh);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {bvh->prims[i] = b->prims[i].ref;}
+    free(b->prims);
+    return large;
+}
+
+// Every sphere and triangle of the scene, spheres first
+static int build_scene(BVH* bvh, const Scene* scene, int pending_prims)
+{
+    memset(bvh, 0, sizeof(*bvh));
+
+    size_t num_tris = scene_num_triangles(scene);
+    int count = (int)(scene->num_spheres + num_tris);
+    if (count == 0) {return 0;}
+
+    Builder b = {0};
+    b.max_depth = BVH_MAX_DEPTH;
+    b.pending_prims = pending_prims;
+    b.prims = (PrimInfo*)malloc(count * sizeof(PrimInfo));
+    if (b.prims == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for BVH\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < scene->num_spheres; i++) {b.prims[i] = prim_info(scene, prim_ref_sphere((unsigned int)i));}
+    for (size_t i = 0; i < num_tris; i++) {b.prims[scene->num_spheres + i] = prim_info(scene, prim_ref_triangle((unsigned int)i));}
+
+    return build_tree(bvh, &b, count, true);
+}
+
+void bvh_order_children(BVH* bvh, int root)
+{
+    // Parents come before their children, so a forward sweep reaches every pair after the
+    // swap above it has moved it into place
+    for (size_t i = root; i < bvh->num_nodes; i++)
+    {
+        BVHNode* node = &bvh->nodes[i];
+        if (node->count > 0) {continue;}
+
+        BVHNode* left = &bvh->nodes[node->left_first];
+        BVHNode* right = left + 1;
+        float d[3] = {
+            (right->minx + right->maxx) - (left->minx + left->maxx),
+            (right->miny + right->maxy) - (left->miny + left->maxy),
+            (right->minz + right->maxz) - (left->minz + left->maxz)
+        };
+        int axis = fabsf(d[1]) > fabsf(d[0]) ? 1 : 0;
+        if (fabsf(d[2]) > fabsf(d[axis])) {axis = 2;}
+
+        if (d[axis] < 0.0f)
+        {
+            BVHNode tmp = *left; *left = *right; *right = tmp;
+        }
+        node->count = -axis;
+    }
+}
+
+bool bvh_build(BVH* bvh, const Scene* scene, int treelet_iterations)
+{
+    int large = build_scene(bvh, scene, 0);
+    if (large < 0) {return false;}
+
+    // The large prim leaf stays where it is, only the real tree is restructured.
+    // A failed optimization leaves a valid tree behind, so it isn't an error.
+    if (bvh->num_nodes > 0)
+    {
+        bvh_optimize(bvh, large > 0 ? 2 : 0, treelet_iterations);
+        bvh_order_children(bvh, large > 0 ? 2 : 0);
+    }
+    return true;
+}
+
+bool bvh_build_top(BVH* bvh, const Scene* scene, int pending_prims, int* num_large)
+{
+    *num_large = build_scene(bvh, scene, pending_prims);
+    if (*num_large < 0) {return false;}
+
+    bvh_order_children(bvh, *num_large > 0 ? 2 : 0);
+    return true;
+}
+
+bool bvh_build_refs(BVH* bvh, const Scene* scene, const unsigned int* refs, int count, int max_depth)
+{
+    memset(bvh, 0, sizeof(*bvh));
+    if (count == 0) {return true;}
+
+    Builder b = {0};
+    b.max_depth = max_depth;
+    b.prims = (PrimInfo*)malloc(count * sizeof(PrimInfo));
+    if (b.prims == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for BVH\n");
+        return false;
+    }
+    for (int i = 0; i < count; i++) {b.prims[i] = prim_info(scene, refs[i]);}
+
+    if (build_tree(bvh, &b, count, false) < 0) {return false;}
+
+    bvh_order_children(bvh, 0);
+    return true;
+}
+
+void bvh_free(BVH* bvh)
+{
+    free(bvh->nodes);
+    free(bvh->prims);
+    memset(bvh, 0, sizeof(*bvh));
+}
+
+// Lets the traversals below be compiled once per BVHPrims with the prim type test folded away
+#ifdef __GNUC__
+#define BVH_INLINE static inline __attribute__((always_inline))
+#else
+#define BVH_INLINE static inline
+#endif
+
+BVH_INLINE float leaf_intersect(const Scene* scene, unsigned int ref, Vec3 ro, Vec3 rd, BVHPrims prims)
+{
+    unsigned int i = prim_ref_index(ref);
+    if (prims == BVH_PRIMS_SPHERES) {return hit_sphere(&scene->spheres[i], ro, rd);}
+    if (prims == BVH_PRIMS_TRIANGLES)
+    {
+        if (scene->tri_records != NULL) {return hit_tri_record(&scene->tri_records[i], ro, rd);}
+        return hit_triangle_indexed(&scene->mesh, (int)i, ro, rd);
+    }
+    return prim_ref_intersect(scene, ref, ro, rd);
+}
+
+BVH_INLINE int leaf_hit_type(unsigned int ref, BVHPrims prims)
+{
+    if (prims == BVH_PRIMS_SPHERES) {return HIT_SPHERE;}
+    if (prims == BVH_PRIMS_TRIANGLES) {return HIT_TRIANGLE;}
+    return prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+}
+
+BVH_INLINE bool intersect_ordered(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHChildOrder order, BVHPrims prims, BVHLeafFn leaf,
+    void* leaf_ctx, Hit* hit, TraversalStats* stats)
+{
+    *hit = hit_none();
+    if (bvh->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int dir_neg[3] = {rd.x < 0.0f, rd.y < 0.0f, rd.z < 0.0f};
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_index = 0;
+
+    if (ray_aabb(bvh_node_bounds(&bvh->nodes[0]), ro, inv_rd, hit->t) == 1e30f) {return false;}
+
+    while (true)
+    {
+        const BVHNode* node = &bvh->nodes[node_index];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += (node->count > 0 ? 1 : 3) * sizeof(BVHNode);
+        }
+
+        if (node->count > 0)
+        {
+            if (leaf != NULL) {leaf(leaf_ctx, node_index);}
+            for (int i = node->left_first; i < node->left_first + node->count; i++)
+            {
+                unsigned int ref = bvh->prims[i];
+                float t = leaf_intersect(scene, ref, ro, rd, prims);
+                if (stats) {stats->prims_tested++;}
+
+                if (t > HIT_EPSILON && t < hit->t)
+                {
+                    hit->t = t;
+                    hit->index = (int)prim_ref_index(ref);
+                    hit->type = leaf_hit_type(ref, prims);
+                }
+            }
+        }
+        else
+        {
+            // Children are ordered low to high along the split axis, so a ray going down that
+            // axis reaches the right one first
+            int near = node->left_first;
+            if (order == BVH_ORDER_OCTANT) {near += dir_neg[bvh_node_axis(node)];}
+            int far = near == node->left_first ? near + 1 : node->left_first;
+            float t_near = ray_aabb(bvh_node_bounds(&bvh->nodes[near]), ro, inv_rd, hit->t);
+            float t_far = ray_aabb(bvh_node_bounds(&bvh->nodes[far]), ro, inv_rd, hit->t);
+            if (order == BVH_ORDER_DISTANCE && t_far < t_near)
+            {
+                int tmp = near; near = far; far = tmp;
+                float tmp_t = t_near; t_near = t_far; t_far = tmp_t;
+            }
+
+            if (t_near != 1e30f)
+            {
+                if (t_far != 1e30f) {stack[sp++] = far;}
+                node_index = near;
+                continue;
+            }
+            if (t_far != 1e30f)
+            {
+                node_index = far;
+                continue;
+            }
+        }
+
+        // Pop until a node that can still hold a closer hit
+        bool found = false;
+        while (sp > 0)
+        {
+            node_index = stack[--sp];
+            if (ray_aabb(bvh_node_bounds(&bvh->nodes[node_index]), ro, inv_rd, hit->t) != 1e30f)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {break;}
+    }
+
+    return hit->type != HIT_NONE;
+}
+
+bool bvh_intersect(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return intersect_ordered(bvh, scene, ro, rd, BVH_ORDER_OCTANT, BVH_PRIMS_MIXED, NULL, NULL, hit, stats);
+}
+
+bool bvh_intersect_ordered(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHChildOrder order, Hit* hit, TraversalStats* stats)
+{
+    return intersect_ordered(bvh, scene, ro, rd, order, BVH_PRIMS_MIXED, NULL, NULL, hit, stats);
+}
+
+bool bvh_intersect_visit(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHLeafFn leaf, void* ctx, Hit* hit, TraversalStats* stats)
+{
+    return intersect_ordered(bvh, scene, ro, rd, BVH_ORDER_OCTANT, BVH_PRIMS_MIXED, leaf, ctx, hit, stats);
+}
+
+bool bvh_intersect_prims(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, BVHPrims prims, Hit* hit, TraversalStats* stats)
+{
+    switch (prims)
+    {
+    case BVH_PRIMS_SPHERES: return intersect_ordered(bvh, scene, ro, rd, BVH_ORDER_OCTANT, BVH_PRIMS_SPHERES, NULL, NULL, hit, stats);
+    case BVH_PRIMS_TRIANGLES: return intersect_ordered(bvh, scene, ro, rd, BVH_ORDER_OCTANT, BVH_PRIMS_TRIANGLES, NULL, NULL, hit, stats);
+    default: return intersect_ordered(bvh, scene, ro, rd, BVH_ORDER_OCTANT, BVH_PRIMS_MIXED, NULL, NULL, hit, stats);
+    }
+}
+
+BVH_INLINE bool occluded(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, BVHPrims prims, TraversalStats* stats)
+{
+    if (bvh->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_index = 0;
+
+    if (ray_aabb(bvh_node_bounds(&bvh->nodes[0]), ro, inv_rd, t_max) == 1e30f) {return false;}
+
+    while (true)
+    {
+        const BVHNode* node = &bvh->nodes[node_index];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += (node->count > 0 ? 1 : 3) * sizeof(BVHNode);
+        }
+
+        if (node->count > 0)
+        {
+            for (int i = node->left_first; i < node->left_first + node->count; i++)
+            {
+                if (stats) {stats->prims_tested++;}
+                float t = leaf_intersect(scene, bvh->prims[i], ro, rd, prims);
+                if (t > HIT_EPSILON && t < t_max) {return true;}
+            }
+        }
+        else
+        {
+            // Distance order doesn't matter for any hit, enter the larger child first:
+            // it is the one more likely to hold a blocker
+            int first = node->left_first;
+            int second = first + 1;
+            AABB first_box = bvh_node_bounds(&bvh->nodes[first]);
+            AABB second_box = bvh_node_bounds(&bvh->nodes[second]);
+            bool hit_first = ray_aabb(first_box, ro, inv_rd, t_max) != 1e30f;
+            bool hit_second = ray_aabb(second_box, ro, inv_rd, t_max) != 1e30f;
+
+            if (hit_first && hit_second)
+            {
+                if (aabb_area(second_box) > aabb_area(first_box))
+                {
+                    int tmp = first; first = second; second = tmp;
+                }
+                stack[sp++] = second;
+                node_index = first;
+                continue;
+            }
+            if (hit_first || hit_second)
+            {
+                node_index = hit_first ? first : second;
+                continue;
+            }
+        }
+
+        // t_max never shrinks, popped nodes need no second box test
+        if (sp == 0) {break;}
+        node_index = stack[--sp];
+    }
+
+    return false;
+}
+
+bool bvh_occluded(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return occluded(bvh, scene, ro, rd, t_max, BVH_PRIMS_MIXED, stats);
+}
+
+bool bvh_occluded_prims(const BVH* bvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, BVHPrims prims, TraversalStats* stats)
+{
+    switch (prims)
+    {
+    case BVH_PRIMS_SPHERES: return occluded(bvh, scene, ro, rd, t_max, BVH_PRIMS_SPHERES, stats);
+    case BVH_PRIMS_TRIANGLES: return occluded(bvh, scene, ro, rd, t_max, BVH_PRIMS_TRIANGLES, stats);
+    default: return occluded(bvh, scene, ro, rd, t_max, BVH_PRIMS_MIXED, stats);
+    }
+}
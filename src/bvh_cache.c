@@ -0,0 +1,239 @@
+#include "bvh_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "hash.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define CACHE_MAGIC 0x43485642u // "BVHC"
+#define CACHE_MAX_BLOBS 64
+
+// File layout: header, num_blobs entries, then the blob data at aligned offsets
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long key;
+    unsigned long long file_size;
+    unsigned int num_blobs;
+    unsigned int padding;
+} CacheHeader;
+
+typedef struct
+{
+    unsigned int id;
+    unsigned int padding;
+    unsigned long long offset;
+    unsigned long long size;
+} CacheEntry;
+
+static size_t align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+unsigned long long bvh_cache_key(const Scene* scene, const int* settings, int num_settings)
+{
+    // Everything that changes the builder output without changing the scene
+    const int format[] = {
+        BVH_CACHE_VERSION, (int)sizeof(BVHNode), BVH_MAX_LEAF_PRIMS, BVH_SAH_BINS, BVH_MAX_DEPTH,
+        BVH_TREELET_LEAVES, BVH_MAX_LARGE_PRIMS, (int)(BVH_LARGE_PRIM_FACTOR * 1000.0f)
+    };
+
+    unsigned long long h = HASH_SEED;
+    h = hash_bytes(h, format, sizeof(format));
+    h = hash_bytes(h, settings, num_settings * sizeof(int));
+    h = hash_bytes(h, scene->spheres, scene->num_spheres * sizeof(Sphere));
+    h = hash_bytes(h, scene->mesh.vertices, scene->mesh.num_vertices * sizeof(float));
+    h = hash_bytes(h, scene->mesh.indices, scene->mesh.num_indices * sizeof(unsigned int));
+    return h;
+}
+
+bool bvh_cache_path(char* path, size_t size, const char* dir, unsigned long long key)
+{
+    int len = snprintf(path, size, "%s/%016llx.bvh", dir, key);
+    return len > 0 && (size_t)len < size;
+}
+
+#ifdef _WIN32
+static bool map_file(BVHCache* cache, const char* path)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {return false;}
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    void* base = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(CacheHeader))
+    {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);}
+    }
+    if (base == NULL)
+    {
+        if (mapping != NULL) {CloseHandle(mapping);}
+        CloseHandle(file);
+        return false;
+    }
+
+    cache->file = file;
+    cache->mapping = mapping;
+    cache->base = base;
+    cache->size = (size_t)size.QuadPart;
+    return true;
+}
+
+static void unmap_file(BVHCache* cache)
+{
+    UnmapViewOfFile(cache->base);
+    CloseHandle((HANDLE)cache->mapping);
+    CloseHandle((HANDLE)cache->file);
+}
+#else
+static bool map_file(BVHCache* cache, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {return false;}
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheHeader))
+    {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping keeps the file alive
+    close(fd);
+    if (base == MAP_FAILED) {return false;}
+
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(base, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+    cache->base = base;
+    cache->size = (size_t)st.st_size;
+    return true;
+}
+
+static void unmap_file(BVHCache* cache)
+{
+    munmap(cache->base, cache->size);
+}
+#endif
+
+bool bvh_cache_open(BVHCache* cache, const char* path, unsigned long long key)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (!map_file(cache, path)) {return false;}
+
+    const CacheHeader* header = (const CacheHeader*)cache->base;
+    bool valid = header->magic == CACHE_MAGIC && header->version == BVH_CACHE_VERSION && header->key == key &&
+        header->file_size == cache->size && header->num_blobs <= CACHE_MAX_BLOBS &&
+        sizeof(CacheHeader) + header->num_blobs * sizeof(CacheEntry) <= cache->size;
+    if (valid && header->num_blobs > 0)
+    {
+        cache->blobs = (BVHCacheBlob*)malloc(header->num_blobs * sizeof(BVHCacheBlob));
+        valid = cache->blobs != NULL;
+    }
+
+    const CacheEntry* entries = (const CacheEntry*)(header + 1);
+    for (unsigned int i = 0; valid && i < header->num_blobs; i++)
+    {
+        const CacheEntry* entry = &entries[i];
+        valid = entry->offset <= cache->size && entry->size <= cache->size - entry->offset;
+        cache->blobs[i] = (BVHCacheBlob){entry->id, (const char*)cache->base + entry->offset, (size_t)entry->size};
+    }
+
+    if (!valid)
+    {
+        bvh_cache_close(cache);
+        return false;
+    }
+    cache->num_blobs = (int)header->num_blobs;
+    return true;
+}
+
+void bvh_cache_close(BVHCache* cache)
+{
+    if (cache->base != NULL) {unmap_file(cache);}
+    free(cache->blobs);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void make_parent_dir(const char* path)
+{
+    char dir[1024];
+    const char* slash = strrchr(path, '/');
+    const char* backslash = strrchr(path, '\\');
+    if (backslash != NULL && (slash == NULL || backslash > slash)) {slash = backslash;}
+    if (slash == NULL || slash == path || (size_t)(slash - path) >= sizeof(dir)) {return;}
+
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    // Fails harmlessly when it exists, fopen reports anything else
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+}
+
+bool bvh_cache_write(const char* path, unsigned long long key, const BVHCacheBlob* blobs, int num_blobs)
+{
+    if (num_blobs < 0 || num_blobs > CACHE_MAX_BLOBS) {return false;}
+
+    CacheEntry entries[CACHE_MAX_BLOBS];
+    size_t offset = align_up(sizeof(CacheHeader) + num_blobs * sizeof(CacheEntry), BVH_CACHE_ALIGN);
+    for (int i = 0; i < num_blobs; i++)
+    {
+        entries[i] = (CacheEntry){blobs[i].id, 0, offset, blobs[i].size};
+        offset = align_up(offset + blobs[i].size, BVH_CACHE_ALIGN);
+    }
+    CacheHeader header = {CACHE_MAGIC, BVH_CACHE_VERSION, key, offset, (unsigned int)num_blobs, 0};
+
+    char temp[1024];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {return false;}
+    make_parent_dir(path);
+
+    FILE* fp = fopen(temp, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not create BVH cache %s\n", temp);
+        return false;
+    }
+
+    static const char zeros[BVH_CACHE_ALIGN] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && (num_blobs == 0 || fwrite(entries, sizeof(CacheEntry), num_blobs, fp) == (size_t)num_blobs);
+    size_t written = sizeof(header) + num_blobs * sizeof(CacheEntry);
+    for (int i = 0; ok && i < num_blobs; i++)
+    {
+        size_t pad = entries[i].offset - written;
+        ok = fwrite(zeros, 1, pad, fp) == pad && fwrite(blobs[i].data, 1, blobs[i].size, fp) == blobs[i].size;
+        written = entries[i].offset + blobs[i].size;
+    }
+    ok = ok && fwrite(zeros, 1, offset - written, fp) == offset - written;
+    ok = (fclose(fp) == 0) && ok;
+
+#ifdef _WIN32
+    // rename does not replace an existing file here
+    remove(path);
+#endif
+    if (!ok || rename(temp, path) != 0)
+    {
+        fprintf(stderr, "Failed to write BVH cache %s\n", path);
+        remove(temp);
+        return false;
+    }
+    return true;
+}
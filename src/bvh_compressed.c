@@ -0,0 +1,341 @@
+#include "bvh_compressed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static float exponent_scale(unsigned char e)
+{
+    union {unsigned int u; float f;} bits = {(unsigned int)e << 23};
+    return bits.f;
+}
+
+static unsigned char node_exponent(const CompressedNode* node, int axis)
+{
+    return axis == 0 ? node->ex : (axis == 1 ? node->ey : node->ez);
+}
+
+static float node_origin(const CompressedNode* node, int axis)
+{
+    return axis == 0 ? node->ox : (axis == 1 ? node->oy : node->oz);
+}
+
+AABB bvh_compressed_child_bounds(const CompressedNode* node, int lane)
+{
+    float lo[3] = {0}, hi[3] = {0};
+    for (int a = 0; a < 3; a++)
+    {
+        float scale = exponent_scale(node_exponent(node, a));
+        lo[a] = node_origin(node, a) + (float)node->qlo[a][lane] * scale;
+        hi[a] = node_origin(node, a) + (float)node->qhi[a][lane] * scale;
+    }
+    return (AABB){{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+}
+
+// Smallest power of two step that spans the extent in 255 steps, as a biased float exponent
+static int initial_exponent(float extent)
+{
+    if (!(extent > 0.0f)) {return 1;}
+
+    int exp;
+    frexpf(extent / 255.0f, &exp);
+    int biased = exp + 127;
+    if (biased < 1) {biased = 1;}
+    if (biased > 254) {biased = 254;}
+    return biased;
+}
+
+// Quantize one axis of every lane, returns false if the exponent is too small to stay conservative
+static bool quantize_axis(CompressedNode* node, int axis, float origin, int e, const float* lo, const float* hi, int lanes)
+{
+    float scale = exponent_scale((unsigned char)e);
+    for (int i = 0; i < lanes; i++)
+    {
+        float qlo = floorf((lo[i] - origin) / scale);
+        float qhi = ceilf((hi[i] - origin) / scale);
+        if (qlo < 0.0f) {qlo = 0.0f;}
+        if (qhi > 255.0f) {qhi = 255.0f;}
+
+        // Step outwards until the decoded box really contains the child
+        while (qlo > 0.0f && origin + qlo * scale > lo[i]) {qlo -= 1.0f;}
+        while (qhi < 255.0f && origin + qhi * scale < hi[i]) {qhi += 1.0f;}
+        if (origin + qlo * scale > lo[i] || origin + qhi * scale < hi[i]) {return false;}
+
+        node->qlo[axis][i] = (unsigned char)qlo;
+        node->qhi[axis][i] = (unsigned char)qhi;
+    }
+    return true;
+}
+
+static void compress_node(CompressedNode* node, const WideBVH* wide, size_t src)
+{
+    static const int min_rows[3] = {WIDE_ROW_MINX, WIDE_ROW_MINY, WIDE_ROW_MINZ};
+    static const int max_rows[3] = {WIDE_ROW_MAXX, WIDE_ROW_MAXY, WIDE_ROW_MAXZ};
+
+    const WideLane* child = bvh_wide_row(wide, src, WIDE_ROW_CHILD);
+    const WideLane* count = bvh_wide_row(wide, src, WIDE_ROW_COUNT);
+
+    // Compact the used lanes, empty lanes are only ever at the end of a wide node
+    int lanes = 0;
+    while (lanes < wide->width && (count[lanes].i > 0 || child[lanes].i >= 0)) {lanes++;}
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo[BVH_WIDE_MAX], hi[BVH_WIDE_MAX];
+        float node_lo = 1e30f, node_hi = -1e30f;
+        for (int i = 0; i < lanes; i++)
+        {
+            lo[i] = bvh_wide_row(wide, src, min_rows[axis])[i].f;
+            hi[i] = bvh_wide_row(wide, src, max_rows[axis])[i].f;
+            node_lo = fminf(node_lo, lo[i]);
+            node_hi = fmaxf(node_hi, hi[i]);
+        }
+        if (lanes == 0) {node_lo = node_hi = 0.0f;}
+
+        int e = initial_exponent(node_hi - node_lo);
+        while (e < 254 && !quantize_axis(node, axis, node_lo, e, lo, hi, lanes)) {e++;}
+
+        if (axis == 0) {node->ox = node_lo; node->ex = (unsigned char)e;}
+        if (axis == 1) {node->oy = node_lo; node->ey = (unsigned char)e;}
+        if (axis == 2) {node->oz = node_lo; node->ez = (unsigned char)e;}
+    }
+
+    for (int i = 0; i < CBVH_WIDTH; i++)
+    {
+        if (i >= lanes)
+        {
+            // Empty lanes are skipped through meta, their boxes are never tested
+            node->meta[i] = CBVH_META_EMPTY;
+            for (int a = 0; a < 3; a++) {node->qlo[a][i] = 0; node->qhi[a][i] = 0;}
+        }
+        else {node->meta[i] = count[i].i > 0 ? (unsigned char)count[i].i : CBVH_META_INTERIOR;}
+    }
+    node->pad = 0;
+}
+
+bool bvh_compressed_build(CompressedBVH* cbvh, const WideBVH* wide)
+{
+    memset(cbvh, 0, sizeof(*cbvh));
+    if (wide->num_nodes == 0) {return true;}
+    if (wide->width > CBVH_WIDTH)
+    {
+        fprintf(stderr, "Compressed BVH supports at most %d wide nodes\n", CBVH_WIDTH);
+        return false;
+    }
+
+    cbvh->nodes = (CompressedNode*)calloc(wide->num_nodes, sizeof(CompressedNode));
+    cbvh->prims = (unsigned int*)malloc(wide->num_prims * sizeof(unsigned int));
+    size_t* source = (size_t*)malloc(wide->num_nodes * sizeof(size_t));
+    if (cbvh->nodes == NULL || cbvh->prims == NULL || source == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for compressed BVH\n");
+        free(source);
+        bvh_compressed_free(cbvh);
+        return false;
+    }
+
+    // Breadth first, so the interior children of a node get consecutive indices
+    source[0] = 0;
+    cbvh->num_nodes = 1;
+    for (size_t k = 0; k < cbvh->num_nodes; k++)
+    {
+        CompressedNode* node = &cbvh->nodes[k];
+        compress_node(node, wide, source[k]);
+
+        const WideLane* child = bvh_wide_row(wide, source[k], WIDE_ROW_CHILD);
+        node->child_base = (unsigned int)cbvh->num_nodes;
+        node->prim_base = (unsigned int)cbvh->num_prims;
+
+        for (int i = 0; i < CBVH_WIDTH; i++)
+        {
+            if (node->meta[i] == CBVH_META_INTERIOR) {source[cbvh->num_nodes++] = (size_t)child[i].i;}
+            else if (node->meta[i] != CBVH_META_EMPTY)
+            {
+                memcpy(cbvh->prims + cbvh->num_prims, wide->prims + child[i].i, node->meta[i] * sizeof(unsigned int));
+                cbvh->num_prims += node->meta[i];
+            }
+        }
+    }
+
+    free(source);
+    return true;
+}
+
+void bvh_compressed_free(CompressedBVH* cbvh)
+{
+    free(cbvh->nodes);
+    free(cbvh->prims);
+    memset(cbvh, 0, sizeof(*cbvh));
+}
+
+int bvh_compressed_stack_entries(const CompressedBVH* cbvh)
+{
+    if (cbvh->num_nodes == 0) {return 1;}
+    int* need = (int*)malloc(cbvh->num_nodes * sizeof(int));
+    if (need == NULL) {return BVH_MAX_DEPTH * (CBVH_WIDTH - 1) + 1;}
+
+    // Nodes are laid out level by level, children after their parent
+    for (size_t n = cbvh->num_nodes; n-- > 0;)
+    {
+        const CompressedNode* node = &cbvh->nodes[n];
+        int interior = 0, deepest = 1;
+        for (int lane = 0; lane < CBVH_WIDTH; lane++)
+        {
+            if (node->meta[lane] != CBVH_META_INTERIOR) {continue;}
+            int child = need[node->child_base + interior++];
+            if (child > deepest) {deepest = child;}
+        }
+        need[n] = interior > 0 ? interior - 1 + deepest : 0;
+    }
+    int entries = need[0] > 1 ? need[0] : 1;
+    free(need);
+    return entries;
+}
+
+bool bvh_compressed_intersect(const CompressedBVH* cbvh, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    *hit = hit_none();
+    if (cbvh->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int stack[BVH_MAX_DEPTH * (CBVH_WIDTH - 1) + 1];
+    float stack_t[BVH_MAX_DEPTH * (CBVH_WIDTH - 1) + 1];
+    int sp = 0;
+    stack[sp] = 0;
+    stack_t[sp++] = 0.0f;
+
+    while (sp > 0)
+    {
+        sp--;
+        if (stack_t[sp] >= hit->t) {continue;}
+        const CompressedNode* node = &cbvh->nodes[stack[sp]];
+
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += sizeof(CompressedNode);
+        }
+
+        // Decode the planes with the same arithmetic the builder verified, then run the regular
+        // slab test. Folding origin and step into the ray would round differently and could clip
+        // a child box by an ulp.
+        float sx = exponent_scale(node->ex);
+        float sy = exponent_scale(node->ey);
+        float sz = exponent_scale(node->ez);
+
+        int order[CBVH_WIDTH];
+        float order_t[CBVH_WIDTH];
+        int num_order = 0;
+        unsigned int child_slot = 0, prim_offset = 0;
+
+        for (int i = 0; i < CBVH_WIDTH; i++)
+        {
+            unsigned char meta = node->meta[i];
+            if (meta == CBVH_META_EMPTY) {continue;}
+
+            bool interior = meta == CBVH_META_INTERIOR;
+            unsigned int child = interior ? node->child_base + child_slot++ : node->prim_base + prim_offset;
+            if (!interior) {prim_offset += meta;}
+
+            float tx1 = (node->ox + node->qlo[0][i] * sx - ro.x) * inv_rd.x, tx2 = (node->ox + node->qhi[0][i] * sx - ro.x) * inv_rd.x;
+            float ty1 = (node->oy + node->qlo[1][i] * sy - ro.y) * inv_rd.y, ty2 = (node->oy + node->qhi[1][i] * sy - ro.y) * inv_rd.y;
+            float tz1 = (node->oz + node->qlo[2][i] * sz - ro.z) * inv_rd.z, tz2 = (node->oz + node->qhi[2][i] * sz - ro.z) * inv_rd.z;
+            float tmin = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+            float tmax = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+            if (!(tmax >= tmin && tmin < hit->t && tmax > 0.0f)) {continue;}
+
+            if (!interior)
+            {
+                for (unsigned int p = child; p < child + meta; p++)
+                {
+                    unsigned int ref = cbvh->prims[p];
+                    float t = prim_ref_intersect(scene, ref, ro, rd);
+                    if (stats) {stats->prims_tested++;}
+
+                    if (t > HIT_EPSILON && t < hit->t)
+                    {
+                        hit->t = t;
+                        hit->index = (int)prim_ref_index(ref);
+                        hit->type = prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+                    }
+                }
+                continue;
+            }
+
+            int j = num_order++;
+            while (j > 0 && order_t[j - 1] < tmin)
+            {
+                order[j] = order[j - 1];
+                order_t[j] = order_t[j - 1];
+                j--;
+            }
+            order[j] = (int)child;
+            order_t[j] = tmin;
+        }
+
+        for (int i = 0; i < num_order; i++)
+        {
+            stack[sp] = order[i];
+            stack_t[sp++] = order_t[i];
+        }
+    }
+
+    return hit->type != HIT_NONE;
+}
+
+bool bvh_compressed_occluded(const CompressedBVH* cbvh, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    if (cbvh->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int stack[BVH_MAX_DEPTH * (CBVH_WIDTH - 1) + 1];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const CompressedNode* node = &cbvh->nodes[stack[--sp]];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += sizeof(CompressedNode);
+        }
+
+        float sx = exponent_scale(node->ex);
+        float sy = exponent_scale(node->ey);
+        float sz = exponent_scale(node->ez);
+        unsigned int child_slot = 0, prim_offset = 0;
+
+        // Same order as bvh_wide_occluded: leaves as soon as they are hit, interior unsorted
+        for (int i = 0; i < CBVH_WIDTH; i++)
+        {
+            unsigned char meta = node->meta[i];
+            if (meta == CBVH_META_EMPTY) {continue;}
+
+            bool interior = meta == CBVH_META_INTERIOR;
+            unsigned int child = interior ? node->child_base + child_slot++ : node->prim_base + prim_offset;
+            if (!interior) {prim_offset += meta;}
+
+            float tx1 = (node->ox + node->qlo[0][i] * sx - ro.x) * inv_rd.x, tx2 = (node->ox + node->qhi[0][i] * sx - ro.x) * inv_rd.x;
+            float ty1 = (node->oy + node->qlo[1][i] * sy - ro.y) * inv_rd.y, ty2 = (node->oy + node->qhi[1][i] * sy - ro.y) * inv_rd.y;
+            float tz1 = (node->oz + node->qlo[2][i] * sz - ro.z) * inv_rd.z, tz2 = (node->oz + node->qhi[2][i] * sz - ro.z) * inv_rd.z;
+            float tmin = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+            float tmax = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+            if (!(tmax >= tmin && tmin < t_max && tmax > 0.0f)) {continue;}
+
+            if (interior)
+            {
+                stack[sp++] = (int)child;
+                continue;
+            }
+
+            for (unsigned int p = child; p < child + meta; p++)
+            {
+                if (stats) {stats->prims_tested++;}
+                if (prim_ref_occludes(scene, cbvh->prims[p], ro, rd, t_max)) {return true;}
+            }
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,550 @@
+#include "bvh_dynamic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool grow_array(void** array, size_t elem_size, size_t old_count, size_t new_count)
+{
+    void* grown = realloc(*array, new_count * elem_size);
+    if (grown == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for dynamic BVH\n");
+        return false;
+    }
+    memset((char*)grown + old_count * elem_size, 0, (new_count - old_count) * elem_size);
+    *array = grown;
+    return true;
+}
+
+static void set_bounds(BVHNode* node, AABB box)
+{
+    node->minx = box.min.x; node->miny = box.min.y; node->minz = box.min.z;
+    node->maxx = box.max.x; node->maxy = box.max.y; node->maxz = box.max.z;
+}
+
+// Root of a tree without prims: an interior node with an inverted box no ray enters
+static void set_empty_root(DynamicBVH* dyn)
+{
+    BVHNode* root = &dyn->bvh.nodes[0];
+    set_bounds(root, aabb_empty());
+    root->left_first = 0;
+    root->count = 0;
+    dyn->height[0] = 0;
+    dyn->parent[0] = -1;
+}
+
+static bool tree_empty(const DynamicBVH* dyn)
+{
+    const BVHNode* root = &dyn->bvh.nodes[0];
+    return root->count <= 0 && root->minx > root->maxx;
+}
+
+// Pairs start at odd slots, the root is alone at 0
+static int sibling_of(int slot) {return (slot & 1) ? slot + 1 : slot - 1;}
+
+// A failed mark forces a full upload of that buffer on the next flush instead
+static void mark_dirty(DynamicBVH* dyn, DynamicBuffer buffer, int slot)
+{
+    DirtyList* list = &dyn->dirty[buffer];
+    if ((size_t)slot >= list->num_flags)
+    {
+        size_t num_flags = list->num_flags * 2 > (size_t)slot + 1 ? list->num_flags * 2 : (size_t)slot + 1;
+        if (!grow_array((void**)&list->flags, 1, list->num_flags, num_flags))
+        {
+            dyn->uploaded_capacity[buffer] = 0;
+            return;
+        }
+        list->num_flags = num_flags;
+    }
+    if (list->flags[slot]) {return;}
+
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+        if (!grow_array((void**)&list->items, sizeof(int), list->capacity, capacity))
+        {
+            dyn->uploaded_capacity[buffer] = 0;
+            return;
+        }
+        list->capacity = capacity;
+    }
+    list->flags[slot] = 1;
+    list->items[list->count++] = slot;
+}
+
+static bool reserve_nodes(DynamicBVH* dyn, size_t count)
+{
+    if (count <= dyn->node_capacity) {return true;}
+
+    size_t old = dyn->node_capacity;
+    size_t capacity = old * 2 > count ? old * 2 : count;
+    if (!grow_array((void**)&dyn->bvh.nodes, sizeof(BVHNode), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->parent, sizeof(int), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->height, sizeof(int), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->free_pairs, sizeof(int), old / 2 + 1, capacity / 2 + 1)) {return false;}
+    dyn->node_capacity = capacity;
+    return true;
+}
+
+static bool reserve_prims(DynamicBVH* dyn, size_t count)
+{
+    if (count <= dyn->prim_capacity) {return true;}
+
+    size_t old = dyn->prim_capacity;
+    size_t capacity = old * 2 > count ? old * 2 : count;
+    if (!grow_array((void**)&dyn->bvh.prims, sizeof(unsigned int), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->prim_leaf, sizeof(int), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->free_prims, sizeof(int), old, capacity)) {return false;}
+    dyn->prim_capacity = capacity;
+    return true;
+}
+
+static bool reserve_spheres(DynamicBVH* dyn, Scene* scene, size_t count)
+{
+    if (count <= dyn->sphere_capacity) {return true;}
+
+    size_t old = dyn->sphere_capacity;
+    size_t capacity = old * 2 > count ? old * 2 : count;
+    if (!grow_array((void**)&scene->spheres, sizeof(Sphere), old, capacity)) {return false;}
+    if (!grow_array((void**)&dyn->sphere_slot, sizeof(int), old, capacity)) {return false;}
+    dyn->sphere_capacity = capacity;
+    return true;
+}
+
+static int alloc_pair(DynamicBVH* dyn)
+{
+    if (dyn->num_free_pairs > 0) {return dyn->free_pairs[--dyn->num_free_pairs];}
+    if (!reserve_nodes(dyn, dyn->bvh.num_nodes + 2)) {return -1;}
+
+    int first = (int)dyn->bvh.num_nodes;
+    dyn->bvh.num_nodes += 2;
+    return first;
+}
+
+static int alloc_prim(DynamicBVH* dyn)
+{
+    if (dyn->num_free_prims > 0) {return dyn->free_prims[--dyn->num_free_prims];}
+    if (!reserve_prims(dyn, dyn->bvh.num_prims + 1)) {return -1;}
+    return (int)dyn->bvh.num_prims++;
+}
+
+static void release_prim(DynamicBVH* dyn, int slot)
+{
+    dyn->prim_leaf[slot] = -1;
+    dyn->free_prims[dyn->num_free_prims++] = slot;
+}
+
+// Point the children or prims of the node in slot back at it
+static void fix_links(DynamicBVH* dyn, int slot)
+{
+    const BVHNode* node = &dyn->bvh.nodes[slot];
+    if (node->count <= 0)
+    {
+        dyn->parent[node->left_first] = slot;
+        dyn->parent[node->left_first + 1] = slot;
+    }
+    else
+    {
+        for (int i = node->left_first; i < node->left_first + node->count; i++) {dyn->prim_leaf[i] = slot;}
+    }
+    mark_dirty(dyn, DYNAMIC_BUFFER_NODES, slot);
+}
+
+// Node contents move, the parent link belongs to the slot and stays
+static void move_node(DynamicBVH* dyn, int from, int to)
+{
+    dyn->bvh.nodes[to] = dyn->bvh.nodes[from];
+    dyn->height[to] = dyn->height[from];
+    fix_links(dyn, to);
+}
+
+static void swap_nodes(DynamicBVH* dyn, int a, int b)
+{
+    BVHNode node = dyn->bvh.nodes[a];
+    int height = dyn->height[a];
+    move_node(dyn, b, a);
+    dyn->bvh.nodes[b] = node;
+    dyn->height[b] = height;
+    fix_links(dyn, b);
+}
+
+static AABB leaf_bounds(const DynamicBVH* dyn, const Scene* scene, const BVHNode* node)
+{
+    AABB box = aabb_empty();
+    for (int i = node->left_first; i < node->left_first + node->count; i++) {box = aabb_union(box, prim_ref_bounds(scene, dyn->bvh.prims[i]));}
+    return box;
+}
+
+static void refit(DynamicBVH* dyn, int slot)
+{
+    BVHNode* node = &dyn->bvh.nodes[slot];
+    int left = node->left_first;
+    set_bounds(node, aabb_union(bvh_node_bounds(&dyn->bvh.nodes[left]), bvh_node_bounds(&dyn->bvh.nodes[left + 1])));
+    dyn->height[slot] = 1 + (dyn->height[left] > dyn->height[left + 1] ? dyn->height[left] : dyn->height[left + 1]);
+    mark_dirty(dyn, DYNAMIC_BUFFER_NODES, slot);
+}
+
+// Swapping node with a child of its sibling other: other then bounds the kept grandchild and
+// node, keep the best swap that shrinks it
+static void consider_rotation(const DynamicBVH* dyn, int node, int other, float* best, int* a, int* b)
+{
+    const BVHNode* nodes = dyn->bvh.nodes;
+    if (nodes[other].count > 0) {return;}
+
+    AABB box = bvh_node_bounds(&nodes[node]);
+    float area = aabb_area(bvh_node_bounds(&nodes[other]));
+    for (int k = 0; k < 2; k++)
+    {
+        int grandchild = nodes[other].left_first + k;
+        int kept = nodes[other].left_first + 1 - k;
+        float gain = area - aabb_area(aabb_union(box, bvh_node_bounds(&nodes[kept])));
+        if (gain > *best)
+        {
+            *best = gain;
+            *a = node;
+            *b = grandchild;
+        }
+    }
+}
+
+static void rotate(DynamicBVH* dyn, int slot)
+{
+    int left = dyn->bvh.nodes[slot].left_first;
+    float best = 0.0f;
+    int a = -1, b = -1;
+    consider_rotation(dyn, left, left + 1, &best, &a, &b);
+    consider_rotation(dyn, left + 1, left, &best, &a, &b);
+    if (a < 0) {return;}
+
+    swap_nodes(dyn, a, b);
+    refit(dyn, dyn->parent[b]);
+    refit(dyn, slot);
+}
+
+// Refit and rotate every node from slot up to the root
+static void refit_up(DynamicBVH* dyn, int slot)
+{
+    while (slot >= 0)
+    {
+        refit(dyn, slot);
+        rotate(dyn, slot);
+        slot = dyn->parent[slot];
+    }
+}
+
+// Greedy descent: stop where making box a sibling is cheaper than pushing it further down,
+// counting the growth of every node it would pass
+static int pick_sibling(const DynamicBVH* dyn, AABB box)
+{
+    const BVHNode* nodes = dyn->bvh.nodes;
+    int index = 0;
+    while (nodes[index].count <= 0)
+    {
+        AABB node_box = bvh_node_bounds(&nodes[index]);
+        float area = aabb_area(node_box);
+        float combined = aabb_area(aabb_union(node_box, box));
+        float cost = 2.0f * combined;
+        float inherit = 2.0f * (combined - area);
+
+        float child_cost[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const BVHNode* child = &nodes[nodes[index].left_first + k];
+            AABB child_box = bvh_node_bounds(child);
+            float grown = aabb_area(aabb_union(child_box, box));
+            child_cost[k] = (child->count > 0 ? grown : grown - aabb_area(child_box)) + inherit;
+        }
+
+        if (cost < child_cost[0] && cost < child_cost[1]) {break;}
+        index = nodes[index].left_first + (child_cost[1] < child_cost[0]);
+    }
+    return index;
+}
+
+static bool insert_leaf(DynamicBVH* dyn, int prim_slot, AABB box)
+{
+    if (tree_empty(dyn))
+    {
+        BVHNode* root = &dyn->bvh.nodes[0];
+        set_bounds(root, box);
+        root->left_first = prim_slot;
+        root->count = 1;
+        fix_links(dyn, 0);
+        return true;
+    }
+
+    int sibling = pick_sibling(dyn, box);
+    int pair = alloc_pair(dyn);
+    if (pair < 0) {return false;}
+
+    // The sibling moves down into the new pair, its slot becomes their parent
+    move_node(dyn, sibling, pair);
+    BVHNode* leaf = &dyn->bvh.nodes[pair + 1];
+    set_bounds(leaf, box);
+    leaf->left_first = prim_slot;
+    leaf->count = 1;
+    dyn->height[pair + 1] = 0;
+    fix_links(dyn, pair + 1);
+
+    dyn->bvh.nodes[sibling].left_first = pair;
+    dyn->bvh.nodes[sibling].count = 0;
+    fix_links(dyn, sibling);
+    refit_up(dyn, sibling);
+    return true;
+}
+
+static void remove_prim(DynamicBVH* dyn, const Scene* scene, int prim_slot)
+{
+    int slot = dyn->prim_leaf[prim_slot];
+    BVHNode* leaf = &dyn->bvh.nodes[slot];
+
+    // Leaves from the SAH build hold several prims, the last one fills the hole
+    if (leaf->count > 1)
+    {
+        int last = leaf->left_first + leaf->count - 1;
+        if (prim_slot != last)
+        {
+            unsigned int ref = dyn->bvh.prims[last];
+            dyn->bvh.prims[prim_slot] = ref;
+            if (!prim_ref_is_triangle(ref)) {dyn->sphere_slot[prim_ref_index(ref)] = prim_slot;}
+            mark_dirty(dyn, DYNAMIC_BUFFER_PRIMS, prim_slot);
+        }
+        release_prim(dyn, last);
+        leaf->count--;
+        set_bounds(leaf, leaf_bounds(dyn, scene, leaf));
+        mark_dirty(dyn, DYNAMIC_BUFFER_NODES, slot);
+        refit_up(dyn, dyn->parent[slot]);
+        return;
+    }
+
+    release_prim(dyn, prim_slot);
+    if (slot == 0)
+    {
+        set_empty_root(dyn);
+        mark_dirty(dyn, DYNAMIC_BUFFER_NODES, 0);
+        return;
+    }
+
+    // The sibling takes over the parent's slot and the pair is freed
+    int parent = dyn->parent[slot];
+    int sibling = sibling_of(slot);
+    move_node(dyn, sibling, parent);
+    dyn->free_pairs[dyn->num_free_pairs++] = slot < sibling ? slot : sibling;
+    refit_up(dyn, dyn->parent[parent]);
+}
+
+static bool insert_sphere(DynamicBVH* dyn, const Scene* scene, int index)
+{
+    int prim_slot = alloc_prim(dyn);
+    if (prim_slot < 0) {return false;}
+
+    unsigned int ref = prim_ref_sphere((unsigned int)index);
+    dyn->bvh.prims[prim_slot] = ref;
+    dyn->sphere_slot[index] = prim_slot;
+    mark_dirty(dyn, DYNAMIC_BUFFER_PRIMS, prim_slot);
+    return insert_leaf(dyn, prim_slot, prim_ref_bounds(scene, ref));
+}
+
+bool dynamic_bvh_init(DynamicBVH* dyn, BVH* bvh, Scene* scene)
+{
+    memset(dyn, 0, sizeof(*dyn));
+    dyn->bvh = *bvh;
+    memset(bvh, 0, sizeof(*bvh));
+
+    // Capacities start at the current sizes so the reserves below keep the existing contents
+    size_t num_nodes = dyn->bvh.num_nodes;
+    dyn->node_capacity = num_nodes;
+    dyn->prim_capacity = dyn->bvh.num_prims;
+    dyn->sphere_capacity = scene->num_spheres;
+    dyn->parent = (int*)calloc(num_nodes + 1, sizeof(int));
+    dyn->height = (int*)calloc(num_nodes + 1, sizeof(int));
+    dyn->free_pairs = (int*)calloc(num_nodes / 2 + 1, sizeof(int));
+    dyn->prim_leaf = (int*)calloc(dyn->bvh.num_prims + 1, sizeof(int));
+    dyn->free_prims = (int*)calloc(dyn->bvh.num_prims + 1, sizeof(int));
+    dyn->sphere_slot = (int*)calloc(scene->num_spheres + 1, sizeof(int));
+    if (dyn->parent == NULL || dyn->height == NULL || dyn->free_pairs == NULL || dyn->prim_leaf == NULL || dyn->free_prims == NULL || dyn->sphere_slot == NULL ||
+        !reserve_nodes(dyn, num_nodes > 0 ? 2 * num_nodes + 1 : 65) ||
+        !reserve_prims(dyn, dyn->bvh.num_prims > 0 ? 2 * dyn->bvh.num_prims : 64) ||
+        !reserve_spheres(dyn, scene, scene->num_spheres > 0 ? 2 * scene->num_spheres : 64))
+    {
+        dynamic_bvh_free(dyn);
+        return false;
+    }
+
+    if (num_nodes == 0)
+    {
+        dyn->bvh.num_nodes = 1;
+        set_empty_root(dyn);
+        return true;
+    }
+
+    // bvh_build order: children behind their parents, so a reverse sweep sees them first
+    BVHNode* nodes = dyn->bvh.nodes;
+    dyn->parent[0] = -1;
+    for (size_t i = num_nodes; i-- > 0;)
+    {
+        const BVHNode* node = &nodes[i];
+        if (node->count <= 0)
+        {
+            int left = node->left_first;
+            dyn->parent[left] = dyn->parent[left + 1] = (int)i;
+            dyn->height[i] = 1 + (dyn->height[left] > dyn->height[left + 1] ? dyn->height[left] : dyn->height[left + 1]);
+        }
+        else
+        {
+            dyn->height[i] = 0;
+            for (int p = node->left_first; p < node->left_first + node->count; p++) {dyn->prim_leaf[p] = (int)i;}
+        }
+    }
+
+    for (size_t p = 0; p < dyn->bvh.num_prims; p++)
+    {
+        unsigned int ref = dyn->bvh.prims[p];
+        if (!prim_ref_is_triangle(ref)) {dyn->sphere_slot[prim_ref_index(ref)] = (int)p;}
+    }
+    return true;
+}
+
+void dynamic_bvh_free(DynamicBVH* dyn)
+{
+    bvh_free(&dyn->bvh);
+    free(dyn->parent);
+    free(dyn->height);
+    free(dyn->prim_leaf);
+    free(dyn->sphere_slot);
+    free(dyn->free_pairs);
+    free(dyn->free_prims);
+    for (int b = 0; b < DYNAMIC_NUM_BUFFERS; b++)
+    {
+        free(dyn->dirty[b].items);
+        free(dyn->dirty[b].flags);
+    }
+    memset(dyn, 0, sizeof(*dyn));
+}
+
+int dynamic_bvh_add_sphere(DynamicBVH* dyn, Scene* scene, Sphere sphere)
+{
+    if (!reserve_spheres(dyn, scene, scene->num_spheres + 1)) {return -1;}
+
+    int index = (int)scene->num_spheres++;
+    scene->spheres[index] = sphere;
+    mark_dirty(dyn, DYNAMIC_BUFFER_SPHERES, index);
+    return insert_sphere(dyn, scene, index) ? index : -1;
+}
+
+// Reinserting costs two O(log n) walks and keeps the tree as tight as a fresh insert,
+// so there are no fat boxes to refit against
+bool dynamic_bvh_move_sphere(DynamicBVH* dyn, Scene* scene, int index, Vec3 position)
+{
+    if (index < 0 || (size_t)index >= scene->num_spheres) {return false;}
+
+    remove_prim(dyn, scene, dyn->sphere_slot[index]);
+    Sphere* sphere = &scene->spheres[index];
+    sphere->px = position.x;
+    sphere->py = position.y;
+    sphere->pz = position.z;
+    mark_dirty(dyn, DYNAMIC_BUFFER_SPHERES, index);
+    return insert_sphere(dyn, scene, index);
+}
+
+bool dynamic_bvh_remove_sphere(DynamicBVH* dyn, Scene* scene, int index)
+{
+    if (index < 0 || (size_t)index >= scene->num_spheres) {return false;}
+
+    remove_prim(dyn, scene, dyn->sphere_slot[index]);
+
+    int last = (int)scene->num_spheres - 1;
+    if (index != last)
+    {
+        int prim_slot = dyn->sphere_slot[last];
+        scene->spheres[index] = scene->spheres[last];
+        dyn->bvh.prims[prim_slot] = prim_ref_sphere((unsigned int)index);
+        dyn->sphere_slot[index] = prim_slot;
+        mark_dirty(dyn, DYNAMIC_BUFFER_PRIMS, prim_slot);
+        mark_dirty(dyn, DYNAMIC_BUFFER_SPHERES, index);
+    }
+
+    // Zeroed spheres are never referenced and never emissive, so light sampling skips them
+    memset(&scene->spheres[last], 0, sizeof(Sphere));
+    mark_dirty(dyn, DYNAMIC_BUFFER_SPHERES, last);
+    scene->num_spheres--;
+    return true;
+}
+
+static int compare_ints(const void* a, const void* b)
+{
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+size_t dynamic_bvh_flush(DynamicBVH* dyn, const Scene* scene, DynamicUploadFn upload, void* ctx)
+{
+    const void* data[DYNAMIC_NUM_BUFFERS] = {dyn->bvh.nodes, dyn->bvh.prims, scene->spheres};
+    size_t elem_size[DYNAMIC_NUM_BUFFERS] = {sizeof(BVHNode), sizeof(unsigned int), sizeof(Sphere)};
+    size_t capacity[DYNAMIC_NUM_BUFFERS] = {dyn->node_capacity, dyn->prim_capacity, dyn->sphere_capacity};
+    size_t uploaded = 0;
+
+    for (int b = 0; b < DYNAMIC_NUM_BUFFERS; b++)
+    {
+        DirtyList* list = &dyn->dirty[b];
+        size_t bytes = capacity[b] * elem_size[b];
+
+        if (dyn->uploaded_capacity[b] != bytes)
+        {
+            upload(ctx, (DynamicBuffer)b, data[b], 0, bytes, bytes);
+            dyn->uploaded_capacity[b] = bytes;
+            uploaded += bytes;
+        }
+        else if (list->count > 0)
+        {
+            // Consecutive slots go out as one range
+            qsort(list->items, list->count, sizeof(int), compare_ints);
+            size_t start = 0;
+            for (size_t i = 1; i <= list->count; i++)
+            {
+                if (i < list->count && list->items[i] == list->items[i - 1] + 1) {continue;}
+
+                size_t first = (size_t)list->items[start];
+                size_t count = (size_t)list->items[i - 1] - first + 1;
+                upload(ctx, (DynamicBuffer)b, data[b], first * elem_size[b], count * elem_size[b], bytes);
+                uploaded += count * elem_size[b];
+                start = i;
+            }
+        }
+
+        for (size_t i = 0; i < list->count; i++) {list->flags[list->items[i]] = 0;}
+        list->count = 0;
+    }
+    return uploaded;
+}
+
+float dynamic_bvh_sah(const DynamicBVH* dyn)
+{
+    if (tree_empty(dyn)) {return 0.0f;}
+
+    const BVHNode* nodes = dyn->bvh.nodes;
+    float root_area = aabb_area(bvh_node_bounds(&nodes[0]));
+    if (root_area <= 0.0f) {return 0.0f;}
+
+    int stack[BVH_MAX_DEPTH * 2];
+    int sp = 0;
+    float cost = 0.0f;
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        const BVHNode* node = &nodes[stack[--sp]];
+        float area = aabb_area(bvh_node_bounds(node)) / root_area;
+        if (node->count > 0)
+        {
+            cost += area * node->count;
+            continue;
+        }
+
+        cost += area;
+        if (sp + 2 > BVH_MAX_DEPTH * 2) {continue;}
+        stack[sp++] = node->left_first;
+        stack[sp++] = node->left_first + 1;
+    }
+    return cost;
+}
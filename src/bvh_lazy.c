@@ -0,0 +1,313 @@
+#include "bvh_lazy.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAZY_MAX_THREADS 64
+
+enum
+{
+    LAZY_PENDING = 0,
+    LAZY_BUILDING,
+    LAZY_BUILT,
+    LAZY_SPLICED
+};
+
+struct LazyWorkers
+{
+    pthread_mutex_t lock;
+    pthread_cond_t built; // Signalled whenever a subtree is finished
+    pthread_t threads[LAZY_MAX_THREADS];
+    int num_threads;
+    const Scene* scene;
+    BVH* results; // Per pending leaf, valid once LAZY_BUILT
+    bool uploaded;
+};
+
+// Most hit pending leaf, the bigger one on ties. Caller holds the lock.
+static int pick_pending(const LazyBVH* lazy)
+{
+    int best = -1;
+    unsigned int best_hits = 0;
+    int best_count = 0;
+    for (int p = 0; p < lazy->num_pending; p++)
+    {
+        if (lazy->pending_state[p] != LAZY_PENDING) {continue;}
+
+        unsigned int hits = __atomic_load_n(&lazy->pending_hits[p], __ATOMIC_RELAXED);
+        int count = lazy->bvh.nodes[lazy->pending_node[p]].count;
+        if (best < 0 || hits > best_hits || (hits == best_hits && count > best_count))
+        {
+            best = p;
+            best_hits = hits;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+// Builds pending leaves until none are left. The leaf and its prim range are only written by
+// its own splice, so they can be read without the lock while other subtrees are spliced.
+static void* worker_main(void* arg)
+{
+    LazyBVH* lazy = (LazyBVH*)arg;
+    LazyWorkers* w = lazy->workers;
+
+    pthread_mutex_lock(&w->lock);
+    while (true)
+    {
+        int p = pick_pending(lazy);
+        if (p < 0) {break;}
+        lazy->pending_state[p] = LAZY_BUILDING;
+        BVHNode leaf = lazy->bvh.nodes[lazy->pending_node[p]];
+        int max_depth = BVH_MAX_DEPTH - lazy->pending_depth[p];
+        pthread_mutex_unlock(&w->lock);
+
+        // A failed build splices nothing, the pending leaf just stays as it is
+        BVH sub;
+        if (!bvh_build_refs(&sub, w->scene, &lazy->bvh.prims[leaf.left_first], leaf.count, max_depth)) {memset(&sub, 0, sizeof(sub));}
+
+        pthread_mutex_lock(&w->lock);
+        w->results[p] = sub;
+        lazy->pending_state[p] = LAZY_BUILT;
+        pthread_cond_broadcast(&w->built);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Depth of every pending leaf, the refined subtree has to stay within BVH_MAX_DEPTH
+static void find_pending(LazyBVH* lazy, int num_large)
+{
+    const BVHNode* nodes = lazy->bvh.nodes;
+    int stack[BVH_MAX_DEPTH * 2];
+    int depth[BVH_MAX_DEPTH * 2];
+    int sp = 0;
+    stack[sp] = 0;
+    depth[sp++] = 0;
+
+    while (sp > 0)
+    {
+        sp--;
+        int index = stack[sp];
+        int d = depth[sp];
+        const BVHNode* node = &nodes[index];
+
+        if (node->count <= 0)
+        {
+            for (int k = 0; k < 2; k++)
+            {
+                stack[sp] = node->left_first + k;
+                depth[sp++] = d + 1;
+            }
+            continue;
+        }
+
+        // The large prim leaf holds a handful of prims that are already where they belong
+        bool large_leaf = num_large > 0 && index == 1;
+        if (node->count <= BVH_MAX_LEAF_PRIMS || large_leaf) {continue;}
+
+        int p = lazy->num_pending++;
+        lazy->pending_node[p] = index;
+        lazy->pending_depth[p] = d;
+        lazy->node_pending[index] = p;
+    }
+}
+
+bool lazy_bvh_build(LazyBVH* lazy, const Scene* scene, int pending_prims, int threads)
+{
+    memset(lazy, 0, sizeof(*lazy));
+
+    BVH top;
+    int num_large = 0;
+    if (!bvh_build_top(&top, scene, pending_prims, &num_large)) {return false;}
+
+    // A full binary tree over n prims never needs more than 2n - 1 nodes
+    lazy->bvh = top;
+    lazy->node_capacity = 2 * top.num_prims + 1;
+    size_t leaves = top.num_nodes / 2 + 1;
+    BVHNode* nodes = (BVHNode*)realloc(lazy->bvh.nodes, lazy->node_capacity * sizeof(BVHNode));
+    if (nodes != NULL)
+    {
+        lazy->bvh.nodes = nodes;
+        memset(nodes + top.num_nodes, 0, (lazy->node_capacity - top.num_nodes) * sizeof(BVHNode));
+    }
+
+    lazy->pending_node = (int*)malloc(leaves * sizeof(int));
+    lazy->pending_depth = (int*)malloc(leaves * sizeof(int));
+    lazy->pending_hits = (unsigned int*)calloc(leaves, sizeof(unsigned int));
+    lazy->pending_state = (unsigned char*)calloc(leaves, 1);
+    lazy->node_pending = (int*)malloc(lazy->node_capacity * sizeof(int));
+    lazy->workers = (LazyWorkers*)calloc(1, sizeof(LazyWorkers));
+    if (lazy->workers != NULL)
+    {
+        pthread_mutex_init(&lazy->workers->lock, NULL);
+        pthread_cond_init(&lazy->workers->built, NULL);
+    }
+    if (nodes == NULL || lazy->pending_node == NULL || lazy->pending_depth == NULL || lazy->pending_hits == NULL ||
+        lazy->pending_state == NULL || lazy->node_pending == NULL || lazy->workers == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for lazy BVH\n");
+        lazy_bvh_free(lazy);
+        return false;
+    }
+    for (size_t i = 0; i < lazy->node_capacity; i++) {lazy->node_pending[i] = -1;}
+    if (top.num_nodes > 0) {find_pending(lazy, num_large);}
+
+    LazyWorkers* w = lazy->workers;
+    w->scene = scene;
+    w->results = (BVH*)calloc(lazy->num_pending > 0 ? lazy->num_pending : 1, sizeof(BVH));
+    if (w->results == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for lazy BVH\n");
+        lazy_bvh_free(lazy);
+        return false;
+    }
+    if (threads < 1) {threads = 1;}
+    if (threads > LAZY_MAX_THREADS) {threads = LAZY_MAX_THREADS;}
+    if (threads > lazy->num_pending) {threads = lazy->num_pending;}
+    for (int t = 0; t < threads; t++)
+    {
+        if (pthread_create(&w->threads[w->num_threads], NULL, worker_main, lazy) == 0) {w->num_threads++;}
+    }
+
+    // No threads to be had: build everything now, the first splice puts it in place
+    if (w->num_threads == 0 && lazy->num_pending > 0) {worker_main(lazy);}
+    return true;
+}
+
+void lazy_bvh_free(LazyBVH* lazy)
+{
+    LazyWorkers* w = lazy->workers;
+    if (w != NULL)
+    {
+        // Workers only exit once the queue is empty, so cancel what hasn't started
+        pthread_mutex_lock(&w->lock);
+        for (int p = 0; p < lazy->num_pending; p++)
+        {
+            if (lazy->pending_state[p] == LAZY_PENDING) {lazy->pending_state[p] = LAZY_SPLICED;}
+        }
+        pthread_mutex_unlock(&w->lock);
+        for (int t = 0; t < w->num_threads; t++) {pthread_join(w->threads[t], NULL);}
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->built);
+
+        if (w->results != NULL)
+        {
+            for (int p = 0; p < lazy->num_pending; p++) {bvh_free(&w->results[p]);}
+            free(w->results);
+        }
+        free(w);
+    }
+
+    bvh_free(&lazy->bvh);
+    free(lazy->pending_node);
+    free(lazy->pending_depth);
+    free(lazy->pending_hits);
+    free(lazy->pending_state);
+    free(lazy->node_pending);
+    memset(lazy, 0, sizeof(*lazy));
+}
+
+static void count_pending(void* ctx, int node_index)
+{
+    LazyBVH* lazy = (LazyBVH*)ctx;
+    int pending = lazy->node_pending[node_index];
+    if (pending >= 0) {__atomic_fetch_add(&lazy->pending_hits[pending], 1u, __ATOMIC_RELAXED);}
+}
+
+bool lazy_bvh_intersect(LazyBVH* lazy, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect_visit(&lazy->bvh, scene, ro, rd, count_pending, lazy, hit, stats);
+}
+
+void lazy_bvh_add_feedback(LazyBVH* lazy, const unsigned int* node_hits, size_t num_nodes)
+{
+    if (num_nodes > lazy->bvh.num_nodes) {num_nodes = lazy->bvh.num_nodes;}
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        int pending = lazy->node_pending[i];
+        if (pending >= 0 && node_hits[i] > 0) {__atomic_fetch_add(&lazy->pending_hits[pending], node_hits[i], __ATOMIC_RELAXED);}
+    }
+}
+
+// Subtree nodes 1.. are appended, its root replaces the pending leaf last so the tree is
+// complete at every step
+static void splice_subtree(LazyBVH* lazy, int p, const BVH* sub, DynamicUploadFn upload, void* ctx, bool ranges)
+{
+    int node_index = lazy->pending_node[p];
+    lazy->node_pending[node_index] = -1;
+    if (sub->num_nodes == 0) {return;}
+
+    BVHNode* nodes = lazy->bvh.nodes;
+    int first = nodes[node_index].left_first;
+    int count = nodes[node_index].count;
+    int base = (int)lazy->bvh.num_nodes - 1;
+
+    for (size_t i = 0; i < sub->num_nodes; i++)
+    {
+        BVHNode node = sub->nodes[i];
+        node.left_first += node.count > 0 ? first : base;
+        nodes[i == 0 ? (size_t)node_index : base + i] = node;
+    }
+    memcpy(&lazy->bvh.prims[first], sub->prims, count * sizeof(unsigned int));
+    lazy->bvh.num_nodes += sub->num_nodes - 1;
+
+    if (!ranges) {return;}
+
+    size_t node_bytes = lazy->node_capacity * sizeof(BVHNode);
+    if (sub->num_nodes > 1) {upload(ctx, DYNAMIC_BUFFER_NODES, nodes, (base + 1) * sizeof(BVHNode), (sub->num_nodes - 1) * sizeof(BVHNode), node_bytes);}
+    upload(ctx, DYNAMIC_BUFFER_NODES, nodes, node_index * sizeof(BVHNode), sizeof(BVHNode), node_bytes);
+    upload(ctx, DYNAMIC_BUFFER_PRIMS, lazy->bvh.prims, first * sizeof(unsigned int), count * sizeof(unsigned int), lazy->bvh.num_prims * sizeof(unsigned int));
+}
+
+int lazy_bvh_splice(LazyBVH* lazy, DynamicUploadFn upload, void* ctx)
+{
+    LazyWorkers* w = lazy->workers;
+    if (w == NULL) {return 0;}
+
+    int spliced = 0;
+    for (int p = 0; p < lazy->num_pending; p++)
+    {
+        pthread_mutex_lock(&w->lock);
+        bool built = lazy->pending_state[p] == LAZY_BUILT;
+        pthread_mutex_unlock(&w->lock);
+        if (!built) {continue;}
+
+        splice_subtree(lazy, p, &w->results[p], upload, ctx, w->uploaded);
+        bvh_free(&w->results[p]);
+
+        pthread_mutex_lock(&w->lock);
+        lazy->pending_state[p] = LAZY_SPLICED;
+        pthread_mutex_unlock(&w->lock);
+        lazy->num_refined++;
+        spliced++;
+    }
+
+    if (!w->uploaded)
+    {
+        upload(ctx, DYNAMIC_BUFFER_NODES, lazy->bvh.nodes, 0, lazy->node_capacity * sizeof(BVHNode), lazy->node_capacity * sizeof(BVHNode));
+        upload(ctx, DYNAMIC_BUFFER_PRIMS, lazy->bvh.prims, 0, lazy->bvh.num_prims * sizeof(unsigned int), lazy->bvh.num_prims * sizeof(unsigned int));
+        w->uploaded = true;
+    }
+    return spliced;
+}
+
+void lazy_bvh_finish(LazyBVH* lazy, DynamicUploadFn upload, void* ctx)
+{
+    LazyWorkers* w = lazy->workers;
+    if (w == NULL) {return;}
+
+    while (!lazy_bvh_done(lazy))
+    {
+        pthread_mutex_lock(&w->lock);
+        bool any_built = false;
+        for (int p = 0; p < lazy->num_pending && !any_built; p++) {any_built = lazy->pending_state[p] == LAZY_BUILT;}
+        if (!any_built) {pthread_cond_wait(&w->built, &w->lock);}
+        pthread_mutex_unlock(&w->lock);
+
+        lazy_bvh_splice(lazy, upload, ctx);
+    }
+}
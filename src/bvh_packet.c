@@ -0,0 +1,366 @@
+#include "bvh_packet.h"
+
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+// Lets the traversal below be compiled once per ISA with the kernel choice folded away
+#ifdef __GNUC__
+#define PACKET_INLINE static inline __attribute__((always_inline))
+#else
+#define PACKET_INLINE static inline
+#endif
+
+typedef struct
+{
+    const RayPacket* rays;
+    float ix[BVH_PACKET_SIZE], iy[BVH_PACKET_SIZE], iz[BVH_PACKET_SIZE];
+    // Closest hit of every lane so far
+    float t[BVH_PACKET_SIZE];
+    int index[BVH_PACKET_SIZE];
+    int type[BVH_PACKET_SIZE];
+    unsigned int active;
+    float t_max; // Largest t of the active lanes
+
+    int dir_neg[3]; // Of the first active lane
+
+    // Frustum: the lanes share direction signs and have finite inverse directions, the ranges
+    // of their origins and inverse directions bound every lane's slab test
+    bool frustum;
+    float omin[3], omax[3], imin[3], imax[3];
+} PacketState;
+
+// Plain compares, fminf / fmaxf are library calls without -ffinite-math-only
+static inline float min_f(float a, float b) {return a < b ? a : b;}
+static inline float max_f(float a, float b) {return a > b ? a : b;}
+
+static void packet_setup(PacketState* s, const RayPacket* rays)
+{
+    s->rays = rays;
+    s->active = rays->active & ((1u << BVH_PACKET_SIZE) - 1u);
+    s->t_max = HIT_MAX_T;
+    for (int i = 0; i < BVH_PACKET_SIZE; i++)
+    {
+        s->ix[i] = 1.0f / rays->dx[i];
+        s->iy[i] = 1.0f / rays->dy[i];
+        s->iz[i] = 1.0f / rays->dz[i];
+        s->t[i] = HIT_MAX_T;
+        s->index[i] = -1;
+        s->type[i] = HIT_NONE;
+    }
+
+    int first = s->active != 0 ? __builtin_ctz(s->active) : 0;
+    s->dir_neg[0] = rays->dx[first] < 0.0f;
+    s->dir_neg[1] = rays->dy[first] < 0.0f;
+    s->dir_neg[2] = rays->dz[first] < 0.0f;
+    s->frustum = false;
+}
+
+static void packet_setup_frustum(PacketState* s)
+{
+    const RayPacket* rays = s->rays;
+    const float* o[3] = {rays->ox, rays->oy, rays->oz};
+    const float* d[3] = {rays->dx, rays->dy, rays->dz};
+    const float* inv[3] = {s->ix, s->iy, s->iz};
+    s->frustum = true;
+    for (int a = 0; a < 3; a++)
+    {
+        s->omin[a] = s->imin[a] = 1e30f;
+        s->omax[a] = s->imax[a] = -1e30f;
+        for (int i = 0; i < BVH_PACKET_SIZE; i++)
+        {
+            if (!(s->active >> i & 1u)) {continue;}
+            if ((d[a][i] < 0.0f) != s->dir_neg[a] || !isfinite(inv[a][i])) {s->frustum = false;}
+            s->omin[a] = min_f(s->omin[a], o[a][i]);
+            s->omax[a] = max_f(s->omax[a], o[a][i]);
+            s->imin[a] = min_f(s->imin[a], inv[a][i]);
+            s->imax[a] = max_f(s->imax[a], inv[a][i]);
+        }
+    }
+}
+
+static inline float interval_mul_min(float a0, float a1, float b0, float b1)
+{
+    return min_f(min_f(a0 * b0, a0 * b1), min_f(a1 * b0, a1 * b1));
+}
+
+static inline float interval_mul_max(float a0, float a1, float b0, float b1)
+{
+    return max_f(max_f(a0 * b0, a0 * b1), max_f(a1 * b0, a1 * b1));
+}
+
+// True if no lane can reach the box: the lowest entry and highest exit over the whole packet,
+// by interval arithmetic on the slab distances. Rounding is monotonic, so the bounds hold for
+// the values the lanes compute themselves.
+static inline bool packet_frustum_misses(const PacketState* s, const BVHNode* node)
+{
+    const float bmin[3] = {node->minx, node->miny, node->minz};
+    const float bmax[3] = {node->maxx, node->maxy, node->maxz};
+    float entry = -1e30f, exit = 1e30f;
+    for (int a = 0; a < 3; a++)
+    {
+        float near = s->dir_neg[a] ? bmax[a] : bmin[a];
+        float far = s->dir_neg[a] ? bmin[a] : bmax[a];
+        entry = max_f(entry, interval_mul_min(near - s->omax[a], near - s->omin[a], s->imin[a], s->imax[a]));
+        exit = min_f(exit, interval_mul_max(far - s->omax[a], far - s->omin[a], s->imin[a], s->imax[a]));
+    }
+    return entry > exit || exit <= 0.0f || entry >= s->t_max;
+}
+
+static void packet_update_lane(PacketState* s, int lane, float t, unsigned int ref)
+{
+    if (t > HIT_EPSILON && t < s->t[lane])
+    {
+        s->t[lane] = t;
+        s->index[lane] = (int)prim_ref_index(ref);
+        s->type[lane] = prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+    }
+}
+
+static unsigned int box_lanes_scalar(const PacketState* s, const BVHNode* node)
+{
+    const RayPacket* r = s->rays;
+    AABB box = bvh_node_bounds(node);
+    unsigned int mask = 0;
+    for (int i = 0; i < BVH_PACKET_SIZE; i++)
+    {
+        if (!(s->active >> i & 1u)) {continue;}
+        if (ray_aabb(box, v3(r->ox[i], r->oy[i], r->oz[i]), v3(s->ix[i], s->iy[i], s->iz[i]), s->t[i]) != 1e30f) {mask |= 1u << i;}
+    }
+    return mask;
+}
+
+static void prim_lanes_scalar(PacketState* s, const Scene* scene, unsigned int ref)
+{
+    const RayPacket* r = s->rays;
+    for (int i = 0; i < BVH_PACKET_SIZE; i++)
+    {
+        if (!(s->active >> i & 1u)) {continue;}
+        packet_update_lane(s, i, prim_ref_intersect(scene, ref, v3(r->ox[i], r->oy[i], r->oz[i]), v3(r->dx[i], r->dy[i], r->dz[i])), ref);
+    }
+}
+
+#ifdef CPU_X86
+// Same operations in the same order as ray_aabb, hit_sphere and hit_triangle, eight lanes at a time
+
+CPU_TARGET_AVX2 static inline unsigned int box_lanes_avx2(const PacketState* s, const BVHNode* node)
+{
+    const RayPacket* r = s->rays;
+    __m256 ox = _mm256_loadu_ps(r->ox), oy = _mm256_loadu_ps(r->oy), oz = _mm256_loadu_ps(r->oz);
+    __m256 ix = _mm256_loadu_ps(s->ix), iy = _mm256_loadu_ps(s->iy), iz = _mm256_loadu_ps(s->iz);
+
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->minx), ox), ix);
+    __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->maxx), ox), ix);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->miny), oy), iy);
+    __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->maxy), oy), iy);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->minz), oz), iz);
+    __m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->maxz), oz), iz);
+
+    __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), _mm256_min_ps(tz1, tz2));
+    __m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), _mm256_max_ps(tz1, tz2));
+
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ), _mm256_cmp_ps(tmin, _mm256_loadu_ps(s->t), _CMP_LT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ));
+    return (unsigned int)_mm256_movemask_ps(hit) & s->active;
+}
+
+CPU_TARGET_AVX2 static inline __m256 sphere_lanes_avx2(const PacketState* s, const Sphere* sphere)
+{
+    const RayPacket* r = s->rays;
+    __m256 dx = _mm256_loadu_ps(r->dx), dy = _mm256_loadu_ps(r->dy), dz = _mm256_loadu_ps(r->dz);
+    __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(r->ox), _mm256_set1_ps(sphere->px));
+    __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(r->oy), _mm256_set1_ps(sphere->py));
+    __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(r->oz), _mm256_set1_ps(sphere->pz));
+
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+    __m256 c = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+    c = _mm256_sub_ps(c, _mm256_set1_ps(sphere->radius * sphere->radius));
+    __m256 h = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+
+    __m256 t = _mm256_sub_ps(_mm256_xor_ps(b, _mm256_set1_ps(-0.0f)), _mm256_sqrt_ps(h));
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), t, _mm256_cmp_ps(h, _mm256_setzero_ps(), _CMP_GE_OQ));
+}
+
+CPU_TARGET_AVX2 static inline __m256 triangle_lanes_avx2(const PacketState* s, Vec3 v0, Vec3 e1, Vec3 e2)
+{
+    const RayPacket* r = s->rays;
+    __m256 dx = _mm256_loadu_ps(r->dx), dy = _mm256_loadu_ps(r->dy), dz = _mm256_loadu_ps(r->dz);
+    __m256 e1x = _mm256_set1_ps(e1.x), e1y = _mm256_set1_ps(e1.y), e1z = _mm256_set1_ps(e1.z);
+    __m256 e2x = _mm256_set1_ps(e2.x), e2y = _mm256_set1_ps(e2.y), e2z = _mm256_set1_ps(e2.z);
+
+    // h = cross(rd, edge2), a = dot(edge1, h)
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+    __m256 ok = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_set1_ps(-0.001f), _CMP_LE_OQ), _mm256_cmp_ps(a, _mm256_set1_ps(0.001f), _CMP_GE_OQ));
+
+    __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+    __m256 sx = _mm256_sub_ps(_mm256_loadu_ps(r->ox), _mm256_set1_ps(v0.x));
+    __m256 sy = _mm256_sub_ps(_mm256_loadu_ps(r->oy), _mm256_set1_ps(v0.y));
+    __m256 sz = _mm256_sub_ps(_mm256_loadu_ps(r->oz), _mm256_set1_ps(v0.z));
+    __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+    // q = cross(s, edge1)
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+
+    __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+    return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), t, ok);
+}
+
+CPU_TARGET_AVX2 static inline void prim_lanes_avx2(PacketState* s, const Scene* scene, unsigned int ref)
+{
+    unsigned int index = prim_ref_index(ref);
+    __m256 t;
+    if (!prim_ref_is_triangle(ref)) {t = sphere_lanes_avx2(s, &scene->spheres[index]);}
+    else if (scene->tri_records != NULL)
+    {
+        const TriRecord* rec = &scene->tri_records[index];
+        t = triangle_lanes_avx2(s, v3(rec->v0x, rec->v0y, rec->v0z), v3(rec->e1x, rec->e1y, rec->e1z), v3(rec->e2x, rec->e2y, rec->e2z));
+    }
+    else
+    {
+        const unsigned int* idx = scene->mesh.indices + 3 * index;
+        Vec3 v0 = mesh_vertex(&scene->mesh, idx[0]);
+        t = triangle_lanes_avx2(s, v0, v3_sub(mesh_vertex(&scene->mesh, idx[1]), v0), v3_sub(mesh_vertex(&scene->mesh, idx[2]), v0));
+    }
+
+    __m256 closer = _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(HIT_EPSILON), _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_loadu_ps(s->t), _CMP_LT_OQ));
+    unsigned int mask = (unsigned int)_mm256_movemask_ps(closer) & s->active;
+    if (mask == 0) {return;}
+
+    float lanes[BVH_PACKET_SIZE];
+    _mm256_storeu_ps(lanes, t);
+    for (; mask != 0; mask &= mask - 1) {packet_update_lane(s, __builtin_ctz(mask), lanes[__builtin_ctz(mask)], ref);}
+}
+#endif
+
+// The frustum test costs about what the AVX2 lane test does, so only the scalar lanes use it
+PACKET_INLINE unsigned int packet_box(const PacketState* s, const BVHNode* node, CpuIsa isa)
+{
+    if (isa == CPU_ISA_SCALAR && s->frustum && packet_frustum_misses(s, node)) {return 0;}
+#ifdef CPU_X86
+    if (isa == CPU_ISA_AVX2) {return box_lanes_avx2(s, node);}
+#endif
+    return box_lanes_scalar(s, node);
+}
+
+PACKET_INLINE void packet_leaf(PacketState* s, const BVH* bvh, const Scene* scene, const BVHNode* node, CpuIsa isa, TraversalStats* stats)
+{
+    for (int i = node->left_first; i < node->left_first + node->count; i++)
+    {
+#ifdef CPU_X86
+        if (isa == CPU_ISA_AVX2) {prim_lanes_avx2(s, scene, bvh->prims[i]);}
+        else
+#endif
+        {prim_lanes_scalar(s, scene, bvh->prims[i]);}
+    }
+    if (stats) {stats->prims_tested += (unsigned long long)node->count * __builtin_popcount(s->active);}
+
+    s->t_max = 0.0f;
+    for (int i = 0; i < BVH_PACKET_SIZE; i++)
+    {
+        if (s->active >> i & 1u) {s->t_max = max_f(s->t_max, s->t[i]);}
+    }
+}
+
+// bvh_intersect with a lane mask in place of the slab test. Children are ordered by the
+// direction signs of the first active lane; lanes that disagree still get the right hit, just
+// with a less useful order.
+PACKET_INLINE void packet_traverse(const BVH* bvh, const Scene* scene, PacketState* s, CpuIsa isa, TraversalStats* stats)
+{
+    int stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    int node_index = 0;
+
+    if (packet_box(s, &bvh->nodes[0], isa) == 0) {return;}
+
+    while (true)
+    {
+        const BVHNode* node = &bvh->nodes[node_index];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += (node->count > 0 ? 1 : 3) * sizeof(BVHNode);
+        }
+
+        if (node->count > 0) {packet_leaf(s, bvh, scene, node, isa, stats);}
+        else
+        {
+            int near = node->left_first + s->dir_neg[bvh_node_axis(node)];
+            int far = near == node->left_first ? near + 1 : node->left_first;
+            bool near_hit = packet_box(s, &bvh->nodes[near], isa) != 0;
+            bool far_hit = packet_box(s, &bvh->nodes[far], isa) != 0;
+
+            if (near_hit)
+            {
+                if (far_hit) {stack[sp++] = far;}
+                node_index = near;
+                continue;
+            }
+            if (far_hit)
+            {
+                node_index = far;
+                continue;
+            }
+        }
+
+        // Pop until a node some lane can still find a closer hit in
+        bool found = false;
+        while (sp > 0)
+        {
+            node_index = stack[--sp];
+            if (packet_box(s, &bvh->nodes[node_index], isa) != 0)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {break;}
+    }
+}
+
+static void traverse_scalar(const BVH* bvh, const Scene* scene, PacketState* s, TraversalStats* stats)
+{
+    packet_setup_frustum(s);
+    packet_traverse(bvh, scene, s, CPU_ISA_SCALAR, stats);
+}
+
+#ifdef CPU_X86
+CPU_TARGET_AVX2 static void traverse_avx2(const BVH* bvh, const Scene* scene, PacketState* s, TraversalStats* stats)
+{
+    packet_traverse(bvh, scene, s, CPU_ISA_AVX2, stats);
+}
+#endif
+
+bool bvh_intersect_packet(const BVH* bvh, const Scene* scene, const RayPacket* packet, Hit hits[BVH_PACKET_SIZE], TraversalStats* stats)
+{
+    PacketState s;
+    packet_setup(&s, packet);
+
+    if (bvh->num_nodes > 0 && s.active != 0)
+    {
+#ifdef CPU_X86
+        if (cpu_isa() >= CPU_ISA_AVX2) {traverse_avx2(bvh, scene, &s, stats);}
+        else
+#endif
+        {traverse_scalar(bvh, scene, &s, stats);}
+    }
+
+    bool any = false;
+    for (int i = 0; i < BVH_PACKET_SIZE; i++)
+    {
+        hits[i] = s.type[i] != HIT_NONE ? (Hit){s.t[i], s.index[i], s.type[i]} : hit_none();
+        any = any || s.type[i] != HIT_NONE;
+    }
+    return any;
+}
@@ -0,0 +1,138 @@
+#include "bvh_stackless.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool bvh_stackless_build(BVH* threaded, const BVH* bvh)
+{
+    memset(threaded, 0, sizeof(*threaded));
+    if (bvh->num_nodes == 0) {return true;}
+
+    threaded->nodes = (BVHNode*)malloc(bvh->num_nodes * sizeof(BVHNode));
+    threaded->prims = (unsigned int*)malloc(bvh->num_prims * sizeof(unsigned int));
+    int* size = (int*)malloc(bvh->num_nodes * sizeof(int));
+    int* stack = (int*)malloc(bvh->num_nodes * sizeof(int));
+    if (threaded->nodes == NULL || threaded->prims == NULL || size == NULL || stack == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for stackless BVH\n");
+        free(size);
+        free(stack);
+        bvh_free(threaded);
+        return false;
+    }
+
+    memcpy(threaded->prims, bvh->prims, bvh->num_prims * sizeof(unsigned int));
+    threaded->num_prims = bvh->num_prims;
+
+    // Subtree sizes give the skip link directly: skip = index + size.
+    // Children always have higher indices than their parent, so a reverse sweep sums them.
+    for (size_t i = bvh->num_nodes; i-- > 0;)
+    {
+        const BVHNode* node = &bvh->nodes[i];
+        size[i] = 1;
+        if (node->count <= 0) {size[i] += size[node->left_first] + size[node->left_first + 1];}
+    }
+
+    // Pre-order walk
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        int src = stack[--sp];
+        int dst = (int)threaded->num_nodes++;
+        const BVHNode* node = &bvh->nodes[src];
+
+        threaded->nodes[dst] = *node;
+        if (node->count <= 0)
+        {
+            threaded->nodes[dst].left_first = dst + size[src];
+
+            // Right pushed first so the left child comes out next
+            stack[sp++] = node->left_first + 1;
+            stack[sp++] = node->left_first;
+        }
+    }
+
+    free(size);
+    free(stack);
+    return true;
+}
+
+bool bvh_stackless_intersect(const BVH* threaded, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    *hit = hit_none();
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int n = (int)threaded->num_nodes;
+    int i = 0;
+
+    while (i < n)
+    {
+        const BVHNode* node = &threaded->nodes[i];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += sizeof(BVHNode);
+        }
+
+        if (ray_aabb(bvh_node_bounds(node), ro, inv_rd, hit->t) == 1e30f)
+        {
+            // Miss, skip the whole subtree
+            i = node->count > 0 ? i + 1 : node->left_first;
+            continue;
+        }
+
+        if (node->count > 0)
+        {
+            for (int p = node->left_first; p < node->left_first + node->count; p++)
+            {
+                unsigned int ref = threaded->prims[p];
+                float t = prim_ref_intersect(scene, ref, ro, rd);
+                if (stats) {stats->prims_tested++;}
+
+                if (t > HIT_EPSILON && t < hit->t)
+                {
+                    hit->t = t;
+                    hit->index = (int)prim_ref_index(ref);
+                    hit->type = prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+                }
+            }
+        }
+        i++;
+    }
+
+    return hit->type != HIT_NONE;
+}
+
+bool bvh_stackless_occluded(const BVH* threaded, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int n = (int)threaded->num_nodes;
+    int i = 0;
+
+    while (i < n)
+    {
+        const BVHNode* node = &threaded->nodes[i];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += sizeof(BVHNode);
+        }
+
+        if (ray_aabb(bvh_node_bounds(node), ro, inv_rd, t_max) == 1e30f)
+        {
+            i = node->count > 0 ? i + 1 : node->left_first;
+            continue;
+        }
+
+        for (int p = node->left_first; node->count > 0 && p < node->left_first + node->count; p++)
+        {
+            if (stats) {stats->prims_tested++;}
+            if (prim_ref_occludes(scene, threaded->prims[p], ro, rd, t_max)) {return true;}
+        }
+        i++;
+    }
+
+    return false;
+}
@@ -0,0 +1,367 @@
+#include "bvh.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TREELET_SUBSETS (1 << BVH_TREELET_LEAVES)
+#define TREELET_COST_TRAVERSAL 1.0f
+#define TREELET_COST_INTERSECT 1.0f
+
+// Subtrees handed to each thread in the parallel phase, small trees skip it entirely
+#define TREELET_TASKS_PER_THREAD 4
+#define TREELET_MIN_PARALLEL_NODES 4096
+
+typedef struct
+{
+    BVHNode* nodes;
+    float* cost; // Unnormalized SAH cost of each node's subtree
+    int* size;   // Nodes in each subtree
+    const int* frontier;
+} Optimizer;
+
+typedef struct
+{
+    BVHNode* nodes;
+    float* cost;
+    int* size;
+    const int* pairs;
+    int next_pair;
+    const BVHNode* leaf_nodes;
+    const float* leaf_cost;
+    const int* leaf_size;
+    const AABB* box;
+    const float* best_cost;
+    const unsigned char* split;
+} TreeletEmit;
+
+static void set_bounds(BVHNode* node, AABB box)
+{
+    node->minx = box.min.x; node->miny = box.min.y; node->minz = box.min.z;
+    node->maxx = box.max.x; node->maxy = box.max.y; node->maxz = box.max.z;
+}
+
+static float leaf_cost(const BVHNode* node)
+{
+    return TREELET_COST_INTERSECT * node->count * aabb_area(bvh_node_bounds(node));
+}
+
+// Write the optimal topology of subset into slot, interior nodes take child pairs in order.
+// Returns the node count of the subtree written.
+static int treelet_emit(TreeletEmit* e, unsigned int subset, int slot)
+{
+    if ((subset & (subset - 1)) == 0)
+    {
+        int leaf = __builtin_ctz(subset);
+        e->nodes[slot] = e->leaf_nodes[leaf];
+        e->cost[slot] = e->leaf_cost[leaf];
+        e->size[slot] = e->leaf_size[leaf];
+        return e->size[slot];
+    }
+
+    int pair = e->pairs[e->next_pair++];
+    BVHNode* node = &e->nodes[slot];
+    set_bounds(node, e->box[subset]);
+    node->left_first = pair;
+    node->count = 0;
+    e->cost[slot] = e->best_cost[subset];
+
+    e->size[slot] = 1 + treelet_emit(e, e->split[subset], pair) + treelet_emit(e, subset ^ e->split[subset], pair + 1);
+    return e->size[slot];
+}
+
+// Grow a treelet under root by repeatedly opening its largest interior leaf, then
+// rebuild it with the SAH optimal topology over those leaves (Karras and Aila 2013).
+// Only nodes of root's subtree are touched.
+static void treelet_restructure(BVHNode* nodes, float* cost, int* size, int root)
+{
+    const BVHNode* r = &nodes[root];
+    if (r->count > 0) {return;}
+
+    int leaves[BVH_TREELET_LEAVES];
+    int pairs[BVH_TREELET_LEAVES - 1];
+    int num_leaves = 2, num_pairs = 1;
+    leaves[0] = r->left_first;
+    leaves[1] = r->left_first + 1;
+    pairs[0] = r->left_first;
+
+    while (num_leaves < BVH_TREELET_LEAVES)
+    {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < num_leaves; i++)
+        {
+            const BVHNode* node = &nodes[leaves[i]];
+            float area = aabb_area(bvh_node_bounds(node));
+            if (node->count <= 0 && area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) {break;}
+
+        int opened = nodes[leaves[best]].left_first;
+        pairs[num_pairs++] = opened;
+        leaves[best] = opened;
+        leaves[num_leaves++] = opened + 1;
+    }
+    if (num_leaves < 3) {return;}
+
+    // Subsets in increasing order see all of their proper subsets first
+    AABB box[TREELET_SUBSETS];
+    float best_cost[TREELET_SUBSETS];
+    unsigned char split[TREELET_SUBSETS];
+    unsigned int full = (1u << num_leaves) - 1;
+
+    for (unsigned int s = 1; s <= full; s++)
+    {
+        unsigned int low = s & (0u - s);
+        int leaf = __builtin_ctz(s);
+        if (s == low)
+        {
+            box[s] = bvh_node_bounds(&nodes[leaves[leaf]]);
+            best_cost[s] = cost[leaves[leaf]];
+            split[s] = 0;
+            continue;
+        }
+        box[s] = aabb_union(box[low], box[s ^ low]);
+
+        // Partitions that keep the lowest leaf on the left, each split is seen once
+        unsigned int rest = s ^ low;
+        float best = 1e30f;
+        unsigned int best_p = low;
+        for (unsigned int q = (rest - 1) & rest; ; q = (q - 1) & rest)
+        {
+            unsigned int p = q | low;
+            float c = best_cost[p] + best_cost[s ^ p];
+            if (c < best)
+            {
+                best = c;
+                best_p = p;
+            }
+            if (q == 0) {break;}
+        }
+        best_cost[s] = TREELET_COST_TRAVERSAL * aabb_area(box[s]) + best;
+        split[s] = (unsigned char)best_p;
+    }
+
+    // Keep the old tree unless the gain is more than rounding noise
+    if (best_cost[full] >= cost[root] * (1.0f - 1e-5f)) {return;}
+
+    BVHNode leaf_nodes[BVH_TREELET_LEAVES];
+    float leaf_costs[BVH_TREELET_LEAVES];
+    int leaf_sizes[BVH_TREELET_LEAVES];
+    for (int i = 0; i < num_leaves; i++)
+    {
+        leaf_nodes[i] = nodes[leaves[i]];
+        leaf_costs[i] = cost[leaves[i]];
+        leaf_sizes[i] = size[leaves[i]];
+    }
+
+    TreeletEmit e = {nodes, cost, size, pairs, 0, leaf_nodes, leaf_costs, leaf_sizes, box, best_cost, split};
+    treelet_emit(&e, full, root);
+}
+
+// Interior nodes of root's subtree with children before parents, subtrees under stop nodes
+// are left out. Returns the count written to order.
+static int post_order(const BVHNode* nodes, int root, const unsigned char* stop, int* stack, int* order)
+{
+    int sp = 0, count = 0;
+    stack[sp++] = root;
+    while (sp > 0)
+    {
+        int index = stack[--sp];
+        const BVHNode* node = &nodes[index];
+        if (node->count > 0) {continue;}
+
+        order[count++] = index;
+        for (int c = 0; c < 2; c++)
+        {
+            int child = node->left_first + c;
+            if (stop == NULL || !stop[child]) {stack[sp++] = child;}
+        }
+    }
+
+    // Reversed pre-order (node, right, left) is post-order (left, right, node)
+    for (int i = 0; i < count / 2; i++)
+    {
+        int tmp = order[i];
+        order[i] = order[count - 1 - i];
+        order[count - 1 - i] = tmp;
+    }
+    return count;
+}
+
+static void optimize_nodes(BVHNode* nodes, float* cost, int* size, const int* order, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int index = order[i];
+        const BVHNode* node = &nodes[index];
+
+        // Children may have been restructured since the cost was computed
+        cost[index] = TREELET_COST_TRAVERSAL * aabb_area(bvh_node_bounds(node)) + cost[node->left_first] + cost[node->left_first + 1];
+        treelet_restructure(nodes, cost, size, index);
+    }
+}
+
+static void optimize_subtree(void* ctx, int index, int thread)
+{
+    (void)thread;
+    Optimizer* opt = (Optimizer*)ctx;
+    int root = opt->frontier[index];
+
+    int* buffer = (int*)malloc(2 * opt->size[root] * sizeof(int));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for treelet optimization\n");
+        return;
+    }
+
+    int count = post_order(opt->nodes, root, NULL, buffer, buffer + opt->size[root]);
+    optimize_nodes(opt->nodes, opt->cost, opt->size, buffer + opt->size[root], count);
+    free(buffer);
+}
+
+// Split the subtree under root into independent subtrees, largest first
+static int pick_frontier(const BVHNode* nodes, const int* size, int root, int* frontier, int target)
+{
+    int count = 0;
+    frontier[count++] = root;
+
+    while (count < target)
+    {
+        int best = -1;
+        for (int i = 0; i < count; i++)
+        {
+            if (nodes[frontier[i]].count <= 0 && (best < 0 || size[frontier[i]] > size[frontier[best]])) {best = i;}
+        }
+        if (best < 0) {break;}
+
+        int left = nodes[frontier[best]].left_first;
+        frontier[best] = left;
+        frontier[count++] = left + 1;
+    }
+
+    // Insertion sort, the frontier is small
+    for (int i = 1; i < count; i++)
+    {
+        int value = frontier[i];
+        int j = i;
+        while (j > 0 && size[frontier[j - 1]] < size[value])
+        {
+            frontier[j] = frontier[j - 1];
+            j--;
+        }
+        frontier[j] = value;
+    }
+    return count;
+}
+
+// Depth first copy in the builder's order, so children are again behind their parent and
+// near it in memory. Returns the maximum depth.
+static int relayout(const BVHNode* src, BVHNode* dst, int* scratch, size_t num_nodes)
+{
+    int* stack = scratch;
+    int* depth = scratch + num_nodes;
+    int max_depth = 0;
+    int sp = 0;
+    int used = 1;
+
+    dst[0] = src[0];
+    depth[0] = 0;
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        int i = stack[--sp];
+        if (depth[i] > max_depth) {max_depth = depth[i];}
+        if (dst[i].count > 0) {continue;}
+
+        // Still the source index until the children are copied
+        int left = dst[i].left_first;
+        dst[i].left_first = used;
+        for (int c = 0; c < 2; c++)
+        {
+            dst[used + c] = src[left + c];
+            depth[used + c] = depth[i] + 1;
+        }
+        stack[sp++] = used + 1;
+        stack[sp++] = used;
+        used += 2;
+    }
+    return max_depth;
+}
+
+bool bvh_optimize(BVH* bvh, int root, int iterations)
+{
+    if (iterations <= 0 || bvh->num_nodes < 3 || bvh->nodes[root].count > 0) {return true;}
+
+    size_t n = bvh->num_nodes;
+    int max_frontier = parallel_thread_count() * TREELET_TASKS_PER_THREAD;
+    float* cost = (float*)malloc(n * sizeof(float));
+    int* size = (int*)malloc(n * sizeof(int));
+    int* scratch = (int*)malloc(2 * n * sizeof(int));
+    int* frontier = (int*)malloc(max_frontier * sizeof(int));
+    unsigned char* stop = (unsigned char*)calloc(n, 1);
+    BVHNode* backup = (BVHNode*)malloc(n * sizeof(BVHNode));
+    BVHNode* spare = (BVHNode*)malloc(n * sizeof(BVHNode));
+    if (cost == NULL || size == NULL || scratch == NULL || frontier == NULL || stop == NULL || backup == NULL || spare == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for treelet optimization\n");
+        free(cost); free(size); free(scratch); free(frontier); free(stop); free(backup); free(spare);
+        return false;
+    }
+
+    for (int it = 0; it < iterations; it++)
+    {
+        memcpy(backup, bvh->nodes, n * sizeof(BVHNode));
+
+        // Children are behind their parents here (builder order, then relayout)
+        for (size_t i = n; i-- > 0;)
+        {
+            const BVHNode* node = &bvh->nodes[i];
+            if (node->count > 0)
+            {
+                cost[i] = leaf_cost(node);
+                size[i] = 1;
+            }
+            else
+            {
+                cost[i] = TREELET_COST_TRAVERSAL * aabb_area(bvh_node_bounds(node)) + cost[node->left_first] + cost[node->left_first + 1];
+                size[i] = 1 + size[node->left_first] + size[node->left_first + 1];
+            }
+        }
+        float old_cost = cost[root];
+
+        // Independent subtrees in parallel, then the nodes above them
+        int num_frontier = 0;
+        if (size[root] >= TREELET_MIN_PARALLEL_NODES) {num_frontier = pick_frontier(bvh->nodes, size, root, frontier, max_frontier);}
+
+        Optimizer opt = {bvh->nodes, cost, size, frontier};
+        parallel_for(num_frontier, 0, optimize_subtree, &opt);
+
+        for (int i = 0; i < num_frontier; i++) {stop[frontier[i]] = 1;}
+        int count = post_order(bvh->nodes, root, stop, scratch, scratch + n);
+        optimize_nodes(bvh->nodes, cost, size, scratch + n, count);
+        for (int i = 0; i < num_frontier; i++) {stop[frontier[i]] = 0;}
+
+        // Deeper trees than the traversal stacks allow are rolled back
+        int depth = relayout(bvh->nodes, spare, scratch, n);
+        if (depth > BVH_MAX_DEPTH - 1)
+        {
+            memcpy(bvh->nodes, backup, n * sizeof(BVHNode));
+            break;
+        }
+
+        BVHNode* tmp = bvh->nodes;
+        bvh->nodes = spare;
+        spare = tmp;
+
+        if (cost[root] > old_cost * (1.0f - 1e-4f)) {break;}
+    }
+
+    free(cost); free(size); free(scratch); free(frontier); free(stop); free(backup); free(spare);
+    return true;
+}
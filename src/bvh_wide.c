@@ -0,0 +1,710 @@
+#include "bvh_wide.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+typedef struct
+{
+    const BVH* bvh;
+    WideBVH* wide;
+} Collapser;
+
+// Min and max both far out along +inf, so the slab interval is empty for any ray direction
+static void set_lane_empty(WideBVH* wide, size_t node, int lane)
+{
+    bvh_wide_row(wide, node, WIDE_ROW_MINX)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_MINY)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_MINZ)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXX)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXY)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXZ)[lane].f = 1e30f;
+    bvh_wide_row(wide, node, WIDE_ROW_CHILD)[lane].i = -1;
+    bvh_wide_row(wide, node, WIDE_ROW_COUNT)[lane].i = 0;
+}
+
+static void set_lane_bounds(WideBVH* wide, size_t node, int lane, const BVHNode* src)
+{
+    bvh_wide_row(wide, node, WIDE_ROW_MINX)[lane].f = src->minx;
+    bvh_wide_row(wide, node, WIDE_ROW_MINY)[lane].f = src->miny;
+    bvh_wide_row(wide, node, WIDE_ROW_MINZ)[lane].f = src->minz;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXX)[lane].f = src->maxx;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXY)[lane].f = src->maxy;
+    bvh_wide_row(wide, node, WIDE_ROW_MAXZ)[lane].f = src->maxz;
+}
+
+// Emit the wide node for binary node src and everything below it, returns its index
+static int collapse(Collapser* c, int src)
+{
+    const BVHNode* nodes = c->bvh->nodes;
+    WideBVH* wide = c->wide;
+
+    // Open up the largest interior child until the node is full
+    int children[BVH_WIDE_MAX];
+    int num_children = 0;
+    if (nodes[src].count > 0) {children[num_children++] = src;}
+    else
+    {
+        children[num_children++] = nodes[src].left_first;
+        children[num_children++] = nodes[src].left_first + 1;
+    }
+
+    while (num_children < wide->width)
+    {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < num_children; i++)
+        {
+            const BVHNode* n = &nodes[children[i]];
+            float area = aabb_area(bvh_node_bounds(n));
+            if (n->count <= 0 && area > best_area)
+            {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) {break;}
+
+        int opened = children[best];
+        children[best] = nodes[opened].left_first;
+        children[num_children++] = nodes[opened].left_first + 1;
+    }
+
+    int index = (int)wide->num_nodes++;
+    for (int lane = 0; lane < wide->width; lane++)
+    {
+        if (lane >= num_children)
+        {
+            set_lane_empty(wide, index, lane);
+            continue;
+        }
+
+        const BVHNode* child = &nodes[children[lane]];
+        set_lane_bounds(wide, index, lane, child);
+
+        if (child->count > 0)
+        {
+            bvh_wide_row(wide, index, WIDE_ROW_CHILD)[lane].i = child->left_first;
+            bvh_wide_row(wide, index, WIDE_ROW_COUNT)[lane].i = child->count;
+        }
+        else
+        {
+            int sub = collapse(c, children[lane]);
+            bvh_wide_row(wide, index, WIDE_ROW_CHILD)[lane].i = sub;
+            bvh_wide_row(wide, index, WIDE_ROW_COUNT)[lane].i = 0;
+        }
+    }
+
+    return index;
+}
+
+bool bvh_wide_build(WideBVH* wide, const BVH* bvh, int width)
+{
+    memset(wide, 0, sizeof(*wide));
+    if (width != 4 && width != 8)
+    {
+        fprintf(stderr, "Unsupported BVH width %d\n", width);
+        return false;
+    }
+    wide->width = width;
+    if (bvh->num_nodes == 0) {return true;}
+
+    // Every wide node consumes at least one binary interior node (or the root leaf)
+    size_t max_nodes = bvh->num_nodes;
+    wide->lanes = (WideLane*)malloc(max_nodes * WIDE_NUM_ROWS * width * sizeof(WideLane));
+    wide->prims = (unsigned int*)malloc(bvh->num_prims * sizeof(unsigned int));
+    if (wide->lanes == NULL || wide->prims == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for wide BVH\n");
+        bvh_wide_free(wide);
+        return false;
+    }
+
+    memcpy(wide->prims, bvh->prims, bvh->num_prims * sizeof(unsigned int));
+    wide->num_prims = bvh->num_prims;
+
+    Collapser c = {bvh, wide};
+    collapse(&c, 0);
+
+    WideLane* shrunk = (WideLane*)realloc(wide->lanes, wide->num_nodes * bvh_wide_node_bytes(wide));
+    if (shrunk != NULL) {wide->lanes = shrunk;}
+
+    return true;
+}
+
+int bvh_wide_stack_entries(const WideBVH* wide)
+{
+    if (wide->num_nodes == 0) {return 1;}
+    int* need = (int*)malloc(wide->num_nodes * sizeof(int));
+    if (need == NULL) {return BVH_MAX_DEPTH * (wide->width - 1) + 1;}
+
+    // Children come after their parent, so one sweep from the back has them ready. A node with
+    // k interior children leaves k - 1 of them waiting while the worst one is walked.
+    for (size_t n = wide->num_nodes; n-- > 0;)
+    {
+        const WideLane* child = bvh_wide_row(wide, n, WIDE_ROW_CHILD);
+        const WideLane* count = bvh_wide_row(wide, n, WIDE_ROW_COUNT);
+        int interior = 0, deepest = 1;
+        for (int lane = 0; lane < wide->width; lane++)
+        {
+            if (count[lane].i != 0 || child[lane].i < 0) {continue;}
+            interior++;
+            if (need[child[lane].i] > deepest) {deepest = need[child[lane].i];}
+        }
+        need[n] = interior > 0 ? interior - 1 + deepest : 0;
+    }
+    int entries = need[0] > 1 ? need[0] : 1;
+    free(need);
+    return entries;
+}
+
+static void free_blocks(WideBVH* wide)
+{
+    free(wide->node_blocks);
+    free(wide->tri_blocks);
+    free(wide->tri_lanes);
+    free(wide->sphere_blocks);
+    free(wide->sphere_lanes);
+    wide->node_blocks = NULL;
+    wide->tri_blocks = NULL;
+    wide->tri_lanes = NULL;
+    wide->sphere_blocks = NULL;
+    wide->sphere_lanes = NULL;
+    wide->num_tri_blocks = wide->num_sphere_blocks = 0;
+}
+
+void bvh_wide_free(WideBVH* wide)
+{
+    free(wide->lanes);
+    free(wide->prims);
+    free_blocks(wide);
+    memset(wide, 0, sizeof(*wide));
+}
+
+// Leaf prims of node of one kind in lane order, written into the blocks from first on unless
+// only counting. Returns the number of blocks.
+static int node_blocks(WideBVH* wide, const Scene* scene, size_t node, bool triangles, int first, bool write)
+{
+    const WideLane* child = bvh_wide_row(wide, node, WIDE_ROW_CHILD);
+    const WideLane* count = bvh_wide_row(wide, node, WIDE_ROW_COUNT);
+    int used = 0;
+    for (int lane = 0; lane < wide->width; lane++)
+    {
+        for (int i = child[lane].i; i < child[lane].i + count[lane].i; i++)
+        {
+            unsigned int ref = wide->prims[i];
+            if (prim_ref_is_triangle(ref) != triangles) {continue;}
+
+            int b = first + used / PRIM_BLOCK_SIZE, slot = used % PRIM_BLOCK_SIZE;
+            used++;
+            if (!write) {continue;}
+
+            WideBlockLanes* lanes = triangles ? &wide->tri_lanes[b] : &wide->sphere_lanes[b];
+            if (slot == 0)
+            {
+                memset(lanes, 0, sizeof(*lanes));
+                if (triangles) {tri_block_clear(&wide->tri_blocks[b]);}
+                else {sphere_block_clear(&wide->sphere_blocks[b]);}
+            }
+            unsigned int index = prim_ref_index(ref);
+            lanes->index[slot] = (int)index;
+            lanes->child_bit[slot] = (unsigned char)(1u << lane);
+
+            if (!triangles)
+            {
+                sphere_block_set(&wide->sphere_blocks[b], slot, &scene->spheres[index]);
+                continue;
+            }
+            const unsigned int* idx = scene->mesh.indices + 3 * index;
+            Vec3 v0 = mesh_vertex(&scene->mesh, idx[0]);
+            tri_block_set(&wide->tri_blocks[b], slot, v0, v3_sub(mesh_vertex(&scene->mesh, idx[1]), v0), v3_sub(mesh_vertex(&scene->mesh, idx[2]), v0));
+        }
+    }
+    return (used + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+}
+
+bool bvh_wide_build_blocks(WideBVH* wide, const Scene* scene)
+{
+    free_blocks(wide);
+    if (wide->num_nodes == 0) {return true;}
+
+    wide->node_blocks = (WideNodeBlocks*)malloc(wide->num_nodes * sizeof(WideNodeBlocks));
+    if (wide->node_blocks == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for wide BVH leaf blocks\n");
+        return false;
+    }
+
+    // Count, then fill in the same order
+    size_t num_tri = 0, num_sphere = 0;
+    for (size_t n = 0; n < wide->num_nodes; n++)
+    {
+        WideNodeBlocks* nb = &wide->node_blocks[n];
+        nb->first_tri = (int)num_tri;
+        nb->num_tri = node_blocks(wide, scene, n, true, 0, false);
+        nb->first_sphere = (int)num_sphere;
+        nb->num_sphere = node_blocks(wide, scene, n, false, 0, false);
+        num_tri += nb->num_tri;
+        num_sphere += nb->num_sphere;
+    }
+
+    wide->tri_blocks = (TriBlock*)malloc((num_tri > 0 ? num_tri : 1) * sizeof(TriBlock));
+    wide->tri_lanes = (WideBlockLanes*)malloc((num_tri > 0 ? num_tri : 1) * sizeof(WideBlockLanes));
+    wide->sphere_blocks = (SphereBlock*)malloc((num_sphere > 0 ? num_sphere : 1) * sizeof(SphereBlock));
+    wide->sphere_lanes = (WideBlockLanes*)malloc((num_sphere > 0 ? num_sphere : 1) * sizeof(WideBlockLanes));
+    if (wide->tri_blocks == NULL || wide->tri_lanes == NULL || wide->sphere_blocks == NULL || wide->sphere_lanes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for wide BVH leaf blocks\n");
+        free_blocks(wide);
+        return false;
+    }
+    wide->num_tri_blocks = num_tri;
+    wide->num_sphere_blocks = num_sphere;
+
+    for (size_t n = 0; n < wide->num_nodes; n++)
+    {
+        node_blocks(wide, scene, n, true, wide->node_blocks[n].first_tri, true);
+        node_blocks(wide, scene, n, false, wide->node_blocks[n].first_sphere, true);
+    }
+    return true;
+}
+
+size_t bvh_wide_block_bytes(const WideBVH* wide)
+{
+    if (wide->node_blocks == NULL) {return 0;}
+    return wide->num_nodes * sizeof(WideNodeBlocks) + wide->num_tri_blocks * (sizeof(TriBlock) + sizeof(WideBlockLanes)) +
+        wide->num_sphere_blocks * (sizeof(SphereBlock) + sizeof(WideBlockLanes));
+}
+
+static bool wide_intersect_scalar(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    *hit = hit_none();
+    if (wide->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int stack[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + 1];
+    float stack_t[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + 1];
+    int sp = 0;
+    stack[sp] = 0;
+    stack_t[sp++] = 0.0f;
+
+    const int width = wide->width;
+    while (sp > 0)
+    {
+        sp--;
+        if (stack_t[sp] >= hit->t) {continue;}
+        int node = stack[sp];
+
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += bvh_wide_node_bytes(wide);
+        }
+
+        const WideLane* minx = bvh_wide_row(wide, node, WIDE_ROW_MINX);
+        const WideLane* miny = bvh_wide_row(wide, node, WIDE_ROW_MINY);
+        const WideLane* minz = bvh_wide_row(wide, node, WIDE_ROW_MINZ);
+        const WideLane* maxx = bvh_wide_row(wide, node, WIDE_ROW_MAXX);
+        const WideLane* maxy = bvh_wide_row(wide, node, WIDE_ROW_MAXY);
+        const WideLane* maxz = bvh_wide_row(wide, node, WIDE_ROW_MAXZ);
+        const WideLane* child = bvh_wide_row(wide, node, WIDE_ROW_CHILD);
+        const WideLane* count = bvh_wide_row(wide, node, WIDE_ROW_COUNT);
+
+        // All child boxes of the node in one pass over the SoA rows
+        float t_near[BVH_WIDE_MAX];
+        for (int lane = 0; lane < width; lane++)
+        {
+            float tx1 = (minx[lane].f - ro.x) * inv_rd.x, tx2 = (maxx[lane].f - ro.x) * inv_rd.x;
+            float ty1 = (miny[lane].f - ro.y) * inv_rd.y, ty2 = (maxy[lane].f - ro.y) * inv_rd.y;
+            float tz1 = (minz[lane].f - ro.z) * inv_rd.z, tz2 = (maxz[lane].f - ro.z) * inv_rd.z;
+            float tmin = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+            float tmax = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+            t_near[lane] = (tmax >= tmin && tmin < hit->t && tmax > 0.0f) ? tmin : 1e30f;
+        }
+
+        // Leaves are intersected right away, interior children pushed far to near
+        int order[BVH_WIDE_MAX];
+        int num_order = 0;
+        for (int lane = 0; lane < width; lane++)
+        {
+            if (t_near[lane] == 1e30f) {continue;}
+
+            if (count[lane].i > 0)
+            {
+                for (int i = child[lane].i; i < child[lane].i + count[lane].i; i++)
+                {
+                    unsigned int ref = wide->prims[i];
+                    float t = prim_ref_intersect(scene, ref, ro, rd);
+                    if (stats) {stats->prims_tested++;}
+
+                    if (t > HIT_EPSILON && t < hit->t)
+                    {
+                        hit->t = t;
+                        hit->index = (int)prim_ref_index(ref);
+                        hit->type = prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+                    }
+                }
+                continue;
+            }
+
+            int j = num_order++;
+            while (j > 0 && t_near[order[j - 1]] < t_near[lane])
+            {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = lane;
+        }
+
+        for (int i = 0; i < num_order; i++)
+        {
+            stack[sp] = child[order[i]].i;
+            stack_t[sp++] = t_near[order[i]];
+        }
+    }
+
+    return hit->type != HIT_NONE;
+}
+
+static bool wide_occluded_scalar(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    if (wide->num_nodes == 0) {return false;}
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    int stack[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + 1];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    const int width = wide->width;
+    while (sp > 0)
+    {
+        int node = stack[--sp];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += bvh_wide_node_bytes(wide);
+        }
+
+        const WideLane* minx = bvh_wide_row(wide, node, WIDE_ROW_MINX);
+        const WideLane* miny = bvh_wide_row(wide, node, WIDE_ROW_MINY);
+        const WideLane* minz = bvh_wide_row(wide, node, WIDE_ROW_MINZ);
+        const WideLane* maxx = bvh_wide_row(wide, node, WIDE_ROW_MAXX);
+        const WideLane* maxy = bvh_wide_row(wide, node, WIDE_ROW_MAXY);
+        const WideLane* maxz = bvh_wide_row(wide, node, WIDE_ROW_MAXZ);
+        const WideLane* child = bvh_wide_row(wide, node, WIDE_ROW_CHILD);
+        const WideLane* count = bvh_wide_row(wide, node, WIDE_ROW_COUNT);
+
+        // Leaves first, a blocker there ends the query before any interior child is pushed.
+        // Interior children go on the stack unsorted, distance order buys nothing for any hit.
+        for (int lane = 0; lane < width; lane++)
+        {
+            float tx1 = (minx[lane].f - ro.x) * inv_rd.x, tx2 = (maxx[lane].f - ro.x) * inv_rd.x;
+            float ty1 = (miny[lane].f - ro.y) * inv_rd.y, ty2 = (maxy[lane].f - ro.y) * inv_rd.y;
+            float tz1 = (minz[lane].f - ro.z) * inv_rd.z, tz2 = (maxz[lane].f - ro.z) * inv_rd.z;
+            float tmin = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+            float tmax = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+            if (!(tmax >= tmin && tmin < t_max && tmax > 0.0f)) {continue;}
+
+            if (count[lane].i == 0)
+            {
+                stack[sp++] = child[lane].i;
+                continue;
+            }
+
+            for (int i = child[lane].i; i < child[lane].i + count[lane].i; i++)
+            {
+                if (stats) {stats->prims_tested++;}
+                if (prim_ref_occludes(scene, wide->prims[i], ro, rd, t_max)) {return true;}
+            }
+        }
+    }
+
+    return false;
+}
+
+#ifdef CPU_X86
+// One ray against a whole node at once: every child box in one AVX2 pass (BVH4 nodes use the
+// low half), the leaf blocks of the node masked down to the hit leaves, and the hit interior
+// children compressed to the front with a pext built permutation before they are sorted onto
+// the stack. Same arithmetic in the same order as the scalar loops.
+
+typedef struct
+{
+    BlockRay8 block;
+    __m256 ix, iy, iz;
+} WideRay;
+
+CPU_TARGET_AVX2 static inline WideRay wide_ray_avx2(Vec3 ro, Vec3 rd, Vec3 inv_rd)
+{
+    return (WideRay){block_ray8(ro, rd), _mm256_set1_ps(inv_rd.x), _mm256_set1_ps(inv_rd.y), _mm256_set1_ps(inv_rd.z)};
+}
+
+CPU_TARGET_AVX2 static inline __m256 wide_row_load(const WideBVH* wide, int node, int row)
+{
+    const float* lanes = (const float*)bvh_wide_row(wide, node, row);
+    if (wide->width == 8) {return _mm256_loadu_ps(lanes);}
+    return _mm256_insertf128_ps(_mm256_setzero_ps(), _mm_loadu_ps(lanes), 0);
+}
+
+// Mask of the children the ray enters before t_max, their entry distances in t_near
+CPU_TARGET_AVX2 static inline unsigned int wide_boxes_avx2(const WideBVH* wide, int node, const WideRay* ray, float t_max, __m256* t_near)
+{
+    const BlockRay8* r = &ray->block;
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MINX), r->ox), ray->ix);
+    __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MAXX), r->ox), ray->ix);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MINY), r->oy), ray->iy);
+    __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MAXY), r->oy), ray->iy);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MINZ), r->oz), ray->iz);
+    __m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(wide_row_load(wide, node, WIDE_ROW_MAXZ), r->oz), ray->iz);
+
+    __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), _mm256_min_ps(tz1, tz2));
+    __m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), _mm256_max_ps(tz1, tz2));
+
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ), _mm256_cmp_ps(tmin, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GT_OQ));
+    *t_near = tmin;
+    return (unsigned int)_mm256_movemask_ps(hit) & ((1u << wide->width) - 1u);
+}
+
+// Lanes of mask moved to the front in order: pdep spreads the mask to one byte per lane,
+// pext then picks the matching lane numbers out of 0..7
+CPU_TARGET_AVX2 static inline __m256i wide_compress_indices(unsigned int mask)
+{
+    unsigned long long bytes = _pdep_u64(mask, 0x0101010101010101ull) * 0xff;
+    unsigned long long lanes = _pext_u64(0x0706050403020100ull, bytes);
+    return _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long)lanes));
+}
+
+// Lanes of a leaf block that belong to one of the leaves
+CPU_TARGET_AVX2 static inline unsigned int block_lanes_in(const WideBlockLanes* lanes, unsigned int leaves)
+{
+    __m256i bits = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)lanes->child_bit));
+    __m256i outside = _mm256_cmpeq_epi32(_mm256_and_si256(bits, _mm256_set1_epi32((int)leaves)), _mm256_setzero_si256());
+    return ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xffu;
+}
+
+// Lanes with t in (HIT_EPSILON, t_max)
+CPU_TARGET_AVX2 static inline unsigned int block_hits(__m256 t, float t_max)
+{
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(HIT_EPSILON), _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+    return (unsigned int)_mm256_movemask_ps(hit);
+}
+
+// Strictly closer lanes in lane order, so the first of equally close prims stays like in the scalar loop
+CPU_TARGET_AVX2 static inline void block_closest(__m256 tv, unsigned int mask, const WideBlockLanes* lanes, int type, Hit* hit)
+{
+    float t[PRIM_BLOCK_SIZE];
+    _mm256_storeu_ps(t, tv);
+    for (; mask != 0; mask &= mask - 1)
+    {
+        int i = __builtin_ctz(mask);
+        if (t[i] < hit->t) {*hit = (Hit){t[i], lanes->index[i], type};}
+    }
+}
+
+CPU_TARGET_AVX2 static inline void wide_leaves_closest(const WideBVH* wide, const Scene* scene, int node, unsigned int leaves, const WideRay* ray,
+    Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    if (wide->node_blocks == NULL)
+    {
+        const WideLane* child = bvh_wide_row(wide, node, WIDE_ROW_CHILD);
+        const WideLane* count = bvh_wide_row(wide, node, WIDE_ROW_COUNT);
+        for (; leaves != 0; leaves &= leaves - 1)
+        {
+            int lane = __builtin_ctz(leaves);
+            for (int i = child[lane].i; i < child[lane].i + count[lane].i; i++)
+            {
+                unsigned int ref = wide->prims[i];
+                float t = prim_ref_intersect(scene, ref, ro, rd);
+                if (t > HIT_EPSILON && t < hit->t) {*hit = (Hit){t, (int)prim_ref_index(ref), prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE};}
+            }
+            if (stats) {stats->prims_tested += count[lane].i;}
+        }
+        return;
+    }
+
+    const WideNodeBlocks* nb = &wide->node_blocks[node];
+    for (int b = nb->first_tri; b < nb->first_tri + nb->num_tri; b++)
+    {
+        unsigned int in = block_lanes_in(&wide->tri_lanes[b], leaves);
+        if (in == 0) {continue;}
+        if (stats) {stats->prims_tested += __builtin_popcount(in);}
+        __m256 t = tri_block_avx2(&wide->tri_blocks[b], &ray->block);
+        block_closest(t, block_hits(t, hit->t) & in, &wide->tri_lanes[b], HIT_TRIANGLE, hit);
+    }
+    for (int b = nb->first_sphere; b < nb->first_sphere + nb->num_sphere; b++)
+    {
+        unsigned int in = block_lanes_in(&wide->sphere_lanes[b], leaves);
+        if (in == 0) {continue;}
+        if (stats) {stats->prims_tested += __builtin_popcount(in);}
+        __m256 t = sphere_block_avx2(&wide->sphere_blocks[b], &ray->block);
+        block_closest(t, block_hits(t, hit->t) & in, &wide->sphere_lanes[b], HIT_SPHERE, hit);
+    }
+}
+
+CPU_TARGET_AVX2 static inline bool wide_leaves_occlude(const WideBVH* wide, const Scene* scene, int node, unsigned int leaves, const WideRay* ray,
+    Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    if (wide->node_blocks == NULL)
+    {
+        const WideLane* child = bvh_wide_row(wide, node, WIDE_ROW_CHILD);
+        const WideLane* count = bvh_wide_row(wide, node, WIDE_ROW_COUNT);
+        for (; leaves != 0; leaves &= leaves - 1)
+        {
+            int lane = __builtin_ctz(leaves);
+            for (int i = child[lane].i; i < child[lane].i + count[lane].i; i++)
+            {
+                if (stats) {stats->prims_tested++;}
+                if (prim_ref_occludes(scene, wide->prims[i], ro, rd, t_max)) {return true;}
+            }
+        }
+        return false;
+    }
+
+    const WideNodeBlocks* nb = &wide->node_blocks[node];
+    for (int b = nb->first_tri; b < nb->first_tri + nb->num_tri; b++)
+    {
+        unsigned int in = block_lanes_in(&wide->tri_lanes[b], leaves);
+        if (in == 0) {continue;}
+        if (stats) {stats->prims_tested += __builtin_popcount(in);}
+        if (block_hits(tri_block_avx2(&wide->tri_blocks[b], &ray->block), t_max) & in) {return true;}
+    }
+    for (int b = nb->first_sphere; b < nb->first_sphere + nb->num_sphere; b++)
+    {
+        unsigned int in = block_lanes_in(&wide->sphere_lanes[b], leaves);
+        if (in == 0) {continue;}
+        if (stats) {stats->prims_tested += __builtin_popcount(in);}
+        if (block_hits(sphere_block_avx2(&wide->sphere_blocks[b], &ray->block), t_max) & in) {return true;}
+    }
+    return false;
+}
+
+CPU_TARGET_AVX2 static bool wide_intersect_avx2(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    WideRay ray = wide_ray_avx2(ro, rd, ray_inv_dir(rd));
+
+    int stack[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + 1];
+    float stack_t[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + 1];
+    int sp = 0;
+    stack[sp] = 0;
+    stack_t[sp++] = 0.0f;
+
+    while (sp > 0)
+    {
+        sp--;
+        if (stack_t[sp] >= hit->t) {continue;}
+        int node = stack[sp];
+
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += bvh_wide_node_bytes(wide);
+        }
+
+        __m256 t_near;
+        unsigned int mask = wide_boxes_avx2(wide, node, &ray, hit->t, &t_near);
+        if (mask == 0) {continue;}
+
+        __m256i count = _mm256_castps_si256(wide_row_load(wide, node, WIDE_ROW_COUNT));
+        unsigned int leaves = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(count, _mm256_setzero_si256()))) & mask;
+        unsigned int interior = mask & ~leaves;
+
+        // Leaves are intersected right away
+        if (leaves != 0) {wide_leaves_closest(wide, scene, node, leaves, &ray, ro, rd, hit, stats);}
+        if (interior == 0) {continue;}
+
+        // Hit interior children to the front, then pushed far to near
+        __m256i order = wide_compress_indices(interior);
+        float t_sorted[BVH_WIDE_MAX];
+        int child_sorted[BVH_WIDE_MAX];
+        _mm256_storeu_ps(t_sorted, _mm256_permutevar8x32_ps(t_near, order));
+        _mm256_storeu_si256((__m256i*)child_sorted, _mm256_permutevar8x32_epi32(_mm256_castps_si256(wide_row_load(wide, node, WIDE_ROW_CHILD)), order));
+
+        int n = __builtin_popcount(interior);
+        for (int i = 1; i < n; i++)
+        {
+            float t = t_sorted[i];
+            int c = child_sorted[i];
+            int j = i;
+            for (; j > 0 && t_sorted[j - 1] < t; j--)
+            {
+                t_sorted[j] = t_sorted[j - 1];
+                child_sorted[j] = child_sorted[j - 1];
+            }
+            t_sorted[j] = t;
+            child_sorted[j] = c;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            stack[sp] = child_sorted[i];
+            stack_t[sp++] = t_sorted[i];
+        }
+    }
+
+    return hit->type != HIT_NONE;
+}
+
+CPU_TARGET_AVX2 static bool wide_occluded_avx2(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    WideRay ray = wide_ray_avx2(ro, rd, ray_inv_dir(rd));
+
+    // Room for a full vector store at the top
+    int stack[BVH_MAX_DEPTH * (BVH_WIDE_MAX - 1) + BVH_WIDE_MAX];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        int node = stack[--sp];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += bvh_wide_node_bytes(wide);
+        }
+
+        __m256 t_near;
+        unsigned int mask = wide_boxes_avx2(wide, node, &ray, t_max, &t_near);
+        if (mask == 0) {continue;}
+
+        __m256i count = _mm256_castps_si256(wide_row_load(wide, node, WIDE_ROW_COUNT));
+        unsigned int leaves = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(count, _mm256_setzero_si256()))) & mask;
+        unsigned int interior = mask & ~leaves;
+
+        // Leaves first, a blocker there ends the query before any interior child is pushed
+        if (leaves != 0 && wide_leaves_occlude(wide, scene, node, leaves, &ray, ro, rd, t_max, stats)) {return true;}
+
+        // Unsorted, distance order buys nothing for any hit
+        __m256i order = wide_compress_indices(interior);
+        _mm256_storeu_si256((__m256i*)&stack[sp], _mm256_permutevar8x32_epi32(_mm256_castps_si256(wide_row_load(wide, node, WIDE_ROW_CHILD)), order));
+        sp += __builtin_popcount(interior);
+    }
+
+    return false;
+}
+#endif
+
+bool bvh_wide_intersect(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+#ifdef CPU_X86
+    if (cpu_isa() >= CPU_ISA_AVX2)
+    {
+        *hit = hit_none();
+        return wide->num_nodes > 0 && wide_intersect_avx2(wide, scene, ro, rd, hit, stats);
+    }
+#endif
+    return wide_intersect_scalar(wide, scene, ro, rd, hit, stats);
+}
+
+bool bvh_wide_occluded(const WideBVH* wide, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+#ifdef CPU_X86
+    if (cpu_isa() >= CPU_ISA_AVX2) {return wide->num_nodes > 0 && wide_occluded_avx2(wide, scene, ro, rd, t_max, stats);}
+#endif
+    return wide_occluded_scalar(wide, scene, ro, rd, t_max, stats);
+}
@@ -0,0 +1,27 @@
+#include "camera.h"
+
+#ifndef M_PI
+#define M_PI 3.1415926
+#endif
+
+static float to_radians(float deg) {return deg * ((float)M_PI / 180.0f);}
+
+void camera_ray(const Camera* camera, float px, float py, int width, int height, Vec3* ro, Vec3* rd)
+{
+    float aspect = (float)width / (float)height;
+    float u = px / width * 2.0f - 1.0f;
+    float v = py / height * 2.0f - 1.0f;
+    u *= aspect;
+
+    float yaw = to_radians(camera->yaw);
+    float pitch = to_radians(camera->pitch);
+
+    Vec3 forward = v3(cosf(yaw) * cosf(pitch), sinf(pitch), sinf(yaw) * cosf(pitch));
+    Vec3 right = v3_normalize(v3_cross(forward, v3(0.0f, 1.0f, 0.0f)));
+    Vec3 up = v3_normalize(v3_cross(right, forward));
+
+    float tan_fov = tanf(to_radians(CAMERA_FOV) * 0.5f);
+
+    *ro = v3(camera->px, camera->py, camera->pz);
+    *rd = v3_normalize(v3_add(forward, v3_add(v3_scale(right, u * tan_fov), v3_scale(up, v * tan_fov))));
+}
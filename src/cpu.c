@@ -0,0 +1,56 @@
+#include "cpu.h"
+
+#include <string.h>
+
+static const char* k_isa_names[] = {"scalar", "sse4.1", "avx2", "avx512"};
+
+static CpuIsa s_limit = CPU_ISA_AVX512;
+
+static CpuIsa cpu_isa_detect(void)
+{
+#ifdef CPU_X86
+    // Checks the OS saves the wider registers too, not just the CPUID bits
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+    if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {return CPU_ISA_AVX512;}
+    if (avx2) {return CPU_ISA_AVX2;}
+    if (__builtin_cpu_supports("sse4.1")) {return CPU_ISA_SSE41;}
+#endif
+    return CPU_ISA_SCALAR;
+}
+
+CpuIsa cpu_isa(void)
+{
+    // Every thread computes the same value, so the race on the first calls is harmless
+    static int detected = -1;
+    int isa = __atomic_load_n(&detected, __ATOMIC_RELAXED);
+    if (isa < 0)
+    {
+        isa = (int)cpu_isa_detect();
+        __atomic_store_n(&detected, isa, __ATOMIC_RELAXED);
+    }
+    return (CpuIsa)isa < s_limit ? (CpuIsa)isa : s_limit;
+}
+
+void cpu_set_isa_limit(CpuIsa isa)
+{
+    s_limit = isa;
+}
+
+const char* cpu_isa_name(CpuIsa isa)
+{
+    return isa >= CPU_ISA_SCALAR && isa <= CPU_ISA_AVX512 ? k_isa_names[isa] : "unknown";
+}
+
+bool cpu_isa_parse(const char* name, CpuIsa* isa)
+{
+    for (int i = 0; i <= CPU_ISA_AVX512; i++)
+    {
+        if (strcmp(name, k_isa_names[i]) == 0)
+        {
+            *isa = (CpuIsa)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,823 @@
+#include "farm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "parallel.h"
+#include "timer.h"
+
+#ifdef _WIN32
+
+int farm_listen(const char* address)
+{
+    (void)address;
+    fprintf(stderr, "The render farm needs POSIX sockets\n");
+    return -1;
+}
+
+void farm_close(int fd) {(void)fd;}
+
+bool farm_coordinate(int listen_fd, const Scene* scene, const FarmRender* render, const FarmOptions* options, RenderImage* image, FarmStats* stats)
+{
+    (void)listen_fd; (void)scene; (void)render; (void)options; (void)image; (void)stats;
+    return false;
+}
+
+bool farm_work(const char* address, const FarmWorkerOptions* options)
+{
+    (void)address; (void)options;
+    fprintf(stderr, "The render farm needs POSIX sockets\n");
+    return false;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define FARM_MAGIC 0x4d524146u // "FARM"
+#define FARM_MAX_WORKERS 1024
+#define FARM_CONNECT_SECONDS 10.0
+#define FARM_SEND_SECONDS 30.0 // A peer that doesn't drain a message in this long is gone
+#define FARM_MAX_SCENE (1ull << 36)
+
+typedef enum
+{
+    MSG_HELLO = 1, // Worker: WireHello
+    MSG_SCENE,     // Coordinator: WireScene, then the spheres, materials, vertices and indices
+    MSG_READY,     // Worker: scene built, send tiles
+    MSG_TILE,      // Coordinator: WireTile
+    MSG_RESULT,    // Worker: WireTile, then 3 floats per tile pixel, row by row
+    MSG_DONE       // Coordinator: every tile is in
+} FarmMessage;
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int type;
+    unsigned long long size; // Payload bytes after the header
+} WireHeader;
+
+typedef struct
+{
+    unsigned int version;
+    int threads;
+} WireHello;
+
+typedef struct
+{
+    Camera camera;
+    int width, height, spp;
+    int light_sampling, packet_bounces, wide_width, treelet, tri_records, wavefront;
+    unsigned int seed_offset;
+    unsigned long long num_spheres, num_materials, num_vertices, num_indices; // num_vertices counts floats, like MeshData
+} WireScene;
+
+typedef struct
+{
+    int id;
+    int x0, y0, x1, y1;
+    int first_frame, num_frames;
+    int padding;
+} WireTile;
+
+// Socket for "unix:/path" or "tcp:[host:]port", listening or connected. -1 on failure, errno
+// tells why.
+static int farm_socket(const char* address, bool listening)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        const char* path = address + 5;
+        if (path[0] == '\0' || strlen(path) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {return -1;}
+        if (listening)
+        {
+            unlink(path); // Left behind by an earlier coordinator
+            if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) {return fd;}
+        }
+        else if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {return fd;}
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    if (strncmp(address, "tcp:", 4) == 0)
+    {
+        char host[256] = "";
+        const char* port = address + 4;
+        const char* colon = strrchr(port, ':');
+        if (colon != NULL)
+        {
+            size_t len = (size_t)(colon - port);
+            if (len >= sizeof(host))
+            {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            memcpy(host, port, len);
+            host[len] = '\0';
+            port = colon + 1;
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        struct addrinfo* list;
+        if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &list) != 0)
+        {
+            errno = EADDRNOTAVAIL;
+            return -1;
+        }
+
+        int fd = -1, err = 0;
+        for (struct addrinfo* ai = list; ai != NULL && fd < 0; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {continue;}
+            int one = 1;
+            bool ok;
+            if (listening)
+            {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0;
+            }
+            else
+            {
+                ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+                if (ok) {setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));}
+            }
+            if (!ok)
+            {
+                err = errno;
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(list);
+        if (fd < 0) {errno = err;}
+        return fd;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int farm_listen(const char* address)
+{
+    int fd = farm_socket(address, true);
+    if (fd < 0) {fprintf(stderr, "Failed to listen on %s (expected unix:/path or tcp:[host:]port): %s\n", address, strerror(errno));}
+    return fd;
+}
+
+void farm_close(int fd)
+{
+    if (fd < 0) {return;}
+
+    // Unix sockets leave their path behind
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) == 0 && addr.sun_family == AF_UNIX && len > sizeof(sa_family_t) && addr.sun_path[0] != '\0')
+    {
+        int accepting = 0;
+        socklen_t size = sizeof(accepting);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &size) == 0 && accepting) {unlink(addr.sun_path);}
+    }
+    close(fd);
+}
+
+// Whole buffer out. The coordinator's sockets are non-blocking, a slow peer gets up to
+// FARM_SEND_SECONDS to make room.
+static bool send_all(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            p += n;
+            size -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {continue;}
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, (int)(FARM_SEND_SECONDS * 1000.0)) > 0) {continue;}
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n > 0)
+        {
+            p += n;
+            size -= (size_t)n;
+        }
+        else if (n == 0 || errno != EINTR) {return false;}
+    }
+    return true;
+}
+
+static bool send_header(int fd, FarmMessage type, unsigned long long size)
+{
+    WireHeader header = {FARM_MAGIC, (unsigned int)type, size};
+    return send_all(fd, &header, sizeof(header));
+}
+
+static bool send_message(int fd, FarmMessage type, const void* payload, size_t size)
+{
+    return send_header(fd, type, size) && send_all(fd, payload, size);
+}
+
+// Coordinator
+
+typedef enum
+{
+    CONN_HELLO,   // Waiting for MSG_HELLO
+    CONN_LOADING, // Scene sent, waiting for MSG_READY
+    CONN_IDLE,
+    CONN_BUSY     // Rendering tile
+} ConnState;
+
+typedef struct
+{
+    int fd;
+    ConnState state;
+    int tile;
+    double since; // Tile handed out
+    // Message being received: the header, then the payload
+    WireHeader header;
+    unsigned char* payload;
+    size_t received;
+} FarmConn;
+
+typedef struct
+{
+    ParallelTile rect;
+    int copies;     // Workers rendering it
+    bool done;
+    bool lost;      // Its worker failed, the next hand out is a reissue
+    double started; // First handed out
+} FarmTile;
+
+typedef struct
+{
+    const Scene* scene;
+    const FarmRender* render;
+    const FarmOptions* options;
+    FarmTile* tiles;
+    int num_tiles;
+    int tiles_done;
+    float* sums; // 3 floats per image pixel
+    FarmConn* conns;
+    int num_conns;
+    FarmStats stats;
+} Farm;
+
+static bool send_scene(int fd, const Scene* scene, const FarmRender* render)
+{
+    WireScene ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.camera = render->camera;
+    ws.width = render->width;
+    ws.height = render->height;
+    ws.spp = render->spp;
+    ws.light_sampling = render->light_sampling;
+    ws.packet_bounces = render->packet_bounces;
+    ws.wide_width = render->wide_width;
+    ws.treelet = render->treelet;
+    ws.tri_records = render->tri_records;
+    ws.wavefront = render->wavefront;
+    ws.seed_offset = render->seed_offset;
+    ws.num_spheres = scene->num_spheres;
+    ws.num_materials = scene->num_materials;
+    ws.num_vertices = scene->mesh.vertices != NULL ? scene->mesh.num_vertices : 0;
+    ws.num_indices = scene->mesh.indices != NULL ? scene->mesh.num_indices : 0;
+
+    const void* parts[4] = {scene->spheres, scene->materials, scene->mesh.vertices, scene->mesh.indices};
+    size_t sizes[4] = {ws.num_spheres * sizeof(Sphere), ws.num_materials * sizeof(Material), ws.num_vertices * sizeof(float),
+        ws.num_indices * sizeof(unsigned int)};
+    unsigned long long total = sizeof(ws);
+    for (int i = 0; i < 4; i++) {total += sizes[i];}
+
+    bool ok = send_header(fd, MSG_SCENE, total) && send_all(fd, &ws, sizeof(ws));
+    for (int i = 0; ok && i < 4; i++) {ok = sizes[i] == 0 || send_all(fd, parts[i], sizes[i]);}
+    return ok;
+}
+
+static void drop_conn(Farm* farm, int index, const char* reason)
+{
+    FarmConn* conn = &farm->conns[index];
+    if (conn->state == CONN_BUSY)
+    {
+        FarmTile* tile = &farm->tiles[conn->tile];
+        tile->copies--;
+        if (!tile->done && tile->copies == 0) {tile->lost = true;}
+        fprintf(stderr, "Lost a worker with tile %d: %s\n", conn->tile, reason);
+    }
+    else {fprintf(stderr, "Lost a worker: %s\n", reason);}
+    farm->stats.failed_workers++;
+
+    close(conn->fd);
+    free(conn->payload);
+    farm->conns[index] = farm->conns[--farm->num_conns];
+}
+
+// Next tile for an idle worker: the first one nobody has, else a backup copy of the tile that
+// has been running longest. -1 if there is nothing to do.
+static int pick_tile(const Farm* farm, bool* backup)
+{
+    int oldest = -1;
+    for (int t = 0; t < farm->num_tiles; t++)
+    {
+        const FarmTile* tile = &farm->tiles[t];
+        if (tile->done) {continue;}
+        if (tile->copies == 0)
+        {
+            *backup = false;
+            return t;
+        }
+        if (tile->copies == 1 && (oldest < 0 || tile->started < farm->tiles[oldest].started)) {oldest = t;}
+    }
+    *backup = true;
+    return farm->options->backups ? oldest : -1;
+}
+
+static bool assign_tile(Farm* farm, FarmConn* conn, double now)
+{
+    bool backup;
+    int t = pick_tile(farm, &backup);
+    if (t < 0) {return true;}
+
+    FarmTile* tile = &farm->tiles[t];
+    WireTile wt = {t, tile->rect.x0, tile->rect.y0, tile->rect.x1, tile->rect.y1, 1, farm->render->spp, 0};
+    if (!send_message(conn->fd, MSG_TILE, &wt, sizeof(wt))) {return false;}
+
+    if (backup) {farm->stats.backups++;}
+    else
+    {
+        if (tile->lost) {farm->stats.reissued++;}
+        tile->lost = false;
+        tile->started = now;
+    }
+    tile->copies++;
+    conn->state = CONN_BUSY;
+    conn->tile = t;
+    conn->since = now;
+    return true;
+}
+
+static bool handle_result(Farm* farm, FarmConn* conn)
+{
+    if (conn->header.size < sizeof(WireTile)) {return false;}
+    WireTile wt;
+    memcpy(&wt, conn->payload, sizeof(wt));
+    if (wt.id != conn->tile) {return false;}
+
+    FarmTile* tile = &farm->tiles[conn->tile];
+    int w = tile->rect.x1 - tile->rect.x0;
+    int h = tile->rect.y1 - tile->rect.y0;
+    if (conn->header.size != sizeof(WireTile) + (size_t)w * h * 3 * sizeof(float)) {return false;}
+
+    tile->copies--;
+    conn->state = CONN_IDLE;
+    if (tile->done)
+    {
+        farm->stats.wasted++;
+        return true;
+    }
+
+    const float* src = (const float*)(conn->payload + sizeof(WireTile));
+    for (int y = 0; y < h; y++)
+    {
+        float* dst = &farm->sums[3 * ((size_t)(tile->rect.y0 + y) * farm->render->width + tile->rect.x0)];
+        memcpy(dst, &src[(size_t)y * w * 3], (size_t)w * 3 * sizeof(float));
+    }
+    tile->done = true;
+    farm->tiles_done++;
+    return true;
+}
+
+static bool handle_message(Farm* farm, FarmConn* conn)
+{
+    switch (conn->header.type)
+    {
+    case MSG_HELLO:
+    {
+        WireHello hello;
+        if (conn->state != CONN_HELLO || conn->header.size != sizeof(hello)) {return false;}
+        memcpy(&hello, conn->payload, sizeof(hello));
+        if (hello.version != FARM_VERSION)
+        {
+            fprintf(stderr, "Worker speaks farm version %u, expected %d\n", hello.version, FARM_VERSION);
+            return false;
+        }
+        farm->stats.workers++;
+        conn->state = CONN_LOADING;
+        return send_scene(conn->fd, farm->scene, farm->render);
+    }
+    case MSG_READY:
+        if (conn->state != CONN_LOADING) {return false;}
+        conn->state = CONN_IDLE;
+        return true;
+    case MSG_RESULT:
+        return conn->state == CONN_BUSY && handle_result(farm, conn);
+    default:
+        return false;
+    }
+}
+
+// Everything the socket has, handling each complete message. false once the worker is gone
+// or talks nonsense.
+static bool conn_read(Farm* farm, FarmConn* conn)
+{
+    size_t max_size = sizeof(WireTile) + (size_t)farm->options->tile_size * farm->options->tile_size * 3 * sizeof(float);
+    while (true)
+    {
+        bool in_header = conn->received < sizeof(WireHeader);
+        char* dst = in_header ? (char*)&conn->header + conn->received : (char*)conn->payload + (conn->received - sizeof(WireHeader));
+        size_t want = in_header ? sizeof(WireHeader) - conn->received : sizeof(WireHeader) + conn->header.size - conn->received;
+
+        ssize_t n = want > 0 ? recv(conn->fd, dst, want, 0) : 0;
+        if (n < 0)
+        {
+            if (errno == EINTR) {continue;}
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (n == 0 && want > 0) {return false;}
+        conn->received += (size_t)n;
+
+        if (in_header && conn->received == sizeof(WireHeader))
+        {
+            if (conn->header.magic != FARM_MAGIC || conn->header.size > max_size) {return false;}
+            conn->payload = (unsigned char*)malloc(conn->header.size > 0 ? conn->header.size : 1);
+            if (conn->payload == NULL) {return false;}
+        }
+        if (conn->received == sizeof(WireHeader) + conn->header.size)
+        {
+            bool ok = handle_message(farm, conn);
+            free(conn->payload);
+            conn->payload = NULL;
+            conn->received = 0;
+            if (!ok) {return false;}
+        }
+    }
+}
+
+static void accept_conn(Farm* farm, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {return;}
+    if (farm->num_conns == FARM_MAX_WORKERS)
+    {
+        close(fd);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on unix sockets
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    FarmConn* conn = &farm->conns[farm->num_conns++];
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->state = CONN_HELLO;
+    conn->tile = -1;
+}
+
+bool farm_coordinate(int listen_fd, const Scene* scene, const FarmRender* render, const FarmOptions* options, RenderImage* image, FarmStats* stats)
+{
+    Farm farm;
+    memset(&farm, 0, sizeof(farm));
+    farm.scene = scene;
+    farm.render = render;
+    farm.options = options;
+
+    int tile_size = options->tile_size > 0 ? options->tile_size : FARM_TILE_SIZE;
+    int tiles_x = (render->width + tile_size - 1) / tile_size;
+    int tiles_y = (render->height + tile_size - 1) / tile_size;
+    farm.num_tiles = tiles_x * tiles_y;
+    FarmOptions tile_options = *options;
+    tile_options.tile_size = tile_size;
+    farm.options = &tile_options;
+
+    farm.tiles = (FarmTile*)calloc((size_t)farm.num_tiles, sizeof(FarmTile));
+    farm.sums = (float*)calloc((size_t)render->width * render->height * 3, sizeof(float));
+    farm.conns = (FarmConn*)malloc(FARM_MAX_WORKERS * sizeof(FarmConn));
+    struct pollfd* fds = (struct pollfd*)malloc((FARM_MAX_WORKERS + 1) * sizeof(struct pollfd));
+    bool ok = farm.tiles != NULL && farm.sums != NULL && farm.conns != NULL && fds != NULL && render->spp > 0;
+    if (!ok) {fprintf(stderr, "Memory allocation failed for the farm\n");}
+
+    for (int t = 0; ok && t < farm.num_tiles; t++)
+    {
+        int x0 = (t % tiles_x) * tile_size, y0 = (t / tiles_x) * tile_size;
+        farm.tiles[t].rect = (ParallelTile){x0, y0, x0 + tile_size < render->width ? x0 + tile_size : render->width,
+            y0 + tile_size < render->height ? y0 + tile_size : render->height};
+    }
+
+    double start = timer_seconds(), last_worker = start;
+    while (ok && farm.tiles_done < farm.num_tiles)
+    {
+        double now = timer_seconds();
+        for (int i = farm.num_conns - 1; i >= 0; i--)
+        {
+            FarmConn* conn = &farm.conns[i];
+            if (conn->state == CONN_IDLE && !assign_tile(&farm, conn, now)) {drop_conn(&farm, i, "send failed");}
+            else if (conn->state == CONN_BUSY && options->tile_timeout > 0.0 && now - conn->since > options->tile_timeout)
+            {
+                drop_conn(&farm, i, "tile timed out");
+            }
+        }
+
+        if (farm.num_conns > 0) {last_worker = now;}
+        else if (now - last_worker > options->wait_timeout)
+        {
+            fprintf(stderr, "No workers for %.0f s, giving up with %d of %d tiles done\n", options->wait_timeout, farm.tiles_done, farm.num_tiles);
+            ok = false;
+            break;
+        }
+
+        fds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+        for (int i = 0; i < farm.num_conns; i++) {fds[i + 1] = (struct pollfd){farm.conns[i].fd, POLLIN, 0};}
+        int ready = poll(fds, (nfds_t)farm.num_conns + 1, 100);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            ok = false;
+        }
+        if (ready <= 0) {continue;}
+
+        // Backwards, so dropping a connection only moves one that was already read
+        for (int i = farm.num_conns - 1; i >= 0; i--)
+        {
+            if (fds[i + 1].revents != 0 && !conn_read(&farm, &farm.conns[i])) {drop_conn(&farm, i, "connection closed");}
+        }
+        if (fds[0].revents & POLLIN) {accept_conn(&farm, listen_fd);}
+    }
+    farm.stats.tiles = farm.num_tiles;
+    farm.stats.seconds = timer_seconds() - start;
+
+    for (int i = 0; i < farm.num_conns; i++)
+    {
+        if (ok) {send_header(farm.conns[i].fd, MSG_DONE, 0);}
+        close(farm.conns[i].fd);
+        free(farm.conns[i].payload);
+    }
+    farm_close(listen_fd);
+
+    if (ok) {render_image_set_sums(image, farm.sums, render->spp);}
+    if (stats != NULL) {*stats = farm.stats;}
+
+    free(fds);
+    free(farm.conns);
+    free(farm.sums);
+    free(farm.tiles);
+    return ok;
+}
+
+// Worker
+
+typedef struct
+{
+    Scene scene;
+    BVH bvh;
+    WideBVH wide;
+    RenderSettings settings;
+    int width, height;
+    bool loaded;
+} FarmWorker;
+
+static void worker_free(FarmWorker* worker)
+{
+    if (worker->settings.wide != NULL) {bvh_wide_free(&worker->wide);}
+    if (worker->loaded) {bvh_free(&worker->bvh);}
+    scene_free(&worker->scene);
+}
+
+static void* copy_part(const unsigned char** src, size_t size)
+{
+    void* dst = malloc(size > 0 ? size : 1);
+    if (dst != NULL) {memcpy(dst, *src, size);}
+    *src += size;
+    return dst;
+}
+
+static bool worker_load(FarmWorker* worker, const unsigned char* payload, unsigned long long size, int threads)
+{
+    WireScene ws;
+    if (worker->loaded || size < sizeof(ws)) {return false;}
+    memcpy(&ws, payload, sizeof(ws));
+    if (ws.width <= 0 || ws.height <= 0 || ws.num_spheres > size || ws.num_materials > size || ws.num_vertices > size || ws.num_indices > size)
+    {
+        return false;
+    }
+    size_t sizes[4] = {ws.num_spheres * sizeof(Sphere), ws.num_materials * sizeof(Material), ws.num_vertices * sizeof(float),
+        ws.num_indices * sizeof(unsigned int)};
+    if (size != sizeof(ws) + sizes[0] + sizes[1] + sizes[2] + sizes[3]) {return false;}
+
+    Scene* scene = &worker->scene;
+    const unsigned char* src = payload + sizeof(ws);
+    scene->spheres = (Sphere*)copy_part(&src, sizes[0]);
+    scene->num_spheres = ws.num_spheres;
+    scene->materials = (Material*)copy_part(&src, sizes[1]);
+    scene->num_materials = ws.num_materials;
+    if (ws.num_indices > 0)
+    {
+        scene->mesh.vertices = (float*)copy_part(&src, sizes[2]);
+        scene->mesh.num_vertices = ws.num_vertices;
+        scene->mesh.indices = (unsigned int*)copy_part(&src, sizes[3]);
+        scene->mesh.num_indices = ws.num_indices;
+    }
+    scene->accel = SCENE_ACCEL_BVH;
+    if (scene->spheres == NULL || scene->materials == NULL || (ws.num_indices > 0 && (scene->mesh.vertices == NULL || scene->mesh.indices == NULL)))
+    {
+        fprintf(stderr, "Memory allocation failed for scene\n");
+        return false;
+    }
+    for (size_t i = 0; i < scene->num_spheres; i++)
+    {
+        if (scene->spheres[i].material_index < 0 || (size_t)scene->spheres[i].material_index >= scene->num_materials) {return false;}
+    }
+    // Every triangle is shaded with material RENDER_TRIANGLE_MATERIAL
+    if (scene->mesh.num_indices > 0 && scene->num_materials <= RENDER_TRIANGLE_MATERIAL) {return false;}
+    for (size_t i = 0; i < scene->mesh.num_indices; i++)
+    {
+        if (scene->mesh.indices[i] >= scene->mesh.num_vertices / 3) {return false;}
+    }
+    if (ws.tri_records && !scene_build_tri_records(scene)) {return false;}
+
+    double start = timer_seconds();
+    if (!bvh_build(&worker->bvh, scene, ws.treelet)) {return false;}
+    worker->loaded = true;
+    if (ws.wide_width > 0)
+    {
+        if (!bvh_wide_build(&worker->wide, &worker->bvh, ws.wide_width) || !bvh_wide_build_blocks(&worker->wide, scene))
+        {
+            bvh_wide_free(&worker->wide);
+            return false;
+        }
+        worker->settings.wide = &worker->wide;
+    }
+    fprintf(stderr, "Worker built the BVH over %zu prims in %.1f ms\n", worker->bvh.num_prims, (timer_seconds() - start) * 1e3);
+
+    worker->settings.camera = ws.camera;
+    worker->settings.light_sampling = ws.light_sampling != 0;
+    worker->settings.threads = threads;
+    worker->settings.packet_bounces = ws.packet_bounces;
+    worker->settings.wavefront = ws.wavefront != 0;
+    worker->settings.seed_offset = ws.seed_offset;
+    worker->settings.kernel = render_kernel_select(scene);
+    worker->width = ws.width;
+    worker->height = ws.height;
+    return true;
+}
+
+// Size a coordinator message of this type can have, checked before anything is allocated for it.
+// Only a scene may be big.
+static bool worker_message_fits(const WireHeader* header)
+{
+    if (header->magic != FARM_MAGIC) {return false;}
+    switch (header->type)
+    {
+    case MSG_SCENE: return header->size >= sizeof(WireScene) && header->size <= FARM_MAX_SCENE;
+    case MSG_TILE: return header->size == sizeof(WireTile);
+    case MSG_DONE: return header->size == 0;
+    default: return false;
+    }
+}
+
+// Render the tile and send its sums, false if the tile is bad or the send fails
+static bool worker_tile(FarmWorker* worker, int fd, const unsigned char* payload, unsigned long long size, int delay_ms)
+{
+    WireTile wt;
+    if (!worker->loaded || size != sizeof(wt)) {return false;}
+    memcpy(&wt, payload, sizeof(wt));
+    if (wt.x0 < 0 || wt.y0 < 0 || wt.x1 > worker->width || wt.y1 > worker->height || wt.x0 >= wt.x1 || wt.y0 >= wt.y1 || wt.num_frames < 1)
+    {
+        return false;
+    }
+
+    size_t result_size = sizeof(wt) + (size_t)(wt.x1 - wt.x0) * (wt.y1 - wt.y0) * 3 * sizeof(float);
+    unsigned char* result = (unsigned char*)calloc(result_size, 1);
+    if (result == NULL) {return false;}
+    memcpy(result, &wt, sizeof(wt));
+
+    render_region(&worker->scene, &worker->bvh, &worker->settings, worker->width, worker->height, (ParallelTile){wt.x0, wt.y0, wt.x1, wt.y1},
+        wt.first_frame, wt.num_frames, (float*)(result + sizeof(wt)));
+    if (delay_ms > 0)
+    {
+        struct timespec ts = {delay_ms / 1000, (long)(delay_ms % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    bool ok = send_message(fd, MSG_RESULT, result, result_size);
+    free(result);
+    return ok;
+}
+
+bool farm_work(const char* address, const FarmWorkerOptions* options)
+{
+    int fd;
+    double start = timer_seconds();
+    while ((fd = farm_socket(address, false)) < 0)
+    {
+        if (errno == EINVAL || errno == ENAMETOOLONG || timer_seconds() - start > FARM_CONNECT_SECONDS)
+        {
+            fprintf(stderr, "Failed to connect to %s: %s\n", address, strerror(errno));
+            return false;
+        }
+        struct timespec ts = {0, 100000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    FarmWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    WireHello hello = {FARM_VERSION, options->threads > 0 ? options->threads : parallel_thread_count()};
+    bool ok = send_message(fd, MSG_HELLO, &hello, sizeof(hello));
+    bool done = false;
+    int tiles = 0;
+
+    while (ok && !done)
+    {
+        WireHeader header;
+        if (!recv_all(fd, &header, sizeof(header)))
+        {
+            fprintf(stderr, "Lost the coordinator\n");
+            ok = false;
+            break;
+        }
+        unsigned char* payload = worker_message_fits(&header) ? (unsigned char*)malloc(header.size > 0 ? header.size : 1) : NULL;
+        if (payload == NULL || !recv_all(fd, payload, header.size))
+        {
+            fprintf(stderr, "Bad message from the coordinator\n");
+            free(payload);
+            ok = false;
+            break;
+        }
+
+        switch (header.type)
+        {
+        case MSG_SCENE:
+            ok = worker_load(&worker, payload, header.size, options->threads);
+            if (!ok) {fprintf(stderr, "Failed to load the farm scene\n");}
+            ok = ok && send_header(fd, MSG_READY, 0);
+            break;
+        case MSG_TILE:
+            if (options->fail_after > 0 && ++tiles > options->fail_after)
+            {
+                fprintf(stderr, "Worker dropping its connection after %d tiles\n", options->fail_after);
+                ok = false;
+                break;
+            }
+            ok = worker_tile(&worker, fd, payload, header.size, options->delay_ms);
+            break;
+        case MSG_DONE:
+            done = true;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        free(payload);
+    }
+
+    close(fd);
+    worker_free(&worker);
+    return ok;
+}
+
+#endif
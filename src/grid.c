@@ -0,0 +1,408 @@
+#include "grid.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    AABB box;
+    float diagonal;
+    unsigned int ref;
+} GridPrim;
+
+typedef struct
+{
+    int cell[3];
+    int step[3];
+    float t_next[3];
+    float t_delta[3];
+} Dda;
+
+static unsigned int float_bits(float f)
+{
+    union {float f; unsigned int u;} bits = {f};
+    return bits.u;
+}
+
+static float bits_float(unsigned int u)
+{
+    union {unsigned int u; float f;} bits = {u};
+    return bits.f;
+}
+
+static int clamp_int(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static int compare_by_diagonal(const void* a, const void* b)
+{
+    float da = ((const GridPrim*)a)->diagonal;
+    float db = ((const GridPrim*)b)->diagonal;
+    return (da > db) - (da < db);
+}
+
+// Same rule as the BVH: prims that dwarf everything smaller than them combined are not binned
+static int separate_large_prims(GridPrim* prims, int count)
+{
+    if (count < 2) {return 0;}
+
+    qsort(prims, count, sizeof(GridPrim), compare_by_diagonal);
+
+    AABB* prefix = (AABB*)malloc(count * sizeof(AABB));
+    if (prefix == NULL) {return 0;}
+
+    AABB box = aabb_empty();
+    for (int i = 0; i < count; i++)
+    {
+        box = aabb_union(box, prims[i].box);
+        prefix[i] = box;
+    }
+
+    int large = 0;
+    for (int i = count - 1; i > 0 && large < BVH_MAX_LARGE_PRIMS; i--)
+    {
+        if (prims[i].diagonal <= BVH_LARGE_PRIM_FACTOR * v3_length(aabb_extent(prefix[i - 1]))) {break;}
+        large++;
+    }
+
+    free(prefix);
+    return large;
+}
+
+// Resolution for count prims in a box of the given extent at density cells per prim
+static void grid_resolution(Vec3 extent, int count, float density, int max_dim, int dims[3])
+{
+    float volume = extent.x * extent.y * extent.z;
+    float k = cbrtf(density * count / (volume > 0.0f ? volume : 1e-30f));
+    for (int a = 0; a < 3; a++) {dims[a] = clamp_int((int)(v3_axis(extent, a) * k), 1, max_dim);}
+}
+
+// Cells of a dims grid at origin that a box overlaps, inclusive
+static void cell_range(AABB box, Vec3 origin, Vec3 inv_size, const int dims[3], int lo[3], int hi[3])
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float o = v3_axis(origin, a), s = v3_axis(inv_size, a);
+        lo[a] = clamp_int((int)floorf((v3_axis(box.min, a) - o) * s), 0, dims[a] - 1);
+        hi[a] = clamp_int((int)floorf((v3_axis(box.max, a) - o) * s), 0, dims[a] - 1);
+    }
+}
+
+static Vec3 v3_inv(Vec3 a) {return v3(1.0f / a.x, 1.0f / a.y, 1.0f / a.z);}
+
+bool grid_build(Grid* grid, const Scene* scene)
+{
+    memset(grid, 0, sizeof(*grid));
+
+    size_t num_tris = scene_num_triangles(scene);
+    int count = (int)(scene->num_spheres + num_tris);
+
+    GridPrim* prims = (GridPrim*)malloc((count > 0 ? count : 1) * sizeof(GridPrim));
+    if (prims == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for grid\n");
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int ref = (size_t)i < scene->num_spheres ? prim_ref_sphere(i) : prim_ref_triangle(i - (unsigned int)scene->num_spheres);
+        AABB box = prim_ref_bounds(scene, ref);
+        prims[i] = (GridPrim){box, v3_length(aabb_extent(box)), ref};
+    }
+
+    int large = separate_large_prims(prims, count);
+    int regular = count - large;
+
+    // Scene box of the binned prims, padded so flat scenes still have volume and prims on the
+    // boundary don't round out of it
+    AABB bounds = aabb_empty();
+    for (int i = 0; i < regular; i++) {bounds = aabb_union(bounds, prims[i].box);}
+    if (regular == 0) {bounds = (AABB){v3(0.0f, 0.0f, 0.0f), v3(0.0f, 0.0f, 0.0f)};}
+    Vec3 extent = aabb_extent(bounds);
+    float pad = 1e-4f * fmaxf(fmaxf(extent.x, extent.y), fmaxf(extent.z, 1e-3f));
+    bounds.min = v3_sub(bounds.min, v3(pad, pad, pad));
+    bounds.max = v3_add(bounds.max, v3(pad, pad, pad));
+    extent = aabb_extent(bounds);
+
+    int dims[3];
+    grid_resolution(extent, regular, GRID_TOP_DENSITY, GRID_MAX_TOP_DIM, dims);
+    Vec3 cell_size = v3(extent.x / dims[0], extent.y / dims[1], extent.z / dims[2]);
+    Vec3 inv_cell = v3_inv(cell_size);
+    int num_top = dims[0] * dims[1] * dims[2];
+
+    // Top level binning: count, prefix sum, fill
+    int* top_start = (int*)calloc(num_top + 1, sizeof(int));
+    int* sub_dims = (int*)malloc(num_top * 3 * sizeof(int));
+    int* leaf_start = (int*)malloc((num_top + 1) * sizeof(int));
+    if (top_start == NULL || sub_dims == NULL || leaf_start == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for grid\n");
+        free(prims); free(top_start); free(sub_dims); free(leaf_start);
+        return false;
+    }
+
+    int lo[3], hi[3];
+    for (int i = 0; i < regular; i++)
+    {
+        cell_range(prims[i].box, bounds.min, inv_cell, dims, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++) {top_start[x + dims[0] * (y + dims[1] * z) + 1]++;}
+    }
+    for (int c = 0; c < num_top; c++) {top_start[c + 1] += top_start[c];}
+
+    int* top_refs = (int*)malloc((top_start[num_top] > 0 ? top_start[num_top] : 1) * sizeof(int));
+    int* fill = (int*)malloc(num_top * sizeof(int));
+    if (top_refs == NULL || fill == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for grid\n");
+        free(prims); free(top_start); free(sub_dims); free(leaf_start); free(top_refs); free(fill);
+        return false;
+    }
+    memcpy(fill, top_start, num_top * sizeof(int));
+
+    for (int i = 0; i < regular; i++)
+    {
+        cell_range(prims[i].box, bounds.min, inv_cell, dims, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+                for (int x = lo[0]; x <= hi[0]; x++) {top_refs[fill[x + dims[0] * (y + dims[1] * z)]++] = i;}
+    }
+
+    // Sub grid resolution per top cell from its own prim count
+    leaf_start[0] = 0;
+    for (int c = 0; c < num_top; c++)
+    {
+        int k = top_start[c + 1] - top_start[c];
+        int* d = sub_dims + 3 * c;
+        if (k == 0) {d[0] = d[1] = d[2] = 0;}
+        else {grid_resolution(cell_size, k, GRID_CELL_DENSITY, GRID_MAX_SUB_DIM, d);}
+        leaf_start[c + 1] = leaf_start[c] + d[0] * d[1] * d[2];
+    }
+    int num_cells = leaf_start[num_top];
+
+    // Second level binning, one top cell at a time
+    int* cell_count = (int*)calloc(num_cells + 1, sizeof(int));
+    if (cell_count == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for grid\n");
+        free(prims); free(top_start); free(sub_dims); free(leaf_start); free(top_refs); free(fill);
+        return false;
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int c = 0; c < num_top; c++)
+        {
+            const int* d = sub_dims + 3 * c;
+            if (d[0] == 0) {continue;}
+
+            int cx = c % dims[0], cy = (c / dims[0]) % dims[1], cz = c / (dims[0] * dims[1]);
+            Vec3 origin = v3_add(bounds.min, v3_mul(v3((float)cx, (float)cy, (float)cz), cell_size));
+            Vec3 inv_sub = v3_inv(v3(cell_size.x / d[0], cell_size.y / d[1], cell_size.z / d[2]));
+
+            for (int r = top_start[c]; r < top_start[c + 1]; r++)
+            {
+                const GridPrim* prim = &prims[top_refs[r]];
+                cell_range(prim->box, origin, inv_sub, d, lo, hi);
+                for (int z = lo[2]; z <= hi[2]; z++)
+                    for (int y = lo[1]; y <= hi[1]; y++)
+                        for (int x = lo[0]; x <= hi[0]; x++)
+                        {
+                            int leaf = leaf_start[c] + x + d[0] * (y + d[1] * z);
+                            if (pass == 0) {cell_count[leaf + 1]++;}
+                            else {grid->refs[large + cell_count[leaf]++] = prim->ref;}
+                        }
+            }
+        }
+
+        if (pass == 0)
+        {
+            for (int i = 0; i < num_cells; i++) {cell_count[i + 1] += cell_count[i];}
+
+            grid->num_refs = (size_t)large + cell_count[num_cells];
+            grid->data_size = GRID_HEADER_SIZE + 2 * (size_t)num_top + 2 * (size_t)num_cells;
+            grid->refs = (unsigned int*)malloc((grid->num_refs > 0 ? grid->num_refs : 1) * sizeof(unsigned int));
+            grid->data = (unsigned int*)calloc(grid->data_size, sizeof(unsigned int));
+            if (grid->refs == NULL || grid->data == NULL)
+            {
+                fprintf(stderr, "Memory allocation failed for grid\n");
+                free(prims); free(top_start); free(sub_dims); free(leaf_start); free(top_refs); free(fill); free(cell_count);
+                grid_free(grid);
+                return false;
+            }
+
+            // Leaf cells record their range before the fill pass moves cell_count to the ends
+            unsigned int* cells = grid->data + GRID_HEADER_SIZE + 2 * num_top;
+            for (int i = 0; i < num_cells; i++)
+            {
+                cells[2 * i] = (unsigned int)(large + cell_count[i]);
+                cells[2 * i + 1] = (unsigned int)(cell_count[i + 1] - cell_count[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < large; i++) {grid->refs[i] = prims[regular + i].ref;}
+
+    unsigned int* header = grid->data;
+    for (int a = 0; a < 3; a++)
+    {
+        header[GRID_HEADER_MIN + a] = float_bits(v3_axis(bounds.min, a));
+        header[GRID_HEADER_MAX + a] = float_bits(v3_axis(bounds.max, a));
+        header[GRID_HEADER_CELL + a] = float_bits(v3_axis(cell_size, a));
+        header[GRID_HEADER_DIMS + a] = (unsigned int)dims[a];
+    }
+    header[GRID_HEADER_NUM_LARGE] = (unsigned int)large;
+    header[GRID_HEADER_TOP] = GRID_HEADER_SIZE;
+    header[GRID_HEADER_CELLS] = GRID_HEADER_SIZE + 2 * num_top;
+
+    unsigned int* top = grid->data + GRID_HEADER_SIZE;
+    for (int c = 0; c < num_top; c++)
+    {
+        const int* d = sub_dims + 3 * c;
+        top[2 * c] = (unsigned int)leaf_start[c];
+        top[2 * c + 1] = (unsigned int)(d[0] | d[1] << 8 | d[2] << 16);
+    }
+
+    free(prims); free(top_start); free(sub_dims); free(leaf_start); free(top_refs); free(fill); free(cell_count);
+    return true;
+}
+
+void grid_free(Grid* grid)
+{
+    free(grid->data);
+    free(grid->refs);
+    memset(grid, 0, sizeof(*grid));
+}
+
+// Amanatides-Woo setup for a dims grid at origin, starting at the ray point at t. The start cell
+// is clamped so rounding at the entry point can't put it outside.
+static void dda_init(Dda* dda, Vec3 origin, Vec3 size, const int dims[3], Vec3 ro, Vec3 rd, Vec3 inv_rd, float t)
+{
+    Vec3 p = v3_add(ro, v3_scale(rd, t));
+    for (int a = 0; a < 3; a++)
+    {
+        float o = v3_axis(origin, a), s = v3_axis(size, a), d = v3_axis(rd, a), inv = v3_axis(inv_rd, a);
+        dda->cell[a] = clamp_int((int)floorf((v3_axis(p, a) - o) / s), 0, dims[a] - 1);
+        dda->step[a] = d > 0.0f ? 1 : (d < 0.0f ? -1 : 0);
+        dda->t_delta[a] = fabsf(s * inv);
+        dda->t_next[a] = dda->step[a] == 0 ? 1e30f : (o + (dda->cell[a] + (dda->step[a] > 0)) * s - v3_axis(ro, a)) * inv;
+    }
+}
+
+static float dda_exit(const Dda* dda)
+{
+    return fminf(fminf(dda->t_next[0], dda->t_next[1]), dda->t_next[2]);
+}
+
+// Step into the next cell, false once the ray leaves the grid
+static bool dda_step(Dda* dda, const int dims[3])
+{
+    int a = dda->t_next[0] < dda->t_next[1] ? (dda->t_next[0] < dda->t_next[2] ? 0 : 2) : (dda->t_next[1] < dda->t_next[2] ? 1 : 2);
+    dda->cell[a] += dda->step[a];
+    dda->t_next[a] += dda->t_delta[a];
+    return dda->cell[a] >= 0 && dda->cell[a] < dims[a];
+}
+
+// Test refs [first, first + count), closest hit or any hit below hit->t
+static bool test_refs(const Grid* grid, const Scene* scene, unsigned int first, unsigned int count, Vec3 ro, Vec3 rd, bool any_hit, Hit* hit, TraversalStats* stats)
+{
+    for (unsigned int i = first; i < first + count; i++)
+    {
+        unsigned int ref = grid->refs[i];
+        float t = prim_ref_intersect(scene, ref, ro, rd);
+        if (stats) {stats->prims_tested++;}
+
+        if (t > HIT_EPSILON && t < hit->t)
+        {
+            hit->t = t;
+            hit->index = (int)prim_ref_index(ref);
+            hit->type = prim_ref_is_triangle(ref) ? HIT_TRIANGLE : HIT_SPHERE;
+            if (any_hit) {return true;}
+        }
+    }
+    return false;
+}
+
+// Both levels of DDA. Cells are visited front to back, so a hit inside the current cell ends
+// the walk. Prims spanning several cells are simply tested again (no mailboxing).
+static bool grid_walk(const Grid* grid, const Scene* scene, Vec3 ro, Vec3 rd, bool any_hit, Hit* hit, TraversalStats* stats)
+{
+    const unsigned int* header = grid->data;
+    if (test_refs(grid, scene, 0, header[GRID_HEADER_NUM_LARGE], ro, rd, any_hit, hit, stats)) {return true;}
+
+    AABB bounds = {v3(bits_float(header[GRID_HEADER_MIN]), bits_float(header[GRID_HEADER_MIN + 1]), bits_float(header[GRID_HEADER_MIN + 2])),
+        v3(bits_float(header[GRID_HEADER_MAX]), bits_float(header[GRID_HEADER_MAX + 1]), bits_float(header[GRID_HEADER_MAX + 2]))};
+    Vec3 cell_size = v3(bits_float(header[GRID_HEADER_CELL]), bits_float(header[GRID_HEADER_CELL + 1]), bits_float(header[GRID_HEADER_CELL + 2]));
+    int dims[3] = {(int)header[GRID_HEADER_DIMS], (int)header[GRID_HEADER_DIMS + 1], (int)header[GRID_HEADER_DIMS + 2]};
+    const unsigned int* top = grid->data + header[GRID_HEADER_TOP];
+    const unsigned int* cells = grid->data + header[GRID_HEADER_CELLS];
+
+    Vec3 inv_rd = ray_inv_dir(rd);
+    Vec3 t1 = v3_mul(v3_sub(bounds.min, ro), inv_rd);
+    Vec3 t2 = v3_mul(v3_sub(bounds.max, ro), inv_rd);
+    float t_enter = fmaxf(fmaxf(fmaxf(fminf(t1.x, t2.x), fminf(t1.y, t2.y)), fminf(t1.z, t2.z)), 0.0f);
+    float t_exit = fminf(fminf(fmaxf(t1.x, t2.x), fmaxf(t1.y, t2.y)), fmaxf(t1.z, t2.z));
+    if (t_enter > t_exit || t_enter >= hit->t) {return false;}
+
+    Dda outer;
+    dda_init(&outer, bounds.min, cell_size, dims, ro, rd, inv_rd, t_enter);
+    while (true)
+    {
+        int c = outer.cell[0] + dims[0] * (outer.cell[1] + dims[1] * outer.cell[2]);
+        float cell_exit = dda_exit(&outer);
+        unsigned int packed = top[2 * c + 1];
+        if (stats)
+        {
+            stats->nodes_visited++;
+            stats->bytes_fetched += 2 * sizeof(unsigned int);
+        }
+
+        if (packed != 0)
+        {
+            int sub_dims[3] = {(int)(packed & 0xffu), (int)((packed >> 8) & 0xffu), (int)((packed >> 16) & 0xffu)};
+            Vec3 origin = v3_add(bounds.min, v3_mul(v3((float)outer.cell[0], (float)outer.cell[1], (float)outer.cell[2]), cell_size));
+            Vec3 sub_size = v3(cell_size.x / sub_dims[0], cell_size.y / sub_dims[1], cell_size.z / sub_dims[2]);
+            float sub_end = fminf(cell_exit, hit->t);
+
+            Dda inner;
+            dda_init(&inner, origin, sub_size, sub_dims, ro, rd, inv_rd, t_enter);
+            while (true)
+            {
+                unsigned int leaf = top[2 * c] + inner.cell[0] + sub_dims[0] * (inner.cell[1] + sub_dims[1] * inner.cell[2]);
+                if (stats)
+                {
+                    stats->nodes_visited++;
+                    stats->bytes_fetched += 2 * sizeof(unsigned int);
+                }
+                if (test_refs(grid, scene, cells[2 * leaf], cells[2 * leaf + 1], ro, rd, any_hit, hit, stats)) {return true;}
+
+                float leaf_exit = dda_exit(&inner);
+                if (hit->t <= leaf_exit || leaf_exit >= sub_end || !dda_step(&inner, sub_dims)) {break;}
+            }
+        }
+
+        if (hit->t <= cell_exit || cell_exit >= t_exit) {break;}
+        t_enter = cell_exit;
+        if (!dda_step(&outer, dims)) {break;}
+    }
+    return hit->type != HIT_NONE;
+}
+
+bool grid_intersect(const Grid* grid, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    *hit = hit_none();
+    if (grid->data == NULL) {return false;}
+    return grid_walk(grid, scene, ro, rd, false, hit, stats);
+}
+
+bool grid_occluded(const Grid* grid, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    if (grid->data == NULL) {return false;}
+
+    Hit hit = {t_max, -1, HIT_NONE};
+    return grid_walk(grid, scene, ro, rd, true, &hit, stats);
+}
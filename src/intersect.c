@@ -0,0 +1,96 @@
+#include "intersect.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+float hit_sphere(const Sphere* s, Vec3 ro, Vec3 rd)
+{
+    Vec3 oc = v3_sub(ro, v3(s->px, s->py, s->pz));
+    float b = v3_dot(oc, rd);
+    float c = v3_dot(oc, oc) - s->radius * s->radius;
+    float h = b * b - c; // a = dot(rd, rd) = 1
+
+    if (h < 0.0f) {return -1.0f;}
+
+    return -b - sqrtf(h);
+}
+
+float hit_triangle(Vec3 v0, Vec3 edge1, Vec3 edge2, Vec3 ro, Vec3 rd)
+{
+    Vec3 h = v3_cross(rd, edge2);
+    float a = v3_dot(edge1, h);
+
+    // Parallel check
+    if (a > -0.001f && a < 0.001f) {return -1.0f;}
+
+    float f = 1.0f / a;
+    Vec3 s = v3_sub(ro, v0);
+    float u = f * v3_dot(s, h);
+
+    if (u < 0.0f || u > 1.0f) {return -1.0f;}
+
+    Vec3 q = v3_cross(s, edge1);
+    float v = f * v3_dot(rd, q);
+
+    if (v < 0.0f || u + v > 1.0f) {return -1.0f;}
+
+    float t = f * v3_dot(edge2, q);
+
+    if (t > HIT_EPSILON) {return t;}
+    return -1.0f;
+}
+
+float hit_triangle_indexed(const MeshData* mesh, int tri_index, Vec3 ro, Vec3 rd)
+{
+    const unsigned int* idx = mesh->indices + 3 * tri_index;
+    Vec3 v0 = mesh_vertex(mesh, idx[0]);
+    Vec3 v1 = mesh_vertex(mesh, idx[1]);
+    Vec3 v2 = mesh_vertex(mesh, idx[2]);
+
+    return hit_triangle(v0, v3_sub(v1, v0), v3_sub(v2, v0), ro, rd);
+}
+
+float hit_tri_record(const TriRecord* rec, Vec3 ro, Vec3 rd)
+{
+    return hit_triangle(v3(rec->v0x, rec->v0y, rec->v0z), v3(rec->e1x, rec->e1y, rec->e1z), v3(rec->e2x, rec->e2y, rec->e2z), ro, rd);
+}
+
+TriRecord* tri_records_build(const MeshData* mesh)
+{
+    size_t count = mesh->num_indices / 3;
+    TriRecord* records = (TriRecord*)malloc((count > 0 ? count : 1) * sizeof(TriRecord));
+    if (records == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for triangle records\n");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const unsigned int* idx = mesh->indices + 3 * i;
+        Vec3 v0 = mesh_vertex(mesh, idx[0]);
+        Vec3 e1 = v3_sub(mesh_vertex(mesh, idx[1]), v0);
+        Vec3 e2 = v3_sub(mesh_vertex(mesh, idx[2]), v0);
+        Vec3 n = v3_normalize(v3_cross(e1, e2));
+
+        records[i] = (TriRecord){v0.x, v0.y, v0.z, n.x, e1.x, e1.y, e1.z, n.y, e2.x, e2.y, e2.z, n.z};
+    }
+    return records;
+}
+
+AABB sphere_bounds(const Sphere* s)
+{
+    Vec3 c = v3(s->px, s->py, s->pz);
+    Vec3 r = v3(s->radius, s->radius, s->radius);
+    return (AABB){v3_sub(c, r), v3_add(c, r)};
+}
+
+AABB triangle_bounds(const MeshData* mesh, int tri_index)
+{
+    const unsigned int* idx = mesh->indices + 3 * tri_index;
+    AABB box = aabb_empty();
+    box = aabb_grow(box, mesh_vertex(mesh, idx[0]));
+    box = aabb_grow(box, mesh_vertex(mesh, idx[1]));
+    box = aabb_grow(box, mesh_vertex(mesh, idx[2]));
+    return box;
+}
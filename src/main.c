@@ -1,12 +1,25 @@
 #include <glad/glad.h>
 #include <glfw3.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <math.h>
 
 #include "struct.h"
 #include "file_util.h"
 #include "obj_loader.h"
+#include "scene.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "bvh_compressed.h"
+#include "bvh_stackless.h"
+#include "grid.h"
+#include "bvh_dynamic.h"
+#include "bvh_lazy.h"
+#include "bvh_cache.h"
+#include "parallel.h"
+#include "camera.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926
@@ -52,6 +65,17 @@ void calculateCameraVectors(Camera* camera, float* forwardX, float* forwardZ, fl
     *rightZ = sin(yawRads + radians(90.0f));
 }
 
+// Scene edits in --dynamic mode, applied once per frame by ApplySceneEdits
+bool g_pendingAddSphere = false;
+bool g_pendingRemoveSphere = false;
+
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS) {return;}
+    if (key == GLFW_KEY_N) {g_pendingAddSphere = true;}
+    if (key == GLFW_KEY_X) {g_pendingRemoveSphere = true;}
+}
+
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 {
     if (g_firstMouse)
@@ -129,15 +153,26 @@ bool processInput(GLFWwindow* window)
     return moved;
 }
 
-GLuint CompileShader(const char* filename, GLenum type)
+// Compile time options, inserted right after the #version line
+char g_shaderDefines[256] = "";
+
+GLuint CompileShader(const char* filename, GLenum type, const char* defines)
 {
 
     char* source = ReadFileToString(filename);
     if (source == NULL) {return 0;}
 
+    // #version has to stay the first line
+    char* body = strchr(source, '\n');
+    body = body ? body + 1 : source + strlen(source);
+
+    const char* parts[3] = {source, defines, body};
+    GLint lengths[3] = {(GLint)(body - source), (GLint)strlen(defines), -1};
+
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, (const char* const*)&source, NULL);
+    glShaderSource(shader, 3, parts, lengths);
     glCompileShader(shader);
+    free(source);
 
     GLint success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
@@ -154,8 +189,8 @@ GLuint CompileShader(const char* filename, GLenum type)
 
 GLuint CreateShaderProgram()
 {
-    GLuint vertexShader = CompileShader("shaders/fullscreen.vert", GL_VERTEX_SHADER);
-    GLuint fragmentShader = CompileShader("shaders/raytrace.frag", GL_FRAGMENT_SHADER);
+    GLuint vertexShader = CompileShader("shaders/fullscreen.vert", GL_VERTEX_SHADER, "");
+    GLuint fragmentShader = CompileShader("shaders/raytrace.frag", GL_FRAGMENT_SHADER, g_shaderDefines);
 
     if (vertexShader == 0 || fragmentShader == 0) {return 0;}
 
@@ -220,70 +255,538 @@ void SetupAccumulationBuffers(int width, int height)
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-Material g_materials[] =
+// SSBO binding points, must match raytrace.frag
+enum
 {
-    // Matte Green 0
-    {0.2f, 1.0f, 0.2f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f}, 
+    BINDING_SPHERES = 0,
+    BINDING_MATERIALS = 1,
+    BINDING_VERTICES = 2,
+    BINDING_INDICES = 3,
+    BINDING_BVH_NODES = 4,
+    BINDING_BVH_PRIMS = 5,
+    BINDING_WIDE_BVH = 6,
+    BINDING_COMPRESSED_BVH = 7,
+    BINDING_TRI_RECORDS = 8,
+    BINDING_GRID = 9,
+    BINDING_LAZY_FEEDBACK = 10,
+    NUM_BINDINGS
+};
+
+GLuint g_ssbos[NUM_BINDINGS];
+
+// 2 for the binary BVH, 4 or 8 to collapse it into wide nodes
+int g_bvhWidth = 2;
+// Quantize the BVH8 child boxes (BVH_COMPRESSED in raytrace.frag)
+bool g_bvhCompressed = false;
+// Threaded binary BVH without a traversal stack (BVH_STACKLESS in raytrace.frag)
+bool g_bvhStackless = false;
+// Traversal stack entries the uploaded wide or compressed tree needs (BVH_STACK_ENTRIES in raytrace.frag)
+int g_bvhStackEntries = 1;
+// Precomputed triangle records instead of index + vertex gathers (TRI_RECORDS in raytrace.frag)
+bool g_triRecords = false;
+// Next event estimation towards the emissive spheres (LIGHT_SAMPLING in raytrace.frag)
+bool g_lightSampling = false;
+// Treelet restructuring rounds after the BVH build, 0 to skip
+int g_treeletIterations = BVH_TREELET_ITERATIONS;
+// Directory of the BVH cache (--bvh-cache), NULL when it is off
+const char* g_bvhCacheDir = "bvh_cache";
+// SceneAccel from --accel, -1 keeps the one the scene asks for
+int g_accel = -1;
+// Keep the scene and an editable BVH around for interactive sphere edits (binary BVH only)
+bool g_dynamic = false;
+Scene g_scene;
+DynamicBVH g_dynamicBvh;
+int g_selectedSphere = -1;
+// Trace the top levels of the BVH right away and splice in subtrees as worker threads finish them
+bool g_lazy = false;
+LazyBVH g_lazyBvh;
+
+void UploadSSBO(int binding, const void* data, size_t size)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_ssbos[binding]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, g_ssbos[binding]);
+}
 
-    // Mirror 1
-    {1.0f, 1.0f, 1.0f, 0.0f, 0.2f, 1.0f, 0.0f, 1.0f}, 
+// Average node bytes fetched per camera ray over a coarse grid of the start view
+double SampleBytesPerRay(const Scene* scene, const void* accel, bool (*intersect)(const void*, const Scene*, Vec3, Vec3, Hit*, TraversalStats*))
+{
+    TraversalStats stats = {0};
+    int rays = 0;
+    for (int y = 0; y < 36; y++)
+    {
+        for (int x = 0; x < 64; x++)
+        {
+            Vec3 ro, rd;
+            Hit hit;
+            camera_ray(&g_camera, (x + 0.5f) * 20.0f, (y + 0.5f) * 20.0f, 1280, 720, &ro, &rd);
+            intersect(accel, scene, ro, rd, &hit, &stats);
+            rays++;
+        }
+    }
+    return (double)stats.bytes_fetched / rays;
+}
 
-    // Emissive White 2
-    {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 10.0f, 1.0f},
+bool IntersectWide(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_wide_intersect((const WideBVH*)accel, scene, ro, rd, hit, stats);
+}
 
-    {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 5.0f, 1.0f},
+bool IntersectCompressed(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_compressed_intersect((const CompressedBVH*)accel, scene, ro, rd, hit, stats);
+}
 
-    // Semi-Transparrent Blue 4
-    {0.2f, 0.2f, 1.0f, 0.0f, 0.2f, 0.0f, 0.0f, 0.2f}, 
- 
-    // Matte white 5
-    {1.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f} 
-};
-const int NUM_MATERIALS = sizeof(g_materials) / sizeof(Material);
+bool IntersectGrid(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return grid_intersect((const Grid*)accel, scene, ro, rd, hit, stats);
+}
+
+// Two level grid, its refs go where the BVH prims would so the leaf loops are shared
+void UploadGrid(const Scene* scene)
+{
+    Grid grid;
+    double start = glfwGetTime();
+    if (!grid_build(&grid, scene)) {return;}
+
+    const unsigned int* header = grid.data;
+    fprintf(stderr, "Built %ux%ux%u grid with %zu refs over %zu prims in %.1f ms\n", header[GRID_HEADER_DIMS], header[GRID_HEADER_DIMS + 1], header[GRID_HEADER_DIMS + 2], grid.num_refs, scene->num_spheres + scene_num_triangles(scene), (glfwGetTime() - start) * 1e3);
+    fprintf(stderr, "Grid bytes per camera ray: %.0f\n", SampleBytesPerRay(scene, &grid, IntersectGrid));
+
+    UploadSSBO(BINDING_GRID, grid.data, grid.data_size * sizeof(unsigned int));
+    UploadSSBO(BINDING_BVH_PRIMS, grid.refs, grid.num_refs * sizeof(unsigned int));
+    grid_free(&grid);
+}
+
+// Acceleration structure buffers by binding, what the BVH cache stores
+typedef struct
+{
+    BVHCacheBlob blobs[NUM_BINDINGS];
+} AccelUploads;
+
+void UploadAccelSSBO(AccelUploads* uploads, int binding, const void* data, size_t size)
+{
+    UploadSSBO(binding, data, size);
+    uploads->blobs[binding] = (BVHCacheBlob){(unsigned int)binding, data, size};
+}
+
+// Cache file for this scene and the BVH options on the command line
+bool AccelCachePath(const Scene* scene, char* path, size_t size, unsigned long long* key)
+{
+    if (g_bvhCacheDir == NULL) {return false;}
+    int settings[] = {g_treeletIterations, g_bvhWidth, g_bvhCompressed, g_bvhStackless};
+    *key = bvh_cache_key(scene, settings, sizeof(settings) / sizeof(settings[0]));
+    return bvh_cache_path(path, size, g_bvhCacheDir, *key);
+}
+
+bool UploadCachedAccel(const char* path, unsigned long long key)
+{
+    double start = glfwGetTime();
+    BVHCache cache;
+    if (!bvh_cache_open(&cache, path, key)) {return false;}
+
+    size_t bytes = 0;
+    for (int i = 0; i < cache.num_blobs; i++)
+    {
+        const BVHCacheBlob* blob = &cache.blobs[i];
+        if (blob->id >= NUM_BINDINGS) {continue;}
+        UploadSSBO(blob->id, blob->data, blob->size);
+        bytes += blob->size;
+        if (blob->id == BINDING_WIDE_BVH && g_bvhWidth > 2 && !g_bvhCompressed)
+        {
+            // A view of the mapped nodes, only read
+            WideBVH wide = {g_bvhWidth, (WideLane*)blob->data};
+            wide.num_nodes = blob->size / bvh_wide_node_bytes(&wide);
+            g_bvhStackEntries = bvh_wide_stack_entries(&wide);
+        }
+        if (blob->id == BINDING_COMPRESSED_BVH && g_bvhCompressed)
+        {
+            CompressedBVH cbvh = {(CompressedNode*)blob->data, blob->size / sizeof(CompressedNode)};
+            g_bvhStackEntries = bvh_compressed_stack_entries(&cbvh);
+        }
+    }
+    bvh_cache_close(&cache);
+
+    fprintf(stderr, "Loaded BVH from %s (%zu bytes) in %.1f ms\n", path, bytes, (glfwGetTime() - start) * 1e3);
+    return true;
+}
+
+// One BVH over spheres and triangles, in the layout picked on the command line. Taken from the
+// BVH cache when this scene was built with the same options before, written to it otherwise.
+void UploadAccelerationStructure(const Scene* scene)
+{
+    if (scene->accel == SCENE_ACCEL_GRID)
+    {
+        UploadGrid(scene);
+        return;
+    }
+
+    char cachePath[1024];
+    unsigned long long cacheKey = 0;
+    bool cached = AccelCachePath(scene, cachePath, sizeof(cachePath), &cacheKey);
+    if (cached && UploadCachedAccel(cachePath, cacheKey)) {return;}
+
+    BVH bvh;
+    double start = glfwGetTime();
+    if (!bvh_build(&bvh, scene, g_treeletIterations)) {return;}
+
+    fprintf(stderr, "Built BVH with %zu nodes over %zu prims in %.1f ms\n", bvh.num_nodes, bvh.num_prims, (glfwGetTime() - start) * 1e3);
+
+    AccelUploads uploads = {0};
+    UploadAccelSSBO(&uploads, BINDING_BVH_NODES, bvh.nodes, bvh.num_nodes * sizeof(BVHNode));
+    UploadAccelSSBO(&uploads, BINDING_BVH_PRIMS, bvh.prims, bvh.num_prims * sizeof(unsigned int));
+
+    // Everything stays alive until the cache is written
+    BVH threaded = {0};
+    WideBVH wide = {0};
+    CompressedBVH cbvh = {0};
+    if (g_bvhStackless && bvh_stackless_build(&threaded, &bvh))
+    {
+        UploadAccelSSBO(&uploads, BINDING_BVH_NODES, threaded.nodes, threaded.num_nodes * sizeof(BVHNode));
+    }
+
+    if (g_bvhWidth > 2 && bvh_wide_build(&wide, &bvh, g_bvhWidth))
+    {
+        size_t wideBytes = wide.num_nodes * bvh_wide_node_bytes(&wide);
+        fprintf(stderr, "Collapsed to %zu BVH%d nodes (%zu bytes, binary %zu bytes)\n", wide.num_nodes, wide.width, wideBytes, bvh.num_nodes * sizeof(BVHNode));
+
+        UploadAccelSSBO(&uploads, BINDING_WIDE_BVH, wide.lanes, wideBytes);
+        g_bvhStackEntries = bvh_wide_stack_entries(&wide);
+
+        if (g_bvhCompressed && bvh_compressed_build(&cbvh, &wide))
+        {
+            size_t compressedBytes = cbvh.num_nodes * sizeof(CompressedNode);
+            fprintf(stderr, "Compressed nodes: %zu bytes, %.2fx smaller than BVH%d\n", compressedBytes, (double)wideBytes / compressedBytes, wide.width);
+            fprintf(stderr, "Node bytes per camera ray: %.0f compressed, %.0f BVH%d\n", SampleBytesPerRay(scene, &cbvh, IntersectCompressed), SampleBytesPerRay(scene, &wide, IntersectWide), wide.width);
+
+            // Leaves of a compressed node are contiguous, so the prim list is reordered
+            UploadAccelSSBO(&uploads, BINDING_COMPRESSED_BVH, cbvh.nodes, compressedBytes);
+            g_bvhStackEntries = bvh_compressed_stack_entries(&cbvh);
+            UploadAccelSSBO(&uploads, BINDING_BVH_PRIMS, cbvh.prims, cbvh.num_prims * sizeof(unsigned int));
+        }
+    }
+
+    if (cached)
+    {
+        BVHCacheBlob blobs[NUM_BINDINGS];
+        int numBlobs = 0;
+        for (int i = 0; i < NUM_BINDINGS; i++)
+        {
+            if (uploads.blobs[i].data != NULL) {blobs[numBlobs++] = uploads.blobs[i];}
+        }
+
+        start = glfwGetTime();
+        if (bvh_cache_write(cachePath, cacheKey, blobs, numBlobs)) {fprintf(stderr, "Wrote BVH cache %s in %.1f ms\n", cachePath, (glfwGetTime() - start) * 1e3);}
+    }
+
+    bvh_compressed_free(&cbvh);
+    bvh_wide_free(&wide);
+    bvh_free(&threaded);
+    bvh_free(&bvh);
+}
+
+void UploadDynamicRange(void* ctx, DynamicBuffer buffer, const void* data, size_t offset, size_t size, size_t capacity)
+{
+    static const int bindings[DYNAMIC_NUM_BUFFERS] = {BINDING_BVH_NODES, BINDING_BVH_PRIMS, BINDING_SPHERES};
+    int binding = bindings[buffer];
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_ssbos[binding]);
+    if (offset == 0 && size == capacity)
+    {
+        // Grown (or first) upload, the spare capacity absorbs the next edits
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacity, data, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, g_ssbos[binding]);
+        return;
+    }
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, size, (const char*)data + offset);
+}
+
+// Editable binary BVH over the scene, replaces UploadAccelerationStructure in --dynamic mode
+bool SetupDynamicBVH(Scene* scene)
+{
+    BVH bvh;
+    double start = glfwGetTime();
+    if (!bvh_build(&bvh, scene, g_treeletIterations)) {return false;}
+    if (!dynamic_bvh_init(&g_dynamicBvh, &bvh, scene))
+    {
+        bvh_free(&bvh);
+        return false;
+    }
 
-void SetupSceneData(GLuint sphere_ssbo, GLuint material_ssbo, GLuint vertex_ssbo, GLuint index_ssbo)
+    fprintf(stderr, "Built dynamic BVH with %zu nodes in %.1f ms (N adds a sphere, X removes the one in view, arrows move the selected one)\n", g_dynamicBvh.bvh.num_nodes, (glfwGetTime() - start) * 1e3);
+    dynamic_bvh_flush(&g_dynamicBvh, scene, UploadDynamicRange, NULL);
+    return true;
+}
+
+// Top levels only, the rest is refined in the background in the order the GPU feedback asks for.
+// Replaces UploadAccelerationStructure in --lazy mode.
+bool SetupLazyBVH(Scene* scene)
+{
+    double start = glfwGetTime();
+    int threads = parallel_thread_count() > 1 ? parallel_thread_count() - 1 : 1;
+    if (!lazy_bvh_build(&g_lazyBvh, scene, BVH_LAZY_PENDING_PRIMS, threads)) {return false;}
+
+    fprintf(stderr, "Built lazy BVH top levels in %.1f ms, %d subtrees of up to %d prims left to %d threads\n",
+        (glfwGetTime() - start) * 1e3, g_lazyBvh.num_pending, BVH_LAZY_PENDING_PRIMS, threads);
+    lazy_bvh_splice(&g_lazyBvh, UploadDynamicRange, NULL);
+
+    // Zeroed hit counters for every node slot the finished tree can use
+    unsigned int* zeros = calloc(g_lazyBvh.node_capacity, sizeof(unsigned int));
+    if (zeros == NULL)
+    {
+        lazy_bvh_free(&g_lazyBvh);
+        return false;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_ssbos[BINDING_LAZY_FEEDBACK]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, g_lazyBvh.node_capacity * sizeof(unsigned int), zeros, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING_LAZY_FEEDBACK, g_ssbos[BINDING_LAZY_FEEDBACK]);
+    free(zeros);
+    return true;
+}
+
+// Splice the subtrees the workers finished since the last frame. The tree only gets tighter,
+// the image stays the same, so accumulation carries on. Every 30 frames the leaf hit counts
+// are read back to steer the workers.
+void RefineLazyBVH(int frameIndex)
+{
+    if (!g_lazy || lazy_bvh_done(&g_lazyBvh)) {return;}
+
+    if (frameIndex % 30 == 0)
+    {
+        size_t count = g_lazyBvh.bvh.num_nodes;
+        unsigned int* hits = malloc(count * sizeof(unsigned int));
+        if (hits != NULL)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_ssbos[BINDING_LAZY_FEEDBACK]);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(unsigned int), hits);
+            glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+            lazy_bvh_add_feedback(&g_lazyBvh, hits, count);
+            free(hits);
+        }
+    }
+
+    double start = glfwGetTime();
+    int spliced = lazy_bvh_splice(&g_lazyBvh, UploadDynamicRange, NULL);
+    if (spliced == 0) {return;}
+
+    fprintf(stderr, "Lazy BVH: spliced %d subtrees in %.3f ms, %d/%d refined, %zu nodes\n",
+        spliced, (glfwGetTime() - start) * 1e3, g_lazyBvh.num_refined, g_lazyBvh.num_pending, g_lazyBvh.bvh.num_nodes);
+}
+
+// Apply this frame's sphere edits and upload what they touched, before the trace pass so an edit
+// is visible in the frame it was made. Returns true if anything changed.
+bool ApplySceneEdits(GLFWwindow* window)
+{
+    if (!g_dynamic) {return false;}
+
+    double start = glfwGetTime();
+    bool edited = false;
+    bool ok = true;
+
+    float forwardX, forwardZ, rightX, rightZ;
+    calculateCameraVectors(&g_camera, &forwardX, &forwardZ, &rightX, &rightZ);
+
+    if (g_pendingAddSphere)
+    {
+        Vec3 pos = v3(g_camera.px + forwardX * 3.0f, g_camera.py, g_camera.pz + forwardZ * 3.0f);
+        Sphere sphere = {pos.x, pos.y, pos.z, 0.3f, (int)(g_scene.num_spheres % g_scene.num_materials)};
+        g_selectedSphere = dynamic_bvh_add_sphere(&g_dynamicBvh, &g_scene, sphere);
+        ok = g_selectedSphere >= 0;
+        edited = true;
+    }
+
+    if (g_pendingRemoveSphere)
+    {
+        Vec3 ro, rd;
+        Hit hit;
+        camera_ray(&g_camera, g_newWidth * 0.5f, g_newHeight * 0.5f, g_newWidth, g_newHeight, &ro, &rd);
+        if (bvh_intersect(&g_dynamicBvh.bvh, &g_scene, ro, rd, &hit, NULL) && hit.type == HIT_SPHERE)
+        {
+            // Removal moves the last sphere into the hole
+            int last = (int)g_scene.num_spheres - 1;
+            ok = dynamic_bvh_remove_sphere(&g_dynamicBvh, &g_scene, hit.index);
+            if (g_selectedSphere == hit.index) {g_selectedSphere = -1;}
+            else if (g_selectedSphere == last) {g_selectedSphere = hit.index;}
+            edited = true;
+        }
+    }
+    g_pendingAddSphere = false;
+    g_pendingRemoveSphere = false;
+
+    if (g_selectedSphere >= 0)
+    {
+        float step = g_cameraSpeed * g_deltaTime;
+        float dx = 0.0f, dy = 0.0f;
+        if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {dx += step;}
+        if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {dx -= step;}
+        if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {dy += step;}
+        if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {dy -= step;}
+
+        if (dx != 0.0f || dy != 0.0f)
+        {
+            const Sphere* s = &g_scene.spheres[g_selectedSphere];
+            Vec3 pos = v3(s->px + rightX * dx, s->py + dy, s->pz + rightZ * dx);
+            ok = ok && dynamic_bvh_move_sphere(&g_dynamicBvh, &g_scene, g_selectedSphere, pos);
+            edited = true;
+        }
+    }
+
+    if (!edited) {return false;}
+
+    // Out of memory or too deep for the traversal stacks: start over from the edited scene
+    if (!ok || g_dynamicBvh.height[0] >= BVH_MAX_DEPTH)
+    {
+        dynamic_bvh_free(&g_dynamicBvh);
+        if (!SetupDynamicBVH(&g_scene))
+        {
+            fprintf(stderr, "Failed to rebuild the dynamic BVH, edits are disabled\n");
+            g_dynamic = false;
+        }
+        return true;
+    }
+
+    size_t bytes = dynamic_bvh_flush(&g_dynamicBvh, &g_scene, UploadDynamicRange, NULL);
+    fprintf(stderr, "Scene edit: %zu spheres, %zu bytes uploaded in %.3f ms\n", g_scene.num_spheres, bytes, (glfwGetTime() - start) * 1e3);
+    return true;
+}
+
+void SetupSceneData()
 {
-    // Load OBJ
-    MeshData mesh = load_obj("tetrahedron.obj");
+    Scene scene;
+    if (!scene_load_default(&scene, "tetrahedron.obj")) {return;}
 
-    if (mesh.vertices != NULL && mesh.indices != NULL)
+    MeshData* mesh = &scene.mesh;
+    if (mesh->vertices != NULL) {fprintf(stderr, "Loaded mesh with %zu v, %zu i\n", mesh->num_vertices / 3, mesh->num_indices);}
+
+    // The traversal is picked before the shader is compiled, so the scene's choice can still add its define
+    if (g_accel >= 0) {scene.accel = (SceneAccel)g_accel;}
+    if ((g_dynamic || g_lazy) && scene.accel != SCENE_ACCEL_BVH)
     {
-        fprintf(stderr, "Loaded mesh with %zu v, %zu i\n", mesh.num_vertices / 3, mesh.num_indices);
+        fprintf(stderr, "%s builds the BVH, ignoring the scene's grid\n", g_dynamic ? "--dynamic" : "--lazy");
+        scene.accel = SCENE_ACCEL_BVH;
+    }
+    size_t len = strlen(g_shaderDefines);
+    if (scene.accel == SCENE_ACCEL_GRID) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define ACCEL_GRID\n");}
+    if (g_lazy) {snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define LAZY_FEEDBACK\n#define BVH_MAX_LEAF_PRIMS %d\n", BVH_MAX_LEAF_PRIMS);}
 
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertex_ssbo);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, mesh.num_vertices * sizeof(float), mesh.vertices, GL_STATIC_DRAW);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, vertex_ssbo);
+    UploadSSBO(BINDING_VERTICES, mesh->vertices, mesh->num_vertices * sizeof(float));
+    UploadSSBO(BINDING_INDICES, mesh->indices, mesh->num_indices * sizeof(unsigned int));
+    UploadSSBO(BINDING_SPHERES, scene.spheres, scene.num_spheres * sizeof(Sphere));
+    UploadSSBO(BINDING_MATERIALS, scene.materials, scene.num_materials * sizeof(Material));
 
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, index_ssbo);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, mesh.num_indices * sizeof(unsigned int), mesh.indices, GL_STATIC_DRAW);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, index_ssbo);
+    if (g_triRecords && scene_build_tri_records(&scene))
+    {
+        UploadSSBO(BINDING_TRI_RECORDS, scene.tri_records, scene_num_triangles(&scene) * sizeof(TriRecord));
+    }
 
-        free_mesh_data(&mesh);
-    }   
-    else {fprintf(stderr, "Failed to load OBJ");}
+    // The dynamic BVH owns the sphere buffer from here, edits upload only the slots they touch
+    if (g_dynamic && SetupDynamicBVH(&scene))
+    {
+        g_scene = scene;
+        return;
+    }
+    g_dynamic = false;
 
-    // Setup spheres
-    Sphere scene[6];
+    // The workers read the scene until the last subtree is built
+    if (g_lazy && SetupLazyBVH(&scene))
+    {
+        g_scene = scene;
+        return;
+    }
+    g_lazy = false;
 
-    scene[0] = (Sphere){0.0f, 0.0f, 0.0f, 1.0f, 1};
-    scene[1] = (Sphere){2.5f, 0.0f, 0.0f, 0.5f, 3};
-    scene[2] = (Sphere){-2.5f, 0.0f, 0.0f, 0.5f, 2}; 
-    scene[3] = (Sphere){0.0f, 0.0f, -3.0f, 1.0f, 5}; 
-    scene[4] = (Sphere){0.0f, 0.0f, 3.0f, 1.0f, 5}; 
-    scene[5] = (Sphere){0.0f, -100.0f, 0.0f, 99.0f, 5};
+    UploadAccelerationStructure(&scene);
+    len = strlen(g_shaderDefines);
+    snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define BVH_STACK_ENTRIES %d\n", g_bvhStackEntries);
 
-    // Sphere Data
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphere_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(scene), scene, GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sphere_ssbo); 
+    scene_free(&scene);
+}
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, material_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(g_materials), g_materials, GL_STATIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, material_ssbo);
+void ParseArguments(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bvh") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "compressed") == 0)
+            {
+                g_bvhWidth = 8;
+                g_bvhCompressed = true;
+                continue;
+            }
+
+            g_bvhWidth = atoi(argv[i]);
+            if (g_bvhWidth != 2 && g_bvhWidth != 4 && g_bvhWidth != 8)
+            {
+                fprintf(stderr, "Unsupported BVH width %s, using binary BVH\n", argv[i]);
+                g_bvhWidth = 2;
+            }
+        }
+        else if (strcmp(argv[i], "--stackless") == 0) {g_bvhStackless = true;}
+        else if (strcmp(argv[i], "--tri-records") == 0) {g_triRecords = true;}
+        else if (strcmp(argv[i], "--light-sampling") == 0) {g_lightSampling = true;}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {g_treeletIterations = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--dynamic") == 0) {g_dynamic = true;}
+        else if (strcmp(argv[i], "--lazy") == 0) {g_lazy = true;}
+        else if (strcmp(argv[i], "--bvh-cache") == 0 && i + 1 < argc)
+        {
+            i++;
+            g_bvhCacheDir = strcmp(argv[i], "off") == 0 ? NULL : argv[i];
+        }
+        else if (strcmp(argv[i], "--accel") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "bvh") == 0) {g_accel = SCENE_ACCEL_BVH;}
+            else if (strcmp(argv[i], "grid") == 0) {g_accel = SCENE_ACCEL_GRID;}
+            else {fprintf(stderr, "Unknown acceleration structure %s, using the scene's\n", argv[i]);}
+        }
+        else {fprintf(stderr, "Unknown argument %s\n", argv[i]);}
+    }
+
+    if (g_bvhStackless && g_bvhWidth > 2)
+    {
+        fprintf(stderr, "--stackless only applies to the binary BVH, ignoring it\n");
+        g_bvhStackless = false;
+    }
+
+    // Edits reorder nodes freely, only the stack traversal of the binary BVH handles that
+    if (g_dynamic && (g_bvhWidth > 2 || g_bvhStackless))
+    {
+        fprintf(stderr, "--dynamic needs the binary BVH, ignoring --bvh and --stackless\n");
+        g_bvhWidth = 2;
+        g_bvhCompressed = false;
+        g_bvhStackless = false;
+    }
+
+    if (g_dynamic && g_lazy)
+    {
+        fprintf(stderr, "--dynamic builds the whole BVH, ignoring --lazy\n");
+        g_lazy = false;
+    }
+
+    // Subtrees are spliced into the binary node array, the collapsed and threaded layouts would need rebuilding
+    if (g_lazy && (g_bvhWidth > 2 || g_bvhStackless))
+    {
+        fprintf(stderr, "--lazy needs the binary BVH, ignoring --bvh and --stackless\n");
+        g_bvhWidth = 2;
+        g_bvhCompressed = false;
+        g_bvhStackless = false;
+    }
+
+    size_t len = 0;
+    if (g_bvhCompressed) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define BVH_COMPRESSED\n");}
+    else if (g_bvhWidth > 2) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define BVH_WIDTH %d\n", g_bvhWidth);}
+    else if (g_bvhStackless) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define BVH_STACKLESS\n");}
+
+    if (g_triRecords) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define TRI_RECORDS\n");}
+    if (g_lightSampling) {len += snprintf(g_shaderDefines + len, sizeof(g_shaderDefines) - len, "#define LIGHT_SAMPLING\n");}
 }
 
 int main(int argc, char* argv[])
 {
+    ParseArguments(argc, argv);
+
     // GLFW Init
     if (!glfwInit())
     {
@@ -312,6 +815,7 @@ int main(int argc, char* argv[])
     // Capture And Hide Mouse Pointer
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetKeyCallback(window, key_callback);
 
     // Load OpenGL Functions 
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
@@ -335,23 +839,22 @@ int main(int argc, char* argv[])
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
 
-    GLuint ssbo_spheres;
-    GLuint ssbo_materials;
-    GLuint ssbo_vertices;
-    GLuint ssbo_indices;
+    glGenBuffers(NUM_BINDINGS, g_ssbos);
 
-    glGenBuffers(1, &ssbo_spheres);
-    glGenBuffers(1, &ssbo_materials);
-    glGenBuffers(1, &ssbo_vertices);
-    glGenBuffers(1, &ssbo_indices);
-
-    SetupSceneData(ssbo_spheres, ssbo_materials, ssbo_vertices, ssbo_indices);
+    SetupSceneData();
 
     GLuint program = CreateShaderProgram();
     glUseProgram(program);
 
     //glUniform2f(glGetUniformLocation(program, "u_resolution"), (float)WIDTH, (float)HEIGHT);
 
+    // GPU time of the trace pass, two queries so reading one never waits on the current frame
+    GLuint timerQueries[2];
+    glGenQueries(2, timerQueries);
+    double traceTimeSum = 0.0;
+    int traceTimeFrames = 0;
+    int frameIndex = 0;
+
     // Main Loop
     while (!glfwWindowShouldClose(window))
     {
@@ -373,7 +876,9 @@ int main(int argc, char* argv[])
         }
 
         bool cameraMoved = processInput(window);
-        if (cameraMoved) {g_frameCount = 0;}
+        bool sceneEdited = ApplySceneEdits(window);
+        RefineLazyBVH(frameIndex);
+        if (cameraMoved || sceneEdited) {g_frameCount = 0;}
         g_frameCount++;
 
         glUniform2f(glGetUniformLocation(program, "u_resolution"), (float)g_newWidth, (float)g_newHeight);
@@ -390,7 +895,23 @@ int main(int argc, char* argv[])
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, g_outputTexture);
 
+        glBeginQuery(GL_TIME_ELAPSED, timerQueries[frameIndex & 1]);
         glDrawArrays(GL_TRIANGLES, 0, 3);
+        glEndQuery(GL_TIME_ELAPSED);
+
+        if (frameIndex > 0)
+        {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(timerQueries[(frameIndex - 1) & 1], GL_QUERY_RESULT, &elapsed);
+            traceTimeSum += elapsed * 1e-6;
+            if (++traceTimeFrames == 100)
+            {
+                fprintf(stderr, "Trace pass: %.2f ms\n", traceTimeSum / traceTimeFrames);
+                traceTimeSum = 0.0;
+                traceTimeFrames = 0;
+            }
+        }
+        frameIndex++;
 
         GLuint temp = g_accumTexture;
         g_accumTexture = g_outputTexture;
@@ -408,6 +929,9 @@ int main(int argc, char* argv[])
         glfwPollEvents();
     }
 
+    glDeleteQueries(2, timerQueries);
+    // Stops the workers if the window closed before the tree was finished
+    if (g_lazy) {lazy_bvh_free(&g_lazyBvh);}
     glfwTerminate();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,310 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sched_getaffinity
+#endif
+
+#include "numa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// From linux/mempolicy.h, without needing libnuma
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MASK_BITS 1024
+#endif
+
+#define NUMA_ALIGN 64
+
+// "0-3,8,10-11" into out, returns the count
+static int parse_list(const char* text, int* out, int max)
+{
+    int count = 0;
+    const char* p = text;
+    while (*p != '\0' && *p != '\n')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {break;}
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long v = first; v <= last && count < max; v++) {out[count++] = (int)v;}
+        if (*p == ',') {p++;}
+    }
+    return count;
+}
+
+#ifdef __linux__
+static bool read_list(const char* path, int* out, int max, int* count)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {return false;}
+    char text[4096];
+    bool ok = fgets(text, sizeof(text), fp) != NULL;
+    fclose(fp);
+    *count = ok ? parse_list(text, out, max) : 0;
+    return ok;
+}
+#endif
+
+void numa_detect(NumaTopology* topo)
+{
+    memset(topo, 0, sizeof(*topo));
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    bool have_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    int nodes[NUMA_MAX_NODES];
+    int num_nodes;
+    if (read_list("/sys/devices/system/node/online", nodes, NUMA_MAX_NODES, &num_nodes))
+    {
+        for (int n = 0; n < num_nodes; n++)
+        {
+            char path[96];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[n]);
+            int cpus[PARALLEL_MAX_THREADS];
+            int num_cpus;
+            if (!read_list(path, cpus, PARALLEL_MAX_THREADS, &num_cpus)) {continue;}
+
+            int node = topo->num_nodes;
+            topo->node_id[node] = nodes[n];
+            topo->first_cpu[node] = topo->total_cpus;
+            for (int c = 0; c < num_cpus && topo->total_cpus < PARALLEL_MAX_THREADS; c++)
+            {
+                if (have_allowed && (cpus[c] >= CPU_SETSIZE || !CPU_ISSET(cpus[c], &allowed))) {continue;}
+                topo->cpus[topo->total_cpus++] = cpus[c];
+            }
+            topo->num_cpus[node] = topo->total_cpus - topo->first_cpu[node];
+            if (topo->num_cpus[node] > 0) {topo->num_nodes++;}
+        }
+    }
+    if (topo->num_nodes > 0) {return;}
+
+    // No sysfs: one node with the CPUs we may use
+    memset(topo, 0, sizeof(*topo));
+    for (int c = 0; have_allowed && c < CPU_SETSIZE && topo->total_cpus < PARALLEL_MAX_THREADS; c++)
+    {
+        if (CPU_ISSET(c, &allowed)) {topo->cpus[topo->total_cpus++] = c;}
+    }
+#endif
+    if (topo->total_cpus == 0)
+    {
+        topo->total_cpus = parallel_thread_count();
+        for (int c = 0; c < topo->total_cpus; c++) {topo->cpus[c] = c;}
+    }
+    topo->num_nodes = 1;
+    topo->num_cpus[0] = topo->total_cpus;
+}
+
+static int clamp_nodes(const NumaTopology* topo, int num_nodes)
+{
+    return num_nodes < 1 || num_nodes > topo->num_nodes ? topo->num_nodes : num_nodes;
+}
+
+int numa_node_cpus(const NumaTopology* topo, int num_nodes)
+{
+    num_nodes = clamp_nodes(topo, num_nodes);
+    return topo->first_cpu[num_nodes - 1] + topo->num_cpus[num_nodes - 1];
+}
+
+int numa_pin_threads(const NumaTopology* topo, int num_nodes, int threads, int* thread_node)
+{
+    num_nodes = clamp_nodes(topo, num_nodes);
+    int cpus = numa_node_cpus(topo, num_nodes);
+    if (threads <= 0) {threads = cpus;}
+    if (threads > PARALLEL_MAX_THREADS) {threads = PARALLEL_MAX_THREADS;}
+
+    // The nodes' CPUs are contiguous in topo->cpus, spreading the threads evenly over that run
+    // gives every node its share
+    int pin[PARALLEL_MAX_THREADS];
+    for (int t = 0; t < threads; t++)
+    {
+        int p = (int)((long long)t * cpus / threads);
+        pin[t] = topo->cpus[p];
+        int node = 0;
+        while (node + 1 < num_nodes && p >= topo->first_cpu[node + 1]) {node++;}
+        thread_node[t] = node;
+    }
+    parallel_set_affinity(pin, threads);
+    return threads;
+}
+
+// Bump allocator over a replica's memory, only measuring while base is NULL
+typedef struct
+{
+    unsigned char* base;
+    size_t used;
+} NumaArena;
+
+static void* arena_copy(NumaArena* arena, const void* src, size_t size)
+{
+    if (src == NULL || size == 0) {return NULL;}
+    void* dst = arena->base != NULL ? arena->base + arena->used : NULL;
+    if (dst != NULL) {memcpy(dst, src, size);}
+    arena->used += (size + NUMA_ALIGN - 1) & ~(size_t)(NUMA_ALIGN - 1);
+    return dst;
+}
+
+// Shallow copies with every array moved into the arena
+static void replica_layout(NumaReplica* rep, NumaArena* arena, const Scene* scene, const BVH* bvh, const WideBVH* wide)
+{
+    rep->scene = *scene;
+    rep->scene.spheres = (Sphere*)arena_copy(arena, scene->spheres, scene->num_spheres * sizeof(Sphere));
+    rep->scene.materials = (Material*)arena_copy(arena, scene->materials, scene->num_materials * sizeof(Material));
+    rep->scene.mesh.vertices = (float*)arena_copy(arena, scene->mesh.vertices, scene->mesh.num_vertices * sizeof(float));
+    rep->scene.mesh.indices = (unsigned int*)arena_copy(arena, scene->mesh.indices, scene->mesh.num_indices * sizeof(unsigned int));
+    rep->scene.tri_records = (TriRecord*)arena_copy(arena, scene->tri_records, scene_num_triangles(scene) * sizeof(TriRecord));
+
+    rep->bvh = *bvh;
+    rep->bvh.nodes = (BVHNode*)arena_copy(arena, bvh->nodes, bvh->num_nodes * sizeof(BVHNode));
+    rep->bvh.prims = (unsigned int*)arena_copy(arena, bvh->prims, bvh->num_prims * sizeof(unsigned int));
+
+    rep->has_wide = wide != NULL;
+    if (wide == NULL) {return;}
+    rep->wide = *wide;
+    rep->wide.lanes = (WideLane*)arena_copy(arena, wide->lanes, wide->num_nodes * WIDE_NUM_ROWS * wide->width * sizeof(WideLane));
+    rep->wide.prims = (unsigned int*)arena_copy(arena, wide->prims, wide->num_prims * sizeof(unsigned int));
+    rep->wide.node_blocks = (WideNodeBlocks*)arena_copy(arena, wide->node_blocks, wide->num_nodes * sizeof(WideNodeBlocks));
+    rep->wide.tri_blocks = (TriBlock*)arena_copy(arena, wide->tri_blocks, wide->num_tri_blocks * sizeof(TriBlock));
+    rep->wide.tri_lanes = (WideBlockLanes*)arena_copy(arena, wide->tri_lanes, wide->num_tri_blocks * sizeof(WideBlockLanes));
+    rep->wide.sphere_blocks = (SphereBlock*)arena_copy(arena, wide->sphere_blocks, wide->num_sphere_blocks * sizeof(SphereBlock));
+    rep->wide.sphere_lanes = (WideBlockLanes*)arena_copy(arena, wide->sphere_lanes, wide->num_sphere_blocks * sizeof(WideBlockLanes));
+}
+
+// Memory for a replica under policy (NUMA_MPOL_*) over nodes, *bound false if the kernel
+// wouldn't take the policy
+static void* replica_alloc(size_t size, int policy, const NumaTopology* topo, int first_node, int num_nodes, bool* bound)
+{
+    *bound = false;
+#ifdef __linux__
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {return NULL;}
+
+    unsigned long mask[NUMA_MASK_BITS / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    for (int n = first_node; n < first_node + num_nodes; n++)
+    {
+        int id = topo->node_id[n];
+        if (id < NUMA_MASK_BITS) {mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));}
+    }
+    *bound = syscall(SYS_mbind, base, size, policy, mask, (unsigned long)NUMA_MASK_BITS + 1, 0ul) == 0;
+    return base;
+#else
+    (void)policy; (void)topo; (void)first_node; (void)num_nodes;
+    return malloc(size);
+#endif
+}
+
+bool numa_scene_build(NumaScene* numa, const NumaTopology* topo, int num_nodes, const int* thread_node, int threads,
+    NumaPlacement placement, const Scene* scene, const BVH* bvh, const WideBVH* wide)
+{
+    memset(numa, 0, sizeof(*numa));
+    numa->placement = placement;
+    if (placement == NUMA_SHARED) {return true;}
+
+    num_nodes = clamp_nodes(topo, num_nodes);
+    numa->num_replicas = placement == NUMA_REPLICATE ? num_nodes : 1;
+    // Threads past the pinned ones wrap around like parallel_set_affinity's CPUs
+    for (int t = 0; threads > 0 && t < PARALLEL_MAX_THREADS; t++)
+    {
+        numa->thread_replica[t] = placement == NUMA_REPLICATE ? (unsigned char)thread_node[t % threads] : 0;
+    }
+
+    NumaArena measure = {NULL, 0};
+    NumaReplica layout;
+    replica_layout(&layout, &measure, scene, bvh, wide);
+#ifdef __linux__
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    cpu_set_t saved;
+    bool have_saved = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+#else
+    size_t page = 4096;
+#endif
+    size_t size = (measure.used + page - 1) / page * page;
+    if (size == 0) {size = page;}
+
+    numa->bound = true;
+    bool ok = true;
+    for (int r = 0; ok && r < numa->num_replicas; r++)
+    {
+        NumaReplica* rep = &numa->replicas[r];
+        bool bound;
+        rep->arena = placement == NUMA_REPLICATE ? replica_alloc(size, NUMA_MPOL_PREFERRED, topo, r, 1, &bound)
+                                                 : replica_alloc(size, NUMA_MPOL_INTERLEAVE, topo, 0, num_nodes, &bound);
+        if (rep->arena == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for NUMA scene replica\n");
+            ok = false;
+            break;
+        }
+        rep->arena_size = size;
+        numa->bound = numa->bound && bound;
+
+#ifdef __linux__
+        // Copy from the replica's node, so the pages land there by first touch even without
+        // the memory policy
+        if (placement == NUMA_REPLICATE && have_saved)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int c = 0; c < topo->num_cpus[r]; c++) {CPU_SET(topo->cpus[topo->first_cpu[r] + c], &set);}
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+#endif
+        NumaArena arena = {(unsigned char*)rep->arena, 0};
+        replica_layout(rep, &arena, scene, bvh, wide);
+    }
+#ifdef __linux__
+    if (placement == NUMA_REPLICATE && have_saved) {sched_setaffinity(0, sizeof(saved), &saved);}
+#endif
+
+    if (!ok) {numa_scene_free(numa);}
+    return ok;
+}
+
+void numa_scene_free(NumaScene* numa)
+{
+    for (int r = 0; r < numa->num_replicas; r++)
+    {
+        NumaReplica* rep = &numa->replicas[r];
+        if (rep->arena == NULL) {continue;}
+#ifdef __linux__
+        munmap(rep->arena, rep->arena_size);
+#else
+        free(rep->arena);
+#endif
+    }
+    memset(numa, 0, sizeof(*numa));
+}
+
+static const char* const k_placement_names[] = {"shared", "replicate", "interleave"};
+
+const char* numa_placement_name(NumaPlacement placement)
+{
+    return k_placement_names[placement];
+}
+
+bool numa_placement_parse(const char* name, NumaPlacement* placement)
+{
+    for (int p = 0; p < 3; p++)
+    {
+        if (strcmp(name, k_placement_names[p]) == 0)
+        {
+            *placement = (NumaPlacement)p;
+            return true;
+        }
+    }
+    return false;
+}
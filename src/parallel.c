@@ -0,0 +1,404 @@
+#ifdef __linux__
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "timer.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+typedef cpu_set_t SavedAffinity;
+#else
+typedef int SavedAffinity;
+#endif
+
+// CPUs of parallel_set_affinity
+static int g_affinity[PARALLEL_MAX_THREADS];
+static int g_num_affinity;
+
+typedef struct
+{
+    ParallelFn fn;
+    void* ctx;
+    int count;
+    int next;
+} ParallelJob;
+
+typedef struct
+{
+    ParallelJob* job;
+    int thread;
+} ParallelWorker;
+
+int parallel_thread_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1) {return 1;}
+    return count < PARALLEL_MAX_THREADS ? count : PARALLEL_MAX_THREADS;
+}
+
+// Every core for 0, otherwise exactly max_threads (more than the cores if asked, so runs on
+// any thread count can be compared on one machine)
+static int parallel_threads(int max_threads)
+{
+    if (max_threads <= 0) {return parallel_thread_count();}
+    return max_threads < PARALLEL_MAX_THREADS ? max_threads : PARALLEL_MAX_THREADS;
+}
+
+void parallel_set_affinity(const int* cpus, int count)
+{
+    if (count > PARALLEL_MAX_THREADS) {count = PARALLEL_MAX_THREADS;}
+    for (int i = 0; i < count; i++) {g_affinity[i] = cpus[i];}
+    g_num_affinity = count > 0 ? count : 0;
+}
+
+// Pin the calling thread to the CPU of worker thread, saved (if not NULL) gets the mask to go
+// back to. false if there is nothing to pin.
+static bool pin_thread(int thread, SavedAffinity* saved)
+{
+#ifdef __linux__
+    if (g_num_affinity == 0) {return false;}
+    if (saved != NULL && pthread_getaffinity_np(pthread_self(), sizeof(*saved), saved) != 0) {return false;}
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(g_affinity[thread % g_num_affinity], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)saved;
+    return false;
+#endif
+}
+
+static void unpin_thread(const SavedAffinity* saved)
+{
+#ifdef __linux__
+    pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+#else
+    (void)saved;
+#endif
+}
+
+static void* parallel_worker(void* arg)
+{
+    ParallelWorker* worker = (ParallelWorker*)arg;
+    ParallelJob* job = worker->job;
+    if (worker->thread > 0) {pin_thread(worker->thread, NULL);}
+
+    while (true)
+    {
+        int index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count) {break;}
+        job->fn(job->ctx, index, worker->thread);
+    }
+    return NULL;
+}
+
+void parallel_for(int count, int max_threads, ParallelFn fn, void* ctx)
+{
+    if (count <= 0) {return;}
+
+    int threads = parallel_threads(max_threads);
+    if (threads > count) {threads = count;}
+
+    ParallelJob job = {fn, ctx, count, 0};
+    ParallelWorker workers[PARALLEL_MAX_THREADS];
+    pthread_t handles[PARALLEL_MAX_THREADS];
+
+    // The calling thread is worker 0
+    int started = 1;
+    for (int i = 1; i < threads; i++)
+    {
+        workers[i] = (ParallelWorker){&job, i};
+        if (pthread_create(&handles[i], NULL, parallel_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start worker thread, continuing with %d\n", started);
+            break;
+        }
+        started++;
+    }
+
+    // Pinned for the call only
+    SavedAffinity saved;
+    bool pinned = pin_thread(0, &saved);
+    workers[0] = (ParallelWorker){&job, 0};
+    parallel_worker(&workers[0]);
+    if (pinned) {unpin_thread(&saved);}
+
+    for (int i = 1; i < started; i++) {pthread_join(handles[i], NULL);}
+}
+
+// Tiles of one thread: the owner takes from head (its next tile in Hilbert order), thieves take
+// from tail, the far end of its run
+typedef struct
+{
+    pthread_mutex_t lock;
+    ParallelTile* items;
+    int head, tail, capacity;
+} TileDeque;
+
+typedef struct
+{
+    ParallelTileFn fn;
+    void* ctx;
+    TileDeque* deques;
+    int threads;
+    int remaining; // Tiles queued or running
+    ParallelTileStats* stats;
+} TileJob;
+
+typedef struct
+{
+    TileJob* job;
+    int thread;
+} TileWorker;
+
+// Cell d of the Hilbert curve over an n x n grid, n a power of two
+static void hilbert_cell(int n, int d, int* x, int* y)
+{
+    *x = *y = 0;
+    for (int s = 1; s < n; s *= 2)
+    {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            int t = *x; *x = *y; *y = t;
+        }
+        *x += s * rx;
+        *y += s * ry;
+        d /= 4;
+    }
+}
+
+// Queue tiles at the tail, all or none
+static bool deque_push(TileDeque* deque, const ParallelTile* tiles, int count)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail + count > deque->capacity && deque->head > 0)
+    {
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(ParallelTile));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail + count > deque->capacity)
+    {
+        int capacity = deque->capacity > 0 ? deque->capacity * 2 : 16;
+        if (capacity < deque->tail + count) {capacity = deque->tail + count;}
+        ParallelTile* items = (ParallelTile*)realloc(deque->items, capacity * sizeof(ParallelTile));
+        if (items == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        deque->items = items;
+        deque->capacity = capacity;
+    }
+    memcpy(deque->items + deque->tail, tiles, count * sizeof(ParallelTile));
+    deque->tail += count;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static bool deque_take(TileDeque* deque, bool from_tail, ParallelTile* tile)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->head < deque->tail;
+    if (found) {*tile = from_tail ? deque->items[--deque->tail] : deque->items[deque->head++];}
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Take a tile from the far end of another thread's run, starting at a random victim. Big
+// stolen tiles are quartered: the thief runs the first quarter and queues the rest.
+static bool steal_tile(TileJob* job, int self, unsigned int* rng, ParallelTile* tile)
+{
+    *rng = *rng * 1664525u + 1013904223u;
+    int first = (int)((*rng >> 8) % (unsigned int)job->threads);
+    for (int k = 0; k < job->threads; k++)
+    {
+        int victim = (first + k) % job->threads;
+        if (victim == self || !deque_take(&job->deques[victim], true, tile)) {continue;}
+
+        int mx = tile->x1 - tile->x0 >= 2 * PARALLEL_MIN_TILE ? (tile->x0 + tile->x1) / 2 : tile->x1;
+        int my = tile->y1 - tile->y0 >= 2 * PARALLEL_MIN_TILE ? (tile->y0 + tile->y1) / 2 : tile->y1;
+        ParallelTile parts[4] = {
+            {tile->x0, tile->y0, mx, my}, {mx, tile->y0, tile->x1, my},
+            {mx, my, tile->x1, tile->y1}, {tile->x0, my, mx, tile->y1}
+        };
+        int count = 0;
+        for (int p = 1; p < 4; p++)
+        {
+            if (parts[p].x0 < parts[p].x1 && parts[p].y0 < parts[p].y1) {parts[1 + count++] = parts[p];}
+        }
+
+        // Counted before they are queued, so remaining never reaches 0 early. Out of memory
+        // the tile just runs whole.
+        if (count == 0) {return true;}
+        __atomic_fetch_add(&job->remaining, count, __ATOMIC_RELAXED);
+        if (!deque_push(&job->deques[self], parts + 1, count))
+        {
+            __atomic_fetch_sub(&job->remaining, count, __ATOMIC_RELAXED);
+            return true;
+        }
+        *tile = parts[0];
+        return true;
+    }
+    return false;
+}
+
+static void* tile_worker(void* arg)
+{
+    TileWorker* worker = (TileWorker*)arg;
+    TileJob* job = worker->job;
+    if (worker->thread > 0) {pin_thread(worker->thread, NULL);}
+    int self = worker->thread;
+    ParallelThreadStats* stats = &job->stats->thread[self];
+    unsigned int rng = 0x9e3779b9u * (unsigned int)(self + 1);
+
+    while (__atomic_load_n(&job->remaining, __ATOMIC_ACQUIRE) > 0)
+    {
+        ParallelTile tile;
+        if (deque_take(&job->deques[self], false, &tile)) {}
+        else if (steal_tile(job, self, &rng, &tile)) {stats->steals++;}
+        else
+        {
+            // Whatever is left is running on other threads
+            stats->failed_steals++;
+            sched_yield();
+            continue;
+        }
+
+        double start = timer_seconds();
+        job->fn(job->ctx, tile, self);
+        stats->busy_seconds += timer_seconds() - start;
+        stats->tiles++;
+        __atomic_fetch_sub(&job->remaining, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void parallel_tiles(int width, int height, int tile_size, int max_threads, ParallelTileFn fn, void* ctx, ParallelTileStats* stats)
+{
+    ParallelTileStats local;
+    if (stats == NULL) {stats = &local;}
+    memset(stats, 0, sizeof(*stats));
+    if (width <= 0 || height <= 0) {return;}
+    if (tile_size < PARALLEL_MIN_TILE) {tile_size = PARALLEL_MIN_TILE;}
+
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    int count = tiles_x * tiles_y;
+
+    int threads = parallel_threads(max_threads);
+    if (threads > count) {threads = count;}
+
+    int side = 1;
+    while (side < tiles_x || side < tiles_y) {side *= 2;}
+
+    TileDeque* deques = (TileDeque*)calloc(threads, sizeof(TileDeque));
+    ParallelTile* order = (ParallelTile*)malloc(count * sizeof(ParallelTile));
+    if (deques == NULL || order == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for tile scheduler\n");
+        free(deques);
+        free(order);
+        return;
+    }
+
+    // Hilbert curve over the enclosing power of two grid, cells outside the image skipped
+    int n = 0;
+    for (int d = 0; d < side * side && n < count; d++)
+    {
+        int tx, ty;
+        hilbert_cell(side, d, &tx, &ty);
+        if (tx >= tiles_x || ty >= tiles_y) {continue;}
+
+        int x0 = tx * tile_size, y0 = ty * tile_size;
+        order[n++] = (ParallelTile){x0, y0, x0 + tile_size < width ? x0 + tile_size : width, y0 + tile_size < height ? y0 + tile_size : height};
+    }
+
+    // Every thread owns one contiguous run of the curve
+    bool ok = true;
+    for (int t = 0; t < threads; t++)
+    {
+        TileDeque* deque = &deques[t];
+        pthread_mutex_init(&deque->lock, NULL);
+        int first = count * t / threads;
+        deque->tail = deque->capacity = count * (t + 1) / threads - first;
+        deque->items = (ParallelTile*)malloc(deque->capacity * sizeof(ParallelTile));
+        if (deque->items == NULL) {ok = false;}
+        else {memcpy(deque->items, order + first, deque->capacity * sizeof(ParallelTile));}
+    }
+    free(order);
+
+    if (!ok) {fprintf(stderr, "Memory allocation failed for tile scheduler\n");}
+    TileJob job = {fn, ctx, deques, threads, ok ? count : 0, stats};
+    TileWorker workers[PARALLEL_MAX_THREADS];
+    pthread_t handles[PARALLEL_MAX_THREADS];
+    double start = timer_seconds();
+
+    // The calling thread is worker 0, runs of threads that fail to start get stolen
+    int started = 1;
+    for (int i = 1; i < threads; i++)
+    {
+        workers[i] = (TileWorker){&job, i};
+        if (pthread_create(&handles[i], NULL, tile_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start worker thread, continuing with %d\n", started);
+            break;
+        }
+        started++;
+    }
+
+    SavedAffinity saved;
+    bool pinned = pin_thread(0, &saved);
+    workers[0] = (TileWorker){&job, 0};
+    tile_worker(&workers[0]);
+    if (pinned) {unpin_thread(&saved);}
+
+    for (int i = 1; i < started; i++) {pthread_join(handles[i], NULL);}
+    stats->seconds = timer_seconds() - start;
+    stats->threads = started;
+
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_mutex_destroy(&deques[t].lock);
+        free(deques[t].items);
+    }
+    free(deques);
+}
+
+double parallel_tile_utilization(const ParallelTileStats* stats)
+{
+    if (stats->threads == 0 || stats->seconds <= 0.0) {return 0.0;}
+
+    double busy = 0.0;
+    for (int t = 0; t < stats->threads; t++) {busy += stats->thread[t].busy_seconds;}
+    return busy / (stats->seconds * stats->threads);
+}
@@ -0,0 +1,391 @@
+#include "prim_block.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void tri_block_clear(TriBlock* block)
+{
+    // Zero edges, the parallel check rejects every ray
+    memset(block, 0, sizeof(*block));
+}
+
+void sphere_block_clear(SphereBlock* block)
+{
+    for (int lane = 0; lane < PRIM_BLOCK_SIZE; lane++)
+    {
+        block->cx[lane] = block->cy[lane] = block->cz[lane] = 0.0f;
+        block->r2[lane] = -INFINITY;
+    }
+}
+
+void tri_block_set(TriBlock* block, int lane, Vec3 v0, Vec3 edge1, Vec3 edge2)
+{
+    block->v0x[lane] = v0.x; block->v0y[lane] = v0.y; block->v0z[lane] = v0.z;
+    block->e1x[lane] = edge1.x; block->e1y[lane] = edge1.y; block->e1z[lane] = edge1.z;
+    block->e2x[lane] = edge2.x; block->e2y[lane] = edge2.y; block->e2z[lane] = edge2.z;
+}
+
+void sphere_block_set(SphereBlock* block, int lane, const Sphere* s)
+{
+    block->cx[lane] = s->px; block->cy[lane] = s->py; block->cz[lane] = s->pz;
+    block->r2[lane] = s->radius * s->radius;
+}
+
+TriBlock* tri_blocks_build(const MeshData* mesh, const TriRecord* tri_records, size_t first, size_t count, size_t* num_blocks)
+{
+    *num_blocks = (count + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+    TriBlock* blocks = (TriBlock*)malloc((*num_blocks > 0 ? *num_blocks : 1) * sizeof(TriBlock));
+    if (blocks == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for %zu triangle blocks\n", *num_blocks);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < *num_blocks * PRIM_BLOCK_SIZE; i++)
+    {
+        TriBlock* block = &blocks[i / PRIM_BLOCK_SIZE];
+        int lane = (int)(i % PRIM_BLOCK_SIZE);
+        if (lane == 0) {tri_block_clear(block);}
+        if (i >= count) {break;}
+
+        if (tri_records != NULL)
+        {
+            const TriRecord* rec = &tri_records[first + i];
+            tri_block_set(block, lane, v3(rec->v0x, rec->v0y, rec->v0z), v3(rec->e1x, rec->e1y, rec->e1z), v3(rec->e2x, rec->e2y, rec->e2z));
+            continue;
+        }
+        const unsigned int* idx = mesh->indices + 3 * (first + i);
+        Vec3 v0 = mesh_vertex(mesh, idx[0]);
+        tri_block_set(block, lane, v0, v3_sub(mesh_vertex(mesh, idx[1]), v0), v3_sub(mesh_vertex(mesh, idx[2]), v0));
+    }
+    return blocks;
+}
+
+SphereBlock* sphere_blocks_build(const Sphere* spheres, size_t count, size_t* num_blocks)
+{
+    *num_blocks = (count + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+    SphereBlock* blocks = (SphereBlock*)malloc((*num_blocks > 0 ? *num_blocks : 1) * sizeof(SphereBlock));
+    if (blocks == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for %zu sphere blocks\n", *num_blocks);
+        return NULL;
+    }
+
+    for (size_t b = 0; b < *num_blocks; b++)
+    {
+        sphere_block_clear(&blocks[b]);
+        for (int lane = 0; lane < PRIM_BLOCK_SIZE && b * PRIM_BLOCK_SIZE + lane < count; lane++)
+        {
+            sphere_block_set(&blocks[b], lane, &spheres[b * PRIM_BLOCK_SIZE + lane]);
+        }
+    }
+    return blocks;
+}
+
+// Closest of the per lane bests, the lowest index on a tie. Lanes that never hit hold -1.
+static bool reduce_lanes(const float* t, const int* index, int lanes, float t_max, PrimBlockHit* hit)
+{
+    *hit = (PrimBlockHit){t_max, -1};
+    for (int i = 0; i < lanes; i++)
+    {
+        if (index[i] < 0) {continue;}
+        if (t[i] < hit->t || (t[i] == hit->t && index[i] < hit->index)) {*hit = (PrimBlockHit){t[i], index[i]};}
+    }
+    return hit->index >= 0;
+}
+
+static bool tri_blocks_scalar(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    *hit = (PrimBlockHit){t_max, -1};
+    for (size_t b = 0; b < num_blocks; b++)
+    {
+        const TriBlock* block = &blocks[b];
+        for (int lane = 0; lane < PRIM_BLOCK_SIZE; lane++)
+        {
+            float t = hit_triangle(v3(block->v0x[lane], block->v0y[lane], block->v0z[lane]), v3(block->e1x[lane], block->e1y[lane], block->e1z[lane]),
+                v3(block->e2x[lane], block->e2y[lane], block->e2z[lane]), ro, rd);
+            if (t > HIT_EPSILON && t < hit->t) {*hit = (PrimBlockHit){t, (int)(b * PRIM_BLOCK_SIZE) + lane};}
+        }
+    }
+    return hit->index >= 0;
+}
+
+static bool sphere_blocks_scalar(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    *hit = (PrimBlockHit){t_max, -1};
+    for (size_t b = 0; b < num_blocks; b++)
+    {
+        const SphereBlock* block = &blocks[b];
+        for (int lane = 0; lane < PRIM_BLOCK_SIZE; lane++)
+        {
+            // hit_sphere with the squared radius stored
+            Vec3 oc = v3_sub(ro, v3(block->cx[lane], block->cy[lane], block->cz[lane]));
+            float bb = v3_dot(oc, rd);
+            float h = bb * bb - (v3_dot(oc, oc) - block->r2[lane]);
+            if (h < 0.0f) {continue;}
+            float t = -bb - sqrtf(h);
+            if (t > HIT_EPSILON && t < hit->t) {*hit = (PrimBlockHit){t, (int)(b * PRIM_BLOCK_SIZE) + lane};}
+        }
+    }
+    return hit->index >= 0;
+}
+
+#ifdef CPU_X86
+// Half a block (4 lanes from lane 4 * half) per register
+
+typedef struct
+{
+    __m128 ox, oy, oz;
+    __m128 dx, dy, dz;
+} BlockRay4;
+
+CPU_TARGET_SSE41 static inline BlockRay4 block_ray4(Vec3 ro, Vec3 rd)
+{
+    return (BlockRay4){
+        _mm_set1_ps(ro.x), _mm_set1_ps(ro.y), _mm_set1_ps(ro.z),
+        _mm_set1_ps(rd.x), _mm_set1_ps(rd.y), _mm_set1_ps(rd.z)
+    };
+}
+
+CPU_TARGET_SSE41 static inline __m128 tri_half_sse41(const TriBlock* b, int half, const BlockRay4* ray)
+{
+    int o = 4 * half;
+    __m128 e1x = _mm_loadu_ps(b->e1x + o), e1y = _mm_loadu_ps(b->e1y + o), e1z = _mm_loadu_ps(b->e1z + o);
+    __m128 e2x = _mm_loadu_ps(b->e2x + o), e2y = _mm_loadu_ps(b->e2y + o), e2z = _mm_loadu_ps(b->e2z + o);
+
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(ray->dy, e2z), _mm_mul_ps(ray->dz, e2y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(ray->dz, e2x), _mm_mul_ps(ray->dx, e2z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(ray->dx, e2y), _mm_mul_ps(ray->dy, e2x));
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+    __m128 ok = _mm_or_ps(_mm_cmple_ps(a, _mm_set1_ps(-0.001f)), _mm_cmpge_ps(a, _mm_set1_ps(0.001f)));
+
+    __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+    __m128 sx = _mm_sub_ps(ray->ox, _mm_loadu_ps(b->v0x + o));
+    __m128 sy = _mm_sub_ps(ray->oy, _mm_loadu_ps(b->v0y + o));
+    __m128 sz = _mm_sub_ps(ray->oz, _mm_loadu_ps(b->v0z + o));
+    __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(u, _mm_setzero_ps()));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(u, _mm_set1_ps(1.0f)));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ray->dx, qx), _mm_mul_ps(ray->dy, qy)), _mm_mul_ps(ray->dz, qz)));
+    ok = _mm_and_ps(ok, _mm_cmpge_ps(v, _mm_setzero_ps()));
+    ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+
+    __m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+    return _mm_blendv_ps(_mm_set1_ps(-1.0f), t, ok);
+}
+
+CPU_TARGET_SSE41 static inline __m128 sphere_half_sse41(const SphereBlock* b, int half, const BlockRay4* ray)
+{
+    int o = 4 * half;
+    __m128 ocx = _mm_sub_ps(ray->ox, _mm_loadu_ps(b->cx + o));
+    __m128 ocy = _mm_sub_ps(ray->oy, _mm_loadu_ps(b->cy + o));
+    __m128 ocz = _mm_sub_ps(ray->oz, _mm_loadu_ps(b->cz + o));
+
+    __m128 bb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ray->dx), _mm_mul_ps(ocy, ray->dy)), _mm_mul_ps(ocz, ray->dz));
+    __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+    c = _mm_sub_ps(c, _mm_loadu_ps(b->r2 + o));
+    __m128 h = _mm_sub_ps(_mm_mul_ps(bb, bb), c);
+
+    __m128 t = _mm_sub_ps(_mm_xor_ps(bb, _mm_set1_ps(-0.0f)), _mm_sqrt_ps(h));
+    return _mm_blendv_ps(_mm_set1_ps(-1.0f), t, _mm_cmpge_ps(h, _mm_setzero_ps()));
+}
+
+// Per lane bests kept in registers, strictly closer replaces so the first index of a tie stays
+#define SSE41_BLOCKS_CLOSEST(kernel) \
+    BlockRay4 ray = block_ray4(ro, rd); \
+    __m128 best_t = _mm_set1_ps(t_max); \
+    __m128i best_index = _mm_set1_epi32(-1); \
+    for (size_t b = 0; b < num_blocks; b++) \
+    { \
+        for (int half = 0; half < 2; half++) \
+        { \
+            __m128 t = kernel(&blocks[b], half, &ray); \
+            __m128 closer = _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(HIT_EPSILON)), _mm_cmplt_ps(t, best_t)); \
+            __m128i index = _mm_add_epi32(_mm_set1_epi32((int)(b * PRIM_BLOCK_SIZE) + 4 * half), _mm_setr_epi32(0, 1, 2, 3)); \
+            best_t = _mm_blendv_ps(best_t, t, closer); \
+            best_index = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(best_index), _mm_castsi128_ps(index), closer)); \
+        } \
+    } \
+    float lane_t[4]; \
+    int lane_index[4]; \
+    _mm_storeu_ps(lane_t, best_t); \
+    _mm_storeu_si128((__m128i*)lane_index, best_index); \
+    return reduce_lanes(lane_t, lane_index, 4, t_max, hit);
+
+CPU_TARGET_SSE41 static bool tri_blocks_sse41(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    SSE41_BLOCKS_CLOSEST(tri_half_sse41)
+}
+
+CPU_TARGET_SSE41 static bool sphere_blocks_sse41(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    SSE41_BLOCKS_CLOSEST(sphere_half_sse41)
+}
+
+#define AVX2_BLOCKS_CLOSEST(kernel) \
+    BlockRay8 ray = block_ray8(ro, rd); \
+    __m256 best_t = _mm256_set1_ps(t_max); \
+    __m256i best_index = _mm256_set1_epi32(-1); \
+    for (size_t b = 0; b < num_blocks; b++) \
+    { \
+        __m256 t = kernel(&blocks[b], &ray); \
+        __m256 closer = _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(HIT_EPSILON), _CMP_GT_OQ), _mm256_cmp_ps(t, best_t, _CMP_LT_OQ)); \
+        __m256i index = _mm256_add_epi32(_mm256_set1_epi32((int)(b * PRIM_BLOCK_SIZE)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)); \
+        best_t = _mm256_blendv_ps(best_t, t, closer); \
+        best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index), _mm256_castsi256_ps(index), closer)); \
+    } \
+    float lane_t[8]; \
+    int lane_index[8]; \
+    _mm256_storeu_ps(lane_t, best_t); \
+    _mm256_storeu_si256((__m256i*)lane_index, best_index); \
+    return reduce_lanes(lane_t, lane_index, 8, t_max, hit);
+
+CPU_TARGET_AVX2 static bool tri_blocks_avx2(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    AVX2_BLOCKS_CLOSEST(tri_block_avx2)
+}
+
+CPU_TARGET_AVX2 static bool sphere_blocks_avx2(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    AVX2_BLOCKS_CLOSEST(sphere_block_avx2)
+}
+
+// Two blocks per register, a lone last block is loaded twice with its copy masked off
+
+typedef struct
+{
+    __m512 ox, oy, oz;
+    __m512 dx, dy, dz;
+} BlockRay16;
+
+CPU_TARGET_AVX512 static inline __m512 load_pair(const float* lo, const float* hi)
+{
+    __m512d wide = _mm512_castpd256_pd512(_mm256_castps_pd(_mm256_loadu_ps(lo)));
+    return _mm512_castpd_ps(_mm512_insertf64x4(wide, _mm256_castps_pd(_mm256_loadu_ps(hi)), 1));
+}
+
+CPU_TARGET_AVX512 static inline __m512 tri_pair_avx512(const TriBlock* b0, const TriBlock* b1, const BlockRay16* ray)
+{
+    __m512 e1x = load_pair(b0->e1x, b1->e1x), e1y = load_pair(b0->e1y, b1->e1y), e1z = load_pair(b0->e1z, b1->e1z);
+    __m512 e2x = load_pair(b0->e2x, b1->e2x), e2y = load_pair(b0->e2y, b1->e2y), e2z = load_pair(b0->e2z, b1->e2z);
+
+    __m512 hx = _mm512_sub_ps(_mm512_mul_ps(ray->dy, e2z), _mm512_mul_ps(ray->dz, e2y));
+    __m512 hy = _mm512_sub_ps(_mm512_mul_ps(ray->dz, e2x), _mm512_mul_ps(ray->dx, e2z));
+    __m512 hz = _mm512_sub_ps(_mm512_mul_ps(ray->dx, e2y), _mm512_mul_ps(ray->dy, e2x));
+    __m512 a = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, hx), _mm512_mul_ps(e1y, hy)), _mm512_mul_ps(e1z, hz));
+    __mmask16 ok = _mm512_cmp_ps_mask(a, _mm512_set1_ps(-0.001f), _CMP_LE_OQ) | _mm512_cmp_ps_mask(a, _mm512_set1_ps(0.001f), _CMP_GE_OQ);
+
+    __m512 f = _mm512_div_ps(_mm512_set1_ps(1.0f), a);
+    __m512 sx = _mm512_sub_ps(ray->ox, load_pair(b0->v0x, b1->v0x));
+    __m512 sy = _mm512_sub_ps(ray->oy, load_pair(b0->v0y, b1->v0y));
+    __m512 sz = _mm512_sub_ps(ray->oz, load_pair(b0->v0z, b1->v0z));
+    __m512 u = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, hx), _mm512_mul_ps(sy, hy)), _mm512_mul_ps(sz, hz)));
+    ok &= _mm512_cmp_ps_mask(u, _mm512_setzero_ps(), _CMP_GE_OQ) & _mm512_cmp_ps_mask(u, _mm512_set1_ps(1.0f), _CMP_LE_OQ);
+
+    __m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+    __m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+    __m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+    __m512 v = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ray->dx, qx), _mm512_mul_ps(ray->dy, qy)), _mm512_mul_ps(ray->dz, qz)));
+    ok &= _mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GE_OQ) & _mm512_cmp_ps_mask(_mm512_add_ps(u, v), _mm512_set1_ps(1.0f), _CMP_LE_OQ);
+
+    __m512 t = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)));
+    return _mm512_mask_blend_ps(ok, _mm512_set1_ps(-1.0f), t);
+}
+
+CPU_TARGET_AVX512 static inline __m512 sphere_pair_avx512(const SphereBlock* b0, const SphereBlock* b1, const BlockRay16* ray)
+{
+    __m512 ocx = _mm512_sub_ps(ray->ox, load_pair(b0->cx, b1->cx));
+    __m512 ocy = _mm512_sub_ps(ray->oy, load_pair(b0->cy, b1->cy));
+    __m512 ocz = _mm512_sub_ps(ray->oz, load_pair(b0->cz, b1->cz));
+
+    __m512 bb = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ray->dx), _mm512_mul_ps(ocy, ray->dy)), _mm512_mul_ps(ocz, ray->dz));
+    __m512 c = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz));
+    c = _mm512_sub_ps(c, load_pair(b0->r2, b1->r2));
+    __m512 h = _mm512_sub_ps(_mm512_mul_ps(bb, bb), c);
+
+    __m512 t = _mm512_sub_ps(_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(bb), _mm512_set1_epi32((int)0x80000000u))), _mm512_sqrt_ps(h));
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(h, _mm512_setzero_ps(), _CMP_GE_OQ), _mm512_set1_ps(-1.0f), t);
+}
+
+#define AVX512_BLOCKS_CLOSEST(kernel) \
+    BlockRay16 ray = { \
+        _mm512_set1_ps(ro.x), _mm512_set1_ps(ro.y), _mm512_set1_ps(ro.z), \
+        _mm512_set1_ps(rd.x), _mm512_set1_ps(rd.y), _mm512_set1_ps(rd.z) \
+    }; \
+    __m512 best_t = _mm512_set1_ps(t_max); \
+    __m512i best_index = _mm512_set1_epi32(-1); \
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); \
+    for (size_t b = 0; b < num_blocks; b += 2) \
+    { \
+        bool pair = b + 1 < num_blocks; \
+        __m512 t = kernel(&blocks[b], &blocks[pair ? b + 1 : b], &ray); \
+        __mmask16 closer = _mm512_cmp_ps_mask(t, _mm512_set1_ps(HIT_EPSILON), _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, best_t, _CMP_LT_OQ); \
+        if (!pair) {closer &= 0x00ff;} \
+        best_t = _mm512_mask_blend_ps(closer, best_t, t); \
+        best_index = _mm512_mask_blend_epi32(closer, best_index, _mm512_add_epi32(_mm512_set1_epi32((int)(b * PRIM_BLOCK_SIZE)), lanes)); \
+    } \
+    float lane_t[16]; \
+    int lane_index[16]; \
+    _mm512_storeu_ps(lane_t, best_t); \
+    _mm512_storeu_si512(lane_index, best_index); \
+    return reduce_lanes(lane_t, lane_index, 16, t_max, hit);
+
+CPU_TARGET_AVX512 static bool tri_blocks_avx512(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    AVX512_BLOCKS_CLOSEST(tri_pair_avx512)
+}
+
+CPU_TARGET_AVX512 static bool sphere_blocks_avx512(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    AVX512_BLOCKS_CLOSEST(sphere_pair_avx512)
+}
+#endif
+
+bool tri_blocks_closest_isa(CpuIsa isa, const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    switch (isa)
+    {
+#ifdef CPU_X86
+    case CPU_ISA_AVX512: return tri_blocks_avx512(blocks, num_blocks, ro, rd, t_max, hit);
+    case CPU_ISA_AVX2: return tri_blocks_avx2(blocks, num_blocks, ro, rd, t_max, hit);
+    case CPU_ISA_SSE41: return tri_blocks_sse41(blocks, num_blocks, ro, rd, t_max, hit);
+#endif
+    default: return tri_blocks_scalar(blocks, num_blocks, ro, rd, t_max, hit);
+    }
+}
+
+bool sphere_blocks_closest_isa(CpuIsa isa, const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    switch (isa)
+    {
+#ifdef CPU_X86
+    case CPU_ISA_AVX512: return sphere_blocks_avx512(blocks, num_blocks, ro, rd, t_max, hit);
+    case CPU_ISA_AVX2: return sphere_blocks_avx2(blocks, num_blocks, ro, rd, t_max, hit);
+    case CPU_ISA_SSE41: return sphere_blocks_sse41(blocks, num_blocks, ro, rd, t_max, hit);
+#endif
+    default: return sphere_blocks_scalar(blocks, num_blocks, ro, rd, t_max, hit);
+    }
+}
+
+// A lone block would fill half an AVX-512 register, AVX2 does it in one
+static CpuIsa blocks_isa(size_t num_blocks)
+{
+    CpuIsa isa = cpu_isa();
+    return isa == CPU_ISA_AVX512 && num_blocks < 2 ? CPU_ISA_AVX2 : isa;
+}
+
+bool tri_blocks_closest(const TriBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    return tri_blocks_closest_isa(blocks_isa(num_blocks), blocks, num_blocks, ro, rd, t_max, hit);
+}
+
+bool sphere_blocks_closest(const SphereBlock* blocks, size_t num_blocks, Vec3 ro, Vec3 rd, float t_max, PrimBlockHit* hit)
+{
+    return sphere_blocks_closest_isa(blocks_isa(num_blocks), blocks, num_blocks, ro, rd, t_max, hit);
+}
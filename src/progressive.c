@@ -0,0 +1,211 @@
+#include "progressive.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+ProgressiveOptions progressive_default_options(void)
+{
+    // A few ms of the 33 left for the blit and input
+    ProgressiveOptions options = {0.028, 4, 0};
+    return options;
+}
+
+bool progressive_init(ProgressiveView* view, int width, int height, const ProgressiveOptions* options)
+{
+    memset(view, 0, sizeof(*view));
+    // Room for the costs of the smaller tiles, those of the depth first loop
+    size_t tiles = (size_t)((width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE) * ((height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE);
+    view->tile_seconds = (double*)calloc(tiles, sizeof(double));
+    if (view->tile_seconds == NULL || !render_image_init(&view->full, width, height) || !render_image_init(&view->preview, width, height))
+    {
+        progressive_free(view);
+        return false;
+    }
+    view->options = *options;
+    if (view->options.max_scale < 1) {view->options.max_scale = 1;}
+    if (view->options.max_scale > PROGRESSIVE_MAX_SCALE) {view->options.max_scale = PROGRESSIVE_MAX_SCALE;}
+    view->scale = view->options.max_scale;
+    return true;
+}
+
+void progressive_free(ProgressiveView* view)
+{
+    render_image_free(&view->full);
+    render_image_free(&view->preview);
+    free(view->tile_seconds);
+    memset(view, 0, sizeof(*view));
+}
+
+void progressive_reset(ProgressiveView* view)
+{
+    view->has_camera = false;
+}
+
+static int scaled(int size, int scale) {return (size + scale - 1) / scale;}
+
+// Finished frames of the full image, the one in progress does not count yet
+static int full_frames(const ProgressiveView* view)
+{
+    return view->full.frame_count - (view->next_tile > 0 ? 1 : 0);
+}
+
+static bool refining(const ProgressiveView* view)
+{
+    return view->options.max_frames <= 0 || full_frames(view) < view->options.max_frames;
+}
+
+// Running average so one slow frame (a page fault storm, another process) does not swing the scale
+static void measure(ProgressiveView* view, double samples, double seconds)
+{
+    if (samples <= 0.0) {return;}
+    double cost = seconds / samples;
+    view->sample_seconds = view->sample_seconds > 0.0 ? 0.75 * view->sample_seconds + 0.25 * cost : cost;
+}
+
+// Seconds tile n is expected to take: what it took in the last pass, else what the tiles of the
+// last run took each
+static double tile_cost(const ProgressiveView* view, int n, double run_tile)
+{
+    return view->tile_seconds[n] > 0.0 ? view->tile_seconds[n] : run_tile;
+}
+
+// Finest scale whose frame fits the budget, the coarsest until something was measured
+static int pick_scale(const ProgressiveView* view)
+{
+    const ProgressiveOptions* options = &view->options;
+    if (view->sample_seconds <= 0.0) {return options->max_scale;}
+    for (int scale = 1; scale < options->max_scale; scale++)
+    {
+        double samples = (double)scaled(view->full.width, scale) * scaled(view->full.height, scale);
+        if (samples * view->sample_seconds <= options->budget) {return scale;}
+    }
+    return options->max_scale;
+}
+
+ProgressiveFrame progressive_update(ProgressiveView* view, const Scene* scene, const BVH* bvh, const RenderSettings* settings)
+{
+    ProgressiveFrame frame = {false, 1, 0, 0, 0.0};
+    double start = timer_seconds();
+    int width = view->full.width, height = view->full.height;
+
+    if (!view->has_camera || memcmp(&view->camera, &settings->camera, sizeof(Camera)) != 0)
+    {
+        // Moved: start over, with one sample per pixel at whatever resolution fits
+        view->camera = settings->camera;
+        view->has_camera = true;
+        view->next_tile = 0;
+        view->cost_tile = 0;
+        render_image_reset(&view->full);
+        view->scale = pick_scale(view);
+        if (view->scale == 1) {render_frame(&view->full, scene, bvh, settings, NULL);}
+        else
+        {
+            view->preview.width = scaled(width, view->scale);
+            view->preview.height = scaled(height, view->scale);
+            render_image_reset(&view->preview);
+            render_frame(&view->preview, scene, bvh, settings, NULL);
+        }
+        frame.samples = scaled(width, view->scale) * scaled(height, view->scale);
+        measure(view, frame.samples, timer_seconds() - start);
+        frame.moving = true;
+    }
+    else if (refining(view))
+    {
+        // Still: runs of the tiles left in the current tile row, or whole tile rows, with the clock
+        // checked between runs. A run is sized to half of what is left of the budget from what
+        // each of its tiles cost in the last pass (tiles differ a lot, an average over the frame
+        // overshoots on the costly ones). Tiles not rendered since the camera stopped are guessed
+        // from the last run, whose tile count at most doubles meanwhile, starting at one tile per
+        // thread. At least one tile per update.
+        int tile = settings->wavefront ? RENDER_STREAM_TILE : RENDER_TILE_SIZE;
+        int tiles_x = scaled(width, tile), tiles_y = scaled(height, tile);
+        if (view->cost_tile != tile)
+        {
+            memset(view->tile_seconds, 0, (size_t)scaled(width, RENDER_TILE_SIZE) * scaled(height, RENDER_TILE_SIZE) * sizeof(double));
+            view->cost_tile = tile;
+        }
+        int threads = settings->threads > 0 ? settings->threads : parallel_thread_count();
+        double run_tile = view->sample_seconds * tile * tile;
+        int run_tiles = 0;
+        do
+        {
+            double left = view->options.budget - (timer_seconds() - start);
+            int tx = view->next_tile % tiles_x, ty = view->next_tile / tiles_x;
+            int most = tx > 0 ? tiles_x - tx : (tiles_y - ty) * tiles_x;
+            int most_guessed = run_tiles > 0 ? 2 * run_tiles : threads;
+            int tiles = 0, guessed = 0;
+            double estimate = 0.0;
+            while (tiles < most)
+            {
+                int n = view->next_tile + tiles;
+                bool guess = view->tile_seconds[n] <= 0.0;
+                double cost = tile_cost(view, n, run_tile);
+                if (tiles > 0 && (estimate + cost > 0.5 * left || (guess && guessed >= most_guessed))) {break;}
+                estimate += cost;
+                guessed += guess ? 1 : 0;
+                tiles++;
+            }
+
+            ParallelTile region;
+            if (tx > 0 || tiles < tiles_x) {region = (ParallelTile){tx * tile, ty * tile, (tx + tiles) * tile, (ty + 1) * tile};}
+            else
+            {
+                tiles -= tiles % tiles_x;
+                region = (ParallelTile){0, ty * tile, width, (ty + tiles / tiles_x) * tile};
+            }
+            if (region.x1 > width) {region.x1 = width;}
+            if (region.y1 > height) {region.y1 = height;}
+
+            if (view->next_tile == 0) {view->full.frame_count++;}
+            double run_start = timer_seconds();
+            render_frame_region(&view->full, scene, bvh, settings, region, NULL);
+            double run_seconds = timer_seconds() - run_start;
+            int samples = (region.x1 - region.x0) * (region.y1 - region.y0);
+            measure(view, samples, run_seconds);
+
+            run_tile = run_seconds / tiles;
+            run_tiles = tiles;
+            for (int i = 0; i < tiles; i++) {view->tile_seconds[view->next_tile + i] = run_tile;}
+            frame.samples += samples;
+            view->next_tile += tiles;
+            if (view->next_tile >= tiles_x * tiles_y) {view->next_tile = 0;}
+        } while (timer_seconds() - start + tile_cost(view, view->next_tile, run_tile) <= view->options.budget && refining(view));
+    }
+
+    bool full = full_frames(view) > 0;
+    frame.scale = full ? 1 : view->scale;
+    frame.frames = full ? full_frames(view) : view->preview.frame_count;
+    frame.seconds = timer_seconds() - start;
+    return frame;
+}
+
+void progressive_display(const ProgressiveView* view, unsigned char* rgb)
+{
+    bool full = full_frames(view) > 0;
+    const RenderImage* image = full ? &view->full : &view->preview;
+    int scale = full ? 1 : view->scale;
+    int width = view->full.width, height = view->full.height;
+
+    for (int y = 0; y < height; y++)
+    {
+        unsigned char* row = &rgb[(size_t)(height - 1 - y) * width * 3];
+        if (image->frame_count == 0)
+        {
+            memset(row, 0, (size_t)width * 3);
+            continue;
+        }
+        // Clamped like the display pass
+        const float* h = &image->history[(size_t)(y / scale) * image->width * 3];
+        for (int x = 0; x < width; x++)
+        {
+            const float* p = &h[3 * (x / scale)];
+            for (int c = 0; c < 3; c++)
+            {
+                float v = p[c] < 0.0f ? 0.0f : (p[c] > 1.0f ? 1.0f : p[c]);
+                row[3 * x + c] = (unsigned char)(v * 255.0f + 0.5f);
+            }
+        }
+    }
+}
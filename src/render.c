@@ -0,0 +1,799 @@
+#include "render.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "camera.h"
+#include "intersect.h"
+#include "bvh_packet.h"
+#include "bvh_wide.h"
+#include "parallel.h"
+#include "hash.h"
+
+#ifndef M_PI
+#define M_PI 3.1415926
+#endif
+
+// Lets the path kernel below be compiled once per scene feature set (RENDER_KERNEL_*) with the
+// tests on prim type and emission folded away
+#ifdef __GNUC__
+#define RENDER_INLINE static inline __attribute__((always_inline))
+#else
+#define RENDER_INLINE static inline
+#endif
+
+static unsigned int pcg_hash(unsigned int* state)
+{
+    *state = *state * 747796405u + 2891336453u;
+    unsigned int word = ((*state >> ((*state >> 28u) + 4u)) ^ *state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static float random_float(unsigned int* state)
+{
+    return (float)pcg_hash(state) * 2.3283064365386963e-10f;
+}
+
+static Vec3 v3_mix(Vec3 a, Vec3 b, float t) {return v3_add(v3_scale(a, 1.0f - t), v3_scale(b, t));}
+static float mixf(float a, float b, float t) {return a * (1.0f - t) + b * t;}
+static Vec3 material_color(const Material* mat) {return v3(mat->cr, mat->cg, mat->cb);}
+
+// Orthonormal basis around n, shared by cosHemisphere and the light cone
+static void basis(Vec3 n, Vec3* tangent, Vec3* bitangent)
+{
+    Vec3 up = fabsf(n.z) < 0.999f ? v3(0.0f, 0.0f, 1.0f) : v3(1.0f, 0.0f, 0.0f);
+    *tangent = v3_normalize(v3_cross(up, n));
+    *bitangent = v3_cross(n, *tangent);
+}
+
+static Vec3 cos_hemisphere(Vec3 n, unsigned int* seed)
+{
+    float r1 = random_float(seed);
+    float r2 = random_float(seed);
+
+    float phi = 2.0f * (float)M_PI * r1;
+    float cos_theta = sqrtf(1.0f - r2);
+    float sin_theta = sqrtf(r2);
+
+    Vec3 tangent, bitangent;
+    basis(n, &tangent, &bitangent);
+    return v3_add(v3_add(v3_scale(tangent, cosf(phi) * sin_theta), v3_scale(bitangent, sinf(phi) * sin_theta)), v3_scale(n, cos_theta));
+}
+
+static Vec3 reflect(Vec3 i, Vec3 n) {return v3_sub(i, v3_scale(n, 2.0f * v3_dot(n, i)));}
+
+// What single rays are traced through: the wide BVH when there is one, the binary one otherwise
+typedef struct
+{
+    const Scene* scene;
+    const BVH* bvh;
+    const WideBVH* wide;
+} Tracer;
+
+// What a kernel variant knows about the scene. Constant in every variant but the generic one,
+// which leaves each test to the hit or the material.
+RENDER_INLINE bool kernel_mixed(unsigned int kernel)
+{
+    unsigned int prims = RENDER_KERNEL_SPHERES | RENDER_KERNEL_TRIANGLES;
+    return kernel == RENDER_KERNEL_GENERIC || (kernel & prims) == prims;
+}
+
+RENDER_INLINE bool kernel_sphere_hit(unsigned int kernel, const Hit* hit)
+{
+    return kernel_mixed(kernel) ? hit->type == HIT_SPHERE : (kernel & RENDER_KERNEL_SPHERES) != 0;
+}
+
+RENDER_INLINE bool kernel_emissive(unsigned int kernel)
+{
+    return kernel == RENDER_KERNEL_GENERIC || (kernel & RENDER_KERNEL_EMISSIVE) != 0;
+}
+
+// Only spheres are sampled as lights
+RENDER_INLINE bool kernel_lights(unsigned int kernel)
+{
+    unsigned int lights = RENDER_KERNEL_SPHERES | RENDER_KERNEL_EMISSIVE;
+    return kernel == RENDER_KERNEL_GENERIC || (kernel & lights) == lights;
+}
+
+RENDER_INLINE BVHPrims kernel_prims(unsigned int kernel)
+{
+    if (kernel_mixed(kernel)) {return BVH_PRIMS_MIXED;}
+    return (kernel & RENDER_KERNEL_SPHERES) != 0 ? BVH_PRIMS_SPHERES : BVH_PRIMS_TRIANGLES;
+}
+
+RENDER_INLINE bool trace_closest(const Tracer* tracer, Vec3 ro, Vec3 rd, Hit* hit, unsigned int kernel)
+{
+    if (tracer->wide != NULL) {return bvh_wide_intersect(tracer->wide, tracer->scene, ro, rd, hit, NULL);}
+    return bvh_intersect_prims(tracer->bvh, tracer->scene, ro, rd, kernel_prims(kernel), hit, NULL);
+}
+
+RENDER_INLINE bool trace_occluded(const Tracer* tracer, Vec3 ro, Vec3 rd, float t_max, unsigned int kernel)
+{
+    if (tracer->wide != NULL) {return bvh_wide_occluded(tracer->wide, tracer->scene, ro, rd, t_max, NULL);}
+    return bvh_occluded_prims(tracer->bvh, tracer->scene, ro, rd, t_max, kernel_prims(kernel), NULL);
+}
+
+// sampleLight of raytrace.frag: radiance * cos / pdf towards one emissive sphere
+RENDER_INLINE Vec3 sample_light(const Tracer* tracer, Vec3 pos, Vec3 normal, unsigned int* seed, unsigned int kernel)
+{
+    const Scene* scene = tracer->scene;
+    if (!kernel_lights(kernel)) {return v3(0.0f, 0.0f, 0.0f);}
+
+    int num_lights = 0;
+    for (size_t i = 0; i < scene->num_spheres; i++)
+    {
+        if (scene->materials[scene->spheres[i].material_index].emission > 0.0f) {num_lights++;}
+    }
+    if (num_lights == 0) {return v3(0.0f, 0.0f, 0.0f);}
+
+    int pick = (int)(random_float(seed) * (float)num_lights);
+    if (pick > num_lights - 1) {pick = num_lights - 1;}
+    size_t light_index = 0;
+    for (size_t i = 0; i < scene->num_spheres; i++)
+    {
+        if (scene->materials[scene->spheres[i].material_index].emission <= 0.0f) {continue;}
+        if (pick-- == 0)
+        {
+            light_index = i;
+            break;
+        }
+    }
+
+    const Sphere* light = &scene->spheres[light_index];
+    Vec3 to_center = v3_sub(v3(light->px, light->py, light->pz), pos);
+    float dist2 = v3_dot(to_center, to_center);
+    float radius2 = light->radius * light->radius;
+    if (dist2 <= radius2) {return v3(0.0f, 0.0f, 0.0f);}
+
+    float cos_max = sqrtf(1.0f - radius2 / dist2);
+    float cos_theta = 1.0f - random_float(seed) * (1.0f - cos_max);
+    float sin_theta = sqrtf(fmaxf(1.0f - cos_theta * cos_theta, 0.0f));
+    float phi = 2.0f * (float)M_PI * random_float(seed);
+
+    Vec3 w = v3_scale(to_center, 1.0f / sqrtf(dist2));
+    Vec3 tangent, bitangent;
+    basis(w, &tangent, &bitangent);
+    Vec3 dir = v3_normalize(v3_add(v3_add(v3_scale(tangent, cosf(phi) * sin_theta), v3_scale(bitangent, sinf(phi) * sin_theta)), v3_scale(w, cos_theta)));
+
+    float cos_surface = v3_dot(normal, dir);
+    if (cos_surface <= 0.0f) {return v3(0.0f, 0.0f, 0.0f);}
+
+    // The light itself sits at t, anything closer blocks it
+    float t = hit_sphere(light, pos, dir);
+    if (t <= 0.0f || trace_occluded(tracer, pos, dir, t * 0.999f, kernel)) {return v3(0.0f, 0.0f, 0.0f);}
+
+    const Material* mat = &scene->materials[light->material_index];
+    float pdf = 1.0f / (2.0f * (float)M_PI * (1.0f - cos_max));
+    return v3_scale(material_color(mat), mat->emission * cos_surface / pdf * (float)num_lights);
+}
+
+static Vec3 triangle_normal(const Scene* scene, int tri_index)
+{
+    if (scene->tri_records != NULL)
+    {
+        const TriRecord* rec = &scene->tri_records[tri_index];
+        return v3(rec->nx, rec->ny, rec->nz);
+    }
+
+    const unsigned int* idx = scene->mesh.indices + 3 * tri_index;
+    Vec3 v0 = mesh_vertex(&scene->mesh, idx[0]);
+    Vec3 edge1 = v3_sub(mesh_vertex(&scene->mesh, idx[1]), v0);
+    Vec3 edge2 = v3_sub(mesh_vertex(&scene->mesh, idx[2]), v0);
+    return v3_normalize(v3_cross(edge1, edge2));
+}
+
+// One path in flight: the next ray and what it has gathered so far
+typedef struct
+{
+    Vec3 ro, rd;
+    Vec3 accumulated, throughput;
+    // Set after a diffuse bounce that sampled the lights directly, so hitting one next isn't counted twice
+    bool light_sampled;
+} PathState;
+
+static PathState path_start(Vec3 ro, Vec3 rd)
+{
+    return (PathState){ro, rd, v3(0.0f, 0.0f, 0.0f), v3(1.0f, 1.0f, 1.0f), false};
+}
+
+// Body of the bounce loop after the hit: shading, the next ray and Russian roulette. False
+// once the path ends.
+RENDER_INLINE bool path_bounce(const Tracer* tracer, PathState* path, const Hit* hit, unsigned int* seed, bool light_sampling, unsigned int kernel)
+{
+    const Scene* scene = tracer->scene;
+    Vec3 rd = path->rd;
+    Vec3 hit_pos = v3_add(path->ro, v3_scale(rd, hit->t));
+    Vec3 normal;
+    int mat_index;
+    if (kernel_sphere_hit(kernel, hit))
+    {
+        const Sphere* s = &scene->spheres[hit->index];
+        normal = v3_normalize(v3_sub(hit_pos, v3(s->px, s->py, s->pz)));
+        mat_index = s->material_index;
+    }
+    else
+    {
+        normal = triangle_normal(scene, hit->index);
+        mat_index = RENDER_TRIANGLE_MATERIAL;
+
+        // Flip normal if hit back face
+        if (v3_dot(normal, rd) > 0.0f) {normal = v3_scale(normal, -1.0f);}
+    }
+    const Material* mat = &scene->materials[mat_index];
+    Vec3 color = material_color(mat);
+
+    if (kernel_emissive(kernel) && !path->light_sampled) {path->accumulated = v3_add(path->accumulated, v3_mul(v3_scale(color, mat->emission), path->throughput));}
+    path->light_sampled = false;
+
+    // Schlick Fresnel
+    float fresnel = 0.04f + (1.0f - 0.04f) * powf(1.0f - fmaxf(v3_dot(normal, v3_scale(rd, -1.0f)), 0.0f), 5.0f);
+    bool is_specular = random_float(seed) < mixf(fresnel, 1.0f, mat->metallic);
+
+    if (is_specular)
+    {
+        Vec3 reflect_dir = reflect(rd, normal);
+        path->rd = v3_normalize(v3_mix(reflect_dir, cos_hemisphere(normal, seed), mat->roughness * mat->roughness));
+        path->throughput = v3_mul(path->throughput, v3_mix(v3(1.0f, 1.0f, 1.0f), color, mat->metallic));
+    }
+    else
+    {
+        if (light_sampling)
+        {
+            Vec3 direct = sample_light(tracer, v3_add(hit_pos, v3_scale(normal, 0.001f)), normal, seed, kernel);
+            path->accumulated = v3_add(path->accumulated, v3_mul(v3_mul(path->throughput, v3_scale(color, 1.0f / (float)M_PI)), direct));
+            path->light_sampled = true;
+        }
+        path->rd = cos_hemisphere(normal, seed);
+        path->throughput = v3_mul(path->throughput, color);
+    }
+
+    // Offset to prevent self intersection
+    path->ro = v3_add(hit_pos, v3_scale(normal, 0.001f));
+
+    float p = fmaxf(path->throughput.x, fmaxf(path->throughput.y, path->throughput.z));
+    if (random_float(seed) > p) {return false;}
+    path->throughput = v3_scale(path->throughput, 1.0f / p);
+    return true;
+}
+
+// The rest of the bounce loop from bounce on, one ray at a time
+RENDER_INLINE void path_trace(const Tracer* tracer, PathState* path, int bounce, unsigned int* seed, bool light_sampling, unsigned int kernel)
+{
+    for (; bounce < RENDER_MAX_BOUNCES; bounce++)
+    {
+        Hit hit;
+        // The sky is black, a miss adds nothing
+        if (!trace_closest(tracer, path->ro, path->rd, &hit, kernel)) {break;}
+        if (!path_bounce(tracer, path, &hit, seed, light_sampling, kernel)) {break;}
+    }
+}
+
+Vec3 render_trace_path(const Scene* scene, const BVH* bvh, Vec3 ro, Vec3 rd, unsigned int* seed, bool light_sampling)
+{
+    Tracer tracer = {scene, bvh, NULL};
+    PathState path = path_start(ro, rd);
+    path_trace(&tracer, &path, 0, seed, light_sampling, RENDER_KERNEL_GENERIC);
+    return path.accumulated;
+}
+
+bool render_image_init(RenderImage* image, int width, int height)
+{
+    memset(image, 0, sizeof(*image));
+    if (width <= 0 || height <= 0) {return false;}
+
+    image->history = (float*)calloc((size_t)width * height * 3, sizeof(float));
+    if (image->history == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for %dx%d image\n", width, height);
+        return false;
+    }
+    image->width = width;
+    image->height = height;
+    return true;
+}
+
+void render_image_free(RenderImage* image)
+{
+    free(image->history);
+    memset(image, 0, sizeof(*image));
+}
+
+// Wavefront mode: every path of a stream tile advances one bounce at a time. The live rays are
+// sorted by direction octant, then origin cell along a Morton curve, and traced one after the
+// other in that order so consecutive rays walk the same part of the tree; the hits are then
+// shaded from one queue per material. Each path keeps its own seed, so the image is the one
+// depth first tracing gives. One stream per thread, sized for a whole stream tile.
+typedef struct
+{
+    PathState* paths;
+    unsigned int* seeds;
+    Hit* hits;
+    int* live;      // Paths to trace this bounce, sorted in place
+    int* shade;     // Paths that hit, by material
+    int* scratch;
+    unsigned int* keys;
+    unsigned int* scratch_keys;
+    int* material_start; // num_materials + 1 counts
+} RayStream;
+
+static void stream_free(RayStream* stream)
+{
+    free(stream->paths);
+    free(stream->seeds);
+    free(stream->hits);
+    free(stream->live);
+    free(stream->shade);
+    free(stream->scratch);
+    free(stream->keys);
+    free(stream->scratch_keys);
+    free(stream->material_start);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static bool stream_alloc(RayStream* stream, size_t count, size_t num_materials)
+{
+    stream->paths = (PathState*)malloc(count * sizeof(PathState));
+    stream->seeds = (unsigned int*)malloc(count * sizeof(unsigned int));
+    stream->hits = (Hit*)malloc(count * sizeof(Hit));
+    stream->live = (int*)malloc(count * sizeof(int));
+    stream->shade = (int*)malloc(count * sizeof(int));
+    stream->scratch = (int*)malloc(count * sizeof(int));
+    stream->keys = (unsigned int*)malloc(count * sizeof(unsigned int));
+    stream->scratch_keys = (unsigned int*)malloc(count * sizeof(unsigned int));
+    stream->material_start = (int*)malloc((num_materials + 1) * sizeof(int));
+    if (stream->paths == NULL || stream->seeds == NULL || stream->hits == NULL || stream->live == NULL || stream->shade == NULL ||
+        stream->scratch == NULL || stream->keys == NULL || stream->scratch_keys == NULL || stream->material_start == NULL)
+    {
+        stream_free(stream);
+        return false;
+    }
+    return true;
+}
+
+// One sample per pixel of the tiles handed to render_tile_kernel, added either to the running mean of
+// image or to the linear sums of region
+typedef struct
+{
+    Tracer tracer;
+    const RenderSettings* settings;
+    int width, height; // Of the whole image, for the camera rays and seeds
+    int frame;         // frame_count of the sample
+    RenderImage* image;
+    float* sums;        // Instead of image if not NULL, 3 floats per region pixel
+    ParallelTile region; // Tiles are relative to its corner
+    RayStream* streams;  // Wavefront mode, PARALLEL_MAX_THREADS of them, NULL for depth first
+} FrameJob;
+
+// Pixel seed and jittered camera ray, as at the top of main()
+static PathState pixel_start(const FrameJob* job, int x, int y, unsigned int* seed)
+{
+    *seed = (unsigned int)x + (unsigned int)y * (unsigned int)job->width + ((unsigned int)job->frame + job->settings->seed_offset) * 7125413u;
+
+    float jx = random_float(seed) - 0.5f;
+    float jy = random_float(seed) - 0.5f;
+    Vec3 ro, rd;
+    camera_ray(&job->settings->camera, (float)x + 0.5f + jx, (float)y + 0.5f + jy, job->width, job->height, &ro, &rd);
+    return path_start(ro, rd);
+}
+
+// Same round trip through gamma space as the accumulation texture
+static void pixel_accumulate(const FrameJob* job, int x, int y, Vec3 radiance)
+{
+    float sample[3] = {radiance.x, radiance.y, radiance.z};
+    if (job->sums != NULL)
+    {
+        float* s = &job->sums[3 * ((size_t)(y - job->region.y0) * (job->region.x1 - job->region.x0) + (x - job->region.x0))];
+        for (int c = 0; c < 3; c++) {s[c] += sample[c];}
+        return;
+    }
+
+    RenderImage* image = job->image;
+    float weight = 1.0f / (float)image->frame_count;
+    float* h = &image->history[3 * ((size_t)y * image->width + x)];
+    for (int c = 0; c < 3; c++)
+    {
+        float prev = image->frame_count > 1 ? powf(h[c], 2.2f) : 0.0f;
+        h[c] = powf(mixf(prev, sample[c], weight), 1.0f / 2.2f);
+    }
+}
+
+// 4x2 pixel blocks traced as packets for the first packet_bounces bounces, each path goes on
+// alone after that. Lanes outside the tile or whose path ended are switched off.
+RENDER_INLINE void render_block(const FrameJob* job, ParallelTile tile, int x0, int y0, unsigned int kernel)
+{
+    const RenderSettings* settings = job->settings;
+    PathState paths[BVH_PACKET_SIZE];
+    unsigned int seeds[BVH_PACKET_SIZE];
+    unsigned int alive = 0;
+    for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+    {
+        int x = x0 + lane % RENDER_PACKET_WIDTH, y = y0 + lane / RENDER_PACKET_WIDTH;
+        if (x >= tile.x1 || y >= tile.y1) {continue;}
+        paths[lane] = pixel_start(job, x, y, &seeds[lane]);
+        alive |= 1u << lane;
+    }
+    unsigned int traced = alive;
+
+    int bounce = 0;
+    for (; bounce < settings->packet_bounces && bounce < RENDER_MAX_BOUNCES && alive != 0; bounce++)
+    {
+        RayPacket packet;
+        packet.active = 0;
+        for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+        {
+            if (alive >> lane & 1u) {ray_packet_set(&packet, lane, paths[lane].ro, paths[lane].rd);}
+        }
+
+        Hit hits[BVH_PACKET_SIZE];
+        bvh_intersect_packet(job->tracer.bvh, job->tracer.scene, &packet, hits, NULL);
+        for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+        {
+            if (!(alive >> lane & 1u)) {continue;}
+            if (hits[lane].type == HIT_NONE || !path_bounce(&job->tracer, &paths[lane], &hits[lane], &seeds[lane], settings->light_sampling, kernel))
+            {
+                alive &= ~(1u << lane);
+            }
+        }
+    }
+
+    for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+    {
+        if (!(traced >> lane & 1u)) {continue;}
+        if (alive >> lane & 1u) {path_trace(&job->tracer, &paths[lane], bounce, &seeds[lane], settings->light_sampling, kernel);}
+        pixel_accumulate(job, x0 + lane % RENDER_PACKET_WIDTH, y0 + lane / RENDER_PACKET_WIDTH, paths[lane].accumulated);
+    }
+}
+
+// 9 bits spread to every third bit
+static unsigned int morton_spread(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xff0000ffu;
+    v = (v * 0x00000101u) & 0x0f00f00fu;
+    v = (v * 0x00000011u) & 0xc30c30c3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static unsigned int morton_cell(float x, float lo, float scale)
+{
+    float cell = (x - lo) * scale;
+    if (!(cell > 0.0f)) {return 0;}
+    return cell < 511.0f ? (unsigned int)cell : 511u;
+}
+
+// Direction octant in bits 27..29 above a 27 bit Morton code of the origin's cell in the scene box
+static unsigned int stream_key(AABB box, Vec3 scale, Vec3 ro, Vec3 rd)
+{
+    unsigned int octant = (rd.x < 0.0f ? 1u : 0u) | (rd.y < 0.0f ? 2u : 0u) | (rd.z < 0.0f ? 4u : 0u);
+    unsigned int cx = morton_cell(ro.x, box.min.x, scale.x);
+    unsigned int cy = morton_cell(ro.y, box.min.y, scale.y);
+    unsigned int cz = morton_cell(ro.z, box.min.z, scale.z);
+    return octant << 27 | morton_spread(cx) << 2 | morton_spread(cy) << 1 | morton_spread(cz);
+}
+
+// Stable LSD radix sort of live[0..count) by keys, 8 bits per pass
+static void stream_sort(RayStream* stream, int count)
+{
+    unsigned int* keys = stream->keys;
+    int* items = stream->live;
+    unsigned int* other_keys = stream->scratch_keys;
+    int* other_items = stream->scratch;
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        int start[257] = {0};
+        for (int i = 0; i < count; i++) {start[(keys[i] >> shift & 0xffu) + 1]++;}
+        if (start[(keys[0] >> shift & 0xffu) + 1] == count) {continue;} // One digit throughout
+        for (int d = 0; d < 256; d++) {start[d + 1] += start[d];}
+        for (int i = 0; i < count; i++)
+        {
+            int at = start[keys[i] >> shift & 0xffu]++;
+            other_keys[at] = keys[i];
+            other_items[at] = items[i];
+        }
+        unsigned int* k = keys; keys = other_keys; other_keys = k;
+        int* it = items; items = other_items; other_items = it;
+    }
+    if (items != stream->live) {memcpy(stream->live, items, count * sizeof(int));}
+}
+
+RENDER_INLINE int hit_material(const Scene* scene, const Hit* hit, unsigned int kernel)
+{
+    return kernel_sphere_hit(kernel, hit) ? scene->spheres[hit->index].material_index : RENDER_TRIANGLE_MATERIAL;
+}
+
+RENDER_INLINE void render_stream(const FrameJob* job, ParallelTile tile, RayStream* stream, unsigned int kernel)
+{
+    const Tracer* tracer = &job->tracer;
+    const Scene* scene = tracer->scene;
+    bool light_sampling = job->settings->light_sampling;
+    int tile_width = tile.x1 - tile.x0;
+    int count = tile_width * (tile.y1 - tile.y0);
+
+    AABB box = tracer->bvh->num_nodes > 0 ? bvh_node_bounds(&tracer->bvh->nodes[0]) : (AABB){v3(0.0f, 0.0f, 0.0f), v3(1.0f, 1.0f, 1.0f)};
+    Vec3 extent = v3_sub(box.max, box.min);
+    Vec3 scale = v3(extent.x > 0.0f ? 512.0f / extent.x : 0.0f, extent.y > 0.0f ? 512.0f / extent.y : 0.0f, extent.z > 0.0f ? 512.0f / extent.z : 0.0f);
+
+    for (int i = 0; i < count; i++)
+    {
+        stream->paths[i] = pixel_start(job, tile.x0 + i % tile_width, tile.y0 + i / tile_width, &stream->seeds[i]);
+        stream->live[i] = i;
+    }
+
+    int num_live = count;
+    for (int bounce = 0; bounce < RENDER_MAX_BOUNCES && num_live > 0; bounce++)
+    {
+        for (int i = 0; i < num_live; i++)
+        {
+            const PathState* path = &stream->paths[stream->live[i]];
+            stream->keys[i] = stream_key(box, scale, path->ro, path->rd);
+        }
+        stream_sort(stream, num_live);
+
+        // Trace in the sorted order, the first packet_bounces as packets of neighbours in it. The
+        // sky is black so misses just end.
+        int num_hits = 0;
+        for (int i = 0; i < num_live; i += BVH_PACKET_SIZE)
+        {
+            int n = num_live - i < BVH_PACKET_SIZE ? num_live - i : BVH_PACKET_SIZE;
+            if (bounce < job->settings->packet_bounces)
+            {
+                RayPacket packet;
+                packet.active = 0;
+                for (int lane = 0; lane < n; lane++)
+                {
+                    const PathState* path = &stream->paths[stream->live[i + lane]];
+                    ray_packet_set(&packet, lane, path->ro, path->rd);
+                }
+                Hit hits[BVH_PACKET_SIZE];
+                bvh_intersect_packet(tracer->bvh, scene, &packet, hits, NULL);
+                for (int lane = 0; lane < n; lane++) {stream->hits[stream->live[i + lane]] = hits[lane];}
+            }
+            else
+            {
+                for (int lane = 0; lane < n; lane++)
+                {
+                    int p = stream->live[i + lane];
+                    trace_closest(tracer, stream->paths[p].ro, stream->paths[p].rd, &stream->hits[p], kernel);
+                }
+            }
+            for (int lane = 0; lane < n; lane++)
+            {
+                int p = stream->live[i + lane];
+                if (stream->hits[p].type != HIT_NONE) {stream->scratch[num_hits++] = p;}
+            }
+        }
+
+        // Counting sort of the hits into one queue per material
+        int* start = stream->material_start;
+        memset(start, 0, (scene->num_materials + 1) * sizeof(int));
+        for (int i = 0; i < num_hits; i++) {start[hit_material(scene, &stream->hits[stream->scratch[i]], kernel) + 1]++;}
+        for (size_t m = 0; m < scene->num_materials; m++) {start[m + 1] += start[m];}
+        for (int i = 0; i < num_hits; i++)
+        {
+            int p = stream->scratch[i];
+            stream->shade[start[hit_material(scene, &stream->hits[p], kernel)]++] = p;
+        }
+
+        num_live = 0;
+        for (int i = 0; i < num_hits; i++)
+        {
+            int p = stream->shade[i];
+            if (path_bounce(tracer, &stream->paths[p], &stream->hits[p], &stream->seeds[p], light_sampling, kernel)) {stream->live[num_live++] = p;}
+        }
+    }
+
+    for (int i = 0; i < count; i++) {pixel_accumulate(job, tile.x0 + i % tile_width, tile.y0 + i / tile_width, stream->paths[i].accumulated);}
+}
+
+RENDER_INLINE void render_tile_kernel(void* ctx, ParallelTile tile, int thread, unsigned int kernel)
+{
+    const FrameJob* job = (const FrameJob*)ctx;
+    FrameJob local;
+    const NumaScene* numa = job->settings->numa;
+    if (numa != NULL && numa->num_replicas > 0)
+    {
+        // The copy in this thread's node memory
+        const NumaReplica* replica = &numa->replicas[numa->thread_replica[thread]];
+        local = *job;
+        local.tracer = (Tracer){&replica->scene, &replica->bvh, job->tracer.wide != NULL && replica->has_wide ? &replica->wide : NULL};
+        job = &local;
+    }
+    tile.x0 += job->region.x0;
+    tile.x1 += job->region.x0;
+    tile.y0 += job->region.y0;
+    tile.y1 += job->region.y0;
+
+    if (job->streams != NULL)
+    {
+        // Allocated on the thread's first tile and kept for the rest of the call, so first touch
+        // puts it in the thread's node memory. Depth first if that fails, the image is the same.
+        RayStream* stream = &job->streams[thread];
+        if (stream->paths != NULL || stream_alloc(stream, (size_t)RENDER_STREAM_TILE * RENDER_STREAM_TILE, job->tracer.scene->num_materials))
+        {
+            render_stream(job, tile, stream, kernel);
+            return;
+        }
+    }
+
+    if (job->settings->packet_bounces > 0)
+    {
+        for (int y = tile.y0; y < tile.y1; y += BVH_PACKET_SIZE / RENDER_PACKET_WIDTH)
+        {
+            for (int x = tile.x0; x < tile.x1; x += RENDER_PACKET_WIDTH) {render_block(job, tile, x, y, kernel);}
+        }
+        return;
+    }
+
+    for (int y = tile.y0; y < tile.y1; y++)
+    {
+        for (int x = tile.x0; x < tile.x1; x++)
+        {
+            unsigned int seed;
+            PathState path = pixel_start(job, x, y, &seed);
+            path_trace(&job->tracer, &path, 0, &seed, job->settings->light_sampling, kernel);
+            pixel_accumulate(job, x, y, path.accumulated);
+        }
+    }
+}
+
+// render_tile_kernel once per kernel variant, like template instantiations
+#define RENDER_TILE_VARIANT(name, kernel) \
+    static void name(void* ctx, ParallelTile tile, int thread) {render_tile_kernel(ctx, tile, thread, kernel);}
+
+RENDER_TILE_VARIANT(render_tile_generic, RENDER_KERNEL_GENERIC)
+RENDER_TILE_VARIANT(render_tile_spheres, RENDER_KERNEL_SPHERES)
+RENDER_TILE_VARIANT(render_tile_triangles, RENDER_KERNEL_TRIANGLES)
+RENDER_TILE_VARIANT(render_tile_mixed, RENDER_KERNEL_SPHERES | RENDER_KERNEL_TRIANGLES)
+RENDER_TILE_VARIANT(render_tile_spheres_emissive, RENDER_KERNEL_SPHERES | RENDER_KERNEL_EMISSIVE)
+RENDER_TILE_VARIANT(render_tile_triangles_emissive, RENDER_KERNEL_TRIANGLES | RENDER_KERNEL_EMISSIVE)
+RENDER_TILE_VARIANT(render_tile_mixed_emissive, RENDER_KERNEL_SPHERES | RENDER_KERNEL_TRIANGLES | RENDER_KERNEL_EMISSIVE)
+
+// By kernel, masks without prims have nothing to specialize
+static const ParallelTileFn render_tile_variants[RENDER_KERNEL_COUNT] = {
+    render_tile_generic, render_tile_spheres, render_tile_triangles, render_tile_mixed,
+    render_tile_generic, render_tile_spheres_emissive, render_tile_triangles_emissive, render_tile_mixed_emissive
+};
+
+static const char* const render_kernel_names[RENDER_KERNEL_COUNT] = {
+    "generic", "spheres", "triangles", "mixed", "generic", "spheres+emissive", "triangles+emissive", "mixed+emissive"
+};
+
+static ParallelTileFn render_tile_fn(const RenderSettings* settings)
+{
+    return settings->kernel < RENDER_KERNEL_COUNT ? render_tile_variants[settings->kernel] : render_tile_generic;
+}
+
+unsigned int render_kernel_select(const Scene* scene)
+{
+    unsigned int kernel = RENDER_KERNEL_GENERIC;
+    for (size_t i = 0; i < scene->num_spheres; i++)
+    {
+        kernel |= RENDER_KERNEL_SPHERES;
+        if (scene->materials[scene->spheres[i].material_index].emission > 0.0f) {kernel |= RENDER_KERNEL_EMISSIVE;}
+    }
+    if (scene_num_triangles(scene) > 0)
+    {
+        kernel |= RENDER_KERNEL_TRIANGLES;
+        if (scene->materials[RENDER_TRIANGLE_MATERIAL].emission > 0.0f) {kernel |= RENDER_KERNEL_EMISSIVE;}
+    }
+    return kernel == RENDER_KERNEL_EMISSIVE ? RENDER_KERNEL_GENERIC : kernel;
+}
+
+const char* render_kernel_name(unsigned int kernel)
+{
+    return kernel < RENDER_KERNEL_COUNT ? render_kernel_names[kernel] : "generic";
+}
+
+// Empty streams for the threads of a wavefront call, each fills its own in render_tile_kernel
+static RayStream* streams_alloc(const RenderSettings* settings)
+{
+    return settings->wavefront ? (RayStream*)calloc(PARALLEL_MAX_THREADS, sizeof(RayStream)) : NULL;
+}
+
+static void streams_free(RayStream* streams)
+{
+    if (streams == NULL) {return;}
+    for (int t = 0; t < PARALLEL_MAX_THREADS; t++) {stream_free(&streams[t]);}
+    free(streams);
+}
+
+void render_frame(RenderImage* image, const Scene* scene, const BVH* bvh, const RenderSettings* settings, ParallelTileStats* stats)
+{
+    image->frame_count++;
+    render_frame_region(image, scene, bvh, settings, (ParallelTile){0, 0, image->width, image->height}, stats);
+}
+
+void render_frame_region(RenderImage* image, const Scene* scene, const BVH* bvh, const RenderSettings* settings, ParallelTile region,
+    ParallelTileStats* stats)
+{
+    FrameJob job = {{scene, bvh, settings->wide}, settings, image->width, image->height, image->frame_count, image, NULL, region,
+        streams_alloc(settings)};
+    parallel_tiles(region.x1 - region.x0, region.y1 - region.y0, settings->wavefront ? RENDER_STREAM_TILE : RENDER_TILE_SIZE,
+        settings->threads, render_tile_fn(settings), &job, stats);
+    streams_free(job.streams);
+}
+
+void render_region(const Scene* scene, const BVH* bvh, const RenderSettings* settings, int width, int height, ParallelTile region,
+    int first_frame, int num_frames, float* sums)
+{
+    FrameJob job = {{scene, bvh, settings->wide}, settings, width, height, 0, NULL, sums, region, streams_alloc(settings)};
+    for (int f = 0; f < num_frames; f++)
+    {
+        job.frame = first_frame + f;
+        parallel_tiles(region.x1 - region.x0, region.y1 - region.y0, settings->wavefront ? RENDER_STREAM_TILE : RENDER_TILE_SIZE,
+            settings->threads, render_tile_fn(settings), &job, NULL);
+    }
+    streams_free(job.streams);
+}
+
+void render_image_set_sums(RenderImage* image, const float* sums, int num_frames)
+{
+    size_t count = (size_t)image->width * image->height * 3;
+    for (size_t i = 0; i < count; i++) {image->history[i] = powf(sums[i] / (float)num_frames, 1.0f / 2.2f);}
+    image->frame_count = num_frames;
+}
+
+// Row y as 8 bit RGB, clamped like the display pass
+static void encode_row(const RenderImage* image, int y, unsigned char* row)
+{
+    const float* h = &image->history[(size_t)y * image->width * 3];
+    for (int i = 0; i < image->width * 3; i++)
+    {
+        float v = h[i] < 0.0f ? 0.0f : (h[i] > 1.0f ? 1.0f : h[i]);
+        row[i] = (unsigned char)(v * 255.0f + 0.5f);
+    }
+}
+
+bool render_image_write_ppm(const RenderImage* image, const char* filename)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        return false;
+    }
+
+    unsigned char* row = (unsigned char*)malloc((size_t)image->width * 3);
+    bool ok = row != NULL && fprintf(fp, "P6\n%d %d\n255\n", image->width, image->height) > 0;
+    for (int y = image->height - 1; ok && y >= 0; y--)
+    {
+        encode_row(image, y, row);
+        ok = fwrite(row, 1, (size_t)image->width * 3, fp) == (size_t)image->width * 3;
+    }
+
+    free(row);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {fprintf(stderr, "Failed to write %s\n", filename);}
+    return ok;
+}
+
+unsigned long long render_image_hash(const RenderImage* image)
+{
+    int size[2] = {image->width, image->height};
+    unsigned long long h = hash_bytes(HASH_SEED, size, sizeof(size));
+    unsigned char* row = (unsigned char*)malloc((size_t)image->width * 3);
+    if (row == NULL) {return 0;}
+    for (int y = image->height - 1; y >= 0; y--)
+    {
+        encode_row(image, y, row);
+        h = hash_bytes(h, row, (size_t)image->width * 3);
+    }
+    free(row);
+    return h;
+}
+
+bool render_image_verify(const RenderImage* image, const char* expected)
+{
+    char actual[20];
+    snprintf(actual, sizeof(actual), "%016llx", render_image_hash(image));
+    if (expected == NULL)
+    {
+        printf("hash %s\n", actual);
+        return true;
+    }
+    bool ok = strcmp(actual, expected) == 0;
+    printf("hash %s %s\n", actual, ok ? "ok" : "MISMATCH");
+    if (!ok) {fprintf(stderr, "Output hash %s, expected %s\n", actual, expected);}
+    return ok;
+}
@@ -0,0 +1,127 @@
+#include "scene.h"
+#include "intersect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const Material k_default_materials[] =
+{
+    // Matte Green 0
+    {0.2f, 1.0f, 0.2f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f},
+
+    // Mirror 1
+    {1.0f, 1.0f, 1.0f, 0.0f, 0.2f, 1.0f, 0.0f, 1.0f},
+
+    // Emissive White 2
+    {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 10.0f, 1.0f},
+
+    {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 5.0f, 1.0f},
+
+    // Semi-Transparrent Blue 4
+    {0.2f, 0.2f, 1.0f, 0.0f, 0.2f, 0.0f, 0.0f, 0.2f},
+
+    // Matte white 5
+    {1.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f}
+};
+
+static const Sphere k_default_spheres[] =
+{
+    {0.0f, 0.0f, 0.0f, 1.0f, 1},
+    {2.5f, 0.0f, 0.0f, 0.5f, 3},
+    {-2.5f, 0.0f, 0.0f, 0.5f, 2},
+    {0.0f, 0.0f, -3.0f, 1.0f, 5},
+    {0.0f, 0.0f, 3.0f, 1.0f, 5},
+    {0.0f, -100.0f, 0.0f, 99.0f, 5}
+};
+
+bool scene_load_default(Scene* scene, const char* obj_filename)
+{
+    memset(scene, 0, sizeof(*scene));
+
+    scene->num_materials = sizeof(k_default_materials) / sizeof(Material);
+    scene->materials = (Material*)malloc(sizeof(k_default_materials));
+    scene->num_spheres = sizeof(k_default_spheres) / sizeof(Sphere);
+    scene->spheres = (Sphere*)malloc(sizeof(k_default_spheres));
+
+    if (scene->materials == NULL || scene->spheres == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for scene\n");
+        scene_free(scene);
+        return false;
+    }
+
+    memcpy(scene->materials, k_default_materials, sizeof(k_default_materials));
+    memcpy(scene->spheres, k_default_spheres, sizeof(k_default_spheres));
+    scene->accel = SCENE_ACCEL_BVH;
+
+    // Load OBJ
+    if (obj_filename != NULL)
+    {
+        scene->mesh = load_obj(obj_filename);
+        if (scene->mesh.vertices == NULL || scene->mesh.indices == NULL)
+        {
+            fprintf(stderr, "Failed to load OBJ %s\n", obj_filename);
+            free_mesh_data(&scene->mesh);
+        }
+    }
+
+    return true;
+}
+
+static float random_unit(unsigned int* state)
+{
+    *state = *state * 747796405u + 2891336453u;
+    unsigned int word = ((*state >> ((*state >> 28u) + 4u)) ^ *state) * 277803737u;
+    return (float)(((word >> 22u) ^ word) * 2.3283064365386963e-10);
+}
+
+bool scene_add_random_triangles(Scene* scene, size_t count, float size, Vec3 box_min, Vec3 box_max, unsigned int seed)
+{
+    MeshData* mesh = &scene->mesh;
+    size_t first_vertex = mesh->num_vertices / 3;
+
+    float* vertices = (float*)realloc(mesh->vertices, (mesh->num_vertices + count * 9) * sizeof(float));
+    if (vertices == NULL) {return false;}
+    mesh->vertices = vertices;
+
+    unsigned int* indices = (unsigned int*)realloc(mesh->indices, (mesh->num_indices + count * 3) * sizeof(unsigned int));
+    if (indices == NULL) {return false;}
+    mesh->indices = indices;
+
+    Vec3 extent = v3_sub(box_max, box_min);
+    for (size_t i = 0; i < count; i++)
+    {
+        Vec3 c = v3(box_min.x + extent.x * random_unit(&seed), box_min.y + extent.y * random_unit(&seed), box_min.z + extent.z * random_unit(&seed));
+
+        for (int k = 0; k < 3; k++)
+        {
+            float* v = mesh->vertices + mesh->num_vertices;
+            v[0] = c.x + size * (random_unit(&seed) - 0.5f);
+            v[1] = c.y + size * (random_unit(&seed) - 0.5f);
+            v[2] = c.z + size * (random_unit(&seed) - 0.5f);
+            mesh->num_vertices += 3;
+
+            mesh->indices[mesh->num_indices++] = (unsigned int)(first_vertex + 3 * i + k);
+        }
+    }
+
+    // Keep existing records in sync with the mesh
+    if (scene->tri_records != NULL) {return scene_build_tri_records(scene);}
+    return true;
+}
+
+bool scene_build_tri_records(Scene* scene)
+{
+    free(scene->tri_records);
+    scene->tri_records = tri_records_build(&scene->mesh);
+    return scene->tri_records != NULL;
+}
+
+void scene_free(Scene* scene)
+{
+    free(scene->tri_records);
+    free(scene->spheres);
+    free(scene->materials);
+    free_mesh_data(&scene->mesh);
+    memset(scene, 0, sizeof(*scene));
+}
@@ -0,0 +1,63 @@
+// Merge accumulation files (render --accum) into one image, reading them one chunk at a time,
+// so any number of sample range jobs can go into a frame
+// Usage: accum_merge [--out image.ppm] [--accum merged.acc] [--hash] [--verify HASH] input.acc...
+
+#include <stdio.h>
+#include <string.h>
+
+#include "render.h"
+#include "accum.h"
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [--out image.ppm] [--accum merged.acc] [--hash] [--verify HASH] input.acc...\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* out_file = "render.ppm";
+    const char* accum_file = NULL;
+    const char* verify = NULL;
+    bool hash = false;
+    RenderAccum accum;
+    memset(&accum, 0, sizeof(accum));
+    int inputs = 0;
+    bool ok = true;
+
+    for (int i = 1; ok && i < argc; i++)
+    {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {out_file = argv[++i];}
+        else if (strcmp(argv[i], "--accum") == 0 && i + 1 < argc) {accum_file = argv[++i];}
+        else if (strcmp(argv[i], "--hash") == 0) {hash = true;}
+        else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {verify = argv[++i];}
+        else if (argv[i][0] != '-')
+        {
+            ok = render_accum_add_file(&accum, argv[i]);
+            inputs++;
+        }
+        else
+        {
+            usage(argv[0]);
+            ok = false;
+        }
+    }
+    if (ok && inputs == 0)
+    {
+        usage(argv[0]);
+        ok = false;
+    }
+
+    RenderImage image;
+    if (ok && render_image_init(&image, accum.width, accum.height))
+    {
+        render_accum_resolve(&accum, &image);
+        fprintf(stderr, "Merged %d files into %dx%d at %d+ spp\n", inputs, accum.width, accum.height, image.frame_count);
+        ok = (accum_file == NULL || render_accum_write(&accum, accum_file)) && render_image_write_ppm(&image, out_file);
+        if (hash || verify != NULL) {ok = render_image_verify(&image, verify) && ok;}
+        render_image_free(&image);
+    }
+    else {ok = false;}
+
+    render_accum_free(&accum);
+    return ok ? 0 : 1;
+}
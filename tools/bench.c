@@ -0,0 +1,1263 @@
+// Headless benchmark harness for the acceleration structures
+// Usage: bench [--suite name] [--obj file] [--tris N] [--res WxH] [--repeat N] [--treelet N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "camera.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "bvh_compressed.h"
+#include "bvh_stackless.h"
+#include "grid.h"
+#include "bvh_dynamic.h"
+#include "bvh_lazy.h"
+#include "bvh_cache.h"
+#include "bvh_packet.h"
+#include "prim_block.h"
+#include "render.h"
+#include "numa.h"
+#include "parallel.h"
+#include "cpu.h"
+#include "timer.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+    Vec3* ro;
+    Vec3* rd;
+    float* t_max; // Segment length, only used by occlusion queries
+    size_t count;
+} RaySet;
+
+typedef struct
+{
+    Scene scene;
+    BVH bvh;
+    RaySet primary;
+    RaySet secondary;
+    RaySet shadow;
+    int repeat;
+    int treelet; // Optimizer rounds for every BVH the suites build
+    const char* obj;
+    int width, height;
+} BenchContext;
+
+typedef bool (*IntersectFn)(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+typedef bool (*OccludedFn)(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats);
+
+typedef struct
+{
+    double seconds;
+    TraversalStats stats;
+    unsigned long long hits;
+} RunResult;
+
+static float bench_random(unsigned int* state)
+{
+    *state = *state * 747796405u + 2891336453u;
+    unsigned int word = ((*state >> ((*state >> 28u) + 4u)) ^ *state) * 277803737u;
+    return (float)(((word >> 22u) ^ word) * 2.3283064365386963e-10);
+}
+
+static bool rayset_alloc(RaySet* rays, size_t count)
+{
+    rays->ro = (Vec3*)malloc(count * sizeof(Vec3));
+    rays->rd = (Vec3*)malloc(count * sizeof(Vec3));
+    rays->t_max = (float*)malloc(count * sizeof(float));
+    rays->count = 0;
+    return rays->ro != NULL && rays->rd != NULL && rays->t_max != NULL;
+}
+
+static void rayset_free(RaySet* rays)
+{
+    free(rays->ro);
+    free(rays->rd);
+    free(rays->t_max);
+    memset(rays, 0, sizeof(*rays));
+}
+
+// Camera rays of the default view, then from every primary hit one random direction and one
+// shadow segment to a random point on an emissive sphere
+static bool generate_rays(BenchContext* ctx, int width, int height)
+{
+    Camera camera = {0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f};
+    size_t count = (size_t)width * height;
+    if (!rayset_alloc(&ctx->primary, count) || !rayset_alloc(&ctx->secondary, count) || !rayset_alloc(&ctx->shadow, count)) {return false;}
+
+    int lights[16];
+    int num_lights = 0;
+    for (size_t i = 0; i < ctx->scene.num_spheres && num_lights < 16; i++)
+    {
+        if (ctx->scene.materials[ctx->scene.spheres[i].material_index].emission > 0.0f) {lights[num_lights++] = (int)i;}
+    }
+
+    unsigned int seed = 7125413u;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            RaySet* p = &ctx->primary;
+            camera_ray(&camera, x + 0.5f, y + 0.5f, width, height, &p->ro[p->count], &p->rd[p->count]);
+            p->t_max[p->count] = HIT_MAX_T;
+
+            Hit hit;
+            if (bvh_intersect(&ctx->bvh, &ctx->scene, p->ro[p->count], p->rd[p->count], &hit, NULL))
+            {
+                RaySet* s = &ctx->secondary;
+                Vec3 pos = v3_add(p->ro[p->count], v3_scale(p->rd[p->count], hit.t * 0.999f));
+                Vec3 dir = v3(bench_random(&seed) - 0.5f, bench_random(&seed) - 0.5f, bench_random(&seed) - 0.5f);
+                s->ro[s->count] = pos;
+                s->rd[s->count] = v3_normalize(dir);
+                s->t_max[s->count] = HIT_MAX_T;
+                s->count++;
+
+                if (num_lights > 0)
+                {
+                    const Sphere* light = &ctx->scene.spheres[lights[(int)(bench_random(&seed) * num_lights) % num_lights]];
+                    Vec3 jitter = v3_normalize(v3(bench_random(&seed) - 0.5f, bench_random(&seed) - 0.5f, bench_random(&seed) - 0.5f));
+                    Vec3 target = v3_add(v3(light->px, light->py, light->pz), v3_scale(jitter, light->radius));
+                    Vec3 to_light = v3_sub(target, pos);
+                    float dist = v3_length(to_light);
+
+                    RaySet* sh = &ctx->shadow;
+                    sh->ro[sh->count] = pos;
+                    sh->rd[sh->count] = v3_scale(to_light, 1.0f / dist);
+                    sh->t_max[sh->count] = dist * 0.999f;
+                    sh->count++;
+                }
+            }
+            p->count++;
+        }
+    }
+    return true;
+}
+
+// Scene of the default spheres (+ optional OBJ) and tris random triangles, its BVH and rays
+static bool bench_setup(BenchContext* ctx, size_t tris, bool verbose)
+{
+    if (!scene_load_default(&ctx->scene, ctx->obj)) {return false;}
+    if (tris > 0 && !scene_add_random_triangles(&ctx->scene, tris, 0.2f, v3(-4.0f, -1.0f, -4.0f), v3(4.0f, 3.0f, -1.5f), 1u))
+    {
+        fprintf(stderr, "Failed to generate triangles\n");
+        return false;
+    }
+
+    double start = timer_seconds();
+    if (!bvh_build(&ctx->bvh, &ctx->scene, ctx->treelet)) {return false;}
+    double build_ms = (timer_seconds() - start) * 1e3;
+
+    if (!generate_rays(ctx, ctx->width, ctx->height)) {return false;}
+
+    if (verbose)
+    {
+        printf("Scene: %zu spheres, %zu triangles, BVH %zu nodes built in %.1f ms\n", ctx->scene.num_spheres,
+            scene_num_triangles(&ctx->scene), ctx->bvh.num_nodes, build_ms);
+        printf("Rays: %zu primary, %zu secondary, %zu shadow\n", ctx->primary.count, ctx->secondary.count, ctx->shadow.count);
+    }
+    return true;
+}
+
+static void bench_teardown(BenchContext* ctx)
+{
+    rayset_free(&ctx->primary);
+    rayset_free(&ctx->secondary);
+    rayset_free(&ctx->shadow);
+    bvh_free(&ctx->bvh);
+    scene_free(&ctx->scene);
+}
+
+static RunResult run_rays(const BenchContext* ctx, const RaySet* rays, IntersectFn fn, const void* accel)
+{
+    RunResult result = {0};
+    Hit hit;
+
+    // Counting pass, then timed passes without stats
+    for (size_t i = 0; i < rays->count; i++)
+    {
+        if (fn(accel, &ctx->scene, rays->ro[i], rays->rd[i], &hit, &result.stats)) {result.hits++;}
+    }
+
+    double start = timer_seconds();
+    for (int r = 0; r < ctx->repeat; r++)
+    {
+        for (size_t i = 0; i < rays->count; i++) {fn(accel, &ctx->scene, rays->ro[i], rays->rd[i], &hit, NULL);}
+    }
+    result.seconds = (timer_seconds() - start) / ctx->repeat;
+    return result;
+}
+
+static RunResult run_occlusion(const BenchContext* ctx, const RaySet* rays, OccludedFn fn, const void* accel)
+{
+    RunResult result = {0};
+
+    for (size_t i = 0; i < rays->count; i++)
+    {
+        if (fn(accel, &ctx->scene, rays->ro[i], rays->rd[i], rays->t_max[i], &result.stats)) {result.hits++;}
+    }
+
+    double start = timer_seconds();
+    for (int r = 0; r < ctx->repeat; r++)
+    {
+        for (size_t i = 0; i < rays->count; i++) {fn(accel, &ctx->scene, rays->ro[i], rays->rd[i], rays->t_max[i], NULL);}
+    }
+    result.seconds = (timer_seconds() - start) / ctx->repeat;
+    return result;
+}
+
+static void print_header(const char* title)
+{
+    printf("\n== %s ==\n", title);
+    printf("%-22s %-9s %12s %10s %12s %10s %10s\n", "structure", "rays", "memory(B)", "nodes/ray", "bytes/ray", "prims/ray", "Mrays/s");
+}
+
+static void print_row(const char* name, const char* ray_kind, const RaySet* rays, RunResult r, size_t memory)
+{
+    double n = rays->count > 0 ? (double)rays->count : 1.0;
+    printf("%-22s %-9s %12zu %10.2f %12.1f %10.2f %10.3f\n", name, ray_kind, memory,
+        r.stats.nodes_visited / n, r.stats.bytes_fetched / n, r.stats.prims_tested / n,
+        r.seconds > 0.0 ? rays->count / r.seconds * 1e-6 : 0.0);
+}
+
+static bool intersect_binary(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect((const BVH*)accel, scene, ro, rd, hit, stats);
+}
+
+static bool intersect_wide(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_wide_intersect((const WideBVH*)accel, scene, ro, rd, hit, stats);
+}
+
+// Binary BVH against the collapsed BVH4 / BVH8 layouts
+static void suite_layouts(BenchContext* ctx)
+{
+    print_header("Node layouts");
+
+    size_t binary_memory = ctx->bvh.num_nodes * sizeof(BVHNode);
+    print_row("BVH2", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &ctx->bvh), binary_memory);
+    print_row("BVH2", "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_binary, &ctx->bvh), binary_memory);
+
+    for (int width = 4; width <= 8; width *= 2)
+    {
+        WideBVH wide;
+        if (!bvh_wide_build(&wide, &ctx->bvh, width)) {continue;}
+
+        // The plain C loops, then the SIMD kernel if this CPU has one, testing leaf prims one at
+        // a time and then as the node's leaf blocks
+        CpuIsa best = cpu_isa();
+        for (int variant = 0; variant < 3; variant++)
+        {
+            CpuIsa isa = variant == 0 ? CPU_ISA_SCALAR : CPU_ISA_AVX2;
+            if (isa > best) {break;}
+            if (variant == 2 && !bvh_wide_build_blocks(&wide, &ctx->scene)) {break;}
+            cpu_set_isa_limit(isa);
+
+            char name[32];
+            snprintf(name, sizeof(name), "BVH%d SoA %s%s", width, cpu_isa_name(isa), variant == 2 ? " blocks" : "");
+            size_t memory = wide.num_nodes * bvh_wide_node_bytes(&wide) + bvh_wide_block_bytes(&wide);
+            print_row(name, "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_wide, &wide), memory);
+            print_row(name, "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_wide, &wide), memory);
+        }
+        cpu_set_isa_limit(best);
+
+        bvh_wide_free(&wide);
+    }
+}
+
+static bool intersect_compressed(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_compressed_intersect((const CompressedBVH*)accel, scene, ro, rd, hit, stats);
+}
+
+// Quantized BVH8 against the full precision BVH8 it was made from
+static void suite_compressed(BenchContext* ctx)
+{
+    print_header("Compressed nodes");
+
+    WideBVH wide;
+    CompressedBVH cbvh;
+    if (!bvh_wide_build(&wide, &ctx->bvh, 8)) {return;}
+    if (!bvh_compressed_build(&cbvh, &wide))
+    {
+        bvh_wide_free(&wide);
+        return;
+    }
+
+    size_t wide_memory = wide.num_nodes * bvh_wide_node_bytes(&wide);
+    size_t compressed_memory = cbvh.num_nodes * sizeof(CompressedNode);
+    print_row("BVH8 SoA", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_wide, &wide), wide_memory);
+    print_row("BVH8 SoA", "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_wide, &wide), wide_memory);
+    print_row("BVH8 quantized", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_compressed, &cbvh), compressed_memory);
+    print_row("BVH8 quantized", "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_compressed, &cbvh), compressed_memory);
+    printf("Node memory %.2fx smaller than BVH8, %.2fx smaller than BVH2\n", (double)wide_memory / compressed_memory,
+        (double)(ctx->bvh.num_nodes * sizeof(BVHNode)) / compressed_memory);
+
+    bvh_compressed_free(&cbvh);
+    bvh_wide_free(&wide);
+}
+
+static bool intersect_stackless(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_stackless_intersect((const BVH*)accel, scene, ro, rd, hit, stats);
+}
+
+// Stack traversal against the threaded BVH over growing scenes
+static void suite_stackless(BenchContext* ctx)
+{
+    static const size_t sizes[] = {1000, 10000, 100000, 1000000};
+
+    print_header("Stack vs stackless");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        BenchContext sized = *ctx;
+        memset(&sized.scene, 0, sizeof(sized.scene));
+        if (!bench_setup(&sized, sizes[s], false))
+        {
+            bench_teardown(&sized);
+            continue;
+        }
+
+        BVH threaded;
+        if (bvh_stackless_build(&threaded, &sized.bvh))
+        {
+            char name[32];
+            size_t memory = sized.bvh.num_nodes * sizeof(BVHNode);
+            snprintf(name, sizeof(name), "stack %zuk", sizes[s] / 1000);
+            print_row(name, "primary", &sized.primary, run_rays(&sized, &sized.primary, intersect_binary, &sized.bvh), memory);
+            print_row(name, "secondary", &sized.secondary, run_rays(&sized, &sized.secondary, intersect_binary, &sized.bvh), memory);
+            snprintf(name, sizeof(name), "stackless %zuk", sizes[s] / 1000);
+            print_row(name, "primary", &sized.primary, run_rays(&sized, &sized.primary, intersect_stackless, &threaded), memory);
+            print_row(name, "secondary", &sized.secondary, run_rays(&sized, &sized.secondary, intersect_stackless, &threaded), memory);
+            bvh_free(&threaded);
+        }
+        bench_teardown(&sized);
+    }
+}
+
+// Build time bought by each treelet optimizer round against what it saves per ray
+static void suite_treelet(BenchContext* ctx)
+{
+    print_header("Treelet optimizer rounds");
+    for (int rounds = 0; rounds <= 3; rounds++)
+    {
+        BVH bvh;
+        double start = timer_seconds();
+        if (!bvh_build(&bvh, &ctx->scene, rounds)) {continue;}
+        double build_ms = (timer_seconds() - start) * 1e3;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%d rounds %.0f ms", rounds, build_ms);
+        size_t memory = bvh.num_nodes * sizeof(BVHNode);
+        print_row(name, "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &bvh), memory);
+        print_row(name, "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_binary, &bvh), memory);
+        bvh_free(&bvh);
+    }
+}
+
+static bool occluded_binary(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return bvh_occluded((const BVH*)accel, scene, ro, rd, t_max, stats);
+}
+
+static bool occluded_wide(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return bvh_wide_occluded((const WideBVH*)accel, scene, ro, rd, t_max, stats);
+}
+
+static bool occluded_compressed(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return bvh_compressed_occluded((const CompressedBVH*)accel, scene, ro, rd, t_max, stats);
+}
+
+static bool occluded_stackless(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return bvh_stackless_occluded((const BVH*)accel, scene, ro, rd, t_max, stats);
+}
+
+static void print_shadow_rows(const BenchContext* ctx, const char* name, IntersectFn closest, OccludedFn occluded, const void* accel, size_t memory)
+{
+    RunResult c = run_rays(ctx, &ctx->shadow, closest, accel);
+    RunResult o = run_occlusion(ctx, &ctx->shadow, occluded, accel);
+    print_row(name, "closest", &ctx->shadow, c, memory);
+    print_row(name, "occluded", &ctx->shadow, o, memory);
+    printf("%-22s %.0f%% of rays blocked, any hit costs %.2fx the nodes and %.2fx the time of closest hit\n", "",
+        100.0 * o.hits / (ctx->shadow.count > 0 ? ctx->shadow.count : 1),
+        c.stats.nodes_visited > 0 ? (double)o.stats.nodes_visited / c.stats.nodes_visited : 0.0,
+        c.seconds > 0.0 ? o.seconds / c.seconds : 0.0);
+}
+
+// Shadow segments towards the emissive spheres, closest hit against the any hit query
+static void suite_shadow(BenchContext* ctx)
+{
+    print_header("Shadow rays");
+
+    print_shadow_rows(ctx, "BVH2", intersect_binary, occluded_binary, &ctx->bvh, ctx->bvh.num_nodes * sizeof(BVHNode));
+
+    BVH threaded;
+    if (bvh_stackless_build(&threaded, &ctx->bvh))
+    {
+        print_shadow_rows(ctx, "BVH2 stackless", intersect_stackless, occluded_stackless, &threaded, threaded.num_nodes * sizeof(BVHNode));
+        bvh_free(&threaded);
+    }
+
+    for (int width = 4; width <= 8; width *= 2)
+    {
+        WideBVH wide;
+        if (!bvh_wide_build(&wide, &ctx->bvh, width)) {continue;}
+
+        char name[32];
+        snprintf(name, sizeof(name), "BVH%d SoA", width);
+        print_shadow_rows(ctx, name, intersect_wide, occluded_wide, &wide, wide.num_nodes * bvh_wide_node_bytes(&wide));
+
+        CompressedBVH cbvh;
+        if (width == 8 && bvh_compressed_build(&cbvh, &wide))
+        {
+            print_shadow_rows(ctx, "BVH8 quantized", intersect_compressed, occluded_compressed, &cbvh, cbvh.num_nodes * sizeof(CompressedNode));
+            bvh_compressed_free(&cbvh);
+        }
+        bvh_wide_free(&wide);
+    }
+}
+
+static bool intersect_grid(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return grid_intersect((const Grid*)accel, scene, ro, rd, hit, stats);
+}
+
+static bool occluded_grid(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, float t_max, TraversalStats* stats)
+{
+    return grid_occluded((const Grid*)accel, scene, ro, rd, t_max, stats);
+}
+
+// Grid and BVH2 built over one scene, memory includes the prim references of both
+static void grid_rows(const BenchContext* ctx, const char* label)
+{
+    char name[48];
+    double start = timer_seconds();
+    BVH bvh;
+    if (!bvh_build(&bvh, &ctx->scene, ctx->treelet)) {return;}
+    double bvh_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    Grid grid;
+    if (!grid_build(&grid, &ctx->scene))
+    {
+        bvh_free(&bvh);
+        return;
+    }
+    double grid_ms = (timer_seconds() - start) * 1e3;
+
+    size_t bvh_memory = bvh.num_nodes * sizeof(BVHNode) + bvh.num_prims * sizeof(unsigned int);
+    size_t grid_memory = (grid.data_size + grid.num_refs) * sizeof(unsigned int);
+
+    snprintf(name, sizeof(name), "BVH2 %s %.0f ms", label, bvh_ms);
+    print_row(name, "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &bvh), bvh_memory);
+    print_row(name, "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_binary, &bvh), bvh_memory);
+    print_row(name, "shadow", &ctx->shadow, run_occlusion(ctx, &ctx->shadow, occluded_binary, &bvh), bvh_memory);
+
+    snprintf(name, sizeof(name), "grid %s %.0f ms", label, grid_ms);
+    print_row(name, "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_grid, &grid), grid_memory);
+    print_row(name, "secondary", &ctx->secondary, run_rays(ctx, &ctx->secondary, intersect_grid, &grid), grid_memory);
+    print_row(name, "shadow", &ctx->shadow, run_occlusion(ctx, &ctx->shadow, occluded_grid, &grid), grid_memory);
+
+    grid_free(&grid);
+    bvh_free(&bvh);
+}
+
+// Two level grid against the BVH2 on the bench scene, then on growing triangle soups.
+// nodes/ray counts top and leaf cells for the grid.
+static void suite_grid(BenchContext* ctx)
+{
+    static const size_t sizes[] = {1000, 10000, 100000};
+
+    print_header("Grid vs BVH");
+    grid_rows(ctx, "scene");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        BenchContext sized = *ctx;
+        memset(&sized.scene, 0, sizeof(sized.scene));
+        if (!bench_setup(&sized, sizes[s], false))
+        {
+            bench_teardown(&sized);
+            continue;
+        }
+
+        char label[24];
+        snprintf(label, sizeof(label), "%zuk", sizes[s] / 1000);
+        grid_rows(&sized, label);
+        bench_teardown(&sized);
+    }
+}
+
+static void count_upload(void* ctx, DynamicBuffer buffer, const void* data, size_t offset, size_t size, size_t capacity)
+{
+    *(size_t*)ctx += size;
+}
+
+// Sphere edits on the dynamic BVH against rebuilding the BVH and uploading everything per edit.
+// Runs on a copy of the spheres, the bench scene keeps its own.
+static void suite_dynamic(BenchContext* ctx)
+{
+    static const int edits = 2000;
+
+    Scene scene = ctx->scene;
+    scene.spheres = (Sphere*)malloc(scene.num_spheres * sizeof(Sphere));
+    if (scene.spheres == NULL) {return;}
+    memcpy(scene.spheres, ctx->scene.spheres, scene.num_spheres * sizeof(Sphere));
+
+    BVH bvh;
+    DynamicBVH dyn;
+    double start = timer_seconds();
+    if (!bvh_build(&bvh, &scene, ctx->treelet))
+    {
+        free(scene.spheres);
+        return;
+    }
+    double rebuild_ms = (timer_seconds() - start) * 1e3;
+    size_t full_bytes = bvh.num_nodes * sizeof(BVHNode) + bvh.num_prims * sizeof(unsigned int) + scene.num_spheres * sizeof(Sphere);
+    if (!dynamic_bvh_init(&dyn, &bvh, &scene))
+    {
+        free(scene.spheres);
+        return;
+    }
+
+    size_t bytes = 0;
+    dynamic_bvh_flush(&dyn, &scene, count_upload, &bytes);
+    float initial_sah = dynamic_bvh_sah(&dyn);
+
+    printf("\n== Dynamic sphere edits ==\n");
+    printf("%-10s %8s %12s %14s\n", "edit", "count", "us/edit", "bytes/edit");
+
+    static const char* names[] = {"add", "move", "remove"};
+    unsigned int seed = 5u;
+    size_t base_spheres = scene.num_spheres;
+    for (int kind = 0; kind < 3; kind++)
+    {
+        bytes = 0;
+        double seconds = 0.0;
+        for (int e = 0; e < edits; e++)
+        {
+            Vec3 pos = v3(bench_random(&seed) * 8.0f - 4.0f, bench_random(&seed) * 4.0f - 1.0f, bench_random(&seed) * 8.0f - 4.0f);
+            // Moves and removals only touch spheres added here, not the ground sphere
+            int added = (int)(scene.num_spheres - base_spheres);
+            int index = (int)base_spheres + (added > 0 ? (int)(bench_random(&seed) * added) % added : 0);
+
+            double edit_start = timer_seconds();
+            if (kind == 0) {dynamic_bvh_add_sphere(&dyn, &scene, (Sphere){pos.x, pos.y, pos.z, 0.1f, 0});}
+            else if (kind == 1) {dynamic_bvh_move_sphere(&dyn, &scene, index, pos);}
+            else {dynamic_bvh_remove_sphere(&dyn, &scene, index);}
+            dynamic_bvh_flush(&dyn, &scene, count_upload, &bytes);
+            seconds += timer_seconds() - edit_start;
+        }
+        printf("%-10s %8d %12.2f %14.1f\n", names[kind], edits, seconds / edits * 1e6, (double)bytes / edits);
+    }
+
+    printf("Full rebuild + upload per edit: %.1f ms, %zu bytes\n", rebuild_ms, full_bytes);
+    printf("SAH %.2f after the edits, %.2f before\n", dynamic_bvh_sah(&dyn), initial_sah);
+
+    dynamic_bvh_free(&dyn);
+    free(scene.spheres);
+}
+
+static bool intersect_lazy(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return lazy_bvh_intersect((LazyBVH*)accel, scene, ro, rd, hit, stats);
+}
+
+// Time to the first traceable tree, then primary passes over the lazy BVH while the workers
+// refine it, splicing between passes like the viewer does between frames
+static void suite_lazy(BenchContext* ctx)
+{
+    print_header("Lazy BVH");
+
+    double start = timer_seconds();
+    BVH bvh;
+    if (!bvh_build(&bvh, &ctx->scene, ctx->treelet)) {return;}
+    double full_ms = (timer_seconds() - start) * 1e3;
+    print_row("full build", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &bvh), bvh.num_nodes * sizeof(BVHNode));
+
+    start = timer_seconds();
+    LazyBVH lazy;
+    int threads = parallel_thread_count() > 1 ? parallel_thread_count() - 1 : 1;
+    if (!lazy_bvh_build(&lazy, &ctx->scene, BVH_LAZY_PENDING_PRIMS, threads))
+    {
+        bvh_free(&bvh);
+        return;
+    }
+    double top_ms = (timer_seconds() - start) * 1e3;
+
+    size_t bytes = 0;
+    for (int pass = 0; pass < 100; pass++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "pass %d (%d/%d built)", pass, lazy.num_refined, lazy.num_pending);
+        print_row(name, "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_lazy, &lazy), lazy.bvh.num_nodes * sizeof(BVHNode));
+
+        if (lazy_bvh_done(&lazy)) {break;}
+        lazy_bvh_splice(&lazy, count_upload, &bytes);
+    }
+
+    printf("Full build %.1f ms, top levels %.1f ms with %d pending leaves of up to %d prims, %zu bytes spliced\n",
+        full_ms, top_ms, lazy.num_pending, BVH_LAZY_PENDING_PRIMS, bytes);
+
+    lazy_bvh_free(&lazy);
+    bvh_free(&bvh);
+}
+
+// Rebuild against a round trip through the BVH cache: hash the scene, write the file, map it
+// back and trace the mapped nodes directly
+static void suite_cache(BenchContext* ctx)
+{
+    static const char* path = "bench_cache.bvh";
+    print_header("BVH cache");
+
+    double start = timer_seconds();
+    BVH bvh;
+    if (!bvh_build(&bvh, &ctx->scene, ctx->treelet)) {return;}
+    double build_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    unsigned long long key = bvh_cache_key(&ctx->scene, &ctx->treelet, 1);
+    double key_ms = (timer_seconds() - start) * 1e3;
+
+    BVHCacheBlob blobs[] = {
+        {0, bvh.nodes, bvh.num_nodes * sizeof(BVHNode)},
+        {1, bvh.prims, bvh.num_prims * sizeof(unsigned int)}
+    };
+    start = timer_seconds();
+    bool written = bvh_cache_write(path, key, blobs, 2);
+    double write_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    BVHCache cache;
+    if (!written || !bvh_cache_open(&cache, path, key) || cache.num_blobs != 2)
+    {
+        fprintf(stderr, "BVH cache round trip failed\n");
+        remove(path);
+        bvh_free(&bvh);
+        return;
+    }
+    double open_ms = (timer_seconds() - start) * 1e3;
+
+    // Reading every byte once stands in for the upload
+    start = timer_seconds();
+    bool same = true;
+    for (int i = 0; i < 2; i++) {same = same && cache.blobs[i].size == blobs[i].size && memcmp(cache.blobs[i].data, blobs[i].data, blobs[i].size) == 0;}
+    double read_ms = (timer_seconds() - start) * 1e3;
+
+    BVH mapped = {(BVHNode*)cache.blobs[0].data, bvh.num_nodes, (unsigned int*)cache.blobs[1].data, bvh.num_prims};
+    print_row("built", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &bvh), blobs[0].size + blobs[1].size);
+    print_row("mapped", "primary", &ctx->primary, run_rays(ctx, &ctx->primary, intersect_binary, &mapped), cache.size);
+
+    BVHCache other;
+    bool stale = bvh_cache_open(&other, path, key + 1);
+    if (stale) {bvh_cache_close(&other);}
+    printf("Build %.1f ms; key %.2f ms, write %.1f ms, open %.3f ms, read %.1f ms; contents %s, other key %s\n",
+        build_ms, key_ms, write_ms, open_ms, read_ms, same ? "identical" : "DIFFER", stale ? "ACCEPTED" : "rejected");
+
+    bvh_cache_close(&cache);
+    remove(path);
+    bvh_free(&bvh);
+}
+
+static bool intersect_left_first(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect_ordered((const BVH*)accel, scene, ro, rd, BVH_ORDER_LEFT, hit, stats);
+}
+
+static bool intersect_octant(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect_ordered((const BVH*)accel, scene, ro, rd, BVH_ORDER_OCTANT, hit, stats);
+}
+
+static bool intersect_distance(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect_ordered((const BVH*)accel, scene, ro, rd, BVH_ORDER_DISTANCE, hit, stats);
+}
+
+static void order_rows(const BenchContext* ctx, const char* label)
+{
+    static const IntersectFn orders[] = {intersect_left_first, intersect_octant, intersect_distance};
+    static const char* names[] = {"left", "octant", "distance"};
+    const RaySet* sets[] = {&ctx->primary, &ctx->secondary};
+    static const char* kinds[] = {"primary", "secondary"};
+
+    size_t memory = ctx->bvh.num_nodes * sizeof(BVHNode);
+    for (int k = 0; k < 2; k++)
+    {
+        double visits[3];
+        for (int o = 0; o < 3; o++)
+        {
+            char name[48];
+            snprintf(name, sizeof(name), "%s %s", names[o], label);
+            RunResult r = run_rays(ctx, sets[k], orders[o], &ctx->bvh);
+            visits[o] = (double)r.stats.nodes_visited;
+            print_row(name, kinds[k], sets[k], r, memory);
+        }
+        printf("octant %s %s: %+.1f%% node visits against left first, %+.1f%% against distance order\n", label, kinds[k],
+            (visits[1] / visits[0] - 1.0) * 100.0, (visits[1] / visits[2] - 1.0) * 100.0);
+    }
+}
+
+// Child visit order of the BVH2 closest hit traversal on the demo scene (the spheres and the
+// --obj mesh, e.g. tetrahedron.obj), with growing triangle soups added, and on the bench scene
+// (--obj with a large scan and --tris 0 for the scan alone)
+static void suite_order(BenchContext* ctx)
+{
+    static const size_t sizes[] = {0, 10000, 100000};
+
+    print_header("Child order");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        BenchContext sized = *ctx;
+        memset(&sized.scene, 0, sizeof(sized.scene));
+        if (!bench_setup(&sized, sizes[s], false))
+        {
+            bench_teardown(&sized);
+            continue;
+        }
+
+        char label[24];
+        if (sizes[s] == 0) {snprintf(label, sizeof(label), "demo");}
+        else {snprintf(label, sizeof(label), "%zuk", sizes[s] / 1000);}
+        order_rows(&sized, label);
+        bench_teardown(&sized);
+    }
+    order_rows(ctx, "scene");
+}
+
+// Camera rays in 4x2 pixel packets against one at a time, for every kernel this CPU has.
+// Packets must find the same hits as bvh_intersect.
+static RunResult run_packets(const BenchContext* ctx, unsigned long long* mismatches)
+{
+    RunResult result = {0};
+    const RaySet* rays = &ctx->primary;
+    int rows = BVH_PACKET_SIZE / RENDER_PACKET_WIDTH;
+    *mismatches = 0;
+
+    for (int pass = 0; pass <= ctx->repeat; pass++)
+    {
+        double start = timer_seconds();
+        for (int y = 0; y < ctx->height; y += rows)
+        {
+            for (int x = 0; x < ctx->width; x += RENDER_PACKET_WIDTH)
+            {
+                RayPacket packet;
+                packet.active = 0;
+                for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+                {
+                    int px = x + lane % RENDER_PACKET_WIDTH, py = y + lane / RENDER_PACKET_WIDTH;
+                    if (px >= ctx->width || py >= ctx->height) {continue;}
+                    size_t i = (size_t)py * ctx->width + px;
+                    ray_packet_set(&packet, lane, rays->ro[i], rays->rd[i]);
+                }
+
+                // Counting pass first, then timed passes without stats
+                Hit hits[BVH_PACKET_SIZE];
+                bvh_intersect_packet(&ctx->bvh, &ctx->scene, &packet, hits, pass == 0 ? &result.stats : NULL);
+                if (pass > 0) {continue;}
+
+                for (int lane = 0; lane < BVH_PACKET_SIZE; lane++)
+                {
+                    if (!(packet.active >> lane & 1u)) {continue;}
+                    size_t i = (size_t)(y + lane / RENDER_PACKET_WIDTH) * ctx->width + x + lane % RENDER_PACKET_WIDTH;
+                    Hit hit;
+                    bvh_intersect(&ctx->bvh, &ctx->scene, rays->ro[i], rays->rd[i], &hit, NULL);
+                    if (hits[lane].type != HIT_NONE) {result.hits++;}
+                    if (hit.type != hits[lane].type || hit.index != hits[lane].index || hit.t != hits[lane].t) {(*mismatches)++;}
+                }
+            }
+        }
+        if (pass > 0) {result.seconds += (timer_seconds() - start) / ctx->repeat;}
+    }
+    return result;
+}
+
+static void suite_packet(BenchContext* ctx)
+{
+    print_header("Ray packets (single thread)");
+
+    size_t memory = ctx->bvh.num_nodes * sizeof(BVHNode);
+    RunResult single = run_rays(ctx, &ctx->primary, intersect_binary, &ctx->bvh);
+    print_row("BVH2 single ray", "primary", &ctx->primary, single, memory);
+
+    CpuIsa best = cpu_isa();
+    static const CpuIsa kernels[] = {CPU_ISA_SCALAR, CPU_ISA_AVX2};
+    for (int k = 0; k < 2; k++)
+    {
+        if (kernels[k] > best) {continue;}
+        cpu_set_isa_limit(kernels[k]);
+
+        unsigned long long mismatches;
+        RunResult r = run_packets(ctx, &mismatches);
+        char name[32];
+        snprintf(name, sizeof(name), "BVH2 packet %s", cpu_isa_name(kernels[k]));
+        print_row(name, "primary", &ctx->primary, r, memory);
+        printf("%-22s %.2fx single ray, %llu hits, %llu mismatches\n", "", r.seconds > 0.0 ? single.seconds / r.seconds : 0.0, r.hits, mismatches);
+    }
+    cpu_set_isa_limit(best);
+}
+
+// The SoA prim block kernels alone: every secondary ray against the same blocks, fed from the
+// start of the scene's triangles and a grid of spheres, once per kernel the CPU supports.
+// Mtests/s counts every lane, padding included.
+static void suite_prims(BenchContext* ctx)
+{
+    static const size_t block_counts[] = {1, 64};
+    size_t max_blocks = 64;
+
+    size_t num_tri_blocks;
+    size_t tris = ctx->scene.mesh.num_indices / 3;
+    TriBlock* tri_blocks = tri_blocks_build(&ctx->scene.mesh, NULL, 0, tris < max_blocks * PRIM_BLOCK_SIZE ? tris : max_blocks * PRIM_BLOCK_SIZE, &num_tri_blocks);
+    if (tri_blocks == NULL) {return;}
+
+    Sphere* spheres = (Sphere*)calloc(max_blocks * PRIM_BLOCK_SIZE, sizeof(Sphere));
+    if (spheres == NULL)
+    {
+        free(tri_blocks);
+        return;
+    }
+    for (size_t i = 0; i < max_blocks * PRIM_BLOCK_SIZE; i++)
+    {
+        spheres[i].px = -4.0f + 8.0f * (float)(i % 16) / 15.0f;
+        spheres[i].py = -1.0f + 4.0f * (float)(i / 16 % 8) / 7.0f;
+        spheres[i].pz = -4.0f + 2.5f * (float)(i / 128) / 3.0f;
+        spheres[i].radius = 0.2f;
+    }
+    size_t num_sphere_blocks;
+    SphereBlock* sphere_blocks = sphere_blocks_build(spheres, max_blocks * PRIM_BLOCK_SIZE, &num_sphere_blocks);
+    free(spheres);
+    if (sphere_blocks == NULL)
+    {
+        free(tri_blocks);
+        return;
+    }
+
+    const RaySet* rays = &ctx->secondary;
+    printf("\n== Prim blocks (single thread, %zu rays) ==\n", rays->count);
+    printf("%-10s %8s %8s %14s %10s %8s %11s\n", "prims", "isa", "blocks", "Mtests/s", "speedup", "hits", "mismatches");
+    CpuIsa best = cpu_isa();
+    for (int kind = 0; kind < 2; kind++)
+    {
+        size_t available = kind == 0 ? num_tri_blocks : num_sphere_blocks;
+        for (int c = 0; c < 2; c++)
+        {
+            size_t blocks = block_counts[c] < available ? block_counts[c] : available;
+            if (blocks == 0) {continue;}
+
+            double scalar_seconds = 0.0;
+            for (int isa = CPU_ISA_SCALAR; isa <= (int)best; isa++)
+            {
+                // Checked against the scalar kernel first, then timed
+                unsigned long long hits = 0, mismatches = 0;
+                for (size_t i = 0; i < rays->count; i++)
+                {
+                    PrimBlockHit a, b;
+                    bool hit = kind == 0 ? tri_blocks_closest_isa((CpuIsa)isa, tri_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &a)
+                        : sphere_blocks_closest_isa((CpuIsa)isa, sphere_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &a);
+                    if (kind == 0) {tri_blocks_closest_isa(CPU_ISA_SCALAR, tri_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &b);}
+                    else {sphere_blocks_closest_isa(CPU_ISA_SCALAR, sphere_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &b);}
+                    if (hit) {hits++;}
+                    if (a.index != b.index || a.t != b.t) {mismatches++;}
+                }
+
+                PrimBlockHit h;
+                double start = timer_seconds();
+                for (int r = 0; r < ctx->repeat; r++)
+                {
+                    for (size_t i = 0; i < rays->count; i++)
+                    {
+                        if (kind == 0) {tri_blocks_closest_isa((CpuIsa)isa, tri_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &h);}
+                        else {sphere_blocks_closest_isa((CpuIsa)isa, sphere_blocks, blocks, rays->ro[i], rays->rd[i], HIT_MAX_T, &h);}
+                    }
+                }
+                double seconds = (timer_seconds() - start) / ctx->repeat;
+                if (isa == CPU_ISA_SCALAR) {scalar_seconds = seconds;}
+
+                double tests = (double)rays->count * blocks * PRIM_BLOCK_SIZE;
+                printf("%-10s %8s %8zu %14.1f %9.2fx %8llu %11llu\n", kind == 0 ? "triangle" : "sphere", cpu_isa_name((CpuIsa)isa), blocks,
+                    seconds > 0.0 ? tests / seconds * 1e-6 : 0.0, seconds > 0.0 ? scalar_seconds / seconds : 0.0, hits, mismatches);
+            }
+        }
+    }
+
+    free(sphere_blocks);
+    free(tri_blocks);
+}
+
+// Full paths of the CPU reference renderer over the bench resolution, the baseline for the
+// traversal numbers above
+static void suite_render(BenchContext* ctx)
+{
+    static const int frames = 4;
+
+    RenderImage image;
+    if (!render_image_init(&image, ctx->width, ctx->height)) {return;}
+    // Rays after the camera packets through the binary BVH, then through BVH8 and its SIMD kernel
+    WideBVH wide;
+    if (!bvh_wide_build(&wide, &ctx->bvh, 8) || !bvh_wide_build_blocks(&wide, &ctx->scene))
+    {
+        bvh_wide_free(&wide);
+        render_image_free(&image);
+        return;
+    }
+
+    printf("\n== CPU path tracer ==\n");
+    printf("%-16s %6s %8s %10s %12s %12s %8s\n", "mode", "bvh", "threads", "ms/frame", "Msamples/s", "utilization", "steals");
+    for (int light_sampling = 0; light_sampling < 2; light_sampling++)
+    {
+        for (int use_wide = 0; use_wide < 2; use_wide++)
+        {
+            RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, light_sampling != 0, 0, 1, use_wide ? &wide : NULL};
+            render_image_reset(&image);
+
+            ParallelTileStats stats;
+            double utilization = 0.0;
+            int steals = 0;
+            double start = timer_seconds();
+            for (int f = 0; f < frames; f++)
+            {
+                render_frame(&image, &ctx->scene, &ctx->bvh, &settings, &stats);
+                utilization += parallel_tile_utilization(&stats) / frames;
+                for (int t = 0; t < stats.threads; t++) {steals += stats.thread[t].steals;}
+            }
+            double seconds = (timer_seconds() - start) / frames;
+
+            printf("%-16s %6s %8d %10.1f %12.3f %11.1f%% %8d\n", light_sampling ? "light sampling" : "brdf only", use_wide ? "BVH8" : "BVH2",
+                stats.threads, seconds * 1e3, (double)ctx->width * ctx->height / seconds * 1e-6, utilization * 100.0, steals / frames);
+        }
+    }
+    bvh_wide_free(&wide);
+    render_image_free(&image);
+}
+
+// Last level cache references and misses of this process and the threads it starts, through
+// perf events. fd -1 where the kernel doesn't allow them (see perf_event_paranoid).
+typedef struct
+{
+    int refs, misses;
+} CacheCounters;
+
+static int perf_counter_open(unsigned long long config)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1; // The render threads are started after the counters
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)config;
+    return -1;
+#endif
+}
+
+static bool cache_counters_open(CacheCounters* c)
+{
+#ifdef __linux__
+    c->refs = perf_counter_open(PERF_COUNT_HW_CACHE_REFERENCES);
+    c->misses = perf_counter_open(PERF_COUNT_HW_CACHE_MISSES);
+#else
+    c->refs = c->misses = -1;
+#endif
+    return c->refs >= 0 && c->misses >= 0;
+}
+
+static void cache_counters_close(CacheCounters* c)
+{
+#ifdef __linux__
+    if (c->refs >= 0) {close(c->refs);}
+    if (c->misses >= 0) {close(c->misses);}
+#endif
+}
+
+static void cache_counters_start(const CacheCounters* c)
+{
+#ifdef __linux__
+    if (c->refs < 0 || c->misses < 0) {return;}
+    ioctl(c->refs, PERF_EVENT_IOC_RESET, 0);
+    ioctl(c->misses, PERF_EVENT_IOC_RESET, 0);
+    ioctl(c->refs, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(c->misses, PERF_EVENT_IOC_ENABLE, 0);
+#else
+    (void)c;
+#endif
+}
+
+static void cache_counters_stop(const CacheCounters* c, unsigned long long* refs, unsigned long long* misses)
+{
+    *refs = *misses = 0;
+#ifdef __linux__
+    if (c->refs < 0 || c->misses < 0) {return;}
+    ioctl(c->refs, PERF_EVENT_IOC_DISABLE, 0);
+    ioctl(c->misses, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(c->refs, refs, sizeof(*refs)) != sizeof(*refs)) {*refs = 0;}
+    if (read(c->misses, misses, sizeof(*misses)) != sizeof(*misses)) {*misses = 0;}
+#endif
+}
+
+// Depth first against wavefront rendering, with the cache misses per sample where perf events
+// are available. Only telling with --tris large enough for the scene to outgrow the LLC.
+static void suite_wavefront(BenchContext* ctx)
+{
+    static const int frames = 2;
+
+    RenderImage image;
+    if (!render_image_init(&image, ctx->width, ctx->height)) {return;}
+    WideBVH wide;
+    if (!bvh_wide_build(&wide, &ctx->bvh, 8) || !bvh_wide_build_blocks(&wide, &ctx->scene))
+    {
+        bvh_wide_free(&wide);
+        render_image_free(&image);
+        return;
+    }
+
+    size_t scene_bytes = ctx->bvh.num_nodes * sizeof(BVHNode) + ctx->bvh.num_prims * sizeof(unsigned int) +
+        ctx->scene.mesh.num_vertices * 3 * sizeof(float) + ctx->scene.mesh.num_indices * sizeof(unsigned int);
+    CacheCounters counters;
+    bool counted = cache_counters_open(&counters);
+    printf("\n== Wavefront rendering (BVH2 and mesh %.1f MB, BVH8 with blocks %.1f MB) ==\n", scene_bytes / 1e6,
+        (wide.num_nodes * bvh_wide_node_bytes(&wide) + bvh_wide_block_bytes(&wide)) / 1e6);
+    if (!counted) {printf("perf events unavailable, no cache numbers\n");}
+    printf("%-12s %6s %10s %12s %14s %14s %10s\n", "mode", "bvh", "ms/frame", "Msamples/s", "LLC refs/spp", "LLC miss/spp", "misses");
+
+    for (int use_wide = 0; use_wide < 2; use_wide++)
+    {
+        unsigned long long depth_first_misses = 0;
+        for (int wavefront = 0; wavefront < 2; wavefront++)
+        {
+            RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, true, 0, 1, use_wide ? &wide : NULL, wavefront != 0};
+            render_image_reset(&image);
+
+            unsigned long long refs, misses;
+            cache_counters_start(&counters);
+            double start = timer_seconds();
+            for (int f = 0; f < frames; f++) {render_frame(&image, &ctx->scene, &ctx->bvh, &settings, NULL);}
+            double seconds = (timer_seconds() - start) / frames;
+            cache_counters_stop(&counters, &refs, &misses);
+            if (!wavefront) {depth_first_misses = misses;}
+
+            printf("%-12s %6s %10.1f %12.3f", wavefront ? "wavefront" : "depth first", use_wide ? "BVH8" : "BVH2",
+                seconds * 1e3, (double)ctx->width * ctx->height / seconds * 1e-6);
+            double samples = (double)ctx->width * ctx->height * frames;
+            if (counted && depth_first_misses > 0)
+            {
+                printf(" %14.1f %14.1f %9.1f%%\n", refs / samples, misses / samples, (double)misses / depth_first_misses * 100.0);
+            }
+            else {printf(" %14s %14s %10s\n", "-", "-", "-");}
+        }
+    }
+
+    cache_counters_close(&counters);
+    bvh_wide_free(&wide);
+    render_image_free(&image);
+}
+
+// Frames through BVH8 on one NUMA node, then a node more per row, for each placement of the
+// scene. Efficiency is the speedup over one node per unit of extra threads.
+static void suite_numa(BenchContext* ctx)
+{
+    static const int frames = 2;
+
+    RenderImage image;
+    if (!render_image_init(&image, ctx->width, ctx->height)) {return;}
+    WideBVH wide;
+    if (!bvh_wide_build(&wide, &ctx->bvh, 8) || !bvh_wide_build_blocks(&wide, &ctx->scene))
+    {
+        bvh_wide_free(&wide);
+        render_image_free(&image);
+        return;
+    }
+
+    NumaTopology topo;
+    numa_detect(&topo);
+    printf("\n== NUMA scaling (%d nodes, %d CPUs) ==\n", topo.num_nodes, topo.total_cpus);
+    printf("%-12s %12s %6s %8s %10s %12s %9s %11s\n", "placement", "policy", "nodes", "threads", "ms/frame", "Msamples/s", "speedup", "efficiency");
+
+    for (int p = 0; p < 3; p++)
+    {
+        double base_rate = 0.0;
+        int base_threads = 1;
+        for (int nodes = 1; nodes <= topo.num_nodes; nodes++)
+        {
+            int thread_node[PARALLEL_MAX_THREADS];
+            int threads = numa_pin_threads(&topo, nodes, 0, thread_node);
+            NumaScene numa;
+            if (!numa_scene_build(&numa, &topo, nodes, thread_node, threads, (NumaPlacement)p, &ctx->scene, &ctx->bvh, &wide)) {break;}
+
+            RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, true, threads, 1, &wide, false, 0, &numa};
+            render_image_reset(&image);
+            double start = timer_seconds();
+            for (int f = 0; f < frames; f++) {render_frame(&image, &ctx->scene, &ctx->bvh, &settings, NULL);}
+            double seconds = (timer_seconds() - start) / frames;
+            double rate = (double)ctx->width * ctx->height / seconds * 1e-6;
+            if (nodes == 1)
+            {
+                base_rate = rate;
+                base_threads = threads;
+            }
+
+            const char* policy = p == NUMA_SHARED ? "first touch" : numa.bound ? "mbind" : "first touch";
+            printf("%-12s %12s %6d %8d %10.1f %12.3f %8.2fx %10.1f%%\n", numa_placement_name((NumaPlacement)p), policy, nodes, threads,
+                seconds * 1e3, rate, rate / base_rate, rate / base_rate / ((double)threads / base_threads) * 100.0);
+            numa_scene_free(&numa);
+        }
+    }
+
+    parallel_set_affinity(NULL, 0);
+    bvh_wide_free(&wide);
+    render_image_free(&image);
+}
+
+// The path kernel variant render_kernel_select picks against the generic kernel, on cut down
+// copies of the scene: spheres only, triangles only and both, with the emissive materials and
+// with every emission zeroed. The image has to be the same, checked by hash.
+static void suite_kernels(BenchContext* ctx)
+{
+    static const int frames = 4;
+
+    RenderImage image;
+    if (!render_image_init(&image, ctx->width, ctx->height)) {return;}
+    Material* dark = (Material*)malloc(ctx->scene.num_materials * sizeof(Material));
+    if (dark == NULL)
+    {
+        render_image_free(&image);
+        return;
+    }
+    memcpy(dark, ctx->scene.materials, ctx->scene.num_materials * sizeof(Material));
+    for (size_t m = 0; m < ctx->scene.num_materials; m++) {dark[m].emission = 0.0f;}
+
+    printf("\n== Path kernel variants ==\n");
+    printf("%-20s %6s %12s %12s %9s %6s\n", "kernel", "bvh", "generic ms", "variant ms", "speedup", "image");
+    for (int prims = 0; prims < 3; prims++)
+    {
+        for (int emissive = 1; emissive >= 0; emissive--)
+        {
+            // Shallow copies, the arrays stay the context's
+            Scene scene = ctx->scene;
+            if (prims == 0)
+            {
+                scene.mesh.num_indices = 0;
+                scene.tri_records = NULL;
+            }
+            if (prims == 1) {scene.num_spheres = 0;}
+            if (!emissive) {scene.materials = dark;}
+            unsigned int kernel = render_kernel_select(&scene);
+            if (kernel == RENDER_KERNEL_GENERIC || (emissive && !(kernel & RENDER_KERNEL_EMISSIVE))) {continue;}
+
+            BVH bvh;
+            if (!bvh_build(&bvh, &scene, ctx->treelet)) {continue;}
+            WideBVH wide;
+            bool has_wide = bvh_wide_build(&wide, &bvh, 8) && bvh_wide_build_blocks(&wide, &scene);
+            for (int use_wide = 0; use_wide < (has_wide ? 2 : 1); use_wide++)
+            {
+                double ms[2];
+                unsigned long long hash[2];
+                for (int v = 0; v < 2; v++)
+                {
+                    RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, true, 0, 1, use_wide ? &wide : NULL};
+                    settings.kernel = v == 0 ? RENDER_KERNEL_GENERIC : kernel;
+                    render_image_reset(&image);
+                    render_frame(&image, &scene, &bvh, &settings, NULL); // Warm up
+                    render_image_reset(&image);
+
+                    double start = timer_seconds();
+                    for (int f = 0; f < frames; f++) {render_frame(&image, &scene, &bvh, &settings, NULL);}
+                    ms[v] = (timer_seconds() - start) / frames * 1e3;
+                    hash[v] = render_image_hash(&image);
+                }
+                printf("%-20s %6s %12.1f %12.1f %8.2fx %6s\n", render_kernel_name(kernel), use_wide ? "BVH8" : "BVH2",
+                    ms[0], ms[1], ms[0] / ms[1], hash[0] == hash[1] ? "same" : "DIFF");
+            }
+            bvh_wide_free(&wide);
+            bvh_free(&bvh);
+        }
+    }
+
+    free(dark);
+    render_image_free(&image);
+}
+
+typedef struct
+{
+    const char* name;
+    void (*run)(BenchContext* ctx);
+} Suite;
+
+static const Suite k_suites[] =
+{
+    {"layouts", suite_layouts},
+    {"compressed", suite_compressed},
+    {"stackless", suite_stackless},
+    {"treelet", suite_treelet},
+    {"shadow", suite_shadow},
+    {"grid", suite_grid},
+    {"dynamic", suite_dynamic},
+    {"lazy", suite_lazy},
+    {"cache", suite_cache},
+    {"order", suite_order},
+    {"packet", suite_packet},
+    {"prims", suite_prims},
+    {"render", suite_render},
+    {"wavefront", suite_wavefront},
+    {"numa", suite_numa},
+    {"kernels", suite_kernels},
+};
+static const int NUM_SUITES = sizeof(k_suites) / sizeof(Suite);
+
+int main(int argc, char* argv[])
+{
+    const char* suite = "all";
+    size_t tris = 100000;
+
+    BenchContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.repeat = 3;
+    ctx.treelet = BVH_TREELET_ITERATIONS;
+    ctx.width = 320;
+    ctx.height = 180;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--suite") == 0 && i + 1 < argc) {suite = argv[++i];}
+        else if (strcmp(argv[i], "--obj") == 0 && i + 1 < argc) {ctx.obj = argv[++i];}
+        else if (strcmp(argv[i], "--tris") == 0 && i + 1 < argc) {tris = (size_t)strtoull(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--res") == 0 && i + 1 < argc) {sscanf(argv[++i], "%dx%d", &ctx.width, &ctx.height);}
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {ctx.repeat = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {ctx.treelet = atoi(argv[++i]);}
+        else
+        {
+            fprintf(stderr, "Usage: %s [--suite name] [--obj file] [--tris N] [--res WxH] [--repeat N] [--treelet N]\n", argv[0]);
+            fprintf(stderr, "Suites: all");
+            for (int s = 0; s < NUM_SUITES; s++) {fprintf(stderr, ", %s", k_suites[s].name);}
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+    if (ctx.repeat < 1) {ctx.repeat = 1;}
+
+    if (!bench_setup(&ctx, tris, true)) {return 1;}
+
+    for (int s = 0; s < NUM_SUITES; s++)
+    {
+        if (strcmp(suite, "all") == 0 || strcmp(suite, k_suites[s].name) == 0) {k_suites[s].run(&ctx);}
+    }
+
+    bench_teardown(&ctx);
+    return 0;
+}
@@ -0,0 +1,552 @@
+// BVH quality analyzer, builds every acceleration structure for a mesh and prints JSON
+// Usage: bvh_stats mesh.obj [--spheres] [--tris N] [--treelet N] [--rays WxH] [--camera px py pz yaw pitch]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "camera.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "bvh_compressed.h"
+#include "bvh_stackless.h"
+#include "timer.h"
+
+#define MAX_HISTOGRAM 128
+
+// Common view of every structure: nodes with a box and either children or a prim range
+typedef struct
+{
+    AABB box;
+    int child_first; // Into Tree.children
+    int num_children;
+    int prim_first;
+    int prim_count;
+} TreeNode;
+
+typedef struct
+{
+    TreeNode* nodes;
+    int* children;
+    size_t num_nodes;
+    size_t num_children;
+    const unsigned int* prims;
+} Tree;
+
+typedef bool (*IntersectFn)(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats);
+
+typedef struct
+{
+    const char* name;
+    double build_ms;
+    size_t memory_bytes;
+    Tree tree;
+    IntersectFn intersect;
+    const void* accel;
+} Structure;
+
+static bool tree_alloc(Tree* tree, size_t max_nodes)
+{
+    tree->nodes = (TreeNode*)malloc(max_nodes * sizeof(TreeNode));
+    tree->children = (int*)malloc(max_nodes * sizeof(int));
+    tree->num_nodes = 0;
+    tree->num_children = 0;
+    return tree->nodes != NULL && tree->children != NULL;
+}
+
+static void tree_free(Tree* tree)
+{
+    free(tree->nodes);
+    free(tree->children);
+    memset(tree, 0, sizeof(*tree));
+}
+
+static int tree_add(Tree* tree, AABB box, int prim_first, int prim_count)
+{
+    int index = (int)tree->num_nodes++;
+    tree->nodes[index] = (TreeNode){box, 0, 0, prim_first, prim_count};
+    return index;
+}
+
+// Binary nodes map one to one
+static bool tree_from_binary(Tree* tree, const BVH* bvh)
+{
+    if (!tree_alloc(tree, bvh->num_nodes)) {return false;}
+    tree->prims = bvh->prims;
+
+    for (size_t i = 0; i < bvh->num_nodes; i++)
+    {
+        const BVHNode* node = &bvh->nodes[i];
+        int index = tree_add(tree, bvh_node_bounds(node), node->count > 0 ? node->left_first : 0, node->count > 0 ? node->count : 0);
+        if (node->count <= 0)
+        {
+            tree->nodes[index].child_first = (int)tree->num_children;
+            tree->nodes[index].num_children = 2;
+            tree->children[tree->num_children++] = node->left_first;
+            tree->children[tree->num_children++] = node->left_first + 1;
+        }
+    }
+    return true;
+}
+
+// Wide lanes become child nodes, leaf lanes get their own leaf node
+static int tree_add_wide(Tree* tree, const WideBVH* wide, int node, AABB box)
+{
+    int index = tree_add(tree, box, 0, 0);
+    int lanes[BVH_WIDE_MAX];
+    int num_lanes = 0;
+
+    for (int lane = 0; lane < wide->width; lane++)
+    {
+        int child = bvh_wide_row(wide, node, WIDE_ROW_CHILD)[lane].i;
+        int count = bvh_wide_row(wide, node, WIDE_ROW_COUNT)[lane].i;
+        if (count == 0 && child < 0) {continue;}
+
+        AABB lane_box = {{bvh_wide_row(wide, node, WIDE_ROW_MINX)[lane].f, bvh_wide_row(wide, node, WIDE_ROW_MINY)[lane].f, bvh_wide_row(wide, node, WIDE_ROW_MINZ)[lane].f},
+            {bvh_wide_row(wide, node, WIDE_ROW_MAXX)[lane].f, bvh_wide_row(wide, node, WIDE_ROW_MAXY)[lane].f, bvh_wide_row(wide, node, WIDE_ROW_MAXZ)[lane].f}};
+        lanes[num_lanes++] = count > 0 ? tree_add(tree, lane_box, child, count) : tree_add_wide(tree, wide, child, lane_box);
+    }
+
+    tree->nodes[index].child_first = (int)tree->num_children;
+    tree->nodes[index].num_children = num_lanes;
+    for (int i = 0; i < num_lanes; i++) {tree->children[tree->num_children++] = lanes[i];}
+    return index;
+}
+
+static bool tree_from_wide(Tree* tree, const WideBVH* wide)
+{
+    if (!tree_alloc(tree, wide->num_nodes * (wide->width + 1))) {return false;}
+    tree->prims = wide->prims;
+    if (wide->num_nodes == 0) {return true;}
+
+    AABB root = aabb_empty();
+    for (int lane = 0; lane < wide->width; lane++)
+    {
+        if (bvh_wide_row(wide, 0, WIDE_ROW_COUNT)[lane].i == 0 && bvh_wide_row(wide, 0, WIDE_ROW_CHILD)[lane].i < 0) {continue;}
+        root = aabb_grow(root, v3(bvh_wide_row(wide, 0, WIDE_ROW_MINX)[lane].f, bvh_wide_row(wide, 0, WIDE_ROW_MINY)[lane].f, bvh_wide_row(wide, 0, WIDE_ROW_MINZ)[lane].f));
+        root = aabb_grow(root, v3(bvh_wide_row(wide, 0, WIDE_ROW_MAXX)[lane].f, bvh_wide_row(wide, 0, WIDE_ROW_MAXY)[lane].f, bvh_wide_row(wide, 0, WIDE_ROW_MAXZ)[lane].f));
+    }
+    tree_add_wide(tree, wide, 0, root);
+    return true;
+}
+
+// Same as the wide version, with the decoded (conservative) boxes
+static int tree_add_compressed(Tree* tree, const CompressedBVH* cbvh, int node, AABB box)
+{
+    const CompressedNode* cnode = &cbvh->nodes[node];
+    int index = tree_add(tree, box, 0, 0);
+    int lanes[CBVH_WIDTH];
+    int num_lanes = 0;
+    unsigned int child_slot = 0, prim_offset = 0;
+
+    for (int lane = 0; lane < CBVH_WIDTH; lane++)
+    {
+        unsigned char meta = cnode->meta[lane];
+        if (meta == CBVH_META_EMPTY) {continue;}
+
+        AABB lane_box = bvh_compressed_child_bounds(cnode, lane);
+        if (meta == CBVH_META_INTERIOR) {lanes[num_lanes++] = tree_add_compressed(tree, cbvh, (int)(cnode->child_base + child_slot++), lane_box);}
+        else
+        {
+            lanes[num_lanes++] = tree_add(tree, lane_box, (int)(cnode->prim_base + prim_offset), meta);
+            prim_offset += meta;
+        }
+    }
+
+    tree->nodes[index].child_first = (int)tree->num_children;
+    tree->nodes[index].num_children = num_lanes;
+    for (int i = 0; i < num_lanes; i++) {tree->children[tree->num_children++] = lanes[i];}
+    return index;
+}
+
+static bool tree_from_compressed(Tree* tree, const CompressedBVH* cbvh, AABB root)
+{
+    if (!tree_alloc(tree, cbvh->num_nodes * (CBVH_WIDTH + 1))) {return false;}
+    tree->prims = cbvh->prims;
+    if (cbvh->num_nodes > 0) {tree_add_compressed(tree, cbvh, 0, root);}
+    return true;
+}
+
+// SAH cost with unit traversal and intersection costs, relative to the root area
+static double tree_sah(const Tree* tree)
+{
+    if (tree->num_nodes == 0) {return 0.0;}
+
+    double root_area = aabb_area(tree->nodes[0].box);
+    if (root_area <= 0.0) {return 0.0;}
+
+    double cost = 0.0;
+    for (size_t i = 0; i < tree->num_nodes; i++)
+    {
+        const TreeNode* node = &tree->nodes[i];
+        double weight = aabb_area(node->box) / root_area;
+        cost += node->num_children > 0 ? weight : weight * node->prim_count;
+    }
+    return cost;
+}
+
+// Clip a convex polygon against one axis aligned plane, keeps the side where sign * (p - d) <= 0
+static int clip_polygon(const Vec3* in, int count, Vec3* out, int axis, float d, float sign)
+{
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Vec3 a = in[i];
+        Vec3 b = in[(i + 1) % count];
+        float da = sign * (v3_axis(a, axis) - d);
+        float db = sign * (v3_axis(b, axis) - d);
+
+        if (da <= 0.0f) {out[n++] = a;}
+        if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f))
+        {
+            float t = da / (da - db);
+            out[n++] = v3_add(a, v3_scale(v3_sub(b, a), t));
+        }
+    }
+    return n;
+}
+
+static double polygon_area(const Vec3* p, int count)
+{
+    Vec3 sum = v3(0.0f, 0.0f, 0.0f);
+    for (int i = 1; i + 1 < count; i++) {sum = v3_add(sum, v3_cross(v3_sub(p[i], p[0]), v3_sub(p[i + 1], p[0])));}
+    return 0.5 * v3_length(sum);
+}
+
+static double clipped_triangle_area(Vec3 a, Vec3 b, Vec3 c, AABB box)
+{
+    Vec3 poly[2][16] = {{a, b, c}};
+    int count = 3;
+    int cur = 0;
+    for (int axis = 0; axis < 3 && count > 0; axis++)
+    {
+        count = clip_polygon(poly[cur], count, poly[1 - cur], axis, v3_axis(box.min, axis), -1.0f);
+        cur = 1 - cur;
+        count = clip_polygon(poly[cur], count, poly[1 - cur], axis, v3_axis(box.max, axis), 1.0f);
+        cur = 1 - cur;
+    }
+    return count >= 3 ? polygon_area(poly[cur], count) : 0.0;
+}
+
+static bool boxes_overlap(AABB a, AABB b)
+{
+    return a.min.x <= b.max.x && a.max.x >= b.min.x && a.min.y <= b.max.y && a.max.y >= b.min.y && a.min.z <= b.max.z && a.max.z >= b.min.z;
+}
+
+// End-point overlap: triangle area that lies inside nodes outside the triangle's own subtree,
+// weighted by node cost and normalized by total triangle area. Spheres are not counted.
+static double tree_epo(const Tree* tree, const Scene* scene)
+{
+    size_t num_tris = scene_num_triangles(scene);
+    if (tree->num_nodes == 0 || num_tris == 0) {return 0.0;}
+
+    // Pre-order numbering gives subtree ranges, and the leaf that holds each triangle
+    int* pre = (int*)malloc(tree->num_nodes * sizeof(int));
+    int* end = (int*)malloc(tree->num_nodes * sizeof(int));
+    int* leaf_of = (int*)malloc(num_tris * sizeof(int));
+    int* stack = (int*)malloc(2 * tree->num_nodes * sizeof(int));
+    double* overlap = (double*)calloc(tree->num_nodes, sizeof(double));
+    if (pre == NULL || end == NULL || leaf_of == NULL || stack == NULL || overlap == NULL)
+    {
+        free(pre); free(end); free(leaf_of); free(stack); free(overlap);
+        return -1.0;
+    }
+    for (size_t i = 0; i < num_tris; i++) {leaf_of[i] = -1;}
+
+    int counter = 0;
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        int entry = stack[--sp];
+        if (entry < 0)
+        {
+            end[-entry - 1] = counter;
+            continue;
+        }
+
+        const TreeNode* node = &tree->nodes[entry];
+        pre[entry] = counter++;
+        stack[sp++] = -entry - 1;
+        for (int c = node->num_children - 1; c >= 0; c--) {stack[sp++] = tree->children[node->child_first + c];}
+        for (int p = node->prim_first; p < node->prim_first + node->prim_count; p++)
+        {
+            if (prim_ref_is_triangle(tree->prims[p])) {leaf_of[prim_ref_index(tree->prims[p])] = entry;}
+        }
+    }
+
+    double total_area = 0.0;
+    for (size_t t = 0; t < num_tris; t++)
+    {
+        const unsigned int* idx = scene->mesh.indices + 3 * t;
+        Vec3 a = mesh_vertex(&scene->mesh, idx[0]);
+        Vec3 b = mesh_vertex(&scene->mesh, idx[1]);
+        Vec3 c = mesh_vertex(&scene->mesh, idx[2]);
+        AABB tri_box = triangle_bounds(&scene->mesh, (int)t);
+        total_area += 0.5 * v3_length(v3_cross(v3_sub(b, a), v3_sub(c, a)));
+        int own = leaf_of[t] >= 0 ? pre[leaf_of[t]] : -1;
+
+        sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0)
+        {
+            int n = stack[--sp];
+            const TreeNode* node = &tree->nodes[n];
+            if (!boxes_overlap(node->box, tri_box)) {continue;}
+
+            bool ancestor = own >= pre[n] && own < end[n];
+            if (!ancestor) {overlap[n] += clipped_triangle_area(a, b, c, node->box);}
+            for (int k = 0; k < node->num_children; k++) {stack[sp++] = tree->children[node->child_first + k];}
+        }
+    }
+
+    double epo = 0.0;
+    for (size_t i = 0; i < tree->num_nodes; i++)
+    {
+        const TreeNode* node = &tree->nodes[i];
+        epo += overlap[i] * (node->num_children > 0 ? 1.0 : (double)node->prim_count);
+    }
+
+    free(pre); free(end); free(leaf_of); free(stack); free(overlap);
+    return total_area > 0.0 ? epo / total_area : 0.0;
+}
+
+static void print_histogram(const char* key, const unsigned long long* bins, int max_bin)
+{
+    printf("      \"%s\": [", key);
+    for (int i = 0; i <= max_bin; i++) {printf("%s%llu", i > 0 ? ", " : "", bins[i]);}
+    printf("],\n");
+}
+
+static void print_structure(const Structure* s, const Scene* scene, const Vec3* ro, const Vec3* rd, size_t num_rays, bool last)
+{
+    const Tree* tree = &s->tree;
+    unsigned long long leaf_sizes[MAX_HISTOGRAM] = {0};
+    unsigned long long depths[MAX_HISTOGRAM] = {0};
+    int max_leaf = 0, max_depth = 0;
+    size_t interior = 0, leaves = 0;
+
+    // Depth first walk for the leaf depth histogram
+    int* stack = (int*)malloc(2 * (tree->num_nodes + 1) * sizeof(int));
+    int sp = 0;
+    if (stack != NULL && tree->num_nodes > 0)
+    {
+        stack[sp++] = 0;
+        stack[sp++] = 0;
+    }
+    while (sp > 0)
+    {
+        int depth = stack[--sp];
+        const TreeNode* node = &tree->nodes[stack[--sp]];
+        if (node->num_children > 0)
+        {
+            interior++;
+            for (int c = 0; c < node->num_children; c++)
+            {
+                stack[sp++] = tree->children[node->child_first + c];
+                stack[sp++] = depth + 1;
+            }
+            continue;
+        }
+
+        leaves++;
+        int size = node->prim_count < MAX_HISTOGRAM ? node->prim_count : MAX_HISTOGRAM - 1;
+        int d = depth < MAX_HISTOGRAM ? depth : MAX_HISTOGRAM - 1;
+        leaf_sizes[size]++;
+        depths[d]++;
+        if (size > max_leaf) {max_leaf = size;}
+        if (d > max_depth) {max_depth = d;}
+    }
+    free(stack);
+
+    TraversalStats stats = {0};
+    for (size_t i = 0; i < num_rays; i++)
+    {
+        Hit hit;
+        s->intersect(s->accel, scene, ro[i], rd[i], &hit, &stats);
+    }
+    double n = num_rays > 0 ? (double)num_rays : 1.0;
+
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", s->name);
+    printf("      \"build_ms\": %.3f,\n", s->build_ms);
+    printf("      \"memory_bytes\": %zu,\n", s->memory_bytes);
+    printf("      \"interior_nodes\": %zu,\n", interior);
+    printf("      \"leaf_nodes\": %zu,\n", leaves);
+    printf("      \"sah_cost\": %.4f,\n", tree_sah(tree));
+    printf("      \"epo\": %.4f,\n", tree_epo(tree, scene));
+    printf("      \"max_depth\": %d,\n", max_depth);
+    print_histogram("leaf_size_histogram", leaf_sizes, max_leaf);
+    print_histogram("leaf_depth_histogram", depths, max_depth);
+    printf("      \"avg_nodes_per_ray\": %.3f,\n", stats.nodes_visited / n);
+    printf("      \"avg_prims_per_ray\": %.3f,\n", stats.prims_tested / n);
+    printf("      \"avg_node_bytes_per_ray\": %.1f\n", stats.bytes_fetched / n);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+static bool intersect_binary(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_intersect((const BVH*)accel, scene, ro, rd, hit, stats);
+}
+
+static bool intersect_wide(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_wide_intersect((const WideBVH*)accel, scene, ro, rd, hit, stats);
+}
+
+static bool intersect_compressed(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_compressed_intersect((const CompressedBVH*)accel, scene, ro, rd, hit, stats);
+}
+
+static bool intersect_stackless(const void* accel, const Scene* scene, Vec3 ro, Vec3 rd, Hit* hit, TraversalStats* stats)
+{
+    return bvh_stackless_intersect((const BVH*)accel, scene, ro, rd, hit, stats);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* mesh_file = NULL;
+    bool spheres = false;
+    bool custom_camera = false;
+    size_t tris = 0;
+    int treelet = BVH_TREELET_ITERATIONS;
+    int width = 160, height = 90;
+    Camera camera = {0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--spheres") == 0) {spheres = true;}
+        else if (strcmp(argv[i], "--tris") == 0 && i + 1 < argc) {tris = (size_t)strtoul(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {treelet = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc) {sscanf(argv[++i], "%dx%d", &width, &height);}
+        else if (strcmp(argv[i], "--camera") == 0 && i + 5 < argc)
+        {
+            camera.px = (float)atof(argv[++i]);
+            camera.py = (float)atof(argv[++i]);
+            camera.pz = (float)atof(argv[++i]);
+            camera.yaw = (float)atof(argv[++i]);
+            camera.pitch = (float)atof(argv[++i]);
+            custom_camera = true;
+        }
+        else if (argv[i][0] != '-' && mesh_file == NULL) {mesh_file = argv[i];}
+        else
+        {
+            fprintf(stderr, "Usage: %s mesh.obj [--spheres] [--tris N] [--treelet N] [--rays WxH] [--camera px py pz yaw pitch]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (mesh_file == NULL)
+    {
+        fprintf(stderr, "Usage: %s mesh.obj [--spheres] [--tris N] [--treelet N] [--rays WxH] [--camera px py pz yaw pitch]\n", argv[0]);
+        return 1;
+    }
+
+    // The mesh alone unless the demo spheres are asked for
+    Scene scene;
+    if (!scene_load_default(&scene, mesh_file)) {return 1;}
+    if (!spheres) {scene.num_spheres = 0;}
+    if (tris > 0 && !scene_add_random_triangles(&scene, tris, 0.2f, v3(-4.0f, -1.0f, -4.0f), v3(4.0f, 3.0f, -1.5f), 1u))
+    {
+        fprintf(stderr, "Failed to generate triangles\n");
+        scene_free(&scene);
+        return 1;
+    }
+    if (scene_num_triangles(&scene) == 0 && scene.num_spheres == 0)
+    {
+        fprintf(stderr, "Nothing to build for %s\n", mesh_file);
+        scene_free(&scene);
+        return 1;
+    }
+
+    BVH bvh;
+    WideBVH wide4, wide8;
+    CompressedBVH cbvh;
+    BVH threaded;
+
+    double start = timer_seconds();
+    if (!bvh_build(&bvh, &scene, treelet)) {return 1;}
+    double bvh_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    if (!bvh_wide_build(&wide4, &bvh, 4)) {return 1;}
+    double wide4_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    if (!bvh_wide_build(&wide8, &bvh, 8)) {return 1;}
+    double wide8_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    if (!bvh_compressed_build(&cbvh, &wide8)) {return 1;}
+    double compressed_ms = (timer_seconds() - start) * 1e3;
+
+    start = timer_seconds();
+    if (!bvh_stackless_build(&threaded, &bvh)) {return 1;}
+    double stackless_ms = (timer_seconds() - start) * 1e3;
+
+    // Sampled camera rays, by default looking down -z at the mesh from in front of its bounds
+    AABB root = aabb_empty();
+    for (size_t t = 0; t < scene_num_triangles(&scene); t++) {root = aabb_union(root, triangle_bounds(&scene.mesh, (int)t));}
+    if (!custom_camera && scene_num_triangles(&scene) > 0)
+    {
+        Vec3 center = aabb_center(root);
+        Vec3 extent = aabb_extent(root);
+        camera.px = center.x;
+        camera.py = center.y;
+        camera.pz = root.max.z + 1.5f * fmaxf(extent.x, extent.y);
+    }
+
+    size_t num_rays = (size_t)width * height;
+    Vec3* ro = (Vec3*)malloc(num_rays * sizeof(Vec3));
+    Vec3* rd = (Vec3*)malloc(num_rays * sizeof(Vec3));
+    if (ro == NULL || rd == NULL) {return 1;}
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++) {camera_ray(&camera, x + 0.5f, y + 0.5f, width, height, &ro[y * width + x], &rd[y * width + x]);}
+    }
+
+    size_t prim_bytes = bvh.num_prims * sizeof(unsigned int);
+    Structure structures[5] =
+    {
+        {"bvh2", bvh_ms, bvh.num_nodes * sizeof(BVHNode) + prim_bytes, {0}, intersect_binary, &bvh},
+        {"bvh4_soa", bvh_ms + wide4_ms, wide4.num_nodes * bvh_wide_node_bytes(&wide4) + prim_bytes, {0}, intersect_wide, &wide4},
+        {"bvh8_soa", bvh_ms + wide8_ms, wide8.num_nodes * bvh_wide_node_bytes(&wide8) + prim_bytes, {0}, intersect_wide, &wide8},
+        {"bvh8_compressed", bvh_ms + wide8_ms + compressed_ms, cbvh.num_nodes * sizeof(CompressedNode) + prim_bytes, {0}, intersect_compressed, &cbvh},
+        {"bvh2_stackless", bvh_ms + stackless_ms, threaded.num_nodes * sizeof(BVHNode) + prim_bytes, {0}, intersect_stackless, &threaded},
+    };
+    const int num_structures = sizeof(structures) / sizeof(Structure);
+
+    AABB cbvh_root = bvh.num_nodes > 0 ? bvh_node_bounds(&bvh.nodes[0]) : aabb_empty();
+    bool ok = tree_from_binary(&structures[0].tree, &bvh) && tree_from_wide(&structures[1].tree, &wide4) && tree_from_wide(&structures[2].tree, &wide8)
+        && tree_from_compressed(&structures[3].tree, &cbvh, cbvh_root) && tree_from_binary(&structures[4].tree, &bvh);
+    if (!ok)
+    {
+        fprintf(stderr, "Memory allocation failed for analysis\n");
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"mesh\": \"%s\",\n", mesh_file);
+    printf("  \"triangles\": %zu,\n", scene_num_triangles(&scene));
+    printf("  \"vertices\": %zu,\n", scene.mesh.num_vertices / 3);
+    printf("  \"spheres\": %zu,\n", scene.num_spheres);
+    printf("  \"treelet_iterations\": %d,\n", treelet);
+    printf("  \"camera\": [%.4f, %.4f, %.4f, %.2f, %.2f],\n", camera.px, camera.py, camera.pz, camera.yaw, camera.pitch);
+    printf("  \"rays\": %zu,\n", num_rays);
+    printf("  \"structures\": [\n");
+    for (int i = 0; i < num_structures; i++) {print_structure(&structures[i], &scene, ro, rd, num_rays, i == num_structures - 1);}
+    printf("  ]\n");
+    printf("}\n");
+
+    for (int i = 0; i < num_structures; i++) {tree_free(&structures[i].tree);}
+    free(ro);
+    free(rd);
+    bvh_free(&threaded);
+    bvh_compressed_free(&cbvh);
+    bvh_wide_free(&wide8);
+    bvh_wide_free(&wide4);
+    bvh_free(&bvh);
+    scene_free(&scene);
+    return 0;
+}
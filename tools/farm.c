@@ -0,0 +1,195 @@
+// Distributed CPU rendering, a coordinator dealing tiles to worker processes (see farm.h)
+// Usage: farm coordinator --listen ADDR [mesh.obj] [--out image.ppm] [--res WxH] [--spp N] [--tile N]
+//                         [--light-sampling] [--tri-records] [--tris N] [--treelet N]
+//                         [--camera px py pz yaw pitch] [--packets N] [--wide 0|4|8] [--wavefront]
+//                         [--tile-timeout S] [--no-backups] [--spawn N] [--worker-threads N] [--hash] [--verify HASH]
+//        farm worker --connect ADDR [--threads N] [--isa scalar|sse4.1|avx2|avx512] [--fail-after N] [--delay MS]
+// ADDR is unix:/path or tcp:[host:]port. --spawn forks N local workers, which with their
+// --fail-after and --delay (given to the coordinator too) tests the farm on one machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "bvh.h"
+#include "render.h"
+#include "farm.h"
+#include "cpu.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#define FARM_MAX_SPAWN 64
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s coordinator --listen ADDR [mesh.obj] [--out image.ppm] [--res WxH] [--spp N] [--tile N]\n"
+        "       [--light-sampling] [--tri-records] [--tris N] [--treelet N] [--camera px py pz yaw pitch]\n"
+        "       [--packets N] [--wide 0|4|8] [--wavefront] [--tile-timeout S] [--no-backups] [--spawn N] [--worker-threads N]\n"
+        "       [--fail-after N] [--delay MS] [--hash] [--verify HASH]\n"
+        "   or: %s worker --connect ADDR [--threads N] [--isa scalar|sse4.1|avx2|avx512] [--fail-after N] [--delay MS]\n"
+        "ADDR is unix:/path or tcp:[host:]port\n", name, name);
+}
+
+static int run_worker(int argc, char* argv[])
+{
+    const char* address = NULL;
+    FarmWorkerOptions options = {0, 0, 0};
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {address = argv[++i];}
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {options.threads = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--fail-after") == 0 && i + 1 < argc) {options.fail_after = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {options.delay_ms = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            CpuIsa isa;
+            if (!cpu_isa_parse(argv[++i], &isa))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            cpu_set_isa_limit(isa);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (address == NULL)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    return farm_work(address, &options) ? 0 : 1;
+}
+
+static int run_coordinator(int argc, char* argv[])
+{
+    const char* address = NULL;
+    const char* mesh_file = "tetrahedron.obj";
+    const char* out_file = "render.ppm";
+    const char* verify = NULL;
+    bool hash = false;
+    size_t tris = 0;
+    int spawn = 0;
+    FarmWorkerOptions worker = {0, 0, 0};
+    FarmOptions options = farm_default_options();
+    // Same defaults as the render tool
+    FarmRender render = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, 800, 600, 16, false, 1, 8, BVH_TREELET_ITERATIONS, false, false};
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {address = argv[++i];}
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {out_file = argv[++i];}
+        else if (strcmp(argv[i], "--res") == 0 && i + 1 < argc) {sscanf(argv[++i], "%dx%d", &render.width, &render.height);}
+        else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {render.spp = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {options.tile_size = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--light-sampling") == 0) {render.light_sampling = true;}
+        else if (strcmp(argv[i], "--tri-records") == 0) {render.tri_records = true;}
+        else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {render.packet_bounces = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--wide") == 0 && i + 1 < argc) {render.wide_width = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--wavefront") == 0) {render.wavefront = true;}
+        else if (strcmp(argv[i], "--tris") == 0 && i + 1 < argc) {tris = (size_t)strtoul(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {render.treelet = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--tile-timeout") == 0 && i + 1 < argc) {options.tile_timeout = atof(argv[++i]);}
+        else if (strcmp(argv[i], "--no-backups") == 0) {options.backups = false;}
+        else if (strcmp(argv[i], "--hash") == 0) {hash = true;}
+        else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {verify = argv[++i];}
+        else if (strcmp(argv[i], "--spawn") == 0 && i + 1 < argc) {spawn = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--worker-threads") == 0 && i + 1 < argc) {worker.threads = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--fail-after") == 0 && i + 1 < argc) {worker.fail_after = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--delay") == 0 && i + 1 < argc) {worker.delay_ms = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--camera") == 0 && i + 5 < argc)
+        {
+            render.camera.px = (float)atof(argv[++i]);
+            render.camera.py = (float)atof(argv[++i]);
+            render.camera.pz = (float)atof(argv[++i]);
+            render.camera.yaw = (float)atof(argv[++i]);
+            render.camera.pitch = (float)atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-') {mesh_file = argv[i];}
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (address == NULL || render.width < 1 || render.height < 1 || spawn > FARM_MAX_SPAWN)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (render.spp < 1) {render.spp = 1;}
+
+    Scene scene;
+    if (!scene_load_default(&scene, mesh_file)) {return 1;}
+    if (tris > 0 && !scene_add_random_triangles(&scene, tris, 0.2f, v3(-4.0f, -1.0f, -4.0f), v3(4.0f, 3.0f, -1.5f), 1u))
+    {
+        fprintf(stderr, "Failed to generate triangles\n");
+        scene_free(&scene);
+        return 1;
+    }
+
+    RenderImage image;
+    int listen_fd = -1;
+    if (!render_image_init(&image, render.width, render.height) || (listen_fd = farm_listen(address)) < 0)
+    {
+        render_image_free(&image);
+        scene_free(&scene);
+        return 1;
+    }
+
+#ifndef _WIN32
+    // Local workers, the first spawned one takes --fail-after and --delay
+    pid_t children[FARM_MAX_SPAWN];
+    for (int i = 0; i < spawn; i++)
+    {
+        children[i] = fork();
+        if (children[i] == 0)
+        {
+            close(listen_fd);
+            FarmWorkerOptions options = worker;
+            if (i > 0) {options.fail_after = options.delay_ms = 0;}
+            _exit(farm_work(address, &options) ? 0 : 1);
+        }
+    }
+#endif
+
+    FarmStats stats;
+    bool ok = farm_coordinate(listen_fd, &scene, &render, &options, &image, &stats);
+
+#ifndef _WIN32
+    for (int i = 0; i < spawn; i++)
+    {
+        if (children[i] <= 0) {continue;}
+        kill(children[i], SIGTERM); // Still on a backup copy
+        waitpid(children[i], NULL, 0);
+    }
+#endif
+
+    fprintf(stderr, "Rendered %dx%d at %d spp on %d workers in %.2f s (%.2f Msamples/s): %d tiles, %d failed workers, %d reissued, %d backups, %d wasted\n",
+        render.width, render.height, render.spp, stats.workers, stats.seconds, (double)render.width * render.height * render.spp / stats.seconds * 1e-6,
+        stats.tiles, stats.failed_workers, stats.reissued, stats.backups, stats.wasted);
+
+    ok = ok && render_image_write_ppm(&image, out_file);
+    if (ok && (hash || verify != NULL)) {ok = render_image_verify(&image, verify);}
+
+    render_image_free(&image);
+    scene_free(&scene);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "worker") == 0) {return run_worker(argc, argv);}
+    if (argc >= 2 && strcmp(argv[1], "coordinator") == 0) {return run_coordinator(argc, argv);}
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,243 @@
+// Interactive CPU preview without a window: a scripted camera that turns for a while and then
+// holds still, rendered under a frame time budget (see progressive.h) and streamed as PPM frames
+// Usage: preview [mesh.obj] [--res WxH] [--budget MS] [--max-scale N] [--max-spp N] [--threads N]
+//                [--light-sampling] [--tri-records] [--tris N] [--treelet N] [--camera px py pz yaw pitch]
+//                [--packets N] [--wide 0|4|8] [--wavefront] [--isa scalar|sse4.1|avx2|avx512]
+//                [--seconds S] [--move S] [--still S] [--turn DEG] [--stream file.ppm|-] [--out image.ppm]
+// The camera turns --turn degrees a second for --move seconds, then stays for --still, over and
+// over for --seconds. --stream writes every displayed frame, e.g. for
+// preview --stream - | ffplay -f image2pipe -vcodec ppm -i -
+// --out writes the last one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scene.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "render.h"
+#include "progressive.h"
+#include "cpu.h"
+#include "timer.h"
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [mesh.obj] [--res WxH] [--budget MS] [--max-scale N] [--max-spp N] [--threads N]\n"
+        "       [--light-sampling] [--tri-records] [--tris N] [--treelet N] [--camera px py pz yaw pitch]\n"
+        "       [--packets N] [--wide 0|4|8] [--wavefront] [--isa scalar|sse4.1|avx2|avx512]\n"
+        "       [--seconds S] [--move S] [--still S] [--turn DEG] [--stream file.ppm|-] [--out image.ppm]\n", name);
+}
+
+// Display frames of one kind, moving or still
+typedef struct
+{
+    int updates;
+    double seconds, worst;
+    int min_scale, max_scale;
+} PhaseStats;
+
+static void phase_add(PhaseStats* phase, double seconds, int scale)
+{
+    if (phase->updates == 0 || scale < phase->min_scale) {phase->min_scale = scale;}
+    if (phase->updates == 0 || scale > phase->max_scale) {phase->max_scale = scale;}
+    phase->updates++;
+    phase->seconds += seconds;
+    if (seconds > phase->worst) {phase->worst = seconds;}
+}
+
+static void phase_print(const char* name, const PhaseStats* phase)
+{
+    if (phase->updates == 0) {return;}
+    fprintf(stderr, "%s: %d frames, %.1f ms average (%.1f fps), %.1f ms worst, scale %d..%d\n", name, phase->updates,
+        phase->seconds / phase->updates * 1e3, phase->updates / phase->seconds, phase->worst * 1e3, phase->min_scale, phase->max_scale);
+}
+
+static bool write_frame(FILE* fp, const unsigned char* rgb, int width, int height)
+{
+    return fprintf(fp, "P6\n%d %d\n255\n", width, height) > 0 && fwrite(rgb, 3, (size_t)width * height, fp) == (size_t)width * height;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* mesh_file = "tetrahedron.obj";
+    const char* stream_file = NULL;
+    const char* out_file = NULL;
+    int width = 800, height = 600;
+    size_t tris = 0;
+    int treelet = BVH_TREELET_ITERATIONS;
+    bool tri_records = false;
+    int wide_width = 8;
+    double seconds = 6.0, move = 2.0, still = 2.0, turn = 45.0;
+    ProgressiveOptions options = progressive_default_options();
+    // Start view of the viewer, camera rays as packets, the rest through the wide BVH
+    RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, false, 0, 1, NULL};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--res") == 0 && i + 1 < argc) {sscanf(argv[++i], "%dx%d", &width, &height);}
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {options.budget = atof(argv[++i]) * 1e-3;}
+        else if (strcmp(argv[i], "--max-scale") == 0 && i + 1 < argc) {options.max_scale = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--max-spp") == 0 && i + 1 < argc) {options.max_frames = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {settings.threads = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--light-sampling") == 0) {settings.light_sampling = true;}
+        else if (strcmp(argv[i], "--tri-records") == 0) {tri_records = true;}
+        else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {settings.packet_bounces = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--wavefront") == 0) {settings.wavefront = true;}
+        else if (strcmp(argv[i], "--wide") == 0 && i + 1 < argc) {wide_width = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            CpuIsa isa;
+            if (!cpu_isa_parse(argv[++i], &isa))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            cpu_set_isa_limit(isa);
+        }
+        else if (strcmp(argv[i], "--tris") == 0 && i + 1 < argc) {tris = (size_t)strtoul(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {treelet = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {seconds = atof(argv[++i]);}
+        else if (strcmp(argv[i], "--move") == 0 && i + 1 < argc) {move = atof(argv[++i]);}
+        else if (strcmp(argv[i], "--still") == 0 && i + 1 < argc) {still = atof(argv[++i]);}
+        else if (strcmp(argv[i], "--turn") == 0 && i + 1 < argc) {turn = atof(argv[++i]);}
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {stream_file = argv[++i];}
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {out_file = argv[++i];}
+        else if (strcmp(argv[i], "--camera") == 0 && i + 5 < argc)
+        {
+            settings.camera.px = (float)atof(argv[++i]);
+            settings.camera.py = (float)atof(argv[++i]);
+            settings.camera.pz = (float)atof(argv[++i]);
+            settings.camera.yaw = (float)atof(argv[++i]);
+            settings.camera.pitch = (float)atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-') {mesh_file = argv[i];}
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (width < 1 || height < 1 || options.budget <= 0.0 || move < 0.0 || still < 0.0 || move + still <= 0.0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Scene scene;
+    if (!scene_load_default(&scene, mesh_file)) {return 1;}
+    if (tris > 0 && !scene_add_random_triangles(&scene, tris, 0.2f, v3(-4.0f, -1.0f, -4.0f), v3(4.0f, 3.0f, -1.5f), 1u))
+    {
+        fprintf(stderr, "Failed to generate triangles\n");
+        scene_free(&scene);
+        return 1;
+    }
+    if (tri_records && !scene_build_tri_records(&scene))
+    {
+        scene_free(&scene);
+        return 1;
+    }
+
+    settings.kernel = render_kernel_select(&scene);
+
+    BVH bvh;
+    if (!bvh_build(&bvh, &scene, treelet))
+    {
+        scene_free(&scene);
+        return 1;
+    }
+    WideBVH wide;
+    if (wide_width > 0)
+    {
+        if (!bvh_wide_build(&wide, &bvh, wide_width) || !bvh_wide_build_blocks(&wide, &scene))
+        {
+            bvh_wide_free(&wide);
+            bvh_free(&bvh);
+            scene_free(&scene);
+            return 1;
+        }
+        settings.wide = &wide;
+    }
+
+    ProgressiveView view;
+    unsigned char* rgb = NULL;
+    FILE* stream = NULL;
+    bool ok = progressive_init(&view, width, height, &options) && (rgb = (unsigned char*)malloc((size_t)width * height * 3)) != NULL;
+    if (ok && stream_file != NULL)
+    {
+        stream = strcmp(stream_file, "-") == 0 ? stdout : fopen(stream_file, "wb");
+        if (stream == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", stream_file);
+            ok = false;
+        }
+    }
+
+    PhaseStats moving = {0}, resting = {0};
+    float start_yaw = settings.camera.yaw;
+    int frames = 0;
+    double still_since = 0.0, first_full = -1.0;
+    double start = timer_seconds(), now = start;
+    while (ok && now - start < seconds)
+    {
+        // Turning for the first move seconds of every cycle, the angle only advances meanwhile
+        double t = now - start;
+        double cycle = move + still;
+        double cycles = (double)(long long)(t / cycle);
+        double into = t - cycles * cycle;
+        double turned = cycles * move + (into < move ? into : move);
+        settings.camera.yaw = start_yaw + (float)(turn * turned);
+
+        ProgressiveFrame frame = progressive_update(&view, &scene, &bvh, &settings);
+        if (frame.samples == 0)
+        {
+            // Done refining (--max-spp), nothing new to show until the camera moves again
+#ifndef _WIN32
+            struct timespec ts = {0, (long)(options.budget * 1e9)};
+            nanosleep(&ts, NULL);
+#endif
+            now = timer_seconds();
+            continue;
+        }
+        progressive_display(&view, rgb);
+        if (stream != NULL && !write_frame(stream, rgb, width, height))
+        {
+            fprintf(stderr, "Failed to write %s\n", stream_file);
+            ok = false;
+        }
+
+        double end = timer_seconds();
+        if (frame.moving)
+        {
+            still_since = end;
+            first_full = -1.0;
+        }
+        else if (first_full < 0.0 && frame.scale == 1) {first_full = end - still_since;}
+        phase_add(frame.moving ? &moving : &resting, end - now, frame.scale);
+        frames = frame.frames;
+        now = end;
+    }
+
+    if (ok)
+    {
+        phase_print("Moving", &moving);
+        phase_print("Still", &resting);
+        if (first_full >= 0.0) {fprintf(stderr, "Full resolution %.0f ms after stopping, %d spp at the end\n", first_full * 1e3, frames);}
+        if (out_file != NULL)
+        {
+            FILE* fp = fopen(out_file, "wb");
+            ok = fp != NULL && write_frame(fp, rgb, width, height);
+            ok = (fp != NULL && fclose(fp) == 0) && ok;
+            if (!ok) {fprintf(stderr, "Failed to write %s\n", out_file);}
+        }
+    }
+
+    if (stream != NULL && stream != stdout) {fclose(stream);}
+    free(rgb);
+    progressive_free(&view);
+    if (settings.wide != NULL) {bvh_wide_free(&wide);}
+    bvh_free(&bvh);
+    scene_free(&scene);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,260 @@
+// Headless CPU renderer, the reference path tracer of render.h on every core
+// Usage: render [mesh.obj] [--out image.ppm] [--res WxH] [--spp N] [--threads N] [--light-sampling]
+//               [--tri-records] [--tris N] [--treelet N] [--camera px py pz yaw pitch] [--thread-stats]
+//               [--packets N] [--wide 0|4|8] [--wavefront] [--isa scalar|sse4.1|avx2|avx512]
+//               [--first-sample N] [--seed-offset N] [--accum file.acc] [--numa shared|replicate|interleave] [--nodes N]
+//               [--hash] [--verify HASH] [--generic-kernel]
+// --first-sample and --seed-offset render samples N .. N + spp - 1 of a longer run (or another
+// sample stream), --accum writes their sums for accum_merge next to the image. --hash prints a
+// hash of the image, --verify fails the run unless it matches. The path kernel is the variant
+// for the scene's features, --generic-kernel keeps the one that tests them per hit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "render.h"
+#include "accum.h"
+#include "parallel.h"
+#include "cpu.h"
+#include "timer.h"
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [mesh.obj] [--out image.ppm] [--res WxH] [--spp N] [--threads N] [--light-sampling]\n"
+        "       [--tri-records] [--tris N] [--treelet N] [--camera px py pz yaw pitch] [--thread-stats]\n"
+        "       [--packets N] [--wide 0|4|8] [--wavefront] [--isa scalar|sse4.1|avx2|avx512]\n"
+        "       [--first-sample N] [--seed-offset N] [--accum file.acc] [--numa shared|replicate|interleave] [--nodes N]\n"
+        "       [--hash] [--verify HASH] [--generic-kernel]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* mesh_file = "tetrahedron.obj";
+    const char* out_file = "render.ppm";
+    const char* accum_file = NULL;
+    const char* verify = NULL;
+    bool hash = false;
+    int width = 800, height = 600;
+    int spp = 16;
+    size_t tris = 0;
+    int treelet = BVH_TREELET_ITERATIONS;
+    bool tri_records = false;
+    bool thread_stats = false;
+    int wide_width = 8;
+    int first_sample = 0;
+    bool use_numa = false;
+    NumaPlacement placement = NUMA_SHARED;
+    int nodes = 0;
+    bool generic_kernel = false;
+    // Start view of the viewer, camera rays as packets, the rest through the wide BVH
+    RenderSettings settings = {{0.0f, 0.0f, 2.0f, -90.0f, 0.0f, 1.0f}, false, 0, 1, NULL};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {out_file = argv[++i];}
+        else if (strcmp(argv[i], "--res") == 0 && i + 1 < argc) {sscanf(argv[++i], "%dx%d", &width, &height);}
+        else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {spp = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {settings.threads = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--light-sampling") == 0) {settings.light_sampling = true;}
+        else if (strcmp(argv[i], "--tri-records") == 0) {tri_records = true;}
+        else if (strcmp(argv[i], "--thread-stats") == 0) {thread_stats = true;}
+        else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) {settings.packet_bounces = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--wavefront") == 0) {settings.wavefront = true;}
+        else if (strcmp(argv[i], "--first-sample") == 0 && i + 1 < argc) {first_sample = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--seed-offset") == 0 && i + 1 < argc) {settings.seed_offset = (unsigned int)strtoul(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--accum") == 0 && i + 1 < argc) {accum_file = argv[++i];}
+        else if (strcmp(argv[i], "--hash") == 0) {hash = true;}
+        else if (strcmp(argv[i], "--generic-kernel") == 0) {generic_kernel = true;}
+        else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {verify = argv[++i];}
+        else if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {nodes = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc)
+        {
+            if (!numa_placement_parse(argv[++i], &placement))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            use_numa = true;
+        }
+        else if (strcmp(argv[i], "--wide") == 0 && i + 1 < argc) {wide_width = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc)
+        {
+            CpuIsa isa;
+            if (!cpu_isa_parse(argv[++i], &isa))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            cpu_set_isa_limit(isa);
+        }
+        else if (strcmp(argv[i], "--tris") == 0 && i + 1 < argc) {tris = (size_t)strtoul(argv[++i], NULL, 10);}
+        else if (strcmp(argv[i], "--treelet") == 0 && i + 1 < argc) {treelet = atoi(argv[++i]);}
+        else if (strcmp(argv[i], "--camera") == 0 && i + 5 < argc)
+        {
+            settings.camera.px = (float)atof(argv[++i]);
+            settings.camera.py = (float)atof(argv[++i]);
+            settings.camera.pz = (float)atof(argv[++i]);
+            settings.camera.yaw = (float)atof(argv[++i]);
+            settings.camera.pitch = (float)atof(argv[++i]);
+        }
+        else if (argv[i][0] != '-') {mesh_file = argv[i];}
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (spp < 1) {spp = 1;}
+    if (first_sample < 0) {first_sample = 0;}
+
+    Scene scene;
+    if (!scene_load_default(&scene, mesh_file)) {return 1;}
+    if (tris > 0 && !scene_add_random_triangles(&scene, tris, 0.2f, v3(-4.0f, -1.0f, -4.0f), v3(4.0f, 3.0f, -1.5f), 1u))
+    {
+        fprintf(stderr, "Failed to generate triangles\n");
+        scene_free(&scene);
+        return 1;
+    }
+    if (tri_records && !scene_build_tri_records(&scene))
+    {
+        scene_free(&scene);
+        return 1;
+    }
+
+    if (!generic_kernel) {settings.kernel = render_kernel_select(&scene);}
+    fprintf(stderr, "Path kernel: %s\n", render_kernel_name(settings.kernel));
+
+    double start = timer_seconds();
+    BVH bvh;
+    if (!bvh_build(&bvh, &scene, treelet))
+    {
+        scene_free(&scene);
+        return 1;
+    }
+    fprintf(stderr, "Built BVH with %zu nodes over %zu prims in %.1f ms\n", bvh.num_nodes, bvh.num_prims, (timer_seconds() - start) * 1e3);
+
+    WideBVH wide;
+    if (wide_width > 0)
+    {
+        if (!bvh_wide_build(&wide, &bvh, wide_width) || !bvh_wide_build_blocks(&wide, &scene))
+        {
+            bvh_wide_free(&wide);
+            bvh_free(&bvh);
+            scene_free(&scene);
+            return 1;
+        }
+        settings.wide = &wide;
+    }
+
+    // Threads pinned node by node, the scene laid out for them
+    NumaScene numa;
+    memset(&numa, 0, sizeof(numa));
+    if (use_numa || nodes > 0)
+    {
+        NumaTopology topo;
+        numa_detect(&topo);
+        int thread_node[PARALLEL_MAX_THREADS];
+        settings.threads = numa_pin_threads(&topo, nodes, settings.threads, thread_node);
+        if (!numa_scene_build(&numa, &topo, nodes, thread_node, settings.threads, placement, &scene, &bvh, settings.wide))
+        {
+            if (settings.wide != NULL) {bvh_wide_free(&wide);}
+            bvh_free(&bvh);
+            scene_free(&scene);
+            return 1;
+        }
+        settings.numa = &numa;
+        fprintf(stderr, "%d NUMA nodes, using %d with %d threads, scene %s%s\n", topo.num_nodes, nodes > 0 && nodes < topo.num_nodes ? nodes : topo.num_nodes,
+            settings.threads, numa_placement_name(placement), placement != NUMA_SHARED && !numa.bound ? " (first touch, no memory policy)" : "");
+    }
+
+    RenderImage image;
+    if (!render_image_init(&image, width, height))
+    {
+        numa_scene_free(&numa);
+        if (settings.wide != NULL) {bvh_wide_free(&wide);}
+        bvh_free(&bvh);
+        scene_free(&scene);
+        return 1;
+    }
+
+    // A slice of the samples goes through linear sums, which is what the merge adds up
+    if (first_sample > 0 || settings.seed_offset != 0 || accum_file != NULL)
+    {
+        RenderAccum accum;
+        float* sums = NULL;
+        bool ok = render_accum_init(&accum, width, height) && (sums = (float*)calloc((size_t)width * height * 3, sizeof(float))) != NULL;
+        if (ok)
+        {
+            start = timer_seconds();
+            render_region(&scene, &bvh, &settings, width, height, (ParallelTile){0, 0, width, height}, first_sample + 1, spp, sums);
+            double seconds = timer_seconds() - start;
+            fprintf(stderr, "Rendered samples %d..%d (seed offset %u) of %dx%d in %.2f s (%.2f Msamples/s)\n", first_sample, first_sample + spp - 1,
+                settings.seed_offset, width, height, seconds, (double)width * height * spp / seconds * 1e-6);
+
+            render_accum_add_sums(&accum, sums, (unsigned int)spp);
+            render_accum_resolve(&accum, &image);
+            ok = (accum_file == NULL || render_accum_write(&accum, accum_file)) && render_image_write_ppm(&image, out_file);
+            if (hash || verify != NULL) {ok = render_image_verify(&image, verify) && ok;}
+        }
+        else {fprintf(stderr, "Memory allocation failed for %dx%d sums\n", width, height);}
+
+        render_accum_free(&accum);
+        free(sums);
+        render_image_free(&image);
+        numa_scene_free(&numa);
+        if (settings.wide != NULL) {bvh_wide_free(&wide);}
+        bvh_free(&bvh);
+        scene_free(&scene);
+        return ok ? 0 : 1;
+    }
+
+    // Scheduler numbers summed over every frame
+    ParallelTileStats frame, total;
+    memset(&total, 0, sizeof(total));
+
+    start = timer_seconds();
+    for (int s = 0; s < spp; s++)
+    {
+        render_frame(&image, &scene, &bvh, &settings, &frame);
+        total.threads = frame.threads;
+        total.seconds += frame.seconds;
+        for (int t = 0; t < frame.threads; t++)
+        {
+            total.thread[t].busy_seconds += frame.thread[t].busy_seconds;
+            total.thread[t].tiles += frame.thread[t].tiles;
+            total.thread[t].steals += frame.thread[t].steals;
+            total.thread[t].failed_steals += frame.thread[t].failed_steals;
+        }
+    }
+    double seconds = timer_seconds() - start;
+
+    int steals = 0;
+    for (int t = 0; t < total.threads; t++) {steals += total.thread[t].steals;}
+    fprintf(stderr, "Rendered %dx%d at %d spp on %d threads (%s) in %.2f s (%.2f Msamples/s), %.1f%% utilization, %d steals\n",
+        width, height, spp, total.threads, cpu_isa_name(cpu_isa()), seconds, (double)width * height * spp / seconds * 1e-6,
+        parallel_tile_utilization(&total) * 100.0, steals);
+    if (thread_stats)
+    {
+        fprintf(stderr, "%8s %8s %8s %8s %14s\n", "thread", "busy", "tiles", "steals", "failed steals");
+        for (int t = 0; t < total.threads; t++)
+        {
+            const ParallelThreadStats* st = &total.thread[t];
+            fprintf(stderr, "%8d %7.1f%% %8d %8d %14d\n", t, total.seconds > 0.0 ? st->busy_seconds / total.seconds * 100.0 : 0.0,
+                st->tiles, st->steals, st->failed_steals);
+        }
+    }
+
+    bool ok = render_image_write_ppm(&image, out_file);
+    if (hash || verify != NULL) {ok = render_image_verify(&image, verify) && ok;}
+
+    render_image_free(&image);
+    numa_scene_free(&numa);
+    if (settings.wide != NULL) {bvh_wide_free(&wide);}
+    bvh_free(&bvh);
+    scene_free(&scene);
+    return ok ? 0 : 1;
+}